@@ -0,0 +1,132 @@
+#pragma once
+#include <stdint.h>
+
+#ifdef _MSC_VER
+#  include <intrin.h>
+#endif
+
+//------------------------------------------------------------------------------
+// GCC and Clang won't emit popcnt unless the function using it is compiled for
+// a target that has it, so fast paths get tagged with TARGET_POPCNT (or
+// TARGET_AVX2, etc) and are only called after checking the CPU at runtime.
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define TARGET_POPCNT __attribute__((target("popcnt")))
+#  define TARGET_SSE42  __attribute__((target("sse4.2,popcnt")))
+#  define TARGET_AVX2   __attribute__((target("avx2,popcnt")))
+#  define TARGET_BMI2   __attribute__((target("bmi2,popcnt")))
+#else
+#  define TARGET_POPCNT
+#  define TARGET_SSE42
+#  define TARGET_AVX2
+#  define TARGET_BMI2
+#endif
+
+inline bool cpu_has_popcnt() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  return __builtin_cpu_supports("popcnt");
+#else
+  return true;
+#endif
+}
+
+inline bool cpu_has_sse42() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  return __builtin_cpu_supports("sse4.2");
+#elif defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 1);
+  return (info[2] >> 20) & 1;
+#else
+  return false;
+#endif
+}
+
+inline bool cpu_has_avx2() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  return __builtin_cpu_supports("avx2");
+#elif defined(_MSC_VER)
+  int info[4];
+  __cpuidex(info, 7, 0);
+  return (info[1] >> 5) & 1;
+#else
+  return false;
+#endif
+}
+
+// PEXT is microcoded (and slow) on AMD before Zen 3, so don't reach for it
+// first when something else will do.
+inline bool cpu_has_bmi2() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  return __builtin_cpu_supports("bmi2");
+#elif defined(_MSC_VER)
+  int info[4];
+  __cpuidex(info, 7, 0);
+  return (info[1] >> 8) & 1;
+#else
+  return false;
+#endif
+}
+
+inline int popcount64(uint64_t x) {
+#ifdef _MSC_VER
+  return (int)__popcnt64(x);
+#else
+  return __builtin_popcountll(x);
+#endif
+}
+
+// Index of the lowest set bit. x must not be zero.
+inline int ctz64(uint64_t x) {
+#ifdef _MSC_VER
+  unsigned long i;
+  _BitScanForward64(&i, x);
+  return (int)i;
+#else
+  return __builtin_ctzll(x);
+#endif
+}
+
+// Index of the highest set bit. x must not be zero.
+inline int log2_floor64(uint64_t x) {
+#ifdef _MSC_VER
+  unsigned long i;
+  _BitScanReverse64(&i, x);
+  return (int)i;
+#else
+  return 63 - __builtin_clzll(x);
+#endif
+}
+
+//------------------------------------------------------------------------------
+// Transposes an 8x8 bit matrix stored one row per byte, so bit N of byte M
+// ends up as bit M of byte N.
+
+inline uint64_t transpose8x8(uint64_t x) {
+  uint64_t t;
+  t = (x ^ (x >>  7)) & 0x00AA00AA00AA00AAull; x ^= t ^ (t <<  7);
+  t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCull; x ^= t ^ (t << 14);
+  t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ull; x ^= t ^ (t << 28);
+  return x;
+}
+
+//------------------------------------------------------------------------------
+// Pulls one channel out of 64 samples of byte-interleaved (stride 8) trace
+// data, 8 samples per source word. Bit K of byte J of the result holds sample
+// 8K+J, which is fine if all we want to do is count bits.
+
+inline uint64_t gather_channel8_unordered(const uint64_t* src, int channel) {
+  uint64_t bits = 0;
+  for (int k = 0; k < 8; k++) {
+    bits |= ((src[k] >> channel) & 0x0101010101010101ull) << k;
+  }
+  return bits;
+}
+
+// Same as above, but transposed back so bit N of the result is sample N.
+
+inline uint64_t gather_channel8(const uint64_t* src, int channel) {
+  return transpose8x8(gather_channel8_unordered(src, channel));
+}
+
+//------------------------------------------------------------------------------
@@ -1,7 +1,11 @@
 #include "Bits.hpp"
 
+#include "BitOps.hpp"
 #include "log.hpp"
 
+#include <immintrin.h>
+#include <string.h>
+
 //------------------------------------------------------------------------------
 
 void generate_mip1(void* blob, size_t samples, size_t channels, size_t stride, int mip_channel, uint8_t* out) {
@@ -19,10 +23,130 @@ void generate_mip1(void* blob, size_t samples, size_t channels, size_t stride, i
 
 //------------------------------------------------------------------------------
 
-void update_mips(TraceBuffer& trace, int channel, size_t sample_min, size_t sample_max, MipBuffer& mips) {
-  auto mip1_min = (sample_min +   0) >> 7;
-  auto mip1_max = (sample_max + 127) >> 7;
+void alloc_mips(MipBuffer& mips, size_t samples, bool exact, bool edges) {
+  alloc_levels(mips, samples);
+
+  if (exact) {
+    mips.mip2_exact = new uint16_t[mips.mip_len[2]]();
+    mips.mip3_exact = new uint32_t[mips.mip_len[3]]();
+    mips.mip4_exact = new uint32_t[mips.mip_len[4]]();
+  }
+
+  if (edges) {
+    mips.edge1 = new uint8_t [mips.mip_len[1]]();
+    mips.edge2 = new uint16_t[mips.mip_len[2]]();
+    mips.edge3 = new uint32_t[mips.mip_len[3]]();
+    mips.edge4 = new uint32_t[mips.mip_len[4]]();
+  }
+}
+
+void free_mips(MipBuffer& mips) {
+  free_levels(mips);
+
+  delete [] mips.mip2_exact;
+  delete [] mips.mip3_exact;
+  delete [] mips.mip4_exact;
+  mips.mip2_exact = nullptr;
+  mips.mip3_exact = nullptr;
+  mips.mip4_exact = nullptr;
+
+  delete [] mips.edge1;
+  delete [] mips.edge2;
+  delete [] mips.edge3;
+  delete [] mips.edge4;
+  mips.edge1 = nullptr;
+  mips.edge2 = nullptr;
+  mips.edge3 = nullptr;
+  mips.edge4 = nullptr;
+}
+
+// Zeroes the mips so a new trace can be appended from scratch.
+void clear_mips(MipBuffer& mips) {
+  clear_levels(mips);
+
+  if (mips.mip2_exact) {
+    memset(mips.mip2_exact, 0, mips.mip_len[2] * sizeof(uint16_t));
+    memset(mips.mip3_exact, 0, mips.mip_len[3] * sizeof(uint32_t));
+    memset(mips.mip4_exact, 0, mips.mip_len[4] * sizeof(uint32_t));
+  }
+
+  if (mips.edge1) {
+    memset(mips.edge1, 0, mips.mip_len[1] * sizeof(uint8_t));
+    memset(mips.edge2, 0, mips.mip_len[2] * sizeof(uint16_t));
+    memset(mips.edge3, 0, mips.mip_len[3] * sizeof(uint32_t));
+    memset(mips.edge4, 0, mips.mip_len[4] * sizeof(uint32_t));
+  }
+
+  mark_dirty(mips, 0, mips.samples);
+}
+
+size_t mips_size_bytes(MipBuffer& mips) {
+  size_t total = levels_size_bytes(mips);
+  if (mips.mip2_exact) {
+    total += mips.mip_len[2] * sizeof(uint16_t);
+    total += mips.mip_len[3] * sizeof(uint32_t);
+    total += mips.mip_len[4] * sizeof(uint32_t);
+  }
+  if (mips.edge1) {
+    total += mips.mip_len[1] * sizeof(uint8_t);
+    total += mips.mip_len[2] * sizeof(uint16_t);
+    total += mips.mip_len[3] * sizeof(uint32_t);
+    total += mips.mip_len[4] * sizeof(uint32_t);
+  }
+  return total;
+}
+
+//------------------------------------------------------------------------------
+// Each level starts on a 256-byte boundary so it can be bound with
+// glBindBufferRange(), and is padded out to a whole number of uints for the
+// shaders.
 
+static size_t align_level(size_t x) {
+  return (x + 255) & ~size_t(255);
+}
+
+void layout_mips(MipBuffer& mips, size_t base) {
+  auto align = align_level;
+
+  mips.mip1_offset = base;
+  mips.mip2_offset = mips.mip1_offset + align(mips.mip_len[1]);
+  mips.mip3_offset = mips.mip2_offset + align(mips.mip_len[2]);
+  mips.mip4_offset = mips.mip3_offset + align(mips.mip_len[3]);
+  mips.ssbo_len    = mips.mip4_offset + align(mips.mip_len[4]);
+
+  if (mips.edge1) {
+    mips.edge1_offset = mips.ssbo_len;
+    mips.edge2_offset = mips.edge1_offset + align(mips.mip_len[1] * sizeof(mips.edge1[0]));
+    mips.edge3_offset = mips.edge2_offset + align(mips.mip_len[2] * sizeof(mips.edge2[0]));
+    mips.edge4_offset = mips.edge3_offset + align(mips.mip_len[3] * sizeof(mips.edge3[0]));
+    mips.ssbo_len     = mips.edge4_offset + align(mips.mip_len[4] * sizeof(mips.edge4[0]));
+  }
+
+  mips.ssbo_len -= base;
+  assert(mips.ssbo_len == mips_ssbo_len(mips.samples, mips.edge1 != nullptr));
+}
+
+size_t mips_ssbo_len(size_t samples, bool edges) {
+  size_t len[5] = {};
+  for (int level = 1; level <= 4; level++) {
+    samples = (samples + mip_fanout - 1) / mip_fanout;
+    len[level] = samples;
+  }
+
+  size_t total = 0;
+  for (int level = 1; level <= 4; level++) total += align_level(len[level]);
+  if (edges) {
+    total += align_level(len[1] * sizeof(uint8_t));
+    total += align_level(len[2] * sizeof(uint16_t));
+    total += align_level(len[3] * sizeof(uint32_t));
+    total += align_level(len[4] * sizeof(uint32_t));
+  }
+  return total;
+}
+
+//------------------------------------------------------------------------------
+
+void update_mip1_scalar(TraceBuffer& trace, int channel, size_t mip1_min, size_t mip1_max, MipBuffer& mips) {
   for (size_t i = mip1_min; i < mip1_max; i++) {
     int total = 0;
     for (size_t j = 0; j < 128; j++) {
@@ -30,274 +154,886 @@ void update_mips(TraceBuffer& trace, int channel, size_t sample_min, size_t samp
       if (index >= trace.samples) break;
       total += trace.get_bit(channel, index);
     }
-    mips.mip1[i] = total;
+    mips.mip[1][i] = total;
   }
+}
 
-  auto mip2_min = (mip1_min +   0) >> 7;
-  auto mip2_max = (mip1_max + 127) >> 7;
+//------------------------------------------------------------------------------
+// Layouts the popcount paths know how to pull a channel's bits out of -
+// planar, or interleaved 8/16/32-bit samples with channel N in bit N.
 
-  for (size_t i = mip2_min; i < mip2_max; i++) {
+static bool popcount_layout(const TraceBuffer& trace) {
+  if (trace.planar()) return true;
+  bool bytewise = trace.stride == 8 || trace.stride == 16 || trace.stride == 32;
+  return bytewise && trace.channel_stride == 1;
+}
+
+// Buckets per extract() call for the wide layouts. 4K on the stack.
+static const size_t extract_buckets = 256;
+
+// A 128-sample bucket of byte-interleaved trace data is 16 64-bit words. We
+// bit-slice the channel out of each group of 8 words into one 64-bit word and
+// popcount that, so a whole bucket costs 16 shift/mask/ors and 2 popcounts
+// instead of 128 get_bit() calls. 16 and 32-bit samples get extract()ed a
+// block of buckets at a time instead.
+
+TARGET_POPCNT
+void update_mip1_popcount(TraceBuffer& trace, int channel, size_t mip1_min, size_t mip1_max, MipBuffer& mips) {
+  assert(popcount_layout(trace));
+  assert(size_t(channel) < trace.channels);
+
+  const uint64_t* words = (const uint64_t*)trace.blob;
+  const uint64_t* plane = trace.plane(channel);
+
+  // Only whole buckets go through the fast path, the partial one at the end of
+  // the trace (if any) goes through the scalar path.
+  size_t full_max = trace.samples / 128;
+  if (full_max > mip1_max) full_max = mip1_max;
+
+  size_t i = mip1_min;
+
+  // Planar traces already have the bits we want packed up.
+  if (trace.planar()) {
+    for (; i < full_max; i++) {
+      mips.mip[1][i] = uint8_t(popcount64(plane[i * 2 + 0]) + popcount64(plane[i * 2 + 1]));
+    }
+  }
+
+  else if (trace.stride == 8) {
+    for (; i < full_max; i++) {
+      const uint64_t* src = words + i * 16;
+      uint64_t lo = gather_channel8_unordered(src + 0, channel);
+      uint64_t hi = gather_channel8_unordered(src + 8, channel);
+      mips.mip[1][i] = uint8_t(popcount64(lo) + popcount64(hi));
+    }
+  }
+  else {
+    uint64_t bits[extract_buckets * 2];
+    while (i < full_max) {
+      size_t count = full_max - i;
+      if (count > extract_buckets) count = extract_buckets;
+      trace.extract(channel, i * 128, count * 128, bits);
+      for (size_t j = 0; j < count; j++, i++) {
+        mips.mip[1][i] = uint8_t(popcount64(bits[j * 2 + 0]) + popcount64(bits[j * 2 + 1]));
+      }
+    }
+  }
+
+  if (i < mip1_max) {
+    update_mip1_scalar(trace, channel, i, mip1_max, mips);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Sample 0 has nothing before it, so it never counts as an edge.
+
+void update_edge1_scalar(TraceBuffer& trace, int channel, size_t mip1_min, size_t mip1_max, MipBuffer& mips) {
+  for (size_t i = mip1_min; i < mip1_max; i++) {
     int total = 0;
     for (size_t j = 0; j < 128; j++) {
       auto index = i * 128 + j;
-      if (index >= mips.mip1_len) break;
-      total += mips.mip1[index];
+      if (index >= trace.samples) break;
+      if (index == 0) continue;
+      total += trace.get_bit(channel, index) ^ trace.get_bit(channel, index - 1);
     }
-    mips.mip2[i] = (total + 127) >> 7;
+    mips.edge1[i] = total;
   }
+}
 
-  auto mip3_min = (mip2_min +   0) >> 7;
-  auto mip3_max = (mip2_max + 127) >> 7;
+// Same bit-slicing as update_mip1_popcount(), but in sample order so that
+// (bits ^ (bits << 1)) marks every sample that differs from its neighbor.
 
-  for (size_t i = mip3_min; i < mip3_max; i++) {
-    int total = 0;
+TARGET_POPCNT
+void update_edge1_popcount(TraceBuffer& trace, int channel, size_t mip1_min, size_t mip1_max, MipBuffer& mips) {
+  assert(popcount_layout(trace));
+  assert(size_t(channel) < trace.channels);
+
+  size_t full_max = trace.samples / 128;
+  if (full_max > mip1_max) full_max = mip1_max;
+
+  size_t i = mip1_min;
+  uint64_t bits[extract_buckets * 2];
+  bool wide = !trace.planar() && trace.stride != 8;
+
+  while (i < full_max) {
+    size_t count = full_max - i;
+    if (count > extract_buckets) count = extract_buckets;
+    if (wide) trace.extract(channel, i * 128, count * 128, bits);
+
+    for (size_t j = 0; j < count; j++, i++) {
+      uint64_t lo = wide ? bits[j * 2 + 0] : channel_word(trace, channel, i * 2 + 0);
+      uint64_t hi = wide ? bits[j * 2 + 1] : channel_word(trace, channel, i * 2 + 1);
+
+      uint64_t prev = i ? uint64_t(trace.get_bit(channel, i * 128 - 1)) : lo & 1;
+      uint64_t edges_lo = lo ^ ((lo << 1) | prev);
+      uint64_t edges_hi = hi ^ ((hi << 1) | (lo >> 63));
+      mips.edge1[i] = uint8_t(popcount64(edges_lo) + popcount64(edges_hi));
+    }
+  }
+
+  if (i < mip1_max) {
+    update_edge1_scalar(trace, channel, i, mip1_max, mips);
+  }
+}
+
+//------------------------------------------------------------------------------
+
+// Each entry in dst is the sum of 128 entries in src.
+
+template<typename SRC, typename DST>
+static void sum_mip(const SRC* src, size_t src_len, DST* dst, size_t dst_min, size_t dst_max) {
+  for (size_t i = dst_min; i < dst_max; i++) {
+    uint32_t total = 0;
     for (size_t j = 0; j < 128; j++) {
       auto index = i * 128 + j;
-      if (index >= mips.mip2_len) break;
-      total += mips.mip2[i * 128 + j];
+      if (index >= src_len) break;
+      total += src[index];
     }
-    mips.mip3[i] = (total + 127) >> 7;
+    dst[i] = DST(total);
   }
+}
+
+// Builds mip2-mip4 of the exact pyramid (if there is one) from mip1.
+
+static void update_exact_mips(MipBuffer& mips, size_t mip2_min, size_t mip2_max) {
+  if (!mips.mip2_exact) return;
+
+  sum_mip(mips.mip[1], mips.mip_len[1], mips.mip2_exact, mip2_min, mip2_max);
+
+  auto mip3_min = (mip2_min +   0) >> 7;
+  auto mip3_max = (mip2_max + 127) >> 7;
+  sum_mip(mips.mip2_exact, mips.mip_len[2], mips.mip3_exact, mip3_min, mip3_max);
 
   auto mip4_min = (mip3_min +   0) >> 7;
   auto mip4_max = (mip3_max + 127) >> 7;
+  sum_mip(mips.mip3_exact, mips.mip_len[3], mips.mip4_exact, mip4_min, mip4_max);
+}
 
-  for (size_t i = mip4_min; i < mip4_max; i++) {
-    int total = 0;
-    for (int j = 0; j < 128; j++) {
-      auto index = i * 128 + j;
-      if (index >= mips.mip3_len) break;
-      total += mips.mip3[i * 128 + j];
-    }
-    mips.mip4[i] = (total + 127) >> 7;
+// Builds edge2-edge4 from edge1, if we have an edge pyramid.
+
+static void update_edge_mips(MipBuffer& mips, size_t mip2_min, size_t mip2_max) {
+  if (!mips.edge1) return;
+
+  sum_mip(mips.edge1, mips.mip_len[1], mips.edge2, mip2_min, mip2_max);
+
+  auto mip3_min = (mip2_min +   0) >> 7;
+  auto mip3_max = (mip2_max + 127) >> 7;
+  sum_mip(mips.edge2, mips.mip_len[2], mips.edge3, mip3_min, mip3_max);
+
+  auto mip4_min = (mip3_min +   0) >> 7;
+  auto mip4_max = (mip3_max + 127) >> 7;
+  sum_mip(mips.edge3, mips.mip_len[3], mips.edge4, mip4_min, mip4_max);
+}
+
+//------------------------------------------------------------------------------
+
+void update_mips(TraceBuffer& trace, int channel, size_t sample_min, size_t sample_max, MipBuffer& mips) {
+  auto mip1_min = (sample_min +   0) >> 7;
+  auto mip1_max = (sample_max + 127) >> 7;
+
+  if (popcount_layout(trace) && cpu_has_popcnt()) {
+    update_mip1_popcount(trace, channel, mip1_min, mip1_max, mips);
+    if (mips.edge1) update_edge1_popcount(trace, channel, mip1_min, mip1_max, mips);
   }
+  else {
+    update_mip1_scalar(trace, channel, mip1_min, mip1_max, mips);
+    if (mips.edge1) update_edge1_scalar(trace, channel, mip1_min, mip1_max, mips);
+  }
+
+  merge_levels(mips, 1, mip1_min, mip1_max);
+
+  auto mip2_min = (mip1_min +   0) >> 7;
+  auto mip2_max = (mip1_max + 127) >> 7;
+  update_exact_mips(mips, mip2_min, mip2_max);
+  update_edge_mips(mips, mip2_min, mip2_max);
+  mark_dirty(mips, sample_min, sample_max);
 }
 
 //------------------------------------------------------------------------------
+// CPU port of mipper_glsl_64 - multiplying a byte by 0x8040201008040201 spreads
+// its bits out 9 apart, which puts bit N of the byte at the top of byte 7-N of
+// the product. Shift and mask, and we've got 8 8-bit accumulators that count
+// all 8 channels of a 128-sample bucket at once. Byte N of the result is the
+// count for channel 7-N.
+
+static uint64_t mip1_swar(const uint8_t* src) {
+  uint64_t accum = 0;
+  for (int i = 0; i < 128; i++) {
+    uint64_t expanded = src[i] * 0x8040201008040201ull;
+    accum += (expanded >> 7) & 0x0101010101010101ull;
+  }
+  return accum;
+}
 
-//#pragma GCC optimize("O0")
-void render(
-  TraceBuffer& trace, MipBuffer& mips, int channel,
-  double world_min, double world_max,
-  double trace_min, double trace_max,
-  double* out, int out_len)
-{
-  const uint64_t mip0_shift =  0;
-  const uint64_t mip1_shift =  7;
-  const uint64_t mip2_shift = 14;
-  const uint64_t mip3_shift = 21;
-  const uint64_t mip4_shift = 28;
-
-  const uint64_t mip0_size = 0b00000000000000000000000000000000001ull;
-  const uint64_t mip1_size = 0b00000000000000000000000000010000000ull;
-  const uint64_t mip2_size = 0b00000000000000000000100000000000000ull;
-  const uint64_t mip3_size = 0b00000000000001000000000000000000000ull;
-  const uint64_t mip4_size = 0b00000010000000000000000000000000000ull;
-
-  const uint64_t mip0_mask = 0b00000000000000000000000000001111111ull;
-  const uint64_t mip1_mask = 0b00000000000000000000011111110000000ull;
-  const uint64_t mip2_mask = 0b00000000000000111111100000000000000ull;
-  const uint64_t mip3_mask = 0b00000001111111000000000000000000000ull;
-  const uint64_t mip4_mask = 0b11111110000000000000000000000000000ull;
-
-  const uint64_t mip0_weight = 128;
-  const uint64_t mip1_weight = 128;
-  const uint64_t mip2_weight = 128 * 128;
-  const uint64_t mip3_weight = 128 * 128 * 128;
-  const uint64_t mip4_weight = 128 * 128 * 128 * 128;
-
-  // We compute a "granularity" based on the width of each pixel in trace space
-  // so that we can reduce the precision of the span endpoints and skip lower
-  // mips when they wouldn't contribute to the final value much. 7 here means
-  // 1/128-subpixel precision.
-
-  // FIXME - use samples_per_pixel or something
-  double pix0_l = remap(0.0, world_min, world_max, trace_min, trace_max);
-  double pix0_r = remap(1.0, world_min, world_max, trace_min, trace_max);
-  double granularity = exp2(ceil(log2(pix0_r - pix0_l)) - 7);
-  double igranularity = 1.0 / granularity;
-
-  mips.mip0_hit = 0;
-  mips.mip1_hit = 0;
-  mips.mip2_hit = 0;
-  mips.mip3_hit = 0;
-  mips.mip4_hit = 0;
+// XORing each sample with the one before it leaves a 1 in every channel that
+// changed, and then counting edges is the same as counting ones.
 
-  for (int x = 0; x < out_len; x++) {
-    out[x] = 0;
+static uint64_t edge1_swar(const uint8_t* src, uint8_t prev) {
+  uint64_t accum = 0;
+  for (int i = 0; i < 128; i++) {
+    uint64_t expanded = uint8_t(src[i] ^ prev) * 0x8040201008040201ull;
+    accum += (expanded >> 7) & 0x0101010101010101ull;
+    prev = src[i];
+  }
+  return accum;
+}
 
-    double pixel_center = x + 0.5;
+// src points at the first sample of bucket mip1_min. Unless that's bucket 0,
+// the sample before it has to be readable too, for the edges.
 
-    double sample_fmin = remap(pixel_center - 0.5, world_min, world_max, trace_min, trace_max);
-    double sample_fmax = remap(pixel_center + 0.5, world_min, world_max, trace_min, trace_max);
+static void update_mip1_all_swar(const uint8_t* src, size_t mip1_min, size_t mip1_max, MipBuffer* mips, int n) {
+  bool edges = mips[0].edge1 != nullptr;
 
-    // If the span is really large, ditch some precision from the end bits so
-    // we don't bother with head/tail samples that don't contribute to the sum
-    sample_fmin = floor(sample_fmin * igranularity) * granularity;
-    sample_fmax = floor(sample_fmax * igranularity) * granularity;
+  for (size_t i = mip1_min; i < mip1_max; i++) {
+    const uint8_t* chunk = src + (i - mip1_min) * 128;
+    uint64_t accum = mip1_swar(chunk);
+    for (int c = 0; c < n; c++) {
+      mips[c].mip[1][i] = uint8_t(accum >> (8 * (7 - c)));
+    }
 
-    if (sample_fmin < 0)             sample_fmin = 0;
-    if (sample_fmax > trace.samples) sample_fmax = trace.samples;
+    if (edges) {
+      uint64_t accum = edge1_swar(chunk, i ? chunk[-1] : chunk[0]);
+      for (int c = 0; c < n; c++) {
+        mips[c].edge1[i] = uint8_t(accum >> (8 * (7 - c)));
+      }
+    }
+  }
+}
 
-    if (sample_fmax < 0)              { out[x] = 0; continue; }
-    if (sample_fmin >= trace.samples) { out[x] = 0; continue; }
+//------------------------------------------------------------------------------
+// AVX2 has no 64-bit multiply, and doing the expansion a nibble at a time in
+// 32-bit lanes like mipper_glsl_32 turned out slower than just bit-slicing
+// with movemask - shift the channel we want into the top bit of every byte,
+// movemask grabs 32 samples at once, popcount counts them. Doubling the bytes
+// after each channel moves the next one up into the top bit.
+
+TARGET_AVX2
+static inline void slice_counts_avx2(__m256i v0, __m256i v1, __m256i v2, __m256i v3, int n, uint8_t* counts) {
+  // Move channel n-1 up to bit 7.
+  v0 = _mm256_slli_epi16(v0, 8 - n);
+  v1 = _mm256_slli_epi16(v1, 8 - n);
+  v2 = _mm256_slli_epi16(v2, 8 - n);
+  v3 = _mm256_slli_epi16(v3, 8 - n);
+
+  for (int c = n - 1; c >= 0; c--) {
+    uint64_t lo = uint32_t(_mm256_movemask_epi8(v0)) | (uint64_t(uint32_t(_mm256_movemask_epi8(v1))) << 32);
+    uint64_t hi = uint32_t(_mm256_movemask_epi8(v2)) | (uint64_t(uint32_t(_mm256_movemask_epi8(v3))) << 32);
+    counts[c] = uint8_t(popcount64(lo) + popcount64(hi));
+
+    v0 = _mm256_add_epi8(v0, v0);
+    v1 = _mm256_add_epi8(v1, v1);
+    v2 = _mm256_add_epi8(v2, v2);
+    v3 = _mm256_add_epi8(v3, v3);
+  }
+}
 
-    //----------------------------------------
-    // Samples coords start as 32.7 fixed point, 7 bit subpixel precision
+TARGET_AVX2
+static void update_mip1_all_avx2(const uint8_t* src, size_t mip1_min, size_t mip1_max, MipBuffer* mips, int n) {
+  bool edges = mips[0].edge1 != nullptr;
+  uint8_t counts[8];
 
-    int64_t sample_imin = (int64_t)floor(sample_fmin * 128.0);
-    int64_t sample_imax = (int64_t)floor(sample_fmax * 128.0);
+  for (size_t i = mip1_min; i < mip1_max; i++) {
+    const uint8_t* chunk = src + (i - mip1_min) * 128;
 
-    // Both endpoints are inside the same sample.
-    if ((sample_imin >> 7) == (sample_imax >> 7)) {
-      out[x] = trace.get_bit(channel, sample_imin >> 7);
-      mips.mip0_hit++;
+    __m256i v0 = _mm256_loadu_si256((const __m256i*)(chunk +  0));
+    __m256i v1 = _mm256_loadu_si256((const __m256i*)(chunk + 32));
+    __m256i v2 = _mm256_loadu_si256((const __m256i*)(chunk + 64));
+    __m256i v3 = _mm256_loadu_si256((const __m256i*)(chunk + 96));
+
+    slice_counts_avx2(v0, v1, v2, v3, n, counts);
+    for (int c = 0; c < n; c++) mips[c].mip[1][i] = counts[c];
+
+    if (!edges) continue;
+
+    // The very first bucket has no sample before it to load.
+    if (i == 0) {
+      uint64_t accum = edge1_swar(chunk, chunk[0]);
+      for (int c = 0; c < n; c++) mips[c].edge1[i] = uint8_t(accum >> (8 * (7 - c)));
       continue;
     }
 
-    uint64_t sample_ilen = sample_imax - sample_imin;
-    uint64_t total = 0;
+    __m256i p0 = _mm256_loadu_si256((const __m256i*)(chunk - 1 +  0));
+    __m256i p1 = _mm256_loadu_si256((const __m256i*)(chunk - 1 + 32));
+    __m256i p2 = _mm256_loadu_si256((const __m256i*)(chunk - 1 + 64));
+    __m256i p3 = _mm256_loadu_si256((const __m256i*)(chunk - 1 + 96));
 
-    // Add the contribution from the fractional portion of the first sample.
-    if (sample_imin & 0x7F) {
-      double head_fract = 128 - (sample_imin & 0x7F);
-      total += head_fract * trace.get_bit(channel, sample_imin >> 7);
-      sample_imin = (sample_imin + 0x7F) & ~0x7F;
-      mips.mip0_hit++;
-    }
+    slice_counts_avx2(_mm256_xor_si256(v0, p0), _mm256_xor_si256(v1, p1),
+                      _mm256_xor_si256(v2, p2), _mm256_xor_si256(v3, p3), n, counts);
+    for (int c = 0; c < n; c++) mips[c].edge1[i] = counts[c];
+  }
+}
+
+//------------------------------------------------------------------------------
+// Striped mips, the way mipper_glsl_64 and merger_glsl_64 lay them out. The
+// SWAR mipper is mip1_swar() with the bytes swapped back into channel order,
+// which is what the bit reverse in the shader does. The AVX2 one is the
+// movemask slicer above. The mergers split each entry into even and odd
+// channels with a 16-bit lane apiece, same as the shader - 128 entries of at
+// most 128 can't carry out of a lane.
+
+static inline uint64_t swap_bytes64(uint64_t x) {
+  x = ((x & 0x00FF00FF00FF00FFull) << 8)  | ((x >> 8)  & 0x00FF00FF00FF00FFull);
+  x = ((x & 0x0000FFFF0000FFFFull) << 16) | ((x >> 16) & 0x0000FFFF0000FFFFull);
+  return (x << 32) | (x >> 32);
+}
+
+static inline uint64_t merge_lanes(uint64_t accum_lo, uint64_t accum_hi) {
+  accum_lo = ((accum_lo + 0x007F007F007F007Full) >> 7) & 0x00FF00FF00FF00FFull;
+  accum_hi = ((accum_hi + 0x007F007F007F007Full) >> 7) & 0x00FF00FF00FF00FFull;
+  return accum_lo | (accum_hi << 8);
+}
+
+void stripe_mip1_swar(const uint8_t* mip0, size_t mip1_min, size_t mip1_max, uint64_t* mip1) {
+  for (size_t i = mip1_min; i < mip1_max; i++) {
+    mip1[i] = swap_bytes64(mip1_swar(mip0 + i * 128));
+  }
+}
+
+TARGET_AVX2
+void stripe_mip1_avx2(const uint8_t* mip0, size_t mip1_min, size_t mip1_max, uint64_t* mip1) {
+  uint8_t counts[8];
+  for (size_t i = mip1_min; i < mip1_max; i++) {
+    const uint8_t* chunk = mip0 + i * 128;
+    __m256i v0 = _mm256_loadu_si256((const __m256i*)(chunk +  0));
+    __m256i v1 = _mm256_loadu_si256((const __m256i*)(chunk + 32));
+    __m256i v2 = _mm256_loadu_si256((const __m256i*)(chunk + 64));
+    __m256i v3 = _mm256_loadu_si256((const __m256i*)(chunk + 96));
+    slice_counts_avx2(v0, v1, v2, v3, 8, counts);
+    memcpy(&mip1[i], counts, 8);
+  }
+}
 
-    // Add the contribution from the fractional portion of the last sample.
-    if (sample_imax & 0x7F) {
-      double tail_fract = sample_imax & 0x7F;
-      total += tail_fract * trace.get_bit(channel, sample_imax >> 7);
-      sample_imax = sample_imax & ~0x7F;
-      mips.mip0_hit++;
+void stripe_mip2_swar(const uint64_t* mip1, size_t mip2_min, size_t mip2_max, uint64_t* mip2) {
+  for (size_t i = mip2_min; i < mip2_max; i++) {
+    uint64_t accum_lo = 0;
+    uint64_t accum_hi = 0;
+    for (size_t j = 0; j < 128; j++) {
+      uint64_t chunk = mip1[i * 128 + j];
+      accum_lo += (chunk >> 0) & 0x00FF00FF00FF00FFull;
+      accum_hi += (chunk >> 8) & 0x00FF00FF00FF00FFull;
     }
+    mip2[i] = merge_lanes(accum_lo, accum_hi);
+  }
+}
 
-    if (sample_imin == sample_imax) {
-      out[x] = double(total) / double(sample_ilen);
-      continue;
+// Four entries per vector, so each 64-bit lane ends up with a quarter of the
+// sum. Adding the lanes together can't carry either.
+
+TARGET_AVX2
+void stripe_mip2_avx2(const uint64_t* mip1, size_t mip2_min, size_t mip2_max, uint64_t* mip2) {
+  const __m256i mask = _mm256_set1_epi16(0x00FF);
+  for (size_t i = mip2_min; i < mip2_max; i++) {
+    const __m256i* src = (const __m256i*)(mip1 + i * 128);
+    __m256i accum_lo = _mm256_setzero_si256();
+    __m256i accum_hi = _mm256_setzero_si256();
+    for (int j = 0; j < 32; j++) {
+      __m256i v = _mm256_loadu_si256(src + j);
+      accum_lo = _mm256_add_epi16(accum_lo, _mm256_and_si256(v, mask));
+      accum_hi = _mm256_add_epi16(accum_hi, _mm256_srli_epi16(v, 8));
     }
 
-    assert(!(sample_imin & 0x7F));
-    assert(!(sample_imax & 0x7F));
-    sample_imin >>= 7;
-    sample_imax >>= 7;
+    __m128i lo = _mm_add_epi16(_mm256_castsi256_si128(accum_lo), _mm256_extracti128_si256(accum_lo, 1));
+    __m128i hi = _mm_add_epi16(_mm256_castsi256_si128(accum_hi), _mm256_extracti128_si256(accum_hi, 1));
+    mip2[i] = merge_lanes(uint64_t(_mm_cvtsi128_si64(lo)) + uint64_t(_mm_extract_epi64(lo, 1)),
+                          uint64_t(_mm_cvtsi128_si64(hi)) + uint64_t(_mm_extract_epi64(hi, 1)));
+  }
+}
 
-    //----------------------------------------
-    // Endpoints are now integers. This could be slightly faster with popcnt,
-    // but it's not really worth it.
+void stripe_mips(const uint8_t* mip0, size_t samples, uint64_t* mip1, uint64_t* mip2) {
+  size_t mip1_len = samples / 128;
+  size_t mip2_len = mip1_len / 128;
+  if (cpu_has_avx2()) {
+    stripe_mip1_avx2(mip0, 0, mip1_len, mip1);
+    stripe_mip2_avx2(mip1, 0, mip2_len, mip2);
+  }
+  else {
+    stripe_mip1_swar(mip0, 0, mip1_len, mip1);
+    stripe_mip2_swar(mip1, 0, mip2_len, mip2);
+  }
+}
 
-    if ((sample_imin & mip0_mask) || (sample_imax & mip0_mask)) {
-      while ((sample_imin & mip0_mask) && (sample_imin < sample_imax)) {
-        total += trace.get_bit(channel, sample_imin >> mip0_shift) * mip0_weight;
-        sample_imin += mip0_size;
-        mips.mip0_hit++;
-      }
+//------------------------------------------------------------------------------
+// We walk the trace in tiles of 128 mip1 buckets, so each tile's mip1 entries
+// are still in cache when we merge them into mip2. Interleaved traces count all
+// their channels in one pass, anything else goes a channel at a time. The levels above that are
+// tiny and get built from mip2 afterwards.
 
-      while ((sample_imax & mip0_mask) && (sample_imin < sample_imax)) {
-        total += trace.get_bit(channel, (sample_imax - 1) >> mip0_shift) * mip0_weight;
-        sample_imax -= mip0_size;
-        mips.mip0_hit++;
-      }
+void update_mips_all(TraceBuffer& trace, MipBuffer* mips, int n) {
+  update_mips_all(trace, mips, n, 0, trace.samples);
+}
 
-      if (sample_imin == sample_imax) {
-        out[x] = double(total) / double(sample_ilen);
-        continue;
-      }
+void update_mips_all(TraceBuffer& trace, MipBuffer* mips, int n, size_t sample_min, size_t sample_max) {
+  size_t bytes_per_sample = trace.stride / 8;
+  int lanes = (n + 7) / 8;
 
-      assert(!(sample_imin & mip0_mask));
-      assert(!(sample_imax & mip0_mask));
+  if (trace.planar() || !popcount_layout(trace) || size_t(lanes) > bytes_per_sample) {
+    for (int c = 0; c < n; c++) {
+      update_mips(trace, c, sample_min, sample_max, mips[c]);
     }
+    return;
+  }
 
-    //----------------------------------------
-    // Endpoints are now multiples of mip1_size
+  const uint8_t* src = (const uint8_t*)trace.blob;
+  bool use_avx2 = cpu_has_avx2();
 
-    if ((sample_imin & mip1_mask) || (sample_imax & mip1_mask)) {
-      while ((sample_imin & mip1_mask) && (sample_imin < sample_imax)) {
-        total += mips.mip1[sample_imin >> mip1_shift] * mip1_weight;
-        sample_imin += mip1_size;
-        mips.mip1_hit++;
+  // 16 and 32-bit samples get split into byte lanes a tile at a time, same as
+  // transpose_samples(), and each lane goes through the 8-channel kernels.
+  // lane_bytes[0] is the sample before the tile, for the edges.
+  uint8_t* lane_bytes = bytes_per_sample > 1 ? new uint8_t[128 * 128 + 1] : nullptr;
+
+  auto mip1_min = (sample_min +   0) >> 7;
+  auto mip1_max = (sample_max + 127) >> 7;
+  auto mip2_min = (mip1_min +   0) >> 7;
+  auto mip2_max = (mip1_max + 127) >> 7;
+
+  // Only whole buckets go through the fast path.
+  size_t mip1_full = trace.samples / 128;
+
+  for (size_t tile = mip2_min; tile < mip2_max; tile++) {
+    size_t tile_min = tile * 128;
+    size_t tile_max = tile_min + 128;
+    if (tile_min < mip1_min) tile_min = mip1_min;
+    if (tile_max > mip1_max) tile_max = mip1_max;
+
+    size_t fast_max = tile_max < mip1_full ? tile_max : mip1_full;
+    if (fast_max < tile_min) fast_max = tile_min;
+
+    for (int lane = 0; lane < lanes && tile_min < fast_max; lane++) {
+      const uint8_t* lane_src = src + tile_min * 128;
+      int lane_n = n - lane * 8 < 8 ? n - lane * 8 : 8;
+
+      if (lane_bytes) {
+        const uint8_t* block = src + tile_min * 128 * bytes_per_sample + lane;
+        size_t count = (fast_max - tile_min) * 128;
+        lane_bytes[0] = tile_min ? block[-ptrdiff_t(bytes_per_sample)] : 0;
+        for (size_t i = 0; i < count; i++) lane_bytes[i + 1] = block[i * bytes_per_sample];
+        lane_src = lane_bytes + 1;
       }
 
-      while ((sample_imax & mip1_mask) && (sample_imin < sample_imax)) {
-        total += mips.mip1[(sample_imax - 1) >> mip1_shift] * mip1_weight;
-        sample_imax -= mip1_size;
-        mips.mip1_hit++;
+      if (use_avx2) {
+        update_mip1_all_avx2(lane_src, tile_min, fast_max, mips + lane * 8, lane_n);
       }
+      else {
+        update_mip1_all_swar(lane_src, tile_min, fast_max, mips + lane * 8, lane_n);
+      }
+    }
 
-      if (sample_imin == sample_imax) {
-        out[x] = double(total) / double(sample_ilen);
-        continue;
+    for (int c = 0; c < n; c++) {
+      if (fast_max < tile_max) {
+        update_mip1_scalar(trace, c, fast_max, tile_max, mips[c]);
+        if (mips[c].edge1) update_edge1_scalar(trace, c, fast_max, tile_max, mips[c]);
       }
+      merge_level(mips[c], 2, tile, tile + 1);
+    }
+  }
 
-      assert(!(sample_imin & mip1_mask));
-      assert(!(sample_imax & mip1_mask));
+  for (int c = 0; c < n; c++) {
+    merge_levels(mips[c], 2, mip2_min, mip2_max);
+    update_exact_mips(mips[c], mip2_min, mip2_max);
+    update_edge_mips(mips[c], mip2_min, mip2_max);
+    mark_dirty(mips[c], sample_min, sample_max);
+  }
+
+  delete [] lane_bytes;
+}
+
+//------------------------------------------------------------------------------
+// Live capture appends raw blocks to the end of the trace. The mips have to be
+// allocated (and zeroed, which alloc_mips() does) for the full capacity of the
+// trace up front - buckets past the end of the trace are still zero, so
+// merging a partially-filled bucket gives the right answer and we only ever
+// have to touch the buckets the new samples land in.
+
+size_t append_samples(TraceBuffer& trace, MipBuffer* mips, int n, const void* data, size_t len) {
+  // Capture data is always interleaved, planar traces get it transposed on
+  // the way in.
+  size_t bytes_per_sample = trace.planar() ? (trace.channels + 7) / 8 : trace.stride / 8;
+  size_t capacity = trace.capacity();
+  assert(bytes_per_sample == 1 || bytes_per_sample == 2 || bytes_per_sample == 4);
+
+  // Drop whatever doesn't fit.
+  size_t count = len / bytes_per_sample;
+  if (trace.samples + count > capacity) count = capacity - trace.samples;
+  if (count == 0) return 0;
+
+  if (trace.planar()) {
+    transpose_samples(trace, trace.samples, data, bytes_per_sample, count);
+  }
+  else {
+    memcpy((uint8_t*)trace.blob + trace.samples * bytes_per_sample, data, count * bytes_per_sample);
+  }
+
+  size_t sample_min = trace.samples;
+  size_t sample_max = trace.samples + count;
+  trace.samples = sample_max;
+
+  update_mips_all(trace, mips, n, sample_min, sample_max);
+  return sample_max - sample_min;
+}
+
+//------------------------------------------------------------------------------
+
+void init_planar(TraceBuffer& trace, size_t channels, size_t capacity) {
+  trace.samples        = 0;
+  trace.channels       = channels;
+  trace.stride         = 1;
+  trace.channel_stride = (capacity + 2047) & ~size_t(2047);
+  trace.ssbo_len       = trace.channel_stride / 8 * channels;
+}
+
+//------------------------------------------------------------------------------
+// 2^24 samples per shard at the least keeps every shard offset 256-byte
+// aligned, and is more than a screen's worth at mip level 0 - the painter
+// never needs more than two neighboring shards for one draw.
+
+void init_shards(TraceBuffer& trace, size_t shard_samples) {
+  assert(shard_samples >= (size_t(1) << 24));
+  assert((shard_samples & (shard_samples - 1)) == 0);
+
+  trace.shard_samples = shard_samples;
+  trace.shard_count   = int((trace.capacity() + shard_samples - 1) / shard_samples);
+  assert(trace.shard_count <= TraceBuffer::max_shards);
+}
+
+size_t trace_shard_count(const TraceBuffer& trace) {
+  return trace.shard_count ? trace.shard_count : 1;
+}
+
+TraceShard trace_shard(const TraceBuffer& trace, size_t channel, size_t shard) {
+  if (trace.shard_count == 0) {
+    if (trace.planar()) {
+      size_t plane_len = trace.channel_stride / 8;
+      return { trace.ssbo, 0, trace.channel_stride, channel * plane_len, plane_len };
     }
+    return { trace.ssbo, 0, trace.capacity(), 0, trace.ssbo_len };
+  }
 
-    //----------------------------------------
-    // Endpoints are now multiples of mip2_size
+  assert(shard < size_t(trace.shard_count));
+  size_t base = shard * trace.shard_samples;
+  if (trace.planar()) {
+    size_t plane_len = trace.shard_samples / 8;
+    return { trace.shards[shard], base, trace.shard_samples, channel * plane_len, plane_len };
+  }
+  return { trace.shards[shard], base, trace.shard_samples, 0, trace.shard_samples * trace.stride / 8 };
+}
 
-    if ((sample_imin & mip2_mask) || (sample_imax & mip2_mask)) {
-      while ((sample_imin & mip2_mask) && (sample_imin < sample_imax)) {
-        total += mips.mip2[sample_imin >> mip2_shift] * mip2_weight;
-        sample_imin += mip2_size;
-        mips.mip2_hit++;
-      }
+//------------------------------------------------------------------------------
+// Interleaved to planar. Word W of each plane gets samples [64W, 64W + 64).
+// Only whole words go through the kernels - the ragged ends of a block get
+// done a bit at a time, since the words they land in are shared with the
+// neighboring blocks.
+
+static void transpose_scalar(TraceBuffer& trace, size_t sample_base, const uint8_t* src,
+                             size_t bytes_per_sample, size_t sample_min, size_t sample_max) {
+  for (size_t s = sample_min; s < sample_max; s++) {
+    const uint8_t* sample = src + (s - sample_base) * bytes_per_sample;
+    uint64_t mask = uint64_t(1) << (s & 63);
+    for (size_t c = 0; c < trace.channels; c++) {
+      uint64_t& word = trace.plane(c)[s >> 6];
+      if ((sample[c >> 3] >> (c & 7)) & 1) word |= mask; else word &= ~mask;
+    }
+  }
+}
 
-      while ((sample_imax & mip2_mask) && (sample_imin < sample_imax)) {
-        total += mips.mip2[(sample_imax - 1) >> mip2_shift] * mip2_weight;
-        sample_imax -= mip2_size;
-        mips.mip2_hit++;
-      }
+void transpose8_swar(TraceBuffer& trace, const uint8_t* src, size_t word_min, size_t word_max, int lane) {
+  size_t c_min = size_t(lane) * 8;
+  size_t c_max = c_min + 8 < trace.channels ? c_min + 8 : trace.channels;
 
-      if (sample_imin == sample_imax) {
-        out[x] = double(total) / double(sample_ilen);
-        continue;
-      }
+  for (size_t w = word_min; w < word_max; w++, src += 64) {
+    for (size_t c = c_min; c < c_max; c++) {
+      trace.plane(c)[w] = gather_channel8((const uint64_t*)src, int(c - c_min));
+    }
+  }
+}
+
+// movemask grabs the top bit of every byte, which is channel 7. Adding each
+// byte to itself shifts the next channel up into the top bit.
+
+TARGET_AVX2
+void transpose8_avx2(TraceBuffer& trace, const uint8_t* src, size_t word_min, size_t word_max, int lane) {
+  uint64_t* planes[8];
+  for (int c = 0; c < 8; c++) {
+    size_t channel = size_t(lane) * 8 + c;
+    planes[c] = channel < trace.channels ? trace.plane(channel) : nullptr;
+  }
+
+  for (size_t w = word_min; w < word_max; w++, src += 64) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(src +  0));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(src + 32));
 
-      assert(!(sample_imin & mip2_mask));
-      assert(!(sample_imax & mip2_mask));
+    for (int c = 7; c >= 0; c--) {
+      uint64_t lo = uint32_t(_mm256_movemask_epi8(a));
+      uint64_t hi = uint32_t(_mm256_movemask_epi8(b));
+      if (planes[c]) planes[c][w] = lo | (hi << 32);
+      a = _mm256_add_epi8(a, a);
+      b = _mm256_add_epi8(b, b);
     }
+  }
+}
 
-    //----------------------------------------
-    // Endpoints are now multiples of mip3_size
+void transpose_samples(TraceBuffer& trace, size_t sample_base, const void* src, size_t bytes_per_sample, size_t count) {
+  assert(trace.planar());
+  assert(sample_base + count <= trace.channel_stride);
 
-    if ((sample_imin & mip3_mask) || (sample_imax & mip3_mask)) {
-      while ((sample_imin & mip3_mask) && (sample_imin < sample_imax)) {
-        total += mips.mip3[sample_imin >> mip3_shift] * mip3_weight;
-        sample_imin += mip3_size;
-        mips.mip3_hit++;
-      }
+  const uint8_t* bytes = (const uint8_t*)src;
+  size_t sample_max = sample_base + count;
 
-      while ((sample_imax & mip3_mask) && (sample_imin < sample_imax)) {
-        total += mips.mip3[(sample_imax - 1) >> mip3_shift] * mip3_weight;
-        sample_imax -= mip3_size;
-        mips.mip3_hit++;
-      }
+  size_t head_max = (sample_base + 63) & ~size_t(63);
+  if (head_max > sample_max) head_max = sample_max;
+  transpose_scalar(trace, sample_base, bytes, bytes_per_sample, sample_base, head_max);
+
+  size_t word_min = head_max >> 6;
+  size_t word_max = sample_max >> 6;
+  size_t tail_min = head_max;
 
-      if (sample_imin == sample_imax) {
-        out[x] = double(total) / double(sample_ilen);
-        continue;
+  if (bytes_per_sample == 1 && trace.channels <= 8 && word_min < word_max) {
+    const uint8_t* body = bytes + (head_max - sample_base);
+    if (cpu_has_avx2()) {
+      transpose8_avx2(trace, body, word_min, word_max);
+    }
+    else {
+      transpose8_swar(trace, body, word_min, word_max);
+    }
+    tail_min = word_max << 6;
+  }
+  else if (bytes_per_sample > 1 && word_min < word_max) {
+    // Wider samples get split into byte lanes a block at a time, and each
+    // lane goes through the 8-channel kernel on its own.
+    const size_t block_words = 64;
+    uint8_t lane_bytes[block_words * 64];
+    int lanes = int((trace.channels + 7) / 8);
+
+    for (size_t w = word_min; w < word_max; w += block_words) {
+      size_t words = word_max - w < block_words ? word_max - w : block_words;
+      const uint8_t* block = bytes + ((w << 6) - sample_base) * bytes_per_sample;
+
+      for (int lane = 0; lane < lanes; lane++) {
+        for (size_t i = 0; i < words * 64; i++) lane_bytes[i] = block[i * bytes_per_sample + lane];
+        if (cpu_has_avx2()) {
+          transpose8_avx2(trace, lane_bytes, w, w + words, lane);
+        }
+        else {
+          transpose8_swar(trace, lane_bytes, w, w + words, lane);
+        }
       }
+    }
+    tail_min = word_max << 6;
+  }
+
+  transpose_scalar(trace, sample_base, bytes, bytes_per_sample, tail_min, sample_max);
+}
+
+//------------------------------------------------------------------------------
+// Bulk channel extraction. Everything but the generic kernel works on whole
+// 64-sample words, extract() does the ragged end (if any) generically.
+
+static uint64_t extract_bits(const TraceBuffer& trace, size_t channel, size_t start, size_t count) {
+  const uint8_t* bytes = (const uint8_t*)trace.blob;
+  size_t index = start * trace.stride + channel * trace.channel_stride;
+  uint64_t word = 0;
+  for (size_t i = 0; i < count; i++, index += trace.stride) {
+    word |= uint64_t((bytes[index >> 3] >> (index & 7)) & 1) << i;
+  }
+  return word;
+}
+
+void extract_generic(const TraceBuffer& trace, size_t channel, size_t start, size_t words, uint64_t* out) {
+  for (size_t w = 0; w < words; w++) {
+    out[w] = extract_bits(trace, channel, start + w * 64, 64);
+  }
+}
+
+void extract_planar(const TraceBuffer& trace, size_t channel, size_t start, size_t words, uint64_t* out) {
+  const uint64_t* src = trace.plane(channel) + (start >> 6);
+  int shift = start & 63;
+
+  if (!shift) {
+    memcpy(out, src, words * sizeof(uint64_t));
+    return;
+  }
 
-      assert(!(sample_imin & mip3_mask));
-      assert(!(sample_imax & mip3_mask));
+  // src[w + 1] is always in the trace - sample start + 64w + 63 lives there.
+  for (size_t w = 0; w < words; w++) {
+    out[w] = (src[w] >> shift) | (src[w + 1] << (64 - shift));
+  }
+}
+
+void extract_swar(const TraceBuffer& trace, size_t channel, size_t start, size_t words, uint64_t* out) {
+  assert(trace.stride == 8);
+  const uint8_t* src = (const uint8_t*)trace.blob + start;
+  uint64_t block[8];
+  for (size_t w = 0; w < words; w++, src += 64) {
+    memcpy(block, src, sizeof(block));
+    out[w] = gather_channel8(block, (int)channel);
+  }
+}
+
+// Each 64-bit source word holds 8 / 4 / 2 samples, and PEXT packs the
+// channel's bit out of every one of them at once.
+
+TARGET_BMI2
+void extract_pext(const TraceBuffer& trace, size_t channel, size_t start, size_t words, uint64_t* out) {
+  size_t bytes_per_sample = trace.stride / 8;
+  assert(bytes_per_sample == 1 || bytes_per_sample == 2 || bytes_per_sample == 4);
+
+  int per_word = int(8 / bytes_per_sample);
+  uint64_t mask = bytes_per_sample == 1 ? 0x0101010101010101ull :
+                  bytes_per_sample == 2 ? 0x0001000100010001ull :
+                                          0x0000000100000001ull;
+  mask <<= channel;
+
+  const uint8_t* src = (const uint8_t*)trace.blob + start * bytes_per_sample;
+  for (size_t w = 0; w < words; w++) {
+    uint64_t bits = 0;
+    for (int k = 0; k < 64; k += per_word, src += 8) {
+      uint64_t x;
+      memcpy(&x, src, 8);
+      bits |= _pext_u64(x, mask) << k;
     }
+    out[w] = bits;
+  }
+}
 
-    //----------------------------------------
-    // Endpoints are now multiples of mip4_size
+// 32 bytes in, 32 samples' worth of the channel's byte out, in sample order.
+// Wider samples get their channel byte shuffled together first. pshufb can't
+// cross 128-bit lanes, so the gathered bytes land in the wrong quarter and
+// get put back with a cross-lane permute. Then shifting the channel's bit to
+// the top of each byte lets movemask pull out all 32 at once.
+
+TARGET_AVX2
+static inline uint64_t extract_group_avx2(const uint8_t* p, int loads, const __m256i* shuf, __m128i shift) {
+  __m256i v;
+  if (loads == 1) {
+    v = _mm256_loadu_si256((const __m256i*)p);
+  }
+  else {
+    v = _mm256_setzero_si256();
+    for (int j = 0; j < loads; j++) {
+      __m256i x = _mm256_loadu_si256((const __m256i*)(p + 32 * j));
+      v = _mm256_or_si256(v, _mm256_shuffle_epi8(x, shuf[j]));
+    }
+    v = loads == 2 ? _mm256_permute4x64_epi64(v, 0xD8)
+                   : _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+  }
+  return uint32_t(_mm256_movemask_epi8(_mm256_sll_epi64(v, shift)));
+}
 
-    while (sample_imin < sample_imax) {
-      total += mips.mip4[sample_imin >> mip4_shift] * mip4_weight;
-      sample_imin += mip4_size;
-      mips.mip4_hit++;
+TARGET_AVX2
+void extract_avx2(const TraceBuffer& trace, size_t channel, size_t start, size_t words, uint64_t* out) {
+  size_t bytes_per_sample = trace.stride / 8;
+  assert(bytes_per_sample == 1 || bytes_per_sample == 2 || bytes_per_sample == 4);
+
+  const uint8_t* src = (const uint8_t*)trace.blob + start * bytes_per_sample;
+  __m128i shift = _mm_cvtsi32_si128(7 - int(channel & 7));
+  int byte = int(channel >> 3);
+
+  // Load J of a group has its samples' channel bytes shuffled into quarter J
+  // of each lane.
+  int loads = int(bytes_per_sample);
+  int per_lane = 16 / loads;
+  alignas(32) uint8_t masks[4][32];
+  __m256i shuf[4];
+  for (int j = 0; j < loads; j++) {
+    for (int i = 0; i < 32; i++) {
+      int slot = (i & 15) / per_lane;
+      int k    = (i & 15) % per_lane;
+      masks[j][i] = slot == j ? uint8_t(byte + k * loads) : 0x80;
     }
+    shuf[j] = _mm256_load_si256((const __m256i*)masks[j]);
+  }
 
-    //----------------------------------------
-    // Done
+  size_t group_bytes = 32 * bytes_per_sample;
+  for (size_t w = 0; w < words; w++, src += 2 * group_bytes) {
+    uint64_t lo = extract_group_avx2(src,               loads, shuf, shift);
+    uint64_t hi = extract_group_avx2(src + group_bytes, loads, shuf, shift);
+    out[w] = lo | (hi << 32);
+  }
+}
+
+void TraceBuffer::extract(size_t channel, size_t start, size_t count, uint64_t* out) const {
+  assert(channel < channels);
+  assert(start + count <= samples);
+
+  size_t words = count >> 6;
+  bool bytewise = stride == 8 || stride == 16 || stride == 32;
+
+  if (planar()) {
+    extract_planar(*this, channel, start, words, out);
+  }
+  else if (bytewise && cpu_has_avx2()) {
+    extract_avx2(*this, channel, start, words, out);
+  }
+  else if (bytewise && cpu_has_bmi2()) {
+    extract_pext(*this, channel, start, words, out);
+  }
+  else if (stride == 8) {
+    extract_swar(*this, channel, start, words, out);
+  }
+  else {
+    extract_generic(*this, channel, start, words, out);
+  }
 
-    out[x] = double(total) / double(sample_ilen);
+  if (count & 63) {
+    out[words] = extract_bits(*this, channel, start + words * 64, count & 63);
+  }
+}
+
+//------------------------------------------------------------------------------
+
+void mark_dirty(MipBuffer& mips, size_t sample_min, size_t sample_max) {
+  if (sample_min < mips.dirty_min) mips.dirty_min = sample_min;
+  if (sample_max > mips.dirty_max) mips.dirty_max = sample_max;
+}
+
+void clear_dirty(MipBuffer& mips) {
+  mips.dirty_min = SIZE_MAX;
+  mips.dirty_max = 0;
+}
+
+//------------------------------------------------------------------------------
+
+void render(
+  TraceBuffer& trace, MipBuffer& mips, int channel,
+  double world_min, double world_max,
+  double trace_min, double trace_max,
+  double* out, int out_len)
+{
+  // The exact pyramid stores sample counts at levels 2-4 instead of rounded
+  // averages, so each count is worth a whole sample. It stops at level 4, so
+  // that's the top of the walk when we have it.
+  const bool exact = mips.mip2_exact != nullptr;
+
+  auto read = [&](int level, size_t index) -> uint64_t {
+    if (exact) {
+      if (level == 2) return uint64_t(mips.mip2_exact[index]) * 128;
+      if (level == 3) return uint64_t(mips.mip3_exact[index]) * 128;
+      if (level == 4) return uint64_t(mips.mip4_exact[index]) * 128;
+    }
+    return uint64_t(mips.mip[level][index]) << ((level - 1) * MipBuffer::fanout_shift + 7);
+  };
+
+  render_walk(trace, mips, channel, world_min, world_max, trace_min, trace_max,
+              out, out_len, exact ? 4 : mip_levels, read);
+}
+
+//------------------------------------------------------------------------------
+// The shader only has levels 1-4, so that's as far as this one walks too.
+
+void render_cover(TraceBuffer& trace, MipBuffer& mips, int channel,
+                  const CoverFx& fx, int64_t origin, double* out, int out_len) {
+  auto read = [&](int level, size_t index) -> uint64_t {
+    return uint64_t(mips.mip[level][index]) << ((level - 1) * MipBuffer::fanout_shift + 7);
+  };
+
+  for (int level = 0; level <= mip_levels; level++) mips.mip_hit[level] = 0;
+
+  for (int x = 0; x < out_len; x++) {
+    int64_t sample_imin, sample_imax;
+    if (!cover_span(fx, origin, trace.samples, x, sample_imin, sample_imax)) {
+      out[x] = 0;
+      continue;
+    }
+    out[x] = walk_span(trace, mips, channel, sample_imin, sample_imax, gpu_mip_levels, read);
   }
 }
 
@@ -3,17 +3,34 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <assert.h>
+#include <math.h>
+#include "BitOps.hpp"
 
-// A buffer full of interleaved logic samples.
+// A buffer full of logic samples. Sample S of channel C is bit
+// (S * stride + C * channel_stride) of the blob, which covers both layouts:
+//
+//   interleaved - stride is the bits per sample, channel_stride is 1. This is
+//                 what the capture hardware sends us.
+//   planar      - stride is 1, channel_stride is the bits per channel. Each
+//                 channel is its own packed bit array, so reading one channel
+//                 only touches that channel's cache lines.
 struct TraceBuffer {
   size_t samples = 0;
   size_t channels = 0;
-  size_t stride = 0;   // Distance in bits between samples in the same channel.
+  size_t stride = 0;         // Distance in bits between samples in the same channel.
+  size_t channel_stride = 1; // Distance in bits between channels in the same sample.
 
   // GPU storage buffer
   int    ssbo = 0;
   size_t ssbo_len = 0;
 
+  // Or, for traces too big to bind as one buffer, a GPU copy split into
+  // shards of shard_samples samples each - see TraceShard.
+  static constexpr int max_shards = 64;
+  int    shards[max_shards] = {};
+  int    shard_count = 0;
+  size_t shard_samples = 0;
+
   // Pointer into mapped GPU memory
   void*  blob = nullptr;
 
@@ -23,43 +40,241 @@ struct TraceBuffer {
       printf("%ld %ld\n", sample, samples);
     }
     assert(sample < samples);
-    assert(((sample * stride + channel) / 8) < ssbo_len);
+    assert(((sample * stride + channel * channel_stride) / 8) < ssbo_len);
 
     uint32_t* words = (uint32_t*)blob;
-    size_t index = sample * stride + channel;
+    size_t index = sample * stride + channel * channel_stride;
     return (words[index >> 5] >> (index & 31)) & 1;
   }
+
+  // Copies samples [start, start + count) of one channel to out, packed 64 per
+  // word with bit N of out[K] = sample start + 64K + N. Writes (count + 63) / 64
+  // words, and the unused bits of the last one are zero. Works on any layout,
+  // but planar and 8/16/32-bit interleaved traces get the fast paths.
+  void extract(size_t channel, size_t start, size_t count, uint64_t* out) const;
+
+  bool planar() const { return stride == 1; }
+
+  // Samples the blob has room for.
+  size_t capacity() const { return planar() ? channel_stride : ssbo_len * 8 / stride; }
+
+  // Planes start on 64-bit boundaries - see init_planar().
+  uint64_t* plane(size_t channel) const {
+    return (uint64_t*)blob + ((channel * channel_stride) >> 6);
+  }
 };
 
-// Mipmaps for one channel of logic trace
-struct MipBuffer {
+// Samples [64 * word, 64 * word + 64) of one channel, bit N = sample 64 * word
+// + N. Planar and byte-interleaved (stride 8) traces are cheap, 16 and 32-bit
+// ones go through extract() and should be read in bigger blocks if it matters.
+inline uint64_t channel_word(const TraceBuffer& trace, size_t channel, size_t word) {
+  if (trace.planar()) return trace.plane(channel)[word];
+  if (trace.stride == 8) return gather_channel8((const uint64_t*)trace.blob + word * 8, (int)channel);
+  uint64_t bits = 0;
+  trace.extract(channel, word * 64, 64, &bits);
+  return bits;
+}
+
+// Where one channel of one shard of the GPU copy lives. Shard K holds samples
+// [K * shard_samples, (K + 1) * shard_samples) in the same layout as the blob,
+// so a planar shard has a plane per channel and an interleaved one is just a
+// slice of the blob. offset/len cover the channel's plane, or the whole shard
+// if the trace is interleaved. A trace without shards is one big shard.
+struct TraceShard {
+  int    ssbo;
+  size_t sample_base;
   size_t samples;
+  size_t offset;
+  size_t len;
+};
 
-  // GPU storage buffer
+TraceShard trace_shard(const TraceBuffer& trace, size_t channel, size_t shard);
+size_t     trace_shard_count(const TraceBuffer& trace);
+
+// Splits the GPU copy of the trace into shards of shard_samples, which has to
+// be a power of two of at least 2^24. Doesn't create the buffers.
+void init_shards(TraceBuffer& trace, size_t shard_samples);
+
+// Sets up an empty planar trace with room for capacity samples per channel.
+// Planes are padded to 256 bytes so each one can be bound as an ssbo range.
+// Doesn't allocate the blob - that's ssbo_len bytes.
+void init_planar(TraceBuffer& trace, size_t channels, size_t capacity);
+
+// Copies count samples of interleaved data - bytes_per_sample bytes each,
+// channel N in bit N - into a planar trace starting at sample_base.
+void transpose_samples(TraceBuffer& trace, size_t sample_base, const void* src, size_t bytes_per_sample, size_t count);
+
+// The 8-channel kernels transpose_samples() picks from. Both fill words
+// [word_min, word_max) of the planes for channels [8 * lane, 8 * lane + 8)
+// from 64 bytes of src per word. Wider samples get split into byte lanes
+// before they get here.
+void transpose8_swar(TraceBuffer& trace, const uint8_t* src, size_t word_min, size_t word_max, int lane = 0);
+void transpose8_avx2(TraceBuffer& trace, const uint8_t* src, size_t word_min, size_t word_max, int lane = 0);
+
+// The kernels extract() picks from. Each one fills out[0, words) from samples
+// [start, start + 64 * words), which have to be in the trace.
+//   generic - any layout, one bit at a time.
+//   planar  - funnel shifts out of the channel's plane.
+//   swar    - stride 8 only, gather_channel8().
+//   pext    - stride 8/16/32, BMI2 bit extract on each 64-bit source word.
+//   avx2    - stride 8/16/32, byte shuffle + movemask.
+void extract_generic(const TraceBuffer& trace, size_t channel, size_t start, size_t words, uint64_t* out);
+void extract_planar (const TraceBuffer& trace, size_t channel, size_t start, size_t words, uint64_t* out);
+void extract_swar   (const TraceBuffer& trace, size_t channel, size_t start, size_t words, uint64_t* out);
+void extract_pext   (const TraceBuffer& trace, size_t channel, size_t start, size_t words, uint64_t* out);
+void extract_avx2   (const TraceBuffer& trace, size_t channel, size_t start, size_t words, uint64_t* out);
+
+// Sample positions are 64-bit everywhere. Shaders get them as a signed 64-bit
+// integer split into 32-bit halves plus a float fraction, so they don't need
+// fp64 and don't run out of bits past 2^32 samples.
+struct SamplePos {
+  int32_t  hi;
+  uint32_t lo;
+  float    frac;
+};
+
+inline SamplePos split_sample_pos(double pos) {
+  double whole = floor(pos);
+  int64_t i = (int64_t)whole;
+  return { int32_t(i >> 32), uint32_t(i), float(pos - whole) };
+}
+
+// Same math trace_glsl uses to find the sample under a fragment, so it can be
+// checked on the CPU.
+inline int64_t fragment_sample(const SamplePos& origin, float scale, float frag_x) {
+  int64_t base = int64_t((uint64_t(uint32_t(origin.hi)) << 32) | origin.lo);
+  return base + (int64_t)floorf(origin.frac + frag_x * scale);
+}
+
+// The integer-only version of the same thing. Positions are 64-bit fixed
+// point with `bits` of fraction - the shader keeps them in a uvec2 - and the
+// sample under column X is (origin + X * step) >> bits, with nothing rounded
+// per column. The float version loses the fraction of the scale once it gets
+// big. This one keeps up to sample_fx_bits of it, and gives up fraction bits
+// as the view gets wider or further out so that 8K columns can't overflow.
+// bits is 0 if even one fraction bit won't fit, and then the view has to go
+// through the float version instead. `limit` is anything else that has to fit
+// at the same precision, in samples.
+static constexpr int sample_fx_bits = 24;
+
+struct SampleFx {
+  int64_t origin;  // Center of column 0
+  int64_t step;    // Samples per column
+  int     bits;    // Fraction bits in both
+};
+
+inline SampleFx sample_fx(double origin, double scale, double limit = 0) {
+  double center = origin + 0.5 * scale;
+  double reach = fabs(center) + 8192.0 * fabs(scale) + 1.0;
+  if (reach < limit + 1.0) reach = limit + 1.0;
+
+  // The shader treats a set top bit as off the left edge, so stay under 2^62.
+  int bits = sample_fx_bits;
+  while (bits > 0 && ldexp(reach, bits) >= 4611686018427387904.0) bits--;
+  if (bits == 0) return { 0, 0, 0 };
+
+  double one = ldexp(1.0, bits);
+  return { (int64_t)floor(center * one), (int64_t)llround(scale * one), bits };
+}
+
+inline int64_t fragment_sample_fx(const SampleFx& view, uint32_t x) {
+  return (view.origin + int64_t(x) * view.step) >> view.bits;
+}
+
+// Coverage columns in the same fixed point, see TracePainter::cover(). A run
+// of columns starts at the left edge of its first one, which can be anywhere
+// within `reach` samples of 0. 2^granule_bits is render()'s granularity for a
+// column `scale` samples wide - span endpoints get rounded down to it. bits
+// is 0 if the fixed point won't fit.
+struct CoverFx {
+  int64_t step;
+  int     bits;
+  int     granule_bits;
+};
+
+inline CoverFx cover_fx(double reach, double scale, double samples) {
+  SampleFx fx = sample_fx(reach - 0.5 * scale, scale, samples);
+  int granule_bits = int(ceil(log2(scale))) - 7 + fx.bits;
+  return { fx.step, fx.bits, fx.bits && granule_bits > 0 ? granule_bits : 0 };
+}
+
+inline int64_t cover_origin(const CoverFx& fx, double origin) {
+  return (int64_t)floor(ldexp(origin, fx.bits));
+}
+
+// The span of column X of a run starting at `origin`, in 1/128ths of a
+// sample - the column's edges rounded down to the granularity, clamped to the
+// trace, then cut to 7 bits of fraction. Clamping before the shift keeps it
+// from overflowing when there are fewer than 7 fraction bits. False if the
+// column is outside the trace. cover_glsl does exactly this in a uvec2.
+inline bool cover_span(const CoverFx& fx, int64_t origin, uint64_t samples, int x,
+                       int64_t& sample_imin, int64_t& sample_imax) {
+  int64_t granule_mask = (int64_t(1) << fx.granule_bits) - 1;
+  int64_t samples_fx = int64_t(samples) << fx.bits;
+
+  int64_t pos_min = (origin + int64_t(x) * fx.step) & ~granule_mask;
+  int64_t pos_max = (origin + int64_t(x + 1) * fx.step) & ~granule_mask;
+
+  if (pos_min < 0)          pos_min = 0;
+  if (pos_max > samples_fx) pos_max = samples_fx;
+  if (pos_max < 0 || pos_min >= samples_fx) return false;
+
+  sample_imin = fx.bits >= 7 ? pos_min >> (fx.bits - 7) : pos_min << (7 - fx.bits);
+  sample_imax = fx.bits >= 7 ? pos_max >> (fx.bits - 7) : pos_max << (7 - fx.bits);
+  return true;
+}
+
+#include "MipPyramid.hpp"
+
+// Shape of the density pyramid in every MipBuffer, see MipPyramid. The GPU
+// copy, the shaders and TraceMipper only know about levels 1-4 at a fanout of
+// 128, and so do the exact and edge pyramids and the 8-channel mip1 kernels.
+// Levels past gpu_mip_levels only exist on the CPU, so render() can zoom out
+// past 2^35 samples a pixel without walking thousands of level 4 entries.
+static constexpr int mip_fanout = 128;
+static constexpr int mip_levels = 5;
+static constexpr int gpu_mip_levels = 4;
+static_assert(mip_fanout == 128, "The shaders and SIMD mip kernels are built for a fanout of 128");
+static_assert(mip_levels >= gpu_mip_levels, "The GPU copy needs levels 1-4");
+
+// Mipmaps for one channel of logic trace - mip[1] through mip[mip_levels]
+// come from MipPyramid.
+struct MipBuffer : MipPyramid<mip_fanout, mip_levels> {
+  // GPU storage buffer, shared by every channel of a trace. ssbo_len is just
+  // this channel's part of it, starting at mip1_offset.
   int    ssbo = 0;
   size_t ssbo_len = 0;
 
-  // Pointers into mapped GPU memory
-  uint8_t* mip1 = nullptr;
-  uint8_t* mip2 = nullptr;
-  uint8_t* mip3 = nullptr;
-  uint8_t* mip4 = nullptr;
+  // Optional exact pyramid. mip[1] is already an exact count, but the levels
+  // above it are rounded-up averages. If these are allocated, update_mips()
+  // also fills in the full sample count of every bucket up to level 4 and
+  // render() uses them, walking level 4 instead of the levels above it.
+  uint16_t* mip2_exact = nullptr;
+  uint32_t* mip3_exact = nullptr;
+  uint32_t* mip4_exact = nullptr;
 
-  size_t mip1_len;
-  size_t mip2_len;
-  size_t mip3_len;
-  size_t mip4_len;
+  // Optional transition-count pyramid. edgeN[i] counts how many samples in
+  // bucket i differ from the sample before them, summed exactly at every level
+  // so a single glitch never rounds away. A 50% clock and a line that toggled
+  // once look the same in mip1-mip4 but not here.
+  uint8_t*  edge1 = nullptr;
+  uint16_t* edge2 = nullptr;
+  uint32_t* edge3 = nullptr;
+  uint32_t* edge4 = nullptr;
 
   size_t mip1_offset;
   size_t mip2_offset;
   size_t mip3_offset;
   size_t mip4_offset;
 
-  size_t mip0_hit = 0;
-  size_t mip1_hit = 0;
-  size_t mip2_hit = 0;
-  size_t mip3_hit = 0;
-  size_t mip4_hit = 0;
+  size_t edge1_offset;
+  size_t edge2_offset;
+  size_t edge3_offset;
+  size_t edge4_offset;
+
+  // Samples whose mips changed since the GPU copy was last updated.
+  size_t dirty_min = SIZE_MAX;
+  size_t dirty_max = 0;
 
   //uint32_t mip4[1];
   //uint32_t mip3[128];
@@ -67,9 +282,63 @@ struct MipBuffer {
   //uint32_t mip1[2097152];
 };
 
+void   alloc_mips(MipBuffer& mips, size_t samples, bool exact = false, bool edges = false);
+void   free_mips(MipBuffer& mips);
+void   clear_mips(MipBuffer& mips);
+size_t mips_size_bytes(MipBuffer& mips);
+
+// Fills in ssbo_len and the offset of every level in the GPU copy of the
+// pyramid, which starts `base` bytes into the buffer. Levels start on 256-byte
+// boundaries so they can be bound as separate buffer ranges.
+void   layout_mips(MipBuffer& mips, size_t base = 0);
+
+// The ssbo_len layout_mips() would give a pyramid over `samples`.
+size_t mips_ssbo_len(size_t samples, bool edges);
+
 void update_mips(TraceBuffer& trace, int channel, size_t sample_min, size_t sample_max, MipBuffer& mips);
 
+// Builds every level for channels [0, n) of the trace in one pass over the blob.
+void update_mips_all(TraceBuffer& trace, MipBuffer* mips, int n);
+void update_mips_all(TraceBuffer& trace, MipBuffer* mips, int n, size_t sample_min, size_t sample_max);
+
+// Appends raw capture data to the end of the trace and updates the mips of
+// channels [0, n) where the new samples landed. Returns the number of samples
+// appended, which will be less than requested if the trace is full.
+size_t append_samples(TraceBuffer& trace, MipBuffer* mips, int n, const void* data, size_t len);
+
+// update_mips() and friends mark the samples they touch as dirty, the GPU
+// upload clears them.
+void mark_dirty(MipBuffer& mips, size_t sample_min, size_t sample_max);
+void clear_dirty(MipBuffer& mips);
+
+// Both of these fill mip1[mip1_min, mip1_max) and produce identical bytes.
+// update_mips() picks the popcount version when the trace layout allows it.
+void update_mip1_scalar  (TraceBuffer& trace, int channel, size_t mip1_min, size_t mip1_max, MipBuffer& mips);
+void update_mip1_popcount(TraceBuffer& trace, int channel, size_t mip1_min, size_t mip1_max, MipBuffer& mips);
+
+// Same deal for edge1[mip1_min, mip1_max).
+void update_edge1_scalar  (TraceBuffer& trace, int channel, size_t mip1_min, size_t mip1_max, MipBuffer& mips);
+void update_edge1_popcount(TraceBuffer& trace, int channel, size_t mip1_min, size_t mip1_max, MipBuffer& mips);
+
+// CPU versions of mipper_glsl_64 and merger_glsl_64 for 8-channel samples,
+// byte for byte. Striped means byte C of a mip1 entry is channel C's count for
+// that bucket, and a mip2 entry has the rounded-up averages of 128 mip1
+// entries in the same order. Each one fills entries [min, max) and only works
+// on whole buckets. stripe_mips() does every whole bucket of the first
+// `samples` bytes with the AVX2 kernels if the CPU has them - for checking the
+// GPU against, or for building mips without one.
+void stripe_mip1_swar(const uint8_t* mip0, size_t mip1_min, size_t mip1_max, uint64_t* mip1);
+void stripe_mip1_avx2(const uint8_t* mip0, size_t mip1_min, size_t mip1_max, uint64_t* mip1);
+void stripe_mip2_swar(const uint64_t* mip1, size_t mip2_min, size_t mip2_max, uint64_t* mip2);
+void stripe_mip2_avx2(const uint64_t* mip1, size_t mip2_min, size_t mip2_max, uint64_t* mip2);
+void stripe_mips(const uint8_t* mip0, size_t samples, uint64_t* mip1, uint64_t* mip2);
+
 void render(TraceBuffer& trace, MipBuffer& mips, int channel,
             double world_min, double world_max,
             double trace_min, double trace_max,
             double* out, int out_len);
+
+// render() with the spans cover_span() gives a run of columns, walking the
+// same levels the coverage shader has. Columns outside the trace are 0.
+void render_cover(TraceBuffer& trace, MipBuffer& mips, int channel,
+                  const CoverFx& fx, int64_t origin, double* out, int out_len);
@@ -0,0 +1,1748 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "log.hpp"
+#include "Bits.hpp"
+#include "RankIndex.hpp"
+#include "EdgeIndex.hpp"
+#include "RowRenderer.hpp"
+#include "RenderPool.hpp"
+#include "TileCache.hpp"
+
+#include <math.h>
+#include <thread>
+#include <sys/mman.h>
+
+//------------------------------------------------------------------------------
+// Benchmarks for the CPU-side trace code. Every fast path gets checked against
+// the path it replaces before it gets timed.
+
+void gen_pattern(TraceBuffer& trace) {
+  assert(trace.stride == 8);
+
+  uint8_t* bits = (uint8_t*)trace.blob;
+
+  for (size_t i = 0; i < trace.samples; i++) {
+    size_t t = i + 0x993781;
+    t = t*((t>>9|t>>13)&25&t>>6);
+    bits[i] = t;
+  }
+}
+
+//------------------------------------------------------------------------------
+
+void bench_mip1(TraceBuffer& trace) {
+  printf("---------- mip1 builder\n");
+
+  MipBuffer mips_a;
+  MipBuffer mips_b;
+  alloc_mips(mips_a, trace.samples);
+  alloc_mips(mips_b, trace.samples);
+
+  size_t mip1_max = mips_a.mip_len[1];
+  double time_a, time_b;
+
+  for (int channel = 5; channel < (int)trace.channels; channel++) {
+    update_mip1_scalar  (trace, channel, 0, mip1_max, mips_a);
+    update_mip1_popcount(trace, channel, 0, mip1_max, mips_b);
+    if (memcmp(mips_a.mip[1], mips_b.mip[1], mip1_max)) {
+      printf("mip1 mismatch on channel %d\n", channel);
+      exit(1);
+    }
+  }
+  printf("mip1 bytes match on all %d channels\n", (int)trace.channels);
+
+  time_a = timestamp();
+  update_mip1_scalar(trace, 0, 0, mip1_max, mips_a);
+  time_b = timestamp();
+  double scalar_time = time_b - time_a;
+
+  time_a = timestamp();
+  update_mip1_popcount(trace, 0, 0, mip1_max, mips_b);
+  time_b = timestamp();
+  double popcount_time = time_b - time_a;
+
+  printf("scalar   %12.6f sec, %8.3f gs/sec\n", scalar_time,   trace.samples / scalar_time   / 1.0e9);
+  printf("popcount %12.6f sec, %8.3f gs/sec\n", popcount_time, trace.samples / popcount_time / 1.0e9);
+  printf("speedup  %8.2fx\n", scalar_time / popcount_time);
+
+  free_mips(mips_a);
+  free_mips(mips_b);
+}
+
+//------------------------------------------------------------------------------
+
+bool mips_match(MipBuffer& a, MipBuffer& b) {
+  return !memcmp(a.mip[1], b.mip[1], a.mip_len[1]) &&
+         !memcmp(a.mip[2], b.mip[2], a.mip_len[2]) &&
+         !memcmp(a.mip[3], b.mip[3], a.mip_len[3]) &&
+         !memcmp(a.mip[4], b.mip[4], a.mip_len[4]);
+}
+
+void bench_mips_all(TraceBuffer& trace) {
+  printf("---------- all-channel mip builder\n");
+
+  int n = (int)trace.channels;
+  MipBuffer mips_a[8];
+  MipBuffer mips_b[8];
+  for (int c = 0; c < n; c++) {
+    alloc_mips(mips_a[c], trace.samples);
+    alloc_mips(mips_b[c], trace.samples);
+  }
+
+  double time_a, time_b;
+
+  time_a = timestamp();
+  for (int c = 0; c < n; c++) {
+    update_mips(trace, c, 0, trace.samples, mips_a[c]);
+  }
+  time_b = timestamp();
+  double per_channel_time = time_b - time_a;
+
+  time_a = timestamp();
+  update_mips_all(trace, mips_b, n);
+  time_b = timestamp();
+  double all_time = time_b - time_a;
+
+  for (int c = 0; c < n; c++) {
+    if (!mips_match(mips_a[c], mips_b[c])) {
+      printf("mip mismatch on channel %d\n", c);
+      exit(1);
+    }
+  }
+  printf("mip1-mip4 match on all %d channels\n", n);
+
+  printf("per-channel %12.6f sec, %8.3f gs/sec\n", per_channel_time, trace.samples / per_channel_time / 1.0e9);
+  printf("all-channel %12.6f sec, %8.3f gs/sec\n", all_time,         trace.samples / all_time         / 1.0e9);
+  printf("speedup     %8.2fx\n", per_channel_time / all_time);
+
+  for (int c = 0; c < n; c++) {
+    free_mips(mips_a[c]);
+    free_mips(mips_b[c]);
+  }
+}
+
+//------------------------------------------------------------------------------
+// The striped mipper and merger the GPU check uses as its reference. Both
+// kernels have to agree with each other and with the per-channel pyramid.
+
+void bench_striped(TraceBuffer& trace) {
+  printf("---------- striped mipper\n");
+
+  const uint8_t* mip0 = (const uint8_t*)trace.blob;
+  size_t mip1_len = trace.samples / 128;
+  size_t mip2_len = mip1_len / 128;
+
+  uint64_t* mip1_a = new uint64_t[mip1_len];
+  uint64_t* mip1_b = new uint64_t[mip1_len];
+  uint64_t* mip2_a = new uint64_t[mip2_len + 1];
+  uint64_t* mip2_b = new uint64_t[mip2_len + 1];
+
+  double time_a, time_b;
+
+  time_a = timestamp();
+  stripe_mip1_swar(mip0, 0, mip1_len, mip1_a);
+  time_b = timestamp();
+  double swar1_time = time_b - time_a;
+
+  time_a = timestamp();
+  stripe_mip2_swar(mip1_a, 0, mip2_len, mip2_a);
+  time_b = timestamp();
+  double swar2_time = time_b - time_a;
+
+  double avx1_time = 0;
+  double avx2_time = 0;
+  bool avx2 = cpu_has_avx2();
+  if (avx2) {
+    time_a = timestamp();
+    stripe_mip1_avx2(mip0, 0, mip1_len, mip1_b);
+    time_b = timestamp();
+    avx1_time = time_b - time_a;
+
+    time_a = timestamp();
+    stripe_mip2_avx2(mip1_b, 0, mip2_len, mip2_b);
+    time_b = timestamp();
+    avx2_time = time_b - time_a;
+
+    if (memcmp(mip1_a, mip1_b, mip1_len * 8) || memcmp(mip2_a, mip2_b, mip2_len * 8)) {
+      printf("swar/avx2 striped mismatch\n");
+      exit(1);
+    }
+  }
+
+  for (int c = 0; c < (int)trace.channels; c++) {
+    MipBuffer mips;
+    alloc_mips(mips, trace.samples);
+    update_mips(trace, c, 0, trace.samples, mips);
+    for (size_t i = 0; i < mip1_len; i++) {
+      if (uint8_t(mip1_a[i] >> (8 * c)) != mips.mip[1][i]) {
+        printf("striped mip1 mismatch on channel %d at %ld\n", c, i);
+        exit(1);
+      }
+    }
+    for (size_t i = 0; i < mip2_len; i++) {
+      if (uint8_t(mip2_a[i] >> (8 * c)) != mips.mip[2][i]) {
+        printf("striped mip2 mismatch on channel %d at %ld\n", c, i);
+        exit(1);
+      }
+    }
+    free_mips(mips);
+  }
+  printf("striped mip1/mip2 match the pyramid on all %d channels%s\n",
+         (int)trace.channels, avx2 ? ", swar and avx2" : "");
+
+  printf("swar mip1 %12.6f sec, %8.3f gs/sec\n", swar1_time, trace.samples / swar1_time / 1.0e9);
+  printf("swar mip2 %12.6f sec\n", swar2_time);
+  if (avx2) {
+    printf("avx2 mip1 %12.6f sec, %8.3f gs/sec\n", avx1_time, trace.samples / avx1_time / 1.0e9);
+    printf("avx2 mip2 %12.6f sec\n", avx2_time);
+    printf("speedup   %8.2fx\n", (swar1_time + swar2_time) / (avx1_time + avx2_time));
+  }
+
+  delete [] mip1_a;
+  delete [] mip1_b;
+  delete [] mip2_a;
+  delete [] mip2_b;
+}
+
+//------------------------------------------------------------------------------
+// Brute-force version of render() - same span endpoints, but sums every sample
+// in the span with get_bit(). Only usable when zoomed in a fair bit.
+
+void render_reference(
+  TraceBuffer& trace, int channel,
+  double world_min, double world_max,
+  double trace_min, double trace_max,
+  double* out, int out_len)
+{
+  double pix0_l = remap(0.0, world_min, world_max, trace_min, trace_max);
+  double pix0_r = remap(1.0, world_min, world_max, trace_min, trace_max);
+  double granularity = exp2(ceil(log2(pix0_r - pix0_l)) - 7);
+  double igranularity = 1.0 / granularity;
+
+  for (int x = 0; x < out_len; x++) {
+    double sample_fmin = remap(x + 0.0, world_min, world_max, trace_min, trace_max);
+    double sample_fmax = remap(x + 1.0, world_min, world_max, trace_min, trace_max);
+
+    sample_fmin = floor(sample_fmin * igranularity) * granularity;
+    sample_fmax = floor(sample_fmax * igranularity) * granularity;
+
+    if (sample_fmin < 0)             sample_fmin = 0;
+    if (sample_fmax > trace.samples) sample_fmax = trace.samples;
+
+    if (sample_fmax < 0)              { out[x] = 0; continue; }
+    if (sample_fmin >= trace.samples) { out[x] = 0; continue; }
+
+    int64_t imin = (int64_t)floor(sample_fmin * 128.0);
+    int64_t imax = (int64_t)floor(sample_fmax * 128.0);
+
+    if ((imin >> 7) == (imax >> 7)) {
+      out[x] = trace.get_bit(channel, imin >> 7);
+      continue;
+    }
+
+    uint64_t total = 0;
+    for (int64_t s = imin >> 7; s <= (imax - 1) >> 7; s++) {
+      int64_t a = s * 128 > imin ? s * 128 : imin;
+      int64_t b = s * 128 + 128 < imax ? s * 128 + 128 : imax;
+      total += (b - a) * trace.get_bit(channel, s);
+    }
+    out[x] = double(total) / double(imax - imin);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Renders a 1920-pixel view of the trace centered at 'center' with the given
+// number of samples per pixel.
+
+void render_view(TraceBuffer& trace, MipBuffer& mips, int channel, double center, double samples_per_pixel, double* out) {
+  double view_min = center - 960.0 * samples_per_pixel;
+  double view_max = center + 960.0 * samples_per_pixel;
+  render(trace, mips, channel, 0, 1920, view_min, view_max, out, 1920);
+}
+
+//------------------------------------------------------------------------------
+
+void bench_exact(TraceBuffer& trace) {
+  printf("---------- exact pyramid\n");
+
+  int n = (int)trace.channels;
+  MipBuffer lossy[8];
+  MipBuffer exact[8];
+  for (int c = 0; c < n; c++) {
+    alloc_mips(lossy[c], trace.samples, false);
+    alloc_mips(exact[c], trace.samples, true);
+  }
+
+  double time_a, time_b;
+
+  time_a = timestamp();
+  update_mips_all(trace, lossy, n);
+  time_b = timestamp();
+  double lossy_build = time_b - time_a;
+
+  time_a = timestamp();
+  update_mips_all(trace, exact, n);
+  time_b = timestamp();
+  double exact_build = time_b - time_a;
+
+  printf("lossy mips %10ld bytes/channel, build %12.6f sec\n", mips_size_bytes(lossy[0]), lossy_build);
+  printf("exact mips %10ld bytes/channel, build %12.6f sec\n", mips_size_bytes(exact[0]), exact_build);
+
+  double out_ref[1920];
+  double out_lossy[1920];
+  double out_exact[1920];
+
+  printf("%16s %14s %14s %14s %14s\n", "samples/pixel", "lossy err", "exact err", "lossy usec", "exact usec");
+
+  for (int zoom = -8; zoom <= 28; zoom += 4) {
+    double spp = exp2(zoom);
+    double center = trace.samples * 0.37;
+
+    // The brute-force reference is too slow to run on really wide views.
+    bool checked = spp * 1920 <= 256.0 * 1024.0 * 1024.0;
+
+    double lossy_err = 0, exact_err = 0;
+    if (checked) {
+      double view_min = center - 960.0 * spp;
+      double view_max = center + 960.0 * spp;
+      for (int c = 0; c < n; c++) {
+        render_reference(trace, c, 0, 1920, view_min, view_max, out_ref, 1920);
+        render_view(trace, lossy[c], c, center, spp, out_lossy);
+        render_view(trace, exact[c], c, center, spp, out_exact);
+        for (int x = 0; x < 1920; x++) {
+          lossy_err = fmax(lossy_err, fabs(out_lossy[x] - out_ref[x]));
+          exact_err = fmax(exact_err, fabs(out_exact[x] - out_ref[x]));
+        }
+      }
+    }
+
+    int reps = 100;
+
+    time_a = timestamp();
+    for (int rep = 0; rep < reps; rep++) render_view(trace, lossy[0], 0, center, spp, out_lossy);
+    time_b = timestamp();
+    double lossy_time = (time_b - time_a) / reps;
+
+    time_a = timestamp();
+    for (int rep = 0; rep < reps; rep++) render_view(trace, exact[0], 0, center, spp, out_exact);
+    time_b = timestamp();
+    double exact_time = (time_b - time_a) / reps;
+
+    if (checked) {
+      printf("%16g %14g %14g %14.3f %14.3f\n", spp, lossy_err, exact_err, lossy_time * 1.0e6, exact_time * 1.0e6);
+    }
+    else {
+      printf("%16g %14s %14s %14.3f %14.3f\n", spp, "-", "-", lossy_time * 1.0e6, exact_time * 1.0e6);
+    }
+  }
+
+  for (int c = 0; c < n; c++) {
+    free_mips(lossy[c]);
+    free_mips(exact[c]);
+  }
+}
+
+//------------------------------------------------------------------------------
+
+void bench_rank(TraceBuffer& trace) {
+  printf("---------- rank index\n");
+
+  MipBuffer mips;
+  alloc_mips(mips, trace.samples, true);
+  update_mips(trace, 0, 0, trace.samples, mips);
+
+  double time_a, time_b;
+
+  printf("%12s %14s %14s %14s\n", "block_shift", "bytes", "overhead", "build sec");
+  for (int block_shift = 6; block_shift <= 12; block_shift += 3) {
+    RankIndex index;
+    time_a = timestamp();
+    index.init(trace, 0, block_shift);
+    time_b = timestamp();
+
+    double packed = double(index.bits_len * sizeof(uint64_t));
+    printf("%12d %14ld %13.2f%% %14.6f\n", block_shift, index.size_bytes(),
+           100.0 * (index.size_bytes() - packed) / packed, time_b - time_a);
+    index.exit();
+  }
+
+  RankIndex index;
+  index.init(trace, 0, 9);
+
+  double out_mips[1920];
+  double out_rank[1920];
+
+  printf("%16s %14s %14s %14s\n", "samples/pixel", "max diff", "mip walk usec", "rank usec");
+
+  for (int zoom = -8; zoom <= 28; zoom += 4) {
+    double spp = exp2(zoom);
+    double center = trace.samples * 0.37;
+    double view_min = center - 960.0 * spp;
+    double view_max = center + 960.0 * spp;
+
+    render(trace, mips, 0, 0, 1920, view_min, view_max, out_mips, 1920);
+    render(index, 0, 1920, view_min, view_max, out_rank, 1920);
+
+    double diff = 0;
+    for (int x = 0; x < 1920; x++) {
+      diff = fmax(diff, fabs(out_mips[x] - out_rank[x]));
+    }
+
+    int reps = 100;
+
+    time_a = timestamp();
+    for (int rep = 0; rep < reps; rep++) render(trace, mips, 0, 0, 1920, view_min, view_max, out_mips, 1920);
+    time_b = timestamp();
+    double mips_time = (time_b - time_a) / reps;
+
+    time_a = timestamp();
+    for (int rep = 0; rep < reps; rep++) render(index, 0, 1920, view_min, view_max, out_rank, 1920);
+    time_b = timestamp();
+    double rank_time = (time_b - time_a) / reps;
+
+    printf("%16g %14g %14.3f %14.3f\n", spp, diff, mips_time * 1.0e6, rank_time * 1.0e6);
+  }
+
+  index.exit();
+  free_mips(mips);
+}
+
+//------------------------------------------------------------------------------
+// Edge pyramid - all three builders have to match a brute-force count, and a
+// one-sample glitch has to survive all the way up to edge4.
+
+bool edges_match(MipBuffer& a, MipBuffer& b) {
+  return !memcmp(a.edge1, b.edge1, a.mip_len[1] * sizeof(a.edge1[0])) &&
+         !memcmp(a.edge2, b.edge2, a.mip_len[2] * sizeof(a.edge2[0])) &&
+         !memcmp(a.edge3, b.edge3, a.mip_len[3] * sizeof(a.edge3[0])) &&
+         !memcmp(a.edge4, b.edge4, a.mip_len[4] * sizeof(a.edge4[0]));
+}
+
+void bench_edges(TraceBuffer& trace) {
+  printf("---------- edge pyramid\n");
+
+  int n = (int)trace.channels;
+  MipBuffer mips_plain[8];
+  MipBuffer mips_ref[8];
+  MipBuffer mips_one[8];
+  MipBuffer mips_all[8];
+  for (int c = 0; c < n; c++) {
+    alloc_mips(mips_plain[c], trace.samples);
+    alloc_mips(mips_ref[c], trace.samples, false, true);
+    alloc_mips(mips_one[c], trace.samples, false, true);
+    alloc_mips(mips_all[c], trace.samples, false, true);
+  }
+
+  double time_a, time_b;
+
+  // Reference - brute force edge1, plain sums for the rest.
+  for (int c = 0; c < n; c++) {
+    MipBuffer& m = mips_ref[c];
+    update_edge1_scalar(trace, c, 0, m.mip_len[1], m);
+    for (size_t i = 0; i < m.mip_len[1]; i++) m.edge2[i >> 7] += m.edge1[i];
+    for (size_t i = 0; i < m.mip_len[2]; i++) m.edge3[i >> 7] += m.edge2[i];
+    for (size_t i = 0; i < m.mip_len[3]; i++) m.edge4[i >> 7] += m.edge3[i];
+  }
+
+  time_a = timestamp();
+  update_mips_all(trace, mips_plain, n);
+  time_b = timestamp();
+  double plain_time = time_b - time_a;
+
+  time_a = timestamp();
+  for (int c = 0; c < n; c++) update_mips(trace, c, 0, trace.samples, mips_one[c]);
+  time_b = timestamp();
+  double one_time = time_b - time_a;
+
+  time_a = timestamp();
+  update_mips_all(trace, mips_all, n);
+  time_b = timestamp();
+  double all_time = time_b - time_a;
+
+  uint64_t total_edges = 0;
+  for (int c = 0; c < n; c++) {
+    if (!edges_match(mips_ref[c], mips_one[c]) || !edges_match(mips_ref[c], mips_all[c]) ||
+        !mips_match(mips_plain[c], mips_all[c])) {
+      printf("edge mismatch on channel %d\n", c);
+      exit(1);
+    }
+    for (size_t i = 0; i < mips_all[c].mip_len[4]; i++) total_edges += mips_all[c].edge4[i];
+  }
+  printf("edge1-edge4 match brute force on all %d channels, %ld edges\n", n, total_edges);
+
+  printf("all-channel without edges %12.6f sec, %8.3f gs/sec\n", plain_time, trace.samples / plain_time / 1.0e9);
+  printf("all-channel with edges    %12.6f sec, %8.3f gs/sec\n", all_time,   trace.samples / all_time   / 1.0e9);
+  printf("per-channel with edges    %12.6f sec, %8.3f gs/sec\n", one_time,   trace.samples / one_time   / 1.0e9);
+  printf("edge pyramid %ld bytes/channel on top of %ld\n",
+         mips_size_bytes(mips_all[0]) - mips_size_bytes(mips_plain[0]), mips_size_bytes(mips_plain[0]));
+
+  for (int c = 0; c < n; c++) {
+    free_mips(mips_plain[c]);
+    free_mips(mips_ref[c]);
+    free_mips(mips_one[c]);
+    free_mips(mips_all[c]);
+  }
+
+  //----------------------------------------
+  // A line that's high the whole time except for one sample.
+
+  TraceBuffer glitch;
+  glitch.samples  = 128 * 128 * 128 * 4;
+  glitch.channels = 8;
+  glitch.stride   = 8;
+  glitch.ssbo_len = glitch.samples;
+  glitch.ssbo     = -1;
+  glitch.blob     = new uint8_t[glitch.ssbo_len];
+  memset(glitch.blob, 0xFF, glitch.ssbo_len);
+  ((uint8_t*)glitch.blob)[1234567] = 0xFE;
+
+  MipBuffer mips;
+  alloc_mips(mips, glitch.samples, false, true);
+  update_mips(glitch, 0, 0, glitch.samples, mips);
+  size_t bucket = 1234567 >> 14;
+  printf("one-sample glitch: mip2 says %d/128 high, edge2 says %d edges, edge4 says %d edges\n",
+         mips.mip[2][bucket], mips.edge2[bucket], mips.edge4[0]);
+  if (mips.edge2[bucket] != 2 || mips.edge4[0] != 2) {
+    printf("glitch didn't survive to edge4\n");
+    exit(1);
+  }
+  free_mips(mips);
+  delete [] (uint8_t*)glitch.blob;
+}
+
+//------------------------------------------------------------------------------
+// Edge index - every query gets checked against a brute-force edge list on the
+// first few million samples, edges_in_range() against the edge pyramid on the
+// whole trace, and the sparse case gets fed synthetic edges over 4G samples.
+
+static uint64_t bench_rng(uint64_t& state) {
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return state;
+}
+
+void bench_edge_index(TraceBuffer& trace) {
+  printf("---------- edge index\n");
+
+  double time_a, time_b;
+  uint64_t seed = 0x1234567887654321ull;
+
+  //----------------------------------------
+  // Brute force check on a prefix of the trace
+
+  TraceBuffer prefix = trace;
+  if (prefix.samples > 4 * 1024 * 1024 + 17) prefix.samples = 4 * 1024 * 1024 + 17;
+
+  EdgeIndex small;
+  small.init(prefix);
+
+  uint64_t* brute = new uint64_t[prefix.samples];
+
+  for (int c = 0; c < (int)prefix.channels; c++) {
+    uint64_t count = 0;
+    for (size_t i = 1; i < prefix.samples; i++) {
+      if (prefix.get_bit(c, i) != prefix.get_bit(c, i - 1)) brute[count++] = i;
+    }
+
+    bool ok = count == small.edge_count(c);
+    for (uint64_t k = 0; ok && k < count; k++) {
+      ok = small.select(c, k) == brute[k];
+    }
+
+    for (int rep = 0; ok && rep < 100000; rep++) {
+      uint64_t pos = bench_rng(seed) % prefix.samples;
+
+      // Brute force next/prev via binary search on the edge list
+      uint64_t lo = 0, hi = count;
+      while (lo < hi) {
+        uint64_t mid = (lo + hi) / 2;
+        if (brute[mid] < pos) lo = mid + 1; else hi = mid;
+      }
+      uint64_t below = lo;
+      uint64_t upto = (below < count && brute[below] == pos) ? below + 1 : below;
+
+      uint64_t next = upto < count ? brute[upto] : EdgeIndex::none;
+      uint64_t prev = below ? brute[below - 1] : EdgeIndex::none;
+
+      ok = small.rank(c, pos) == below &&
+           small.next_edge(c, pos) == next &&
+           small.prev_edge(c, pos) == prev;
+    }
+
+    if (!ok) {
+      printf("edge index mismatch on channel %d\n", c);
+      exit(1);
+    }
+  }
+  printf("select/rank/next/prev match brute force on %ld samples\n", prefix.samples);
+
+  delete [] brute;
+  small.exit();
+
+  //----------------------------------------
+  // Whole trace - build speed, size, and range counts against edge1
+
+  EdgeIndex index;
+  time_a = timestamp();
+  index.init(trace);
+  time_b = timestamp();
+  double build_time = time_b - time_a;
+
+  MipBuffer mips;
+  printf("%8s %12s %12s %14s\n", "channel", "edges", "bytes", "bits/edge");
+  for (int c = 0; c < (int)trace.channels; c++) {
+    alloc_mips(mips, trace.samples, false, true);
+    update_mips(trace, c, 0, trace.samples, mips);
+
+    for (size_t i = 0; i < mips.mip_len[1]; i++) {
+      if (index.edges_in_range(c, i * 128, i * 128 + 128) != mips.edge1[i]) {
+        printf("edges_in_range doesn't match edge1 on channel %d bucket %ld\n", c, i);
+        exit(1);
+      }
+    }
+    free_mips(mips);
+
+    uint64_t edges = index.edge_count(c);
+    printf("%8d %12ld %12ld %14.3f\n", c, edges, index.size_bytes(c),
+           edges ? 8.0 * index.size_bytes(c) / edges : 0.0);
+  }
+  printf("edges_in_range matches edge1 on all %ld channels\n", trace.channels);
+  printf("build %f sec, %f gs/sec, %ld bytes total\n",
+         build_time, trace.samples / build_time / 1.0e9, index.size_bytes());
+
+  int reps = 1000000;
+  uint64_t sum = 0;
+  time_a = timestamp();
+  for (int rep = 0; rep < reps; rep++) {
+    int c = rep & 7;
+    sum += index.next_edge(c, bench_rng(seed) % trace.samples);
+  }
+  time_b = timestamp();
+  printf("next_edge %f nsec/query (%lx)\n", (time_b - time_a) * 1.0e9 / reps, sum);
+
+  index.exit();
+
+  //----------------------------------------
+  // Sparse channels over 4G samples
+
+  uint64_t span = 4ull * 1024 * 1024 * 1024;
+  uint64_t gaps[] = { 1000, 100000, 10000000 };
+
+  for (uint64_t gap : gaps) {
+    EdgeIndex sparse;
+    sparse.begin(1);
+    uint64_t pos = 0;
+    while (1) {
+      pos += 1 + bench_rng(seed) % (2 * gap);
+      if (pos >= span) break;
+      sparse.push(0, pos);
+    }
+    sparse.finish();
+
+    uint64_t edges = sparse.edge_count(0);
+    bool ok = true;
+    uint64_t prev = 0;
+    for (uint64_t k = 0; ok && k < edges; k++) {
+      uint64_t e = sparse.select(0, k);
+      ok = e > prev && sparse.next_edge(0, prev) == e && sparse.rank(0, e) == k;
+      prev = e;
+    }
+    if (!ok) {
+      printf("sparse edge index mismatch\n");
+      exit(1);
+    }
+
+    printf("4G samples, avg gap %9ld: %9ld edges, %10ld bytes, %6.3f bytes/edge\n",
+           gap, edges, sparse.size_bytes(0), double(sparse.size_bytes(0)) / edges);
+    sparse.exit();
+  }
+}
+
+//------------------------------------------------------------------------------
+// Fanout matrix. Every pyramid gets built for the same channel and rendered
+// over the same zoom sweep. Error is against the rank index, which is exact -
+// channel 5 because channel 0's duty cycle happens to average out exactly.
+// Levels are picked so each top-level entry covers 2^28-2^30 samples.
+
+template<int F, int L>
+void bench_fanout_one(TraceBuffer& trace, RankIndex& index, int channel, double* out_ref, double* out, int width) {
+  double time_a, time_b;
+
+  MipPyramid<F, L> mips;
+  alloc_mips(mips, trace.samples);
+
+  time_a = timestamp();
+  update_mips(trace, channel, 0, trace.samples, mips);
+  time_b = timestamp();
+  double build_time = time_b - time_a;
+
+  double total_time = 0;
+  double max_diff = 0;
+  int zooms = 0;
+
+  for (int zoom = -4; zoom <= 26; zoom += 2) {
+    double spp = exp2(zoom);
+    double center = trace.samples * 0.37;
+    double view_min = center - (width / 2) * spp;
+    double view_max = center + (width / 2) * spp;
+
+    render(index, 0, width, view_min, view_max, out_ref, width);
+    render(trace, mips, channel, 0, width, view_min, view_max, out, width);
+    for (int x = 0; x < width; x++) max_diff = fmax(max_diff, fabs(out[x] - out_ref[x]));
+
+    int reps = 20;
+    time_a = timestamp();
+    for (int rep = 0; rep < reps; rep++) render(trace, mips, channel, 0, width, view_min, view_max, out, width);
+    time_b = timestamp();
+    total_time += (time_b - time_a) / reps;
+    zooms++;
+  }
+
+  printf("%8d %8d %14ld %12.6f %14.3f %12.5f\n", F, L, mips_size_bytes(mips),
+         build_time, total_time / zooms * 1.0e6, max_diff);
+
+  free_mips(mips);
+}
+
+void bench_fanout(TraceBuffer& trace) {
+  printf("---------- mip fanout\n");
+
+  const int width = 1920;
+  double* out_ref = new double[width];
+  double* out_a = new double[width];
+  double* out_b = new double[width];
+
+  // MipBuffer is a MipPyramid<mip_fanout, mip_levels> with extras, so a bare
+  // pyramid of the same shape has to match its mips and render() exactly.
+  {
+    MipBuffer mips;
+    alloc_mips(mips, trace.samples);
+    update_mips(trace, 0, 0, trace.samples, mips);
+
+    MipPyramid<mip_fanout, mip_levels> pyramid;
+    alloc_mips(pyramid, trace.samples);
+    update_mips(trace, 0, 0, trace.samples, pyramid);
+
+    bool ok = true;
+    for (int level = 1; level <= mip_levels; level++) {
+      ok &= !memcmp(mips.mip[level], pyramid.mip[level], mips.mip_len[level]);
+    }
+
+    for (int zoom = -8; ok && zoom <= 28; zoom++) {
+      double spp = exp2(zoom);
+      double center = trace.samples * 0.37;
+      render(trace, mips,    0, 0, width, center - 960.0 * spp, center + 960.0 * spp, out_a, width);
+      render(trace, pyramid, 0, 0, width, center - 960.0 * spp, center + 960.0 * spp, out_b, width);
+      ok = !memcmp(out_a, out_b, width * sizeof(double));
+    }
+
+    if (!ok) {
+      printf("MipPyramid<%d, %d> doesn't match MipBuffer\n", mip_fanout, mip_levels);
+      exit(1);
+    }
+    printf("MipPyramid<%d, %d> matches MipBuffer mips and render()\n", mip_fanout, mip_levels);
+
+    // Scalar and popcount level 1 have to agree for the small fanouts too.
+    MipPyramid<16, 7> small_a, small_b;
+    alloc_mips(small_a, trace.samples);
+    alloc_mips(small_b, trace.samples);
+    update_level1_scalar  (trace, 0, 3, small_a.mip_len[1], small_a);
+    update_level1_popcount(trace, 0, 3, small_b.mip_len[1], small_b);
+    if (memcmp(small_a.mip[1], small_b.mip[1], small_a.mip_len[1])) {
+      printf("MipPyramid<16, 7> level 1 mismatch\n");
+      exit(1);
+    }
+    free_mips(small_a);
+    free_mips(small_b);
+
+    free_mips(pyramid);
+    free_mips(mips);
+  }
+
+  int channel = 5;
+  RankIndex index;
+  index.init(trace, channel, 9);
+
+  printf("%8s %8s %14s %12s %14s %12s\n", "fanout", "levels", "bytes", "build sec", "render usec", "max error");
+  bench_fanout_one< 16, 7>(trace, index, channel, out_ref, out_a, width);
+  bench_fanout_one< 32, 6>(trace, index, channel, out_ref, out_a, width);
+  bench_fanout_one< 64, 5>(trace, index, channel, out_ref, out_a, width);
+  bench_fanout_one<128, 4>(trace, index, channel, out_ref, out_a, width);
+
+  index.exit();
+  delete [] out_ref;
+  delete [] out_a;
+  delete [] out_b;
+}
+
+//------------------------------------------------------------------------------
+// A 2^36-sample, one-channel trace. The blob is 8 gigs of untouched zero pages
+// with a couple of patterned patches - one straddling 2^32 and one near the
+// end - so only the patches and the mips take real memory.
+
+void bench_wide() {
+  printf("---------- 2^36 samples\n");
+
+  TraceBuffer trace;
+  trace.samples  = 1ull << 36;
+  trace.channels = 1;
+  trace.stride   = 1;
+  trace.ssbo_len = trace.samples / 8;
+  trace.ssbo     = -1;
+  trace.blob     = mmap(nullptr, trace.ssbo_len, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (trace.blob == MAP_FAILED) {
+    printf("couldn't map %ld bytes, skipping\n", trace.ssbo_len);
+    return;
+  }
+
+  uint8_t* bytes = (uint8_t*)trace.blob;
+  size_t patch_min[2] = { (1ull << 32) - 1000000, (1ull << 36) - 3000000 };
+  size_t patch_max[2] = { (1ull << 32) + 2000000, (1ull << 36) -   10000 };
+  uint64_t total_ones = 0;
+
+  MipBuffer mips;
+  alloc_mips(mips, trace.samples, true);
+
+  for (int p = 0; p < 2; p++) {
+    for (size_t i = patch_min[p]; i < patch_max[p]; i++) {
+      if (((i * 2654435761u) >> 7) % 5 < 2) {
+        bytes[i >> 3] |= 1 << (i & 7);
+        total_ones++;
+      }
+    }
+    update_mips(trace, 0, patch_min[p], patch_max[p], mips);
+  }
+
+  //----------------------------------------
+  // Zoomed in - views are aligned to the render granularity, so with the exact
+  // pyramid the result has to match a brute-force count bit for bit.
+
+  const int width = 1024;
+  double out[width];
+  bool ok = true;
+
+  for (int p = 0; p < 2 && ok; p++) {
+    for (int zoom = -3; zoom <= 10 && ok; zoom++) {
+      double spp = exp2(zoom);
+      double view_min = floor(patch_min[p] / spp + 100) * spp;
+      double view_max = view_min + width * spp;
+
+      render(trace, mips, 0, 0, width, view_min, view_max, out, width);
+
+      for (int x = 0; x < width && ok; x++) {
+        double a = view_min + x * spp;
+        double b = a + spp;
+        double ones = 0;
+        for (double s = floor(a); s < b; s += 1) {
+          double overlap = fmin(b, s + 1) - fmax(a, s);
+          ones += overlap * trace.get_bit(0, size_t(s));
+        }
+        ok = out[x] == ones / spp;
+      }
+    }
+  }
+
+  // Zoomed all the way out - every one has to be accounted for.
+  render(trace, mips, 0, 0, width, 0, double(trace.samples), out, width);
+  double sum = 0;
+  for (int x = 0; x < width; x++) sum += out[x] * double(trace.samples / width);
+  ok = ok && fabs(sum - total_ones) < 0.5;
+
+  if (!ok) {
+    printf("render() mismatch past 2^32\n");
+    exit(1);
+  }
+  printf("render() matches brute force around 2^32 and 2^36, %ld ones accounted for\n", total_ones);
+
+  //----------------------------------------
+  // The shader's hi/lo + float addressing against doubles
+
+  double worst = 0;
+  double origins[] = { -12345.5, 4294967296.0 - 777.25, 68719476736.0 - 1000000.125, 68719476736.0 - 1.5 };
+  for (double origin : origins) {
+    for (int zoom = -7; zoom <= 26; zoom++) {
+      double spp = exp2(zoom) * 1.37;
+      SamplePos pos = split_sample_pos(origin);
+      for (int x = 0; x < 4096; x += 7) {
+        double ref = floor(origin + (x + 0.5) * spp);
+        double got = double(fragment_sample(pos, float(spp), float(x) + 0.5f));
+        // Rounding can always land one sample over, past that it has to be
+        // a tiny fraction of a pixel.
+        double diff = fabs(got - ref);
+        if (diff > 1) worst = fmax(worst, diff / spp);
+      }
+    }
+  }
+  printf("shader sample addressing within one sample or %g pixels\n", worst);
+  if (worst > 0.01) {
+    printf("shader sample addressing is too far off\n");
+    exit(1);
+  }
+
+  // The integer-only version gets the same answer as the doubles wherever
+  // the doubles are exact, and can't be off by more than the rounding of
+  // the step anywhere else.
+
+  double worst_fx = 0;
+  for (double origin : origins) {
+    for (int zoom = -7; zoom <= 42; zoom++) {
+      // Power of two zooms are exact in both, so those have to match.
+      double spp = exp2(zoom) * (zoom < 0 ? 1.0 : 1.37);
+      SampleFx fx = sample_fx(origin, spp);
+      for (int x = 0; x < 8192; x += 7) {
+        double ref = floor(origin + (x + 0.5) * spp);
+        double got = double(fragment_sample_fx(fx, uint32_t(x)));
+        double diff = fabs(got - ref);
+        if (spp == exp2(zoom) && diff != 0) worst_fx = 1.0e9;
+        if (diff > 1) worst_fx = fmax(worst_fx, diff / spp);
+      }
+    }
+  }
+  printf("integer sample addressing within one sample or %g pixels\n", worst_fx);
+
+  // Past what 62 bits can hold there's no fixed point to fall back on, the
+  // painter has to use the float version.
+  if (sample_fx(exp2(61), 1.0).bits != 0 || sample_fx(0, exp2(50)).bits != 0) worst_fx = 1.0e9;
+
+  if (worst_fx > 0.001) {
+    printf("integer sample addressing is too far off\n");
+    exit(1);
+  }
+
+  free_mips(mips);
+  munmap(trace.blob, trace.ssbo_len);
+}
+
+//------------------------------------------------------------------------------
+// render_cover() is the coverage shader's reference, so its walk has to add up
+// to exactly what summing every sample in cover_span()'s spans does. Where
+// render() has nothing to round - power of two zooms and widths, origins on a
+// whole granule - the spans are the same and so is every pixel.
+
+void bench_cover(TraceBuffer& trace) {
+  printf("---------- coverage spans\n");
+
+  MipBuffer mips;
+  alloc_mips(mips, trace.samples);
+  update_mips(trace, 0, 0, trace.samples, mips);
+
+  const int width = 2048;
+  double out[width];
+  double ref[width];
+  size_t bad_walk = 0;
+  size_t bad_render = 0;
+
+  double origins[] = { -12345.5, 1000.0, trace.samples * 0.37 + 0.123, trace.samples - 5000.25 };
+  for (double origin : origins) {
+    for (int zoom = -7; zoom <= 12; zoom++) {
+      double spp = exp2(zoom) * 1.37;
+      CoverFx fx = cover_fx(origin, spp, double(trace.samples));
+      int64_t origin_fx = cover_origin(fx, origin);
+      render_cover(trace, mips, 0, fx, origin_fx, out, width);
+
+      for (int x = 0; x < width; x++) {
+        int64_t imin, imax;
+        double want = 0;
+        if (cover_span(fx, origin_fx, trace.samples, x, imin, imax)) {
+          if ((imin >> 7) == (imax >> 7)) {
+            want = trace.get_bit(0, imin >> 7);
+          }
+          else {
+            uint64_t total = 0;
+            for (int64_t s = imin >> 7; s <= (imax - 1) >> 7; s++) {
+              int64_t a = s * 128 > imin ? s * 128 : imin;
+              int64_t b = s * 128 + 128 < imax ? s * 128 + 128 : imax;
+              total += (b - a) * trace.get_bit(0, s);
+            }
+            want = double(total) / double(imax - imin);
+          }
+        }
+        if (out[x] != want) bad_walk++;
+      }
+
+      spp = exp2(zoom);
+      double granule = exp2(zoom - 7);
+      double whole = floor(origin / granule) * granule;
+      fx = cover_fx(whole, spp, double(trace.samples));
+      render_cover(trace, mips, 0, fx, cover_origin(fx, whole), out, width);
+      render(trace, mips, 0, 0, width, whole, whole + width * spp, ref, width);
+      for (int x = 0; x < width; x++) {
+        if (out[x] != ref[x]) bad_render++;
+      }
+    }
+  }
+
+  printf("render_cover() vs brute force %ld bad pixels, vs render() %ld bad pixels\n", bad_walk, bad_render);
+  if (bad_walk || bad_render) {
+    printf("render_cover() doesn't match\n");
+    exit(1);
+  }
+
+  free_mips(mips);
+}
+
+//------------------------------------------------------------------------------
+// Row renderer vs the scalar mip walk. See RowRenderer.hpp for the tolerance -
+// a pixel is allowed to be off by (2 * granule / pixel width), where both are
+// in 1/128ths of a sample.
+
+void bench_row(TraceBuffer& trace) {
+  printf("---------- row renderer\n");
+
+  MipBuffer mips;
+  alloc_mips(mips, trace.samples, true);
+  update_mips(trace, 0, 0, trace.samples, mips);
+
+  RankIndex index;
+  index.init(trace, 0, 9);
+
+  RowRenderer row;
+  row.init(1920);
+  int best_level = row.simd_level;
+
+  double out_ref[1920];
+  double out_row[1920];
+  double out_tmp[1920];
+
+  const char* level_names[] = { "scalar", "sse4.2", "avx2" };
+  printf("best kernel %s\n", level_names[best_level]);
+
+  printf("%14s %10s %12s %8s %12s", "samples/pixel", "identical", "max diff", "> tol", "mip walk");
+  for (int level = 0; level <= best_level; level++) printf(" %12s", level_names[level]);
+  printf("   (usec per 1920 px)\n");
+
+  for (int zoom = -28; zoom <= 6; zoom += 2) {
+    double spp = exp2(zoom);
+    double center = trace.samples * 0.37 + 0.123;
+    double view_min = center - 960.0 * spp;
+    double view_max = center + 960.0 * spp;
+
+    render(trace, mips, 0, 0, 1920, view_min, view_max, out_ref, 1920);
+
+    row.simd_level = best_level;
+    row.render(index, 0, 1920, view_min, view_max, out_row, 1920);
+
+    int identical = 0;
+    int over = 0;
+    double max_diff = 0;
+    double granule = fmax(1.0, exp2(ceil(log2(spp)))); // in 1/128ths
+
+    for (int x = 0; x < 1920; x++) {
+      double diff = fabs(out_ref[x] - out_row[x]);
+      double len  = double(row.bound[x + 1] - row.bound[x]);
+      double tol  = len > 2 * granule ? 2 * granule / len : 1.0;
+      if (diff == 0)  identical++;
+      if (diff > tol) over++;
+      max_diff = fmax(max_diff, diff);
+    }
+
+    // The kernels themselves have to agree exactly.
+    for (int level = 0; level < best_level; level++) {
+      row.simd_level = level;
+      row.render(index, 0, 1920, view_min, view_max, out_tmp, 1920);
+      if (memcmp(out_tmp, out_row, sizeof(out_row))) {
+        printf("%s kernel doesn't match %s\n", level_names[level], level_names[best_level]);
+        exit(1);
+      }
+    }
+
+    printf("%14g %9.2f%% %12g %8d", spp, 100.0 * identical / 1920, max_diff, over);
+
+    int reps = 200;
+    double time_a = timestamp();
+    for (int rep = 0; rep < reps; rep++) render(trace, mips, 0, 0, 1920, view_min, view_max, out_ref, 1920);
+    double time_b = timestamp();
+    printf(" %12.3f", (time_b - time_a) / reps * 1.0e6);
+
+    for (int level = 0; level <= best_level; level++) {
+      row.simd_level = level;
+      time_a = timestamp();
+      for (int rep = 0; rep < reps; rep++) row.render(index, 0, 1920, view_min, view_max, out_row, 1920);
+      time_b = timestamp();
+      printf(" %12.3f", (time_b - time_a) / reps * 1.0e6);
+    }
+    printf("\n");
+  }
+
+  row.exit();
+  index.exit();
+  free_mips(mips);
+}
+
+//------------------------------------------------------------------------------
+// Per-frame render time for a 64-channel trace across worker counts. Every
+// configuration has to produce exactly what the single-threaded path does.
+
+void bench_pool() {
+  printf("---------- render pool\n");
+
+  TraceBuffer trace;
+  trace.samples  = 4 * 1024 * 1024;
+  trace.channels = 64;
+  trace.stride   = 64;
+  trace.ssbo_len = (trace.samples * trace.stride + 7) / 8;
+  trace.ssbo     = -1;
+  trace.blob     = new uint8_t[trace.ssbo_len];
+
+  uint8_t* bytes = (uint8_t*)trace.blob;
+  for (size_t i = 0; i < trace.samples; i++) {
+    for (int k = 0; k < 8; k++) {
+      size_t t = i + 0x993781 + k * 0x10101;
+      bytes[i * 8 + k] = uint8_t(t*((t>>9|t>>13)&25&t>>6));
+    }
+  }
+
+  MipBuffer mips[64];
+  for (int c = 0; c < 64; c++) alloc_mips(mips[c], trace.samples);
+  update_mips_all(trace, mips, 64);
+
+  const int width = 1920;
+  double zooms[] = { -4, 4, 10 };
+  const int zoom_count = sizeof(zooms) / sizeof(zooms[0]);
+
+  double* out_ref = new double[zoom_count * 64 * width];
+  double* out     = new double[64 * width];
+  double* ref_row = new double[width];
+
+  int hw = (int)std::thread::hardware_concurrency();
+  printf("hardware threads %d\n", hw);
+
+  printf("%8s", "threads");
+  for (auto zoom : zooms) printf(" %10g spp", exp2(zoom));
+  printf(" %10s   (msec per 64-channel frame)\n", "speedup");
+
+  double base_time = 0;
+  int max_threads = hw > 4 ? hw : 4;
+
+  for (int threads = 0; threads <= max_threads; threads = threads ? threads * 2 : 1) {
+    RenderPool pool;
+    pool.init(threads);
+
+    printf("%8d", threads);
+    double total_time = 0;
+
+    for (int z = 0; z < zoom_count; z++) {
+      double spp = exp2(zooms[z]);
+      double center = trace.samples * 0.37;
+      double view_min = center - width * 0.5 * spp;
+      double view_max = center + width * 0.5 * spp;
+
+      pool.render(trace, mips, 64, 0, width, view_min, view_max, out, width, width);
+
+      double* ref = out_ref + z * 64 * width;
+      if (threads == 0) {
+        memcpy(ref, out, 64 * width * sizeof(double));
+      }
+      else if (memcmp(ref, out, 64 * width * sizeof(double))) {
+        printf("\n%d threads doesn't match single-threaded output\n", threads);
+        exit(1);
+      }
+
+      // The hit counters have to come out the same as rendering directly.
+      for (int c = 0; c < 64; c += 9) {
+        MipBuffer direct = mips[c];
+        render(trace, direct, c, 0, width, view_min, view_max, ref_row, width);
+        bool same = true;
+        for (int level = 0; level <= mip_levels; level++) {
+          same &= direct.mip_hit[level] == mips[c].mip_hit[level];
+        }
+        if (!same) {
+          printf("\n%d threads lost mip hit counts on channel %d\n", threads, c);
+          exit(1);
+        }
+      }
+
+      int reps = 10;
+      double time_a = timestamp();
+      for (int rep = 0; rep < reps; rep++) {
+        pool.render(trace, mips, 64, 0, width, view_min, view_max, out, width, width);
+      }
+      double time_b = timestamp();
+      double t = (time_b - time_a) / reps;
+      total_time += t;
+      printf(" %14.3f", t * 1.0e3);
+    }
+
+    if (threads == 0) base_time = total_time;
+    printf(" %9.2fx\n", base_time / total_time);
+
+    pool.exit();
+  }
+
+  delete [] out_ref;
+  delete [] out;
+  delete [] ref_row;
+  for (int c = 0; c < 64; c++) free_mips(mips[c]);
+  delete [] (uint8_t*)trace.blob;
+}
+
+//------------------------------------------------------------------------------
+// Panning a few pixels per frame through the tile cache vs re-rendering the
+// whole frame every time. The small budget keeps evicting tiles, which
+// shouldn't change the output either.
+
+void bench_tiles(TraceBuffer& trace) {
+  printf("---------- tile cache\n");
+
+  int n = (int)trace.channels;
+  MipBuffer mips[8];
+  for (int c = 0; c < n; c++) alloc_mips(mips[c], trace.samples);
+  update_mips_all(trace, mips, n);
+
+  RenderPool pool;
+  pool.init(0);
+
+  const int width = 1920;
+  const int frames = 300;
+  const int pan = 8;
+  double* out_ref = new double[n * width];
+  double* out     = new double[n * width];
+
+  size_t budgets[] = { 64 * 1024 * 1024, 100 * TileCache::tile_width * sizeof(double) };
+
+  printf("%8s %10s %10s %10s %10s %12s %12s %10s\n",
+         "zoom", "budget", "hit rate", "evictions", "max diff", "direct usec", "cached usec", "speedup");
+
+  for (auto budget : budgets) {
+    for (int zoom = -12; zoom <= 6; zoom += 6) {
+      TileCache cache;
+      cache.init(budget);
+
+      double spp = exp2(-zoom);
+      double origin = trace.samples / 2.0;
+      int64_t start = int64_t(trace.samples * 0.37 / spp) - int64_t(trace.samples / 2.0 / spp);
+
+      double direct_time = 0;
+      double diff = 0;
+
+      for (int f = 0; f < frames; f++) {
+        // Back and forth, so the small budget has to re-render tiles it
+        // already had once.
+        int step = f < frames / 2 ? f : frames - f;
+        double view_min = origin + double(start + step * pan) * spp;
+
+        double time_a = timestamp();
+        pool.render(trace, mips, n, 0, width, view_min, view_min + width * spp, out_ref, width, width);
+        double time_b = timestamp();
+        direct_time += time_b - time_a;
+
+        cache.render(pool, trace, mips, n, origin, zoom, view_min, out, width, width);
+        if (cache.frame.bypassed) {
+          printf("tile cache bypassed an on-grid frame\n");
+          exit(1);
+        }
+
+        for (int i = 0; i < n * width; i++) diff = fmax(diff, fabs(out[i] - out_ref[i]));
+      }
+
+      if (diff > 1.0e-9) {
+        printf("tile cache doesn't match direct render at zoom %d, diff %g\n", zoom, diff);
+        exit(1);
+      }
+
+      int lookups = cache.total.hits + cache.total.misses;
+      printf("%8d %10ld %9.2f%% %10d %10g %12.3f %12.3f %9.2fx\n",
+             zoom, budget, 100.0 * cache.total.hits / lookups, cache.total.evictions, diff,
+             direct_time / frames * 1.0e6, cache.total.time / frames * 1.0e6,
+             direct_time / cache.total.time);
+
+      cache.exit();
+    }
+  }
+
+  // Off the pixel grid has to fall back to a direct render.
+  TileCache cache;
+  cache.init(budgets[0]);
+  cache.render(pool, trace, mips, n, 0, 0.5, 1000.0, out, width, width);
+  bool bypass_frac = cache.frame.bypassed;
+  cache.render(pool, trace, mips, n, 0, 2, 1000.1, out, width, width);
+  bool bypass_off = cache.frame.bypassed;
+  if (!bypass_frac || !bypass_off) {
+    printf("tile cache didn't bypass an off-grid frame\n");
+    exit(1);
+  }
+  printf("off-grid frames bypass the cache\n");
+  cache.exit();
+
+  pool.exit();
+  delete [] out_ref;
+  delete [] out;
+  for (int c = 0; c < n; c++) free_mips(mips[c]);
+}
+
+//------------------------------------------------------------------------------
+// Feeds the trace through append_samples() the way the capture thread hands
+// it to us and checks that we end up with the same mips as a full rebuild.
+// Odd block sizes make sure buckets split across blocks work.
+
+void bench_append(TraceBuffer& trace) {
+  printf("---------- incremental append\n");
+
+  int n = (int)trace.channels;
+  MipBuffer mips_full[8];
+  MipBuffer mips_live[8];
+  for (int c = 0; c < n; c++) {
+    alloc_mips(mips_full[c], trace.samples, true, true);
+  }
+  update_mips_all(trace, mips_full, n);
+
+  TraceBuffer live;
+  live.channels = trace.channels;
+  live.stride   = trace.stride;
+  live.ssbo_len = trace.ssbo_len;
+  live.ssbo     = -1;
+  live.blob     = new uint8_t[live.ssbo_len];
+
+  size_t block_sizes[] = { 65536, 1000, 4096 * 3 + 5 };
+
+  for (auto block_size : block_sizes) {
+    live.samples = 0;
+    for (int c = 0; c < n; c++) {
+      alloc_mips(mips_live[c], trace.samples, true, true);
+    }
+
+    double time_a = timestamp();
+    size_t blocks = 0;
+    for (size_t offset = 0; offset < trace.ssbo_len; offset += block_size) {
+      size_t len = trace.ssbo_len - offset;
+      if (len > block_size) len = block_size;
+      append_samples(live, mips_live, n, (uint8_t*)trace.blob + offset, len);
+      blocks++;
+    }
+    double time_b = timestamp();
+
+    for (int c = 0; c < n; c++) {
+      MipBuffer& a = mips_full[c];
+      MipBuffer& b = mips_live[c];
+      bool match = mips_match(a, b) &&
+                   !memcmp(a.mip2_exact, b.mip2_exact, a.mip_len[2] * sizeof(a.mip2_exact[0])) &&
+                   !memcmp(a.mip3_exact, b.mip3_exact, a.mip_len[3] * sizeof(a.mip3_exact[0])) &&
+                   !memcmp(a.mip4_exact, b.mip4_exact, a.mip_len[4] * sizeof(a.mip4_exact[0])) &&
+                   edges_match(a, b);
+      if (!match || b.dirty_min != 0 || b.dirty_max != trace.samples) {
+        printf("append mismatch on channel %d, block size %ld\n", c, block_size);
+        exit(1);
+      }
+      free_mips(mips_live[c]);
+    }
+
+    double t = time_b - time_a;
+    printf("block %6ld bytes : %8ld blocks %12.6f sec, %8.3f gs/sec, %8.3f usec/block\n",
+           block_size, blocks, t, trace.samples / t / 1.0e9, t / blocks * 1.0e6);
+  }
+  printf("incremental mips match full rebuild\n");
+
+  delete [] (uint8_t*)live.blob;
+  for (int c = 0; c < n; c++) {
+    free_mips(mips_full[c]);
+  }
+}
+
+//------------------------------------------------------------------------------
+// extract() on every layout it has a fast path for. Each kernel gets checked
+// against the generic one at random unaligned spots, then timed pulling one
+// whole channel out of the trace.
+
+typedef void (*ExtractKernel)(const TraceBuffer&, size_t, size_t, size_t, uint64_t*);
+
+void bench_extract_layout(const char* name, TraceBuffer& trace, uint64_t* out, uint64_t* ref) {
+  struct { const char* name; ExtractKernel kernel; bool ok; } kernels[] = {
+    { "generic", extract_generic, true },
+    { "planar",  extract_planar,  trace.planar() },
+    { "swar",    extract_swar,    trace.stride == 8 },
+    { "pext",    extract_pext,    trace.stride >= 8 && cpu_has_bmi2() },
+    { "avx2",    extract_avx2,    trace.stride >= 8 && cpu_has_avx2() },
+  };
+
+  int channel = int(trace.channels) - 3;
+  size_t words = trace.samples / 64;
+  uint64_t seed = 0x1234567;
+
+  for (auto& k : kernels) {
+    if (!k.ok) continue;
+    for (int rep = 0; rep < 1000; rep++) {
+      size_t c     = bench_rng(seed) % trace.channels;
+      size_t count = bench_rng(seed) % 3000;
+      size_t start = bench_rng(seed) % (trace.samples - count);
+      size_t n = count / 64;
+      extract_generic(trace, c, start, n, ref);
+      k.kernel(trace, c, start, n, out);
+      if (memcmp(out, ref, n * sizeof(uint64_t))) {
+        printf("%s extract mismatch on %s trace, channel %ld start %ld\n", k.name, name, c, start);
+        exit(1);
+      }
+    }
+  }
+
+  // The whole-channel result has to match get_bit(), ragged end included.
+  trace.extract(channel, 0, trace.samples, out);
+  for (size_t i = 0; i < trace.samples; i++) {
+    if (int((out[i >> 6] >> (i & 63)) & 1) != trace.get_bit(channel, i)) {
+      printf("extract() doesn't match get_bit() on %s trace, sample %ld\n", name, i);
+      exit(1);
+    }
+  }
+  if ((trace.samples & 63) && (out[words] >> (trace.samples & 63))) {
+    printf("extract() left junk past the end of the %s trace\n", name);
+    exit(1);
+  }
+
+  double time_a, time_b;
+
+  time_a = timestamp();
+  for (size_t i = 0; i < words * 64; i++) {
+    ref[i >> 6] = (ref[i >> 6] & ~(uint64_t(1) << (i & 63))) | (uint64_t(trace.get_bit(channel, i)) << (i & 63));
+  }
+  time_b = timestamp();
+  double get_bit_time = time_b - time_a;
+  printf("%-12s %-8s %12.6f sec, %8.3f gs/sec\n", name, "get_bit", get_bit_time, words * 64 / get_bit_time / 1.0e9);
+
+  // Bytes the kernel has to pull in - the channel's plane, or every sample.
+  double bytes = trace.planar() ? words * 8.0 : words * 64.0 * trace.stride / 8;
+
+  for (auto& k : kernels) {
+    if (!k.ok) continue;
+    time_a = timestamp();
+    k.kernel(trace, channel, 0, words, out);
+    time_b = timestamp();
+    double t = time_b - time_a;
+    printf("%-12s %-8s %12.6f sec, %8.3f gs/sec, %8.3f GB/sec\n", name, k.name, t, words * 64 / t / 1.0e9, bytes / t / 1.0e9);
+  }
+}
+
+// Wider samples - the 8-bit pattern in the low byte and scrambled copies of it
+// above that. The caller deletes the blob.
+
+void widen_trace(TraceBuffer& trace, size_t stride, TraceBuffer& wide) {
+  wide.samples  = trace.samples;
+  wide.channels = stride;
+  wide.stride   = stride;
+  wide.ssbo_len = trace.samples * stride / 8;
+  wide.ssbo     = -1;
+  wide.blob     = new uint8_t[wide.ssbo_len];
+
+  const uint8_t* src = (const uint8_t*)trace.blob;
+  uint8_t* dst = (uint8_t*)wide.blob;
+  for (size_t i = 0; i < trace.samples; i++) {
+    for (size_t b = 0; b < stride / 8; b++) {
+      dst[i * (stride / 8) + b] = uint8_t(src[i] * (2 * b + 1) + b * 0x35);
+    }
+  }
+}
+
+void bench_extract(TraceBuffer& trace) {
+  printf("---------- bulk extract\n");
+  assert(trace.stride == 8);
+
+  size_t samples = trace.samples;
+  uint64_t* out = new uint64_t[samples / 64 + 1];
+  uint64_t* ref = new uint64_t[samples / 64 + 1];
+
+  bench_extract_layout("8-bit", trace, out, ref);
+
+  TraceBuffer planar;
+  init_planar(planar, trace.channels, samples);
+  planar.ssbo = -1;
+  planar.blob = new uint8_t[planar.ssbo_len]();
+  transpose_samples(planar, 0, trace.blob, 1, samples);
+  planar.samples = samples;
+  bench_extract_layout("planar", planar, out, ref);
+  delete [] (uint8_t*)planar.blob;
+
+  for (size_t stride = 16; stride <= 32; stride *= 2) {
+    TraceBuffer wide;
+    widen_trace(trace, stride, wide);
+    bench_extract_layout(stride == 16 ? "16-bit" : "32-bit", wide, out, ref);
+    delete [] (uint8_t*)wide.blob;
+  }
+
+  delete [] out;
+  delete [] ref;
+}
+
+//------------------------------------------------------------------------------
+// Same capture data as a planar trace - transposed in odd-sized blocks the way
+// append_samples() sees it, checked bit for bit against the interleaved trace,
+// then the single-channel consumers timed on both layouts.
+
+void bench_planar(TraceBuffer& trace) {
+  printf("---------- planar layout\n");
+  assert(trace.stride == 8);
+
+  int n = (int)trace.channels;
+
+  TraceBuffer planar;
+  init_planar(planar, n, trace.samples);
+  planar.ssbo = -1;
+  planar.blob = new uint8_t[planar.ssbo_len]();
+
+  MipBuffer mips_full[8];
+  MipBuffer mips_live[8];
+  for (int c = 0; c < n; c++) {
+    alloc_mips(mips_full[c], trace.samples, false, true);
+    alloc_mips(mips_live[c], trace.samples, false, true);
+  }
+  update_mips_all(trace, mips_full, n);
+
+  size_t block = 4096 * 3 + 5;
+  for (size_t offset = 0; offset < trace.samples; offset += block) {
+    size_t count = trace.samples - offset;
+    if (count > block) count = block;
+    append_samples(planar, mips_live, n, (uint8_t*)trace.blob + offset, count);
+  }
+
+  for (int c = 0; c < n; c++) {
+    if (!mips_match(mips_full[c], mips_live[c]) || !edges_match(mips_full[c], mips_live[c])) {
+      printf("planar append mips mismatch on channel %d\n", c);
+      exit(1);
+    }
+    free_mips(mips_full[c]);
+    free_mips(mips_live[c]);
+  }
+
+  size_t full_words = trace.samples / 64;
+  for (int c = 0; c < n; c++) {
+    for (size_t w = 0; w < full_words; w++) {
+      if (channel_word(planar, c, w) != channel_word(trace, c, w)) {
+        printf("planar word mismatch on channel %d word %ld\n", c, w);
+        exit(1);
+      }
+    }
+    for (size_t i = full_words * 64; i < trace.samples; i++) {
+      if (planar.get_bit(c, i) != trace.get_bit(c, i)) {
+        printf("planar bit mismatch on channel %d sample %ld\n", c, i);
+        exit(1);
+      }
+    }
+  }
+  printf("planar trace and appended mips match interleaved on all %d channels\n", n);
+
+  double time_a, time_b;
+
+  time_a = timestamp();
+  transpose8_swar(planar, (uint8_t*)trace.blob, 0, full_words);
+  time_b = timestamp();
+  double swar_time = time_b - time_a;
+  printf("transpose swar %12.6f sec, %8.3f gs/sec\n", swar_time, trace.samples / swar_time / 1.0e9);
+
+  if (cpu_has_avx2()) {
+    time_a = timestamp();
+    transpose8_avx2(planar, (uint8_t*)trace.blob, 0, full_words);
+    time_b = timestamp();
+    double avx2_time = time_b - time_a;
+    printf("transpose avx2 %12.6f sec, %8.3f gs/sec\n", avx2_time, trace.samples / avx2_time / 1.0e9);
+  }
+
+  // One channel at a time is where planar should pay off - the interleaved
+  // trace drags the other seven channels through the cache with it.
+  int channel = 5;
+  MipBuffer mips_a;
+  MipBuffer mips_b;
+  alloc_mips(mips_a, trace.samples);
+  alloc_mips(mips_b, trace.samples);
+
+  time_a = timestamp();
+  update_mips(trace, channel, 0, trace.samples, mips_a);
+  time_b = timestamp();
+  double mips_il = time_b - time_a;
+
+  time_a = timestamp();
+  update_mips(planar, channel, 0, trace.samples, mips_b);
+  time_b = timestamp();
+  double mips_pl = time_b - time_a;
+
+  if (!mips_match(mips_a, mips_b)) {
+    printf("planar mips don't match interleaved\n");
+    exit(1);
+  }
+
+  RankIndex index_a;
+  RankIndex index_b;
+
+  time_a = timestamp();
+  index_a.init(trace, channel);
+  time_b = timestamp();
+  double rank_il = time_b - time_a;
+
+  time_a = timestamp();
+  index_b.init(planar, channel);
+  time_b = timestamp();
+  double rank_pl = time_b - time_a;
+
+  if (index_a.size_bytes() != index_b.size_bytes() ||
+      memcmp(index_a.bits, index_b.bits, index_a.bits_len * sizeof(uint64_t))) {
+    printf("planar rank index doesn't match interleaved\n");
+    exit(1);
+  }
+
+  // Zoomed in far enough that render() spends its time in the raw samples.
+  double out_a[1920];
+  double out_b[1920];
+  double spp = 0.25;
+  double view_min = trace.samples * 0.37 - 960.0 * spp;
+  double view_max = trace.samples * 0.37 + 960.0 * spp;
+  int reps = 1000;
+
+  time_a = timestamp();
+  for (int rep = 0; rep < reps; rep++) render(trace, mips_a, channel, 0, 1920, view_min, view_max, out_a, 1920);
+  time_b = timestamp();
+  double render_il = (time_b - time_a) / reps;
+
+  time_a = timestamp();
+  for (int rep = 0; rep < reps; rep++) render(planar, mips_b, channel, 0, 1920, view_min, view_max, out_b, 1920);
+  time_b = timestamp();
+  double render_pl = (time_b - time_a) / reps;
+
+  if (memcmp(out_a, out_b, sizeof(out_a))) {
+    printf("planar render doesn't match interleaved\n");
+    exit(1);
+  }
+  printf("mips, rank index and render match on channel %d\n", channel);
+
+  printf("%16s %14s %14s\n", "", "interleaved", "planar");
+  printf("%16s %14.6f %14.6f\n", "update_mips sec", mips_il, mips_pl);
+  printf("%16s %14.6f %14.6f\n", "rank init sec", rank_il, rank_pl);
+  printf("%16s %14.3f %14.3f\n", "render usec", render_il * 1.0e6, render_pl * 1.0e6);
+
+  index_a.exit();
+  index_b.exit();
+  free_mips(mips_a);
+  free_mips(mips_b);
+  delete [] (uint8_t*)planar.blob;
+}
+
+//------------------------------------------------------------------------------
+// 16 and 32-channel captures end to end on the CPU - the popcount mip paths
+// against the scalar ones, and a planar trace built from odd-sized appends
+// against the interleaved one.
+
+void bench_channels(TraceBuffer& trace) {
+  printf("---------- 16 and 32 channels\n");
+
+  // The scalar reference is slow, so it only covers the start of the trace.
+  size_t check_samples = trace.samples < 4 * 1024 * 1024 ? trace.samples : 4 * 1024 * 1024;
+  size_t check_buckets = check_samples / 128;
+
+  for (size_t stride = 16; stride <= 32; stride *= 2) {
+    int n = int(stride);
+    size_t bytes_per_sample = stride / 8;
+
+    TraceBuffer wide;
+    widen_trace(trace, stride, wide);
+
+    MipBuffer* mips_fast = new MipBuffer[n];
+    MipBuffer* mips_live = new MipBuffer[n];
+    for (int c = 0; c < n; c++) {
+      alloc_mips(mips_fast[c], wide.samples, false, true);
+      alloc_mips(mips_live[c], wide.samples, false, true);
+    }
+
+    double time_a = timestamp();
+    update_mips_all(wide, mips_fast, n);
+    double time_b = timestamp();
+    double mips_time = time_b - time_a;
+
+    TraceBuffer head = wide;
+    head.samples = check_samples;
+    MipBuffer ref;
+    alloc_mips(ref, check_samples, false, true);
+    for (int c = 0; c < n; c++) {
+      update_mip1_scalar(head, c, 0, check_buckets, ref);
+      update_edge1_scalar(head, c, 0, check_buckets, ref);
+      if (memcmp(ref.mip[1], mips_fast[c].mip[1], check_buckets) ||
+          memcmp(ref.edge1, mips_fast[c].edge1, check_buckets)) {
+        printf("%d-channel popcount mips don't match scalar on channel %d\n", n, c);
+        exit(1);
+      }
+    }
+    free_mips(ref);
+
+    TraceBuffer planar;
+    init_planar(planar, n, wide.samples);
+    planar.ssbo = -1;
+    planar.blob = new uint8_t[planar.ssbo_len]();
+
+    size_t block = 4096 * 3 + 5;
+    time_a = timestamp();
+    for (size_t offset = 0; offset < wide.samples; offset += block) {
+      size_t count = wide.samples - offset;
+      if (count > block) count = block;
+      append_samples(planar, mips_live, n, (uint8_t*)wide.blob + offset * bytes_per_sample, count * bytes_per_sample);
+    }
+    time_b = timestamp();
+    double append_time = time_b - time_a;
+
+    size_t full_words = wide.samples / 64;
+    uint64_t* bits = new uint64_t[full_words + 1];
+    for (int c = 0; c < n; c++) {
+      wide.extract(c, 0, wide.samples, bits);
+      if (memcmp(bits, planar.plane(c), full_words * sizeof(uint64_t))) {
+        printf("%d-channel planar trace doesn't match interleaved on channel %d\n", n, c);
+        exit(1);
+      }
+      if (!mips_match(mips_fast[c], mips_live[c]) || !edges_match(mips_fast[c], mips_live[c])) {
+        printf("%d-channel appended mips mismatch on channel %d\n", n, c);
+        exit(1);
+      }
+    }
+    printf("%d channels - mips match scalar, planar appends match interleaved\n", n);
+    printf("update_mips_all %12.6f sec, %8.3f gs/sec\n", mips_time, wide.samples / mips_time / 1.0e9);
+    printf("planar append   %12.6f sec, %8.3f gs/sec\n", append_time, wide.samples / append_time / 1.0e9);
+
+    for (int c = 0; c < n; c++) {
+      free_mips(mips_fast[c]);
+      free_mips(mips_live[c]);
+    }
+    delete [] mips_fast;
+    delete [] mips_live;
+    delete [] bits;
+    delete [] (uint8_t*)planar.blob;
+    delete [] (uint8_t*)wide.blob;
+  }
+}
+
+//------------------------------------------------------------------------------
+
+int main(int argc, char** argv) {
+  size_t samples = 64ull * 1024ull * 1024ull;
+  if (argc > 1) samples = strtoull(argv[1], nullptr, 0);
+
+  TraceBuffer trace;
+  trace.samples  = samples;
+  trace.channels = 8;
+  trace.stride   = 8;
+  trace.ssbo_len = (trace.samples * trace.stride + 7) / 8;
+  trace.ssbo     = -1;
+  trace.blob     = new uint8_t[trace.ssbo_len];
+
+  printf("generating %ld samples\n", trace.samples);
+  gen_pattern(trace);
+
+  bench_mip1(trace);
+  bench_mips_all(trace);
+  bench_striped(trace);
+  bench_exact(trace);
+  bench_cover(trace);
+  bench_edges(trace);
+  bench_rank(trace);
+  bench_edge_index(trace);
+  bench_fanout(trace);
+  bench_row(trace);
+  bench_pool();
+  bench_tiles(trace);
+  bench_append(trace);
+  bench_planar(trace);
+  bench_extract(trace);
+  bench_channels(trace);
+  bench_wide();
+
+  delete [] (uint8_t*)trace.blob;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
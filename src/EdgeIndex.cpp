@@ -0,0 +1,322 @@
+#include "EdgeIndex.hpp"
+
+#include "BitOps.hpp"
+
+#include <string.h>
+
+static constexpr uint64_t part_size = uint64_t(1) << EdgeIndex::part_shift;
+
+//------------------------------------------------------------------------------
+// Bitstream helpers. width has to be less than 64.
+
+static inline uint64_t read_bits(const uint64_t* data, uint64_t pos, int width) {
+  if (!width) return 0;
+  uint64_t word = pos >> 6;
+  int shift = pos & 63;
+  uint64_t value = data[word] >> shift;
+  if (shift + width > 64) value |= data[word + 1] << (64 - shift);
+  return value & ((uint64_t(1) << width) - 1);
+}
+
+static inline int read_bit(const uint64_t* data, uint64_t pos) {
+  return (data[pos >> 6] >> (pos & 63)) & 1;
+}
+
+// Offset from start of the k'th (from 0) set bit at or after start, or of the
+// k'th clear bit if flip is all ones. The caller has to know it's there.
+static inline uint64_t select_bit(const uint64_t* data, uint64_t start, uint64_t k, uint64_t flip) {
+  uint64_t word = start >> 6;
+  uint64_t bits = ((data[word] ^ flip) >> (start & 63)) << (start & 63);
+
+  while (1) {
+    uint64_t count = popcount64(bits);
+    if (k < count) break;
+    k -= count;
+    bits = data[++word] ^ flip;
+  }
+
+  for (; k; k--) bits &= bits - 1;
+  return word * 64 + ctz64(bits) - start;
+}
+
+//------------------------------------------------------------------------------
+// Partition layout: n * L low bits, then the high bitvector. Edge i of the
+// partition is at part_first + ((high << L) | low), and sets bit (high + i) of
+// the bitvector - so the number of zeros before edge i's one is its high part.
+
+void EdgeIndex::flush_partition(EdgeList& list) {
+  int n = list.pending_len;
+  if (!n) return;
+
+  uint64_t first = list.pending[0];
+  uint64_t span  = list.pending[n - 1] - first;
+  uint64_t avg   = span / n;
+  int low_bits   = avg ? log2_floor64(avg) : 0;
+
+  uint64_t high_len = n + (span >> low_bits) + 1;
+  uint64_t part_bits = uint64_t(n) * low_bits + high_len;
+
+  // Room for this partition, plus one spare word so the bit writers can
+  // straddle the end.
+  size_t need_words = ((list.data_bits + part_bits + 63) >> 6) + 1;
+  if (need_words > list.data_cap) {
+    size_t new_cap = list.data_cap ? list.data_cap * 2 : 1024;
+    while (new_cap < need_words) new_cap *= 2;
+    uint64_t* new_data = new uint64_t[new_cap]();
+    if (list.data) memcpy(new_data, list.data, list.data_cap * sizeof(uint64_t));
+    delete [] list.data;
+    list.data = new_data;
+    list.data_cap = new_cap;
+  }
+
+  if (list.part_count + 1 >= list.part_cap) {
+    size_t new_cap = list.part_cap ? list.part_cap * 2 : 64;
+    uint64_t* new_first = new uint64_t[new_cap];
+    uint64_t* new_info  = new uint64_t[new_cap];
+    if (list.part_count) {
+      memcpy(new_first, list.part_first, list.part_count * sizeof(uint64_t));
+      memcpy(new_info,  list.part_info,  list.part_count * sizeof(uint64_t));
+    }
+    delete [] list.part_first;
+    delete [] list.part_info;
+    list.part_first = new_first;
+    list.part_info  = new_info;
+    list.part_cap   = new_cap;
+  }
+
+  uint64_t low_start  = list.data_bits;
+  uint64_t high_start = low_start + uint64_t(n) * low_bits;
+  uint64_t low_mask   = (uint64_t(1) << low_bits) - 1;
+
+  // Low bits go out through a one-word accumulator instead of write_bits(),
+  // this loop is most of the build time.
+  if (low_bits) {
+    uint64_t* out = list.data + (low_start >> 6);
+    int fill = low_start & 63;
+    uint64_t accum = *out;
+
+    for (int i = 0; i < n; i++) {
+      uint64_t low = (list.pending[i] - first) & low_mask;
+      accum |= low << fill;
+      fill += low_bits;
+      if (fill >= 64) {
+        *out++ = accum;
+        fill -= 64;
+        accum = fill ? low >> (low_bits - fill) : 0;
+      }
+    }
+    *out = accum;
+  }
+
+  for (int i = 0; i < n; i++) {
+    uint64_t high = high_start + ((list.pending[i] - first) >> low_bits) + i;
+    list.data[high >> 6] |= uint64_t(1) << (high & 63);
+  }
+
+  list.part_first[list.part_count] = first;
+  list.part_info[list.part_count]  = (low_start << 8) | low_bits;
+  list.part_count++;
+
+  list.count += n;
+  list.data_bits += part_bits;
+  list.part_info[list.part_count] = list.data_bits << 8;
+  list.pending_len = 0;
+}
+
+//------------------------------------------------------------------------------
+
+void EdgeIndex::begin(int _channels) {
+  channels = _channels;
+  lists = new EdgeList[channels];
+}
+
+//------------------------------------------------------------------------------
+// The directory step is (roughly) the average span of a partition, so most
+// directory cells hold one or two partition starts.
+
+void EdgeIndex::finish() {
+  for (int c = 0; c < channels; c++) {
+    EdgeList& list = lists[c];
+    flush_partition(list);
+    if (!list.part_count) continue;
+
+    uint64_t last = list.part_first[list.part_count - 1];
+    uint64_t step = last / list.part_count;
+    list.dir_shift = step ? log2_floor64(step) + 1 : 0;
+    list.dir_len   = (last >> list.dir_shift) + 2;
+    list.dir       = new uint32_t[list.dir_len];
+
+    size_t part = 0;
+    for (size_t i = 0; i < list.dir_len; i++) {
+      uint64_t start = uint64_t(i) << list.dir_shift;
+      while (part < list.part_count && list.part_first[part] < start) part++;
+      list.dir[i] = uint32_t(part);
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+
+void EdgeIndex::init(TraceBuffer& trace) {
+  assert(trace.channels <= 64);
+  begin((int)trace.channels);
+
+  size_t samples = trace.samples;
+  if (!samples) {
+    finish();
+    return;
+  }
+
+  // Last bit of the previous word per channel. Starting from sample 0 itself
+  // means sample 0 never counts as an edge.
+  uint64_t prev[64];
+  for (int c = 0; c < channels; c++) prev[c] = trace.get_bit(c, 0);
+
+  // A chunk at a time, so the chunk's samples stay in cache while each
+  // channel gets pulled out of them.
+  const size_t chunk_words = 64;
+  uint64_t bits[chunk_words];
+
+  for (size_t base = 0; base < samples; base += chunk_words * 64) {
+    size_t count = samples - base;
+    if (count > chunk_words * 64) count = chunk_words * 64;
+    size_t words = (count + 63) >> 6;
+
+    for (int c = 0; c < channels; c++) {
+      trace.extract(c, base, count, bits);
+
+      for (size_t i = 0; i < words; i++) {
+        uint64_t edges = bits[i] ^ ((bits[i] << 1) | prev[c]);
+        prev[c] = bits[i] >> 63;
+
+        // Bits past the end of the trace are zero, so they can only look like
+        // an edge after a one.
+        size_t valid = count - i * 64;
+        if (valid < 64) edges &= (uint64_t(1) << valid) - 1;
+
+        uint64_t pos = base + i * 64;
+        while (edges) {
+          push(c, pos + ctz64(edges));
+          edges &= edges - 1;
+        }
+      }
+    }
+  }
+
+  finish();
+}
+
+//------------------------------------------------------------------------------
+
+void EdgeIndex::exit() {
+  for (int c = 0; c < channels; c++) {
+    delete [] lists[c].data;
+    delete [] lists[c].part_first;
+    delete [] lists[c].part_info;
+    delete [] lists[c].dir;
+  }
+  delete [] lists;
+  lists = nullptr;
+  channels = 0;
+}
+
+//------------------------------------------------------------------------------
+
+uint64_t EdgeIndex::rank(int channel, uint64_t pos) const {
+  const EdgeList& list = lists[channel];
+  if (!list.count || pos <= list.part_first[0]) return 0;
+
+  // Count the partitions starting before pos. The directory narrows it down
+  // to [lo, hi], then binary search.
+  uint64_t cell = pos >> list.dir_shift;
+  size_t lo = cell < list.dir_len ? list.dir[cell] : list.part_count;
+  size_t hi = cell + 1 < list.dir_len ? list.dir[cell + 1] : list.part_count;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (list.part_first[mid] < pos) lo = mid + 1; else hi = mid;
+  }
+
+  size_t part = lo - 1;
+  uint64_t n = part + 1 < list.part_count ? part_size : list.count - part * part_size;
+  int low_bits = list.part_info[part] & 0xFF;
+  uint64_t low_start  = list.part_info[part] >> 8;
+  uint64_t high_start = low_start + n * low_bits;
+  uint64_t zeros = (list.part_info[part + 1] >> 8) - high_start - n;
+
+  uint64_t rel  = pos - list.part_first[part];
+  uint64_t high = rel >> low_bits;
+  if (high >= zeros) return part * part_size + n;
+
+  // Skip everything in lower buckets, then compare low bits in this one.
+  uint64_t k = 0;
+  uint64_t cursor = 0;
+  if (high) {
+    uint64_t zero = select_bit(list.data, high_start, high - 1, ~uint64_t(0));
+    k = zero - (high - 1);
+    cursor = zero + 1;
+  }
+
+  uint64_t rel_low = rel & ((uint64_t(1) << low_bits) - 1);
+  while (k < n && read_bit(list.data, high_start + cursor)) {
+    if (read_bits(list.data, low_start + k * low_bits, low_bits) >= rel_low) break;
+    k++;
+    cursor++;
+  }
+
+  return part * part_size + k;
+}
+
+//------------------------------------------------------------------------------
+
+uint64_t EdgeIndex::select(int channel, uint64_t k) const {
+  const EdgeList& list = lists[channel];
+  assert(k < list.count);
+
+  size_t part = k >> part_shift;
+  uint64_t i  = k & (part_size - 1);
+  if (!i) return list.part_first[part];
+
+  uint64_t n = part + 1 < list.part_count ? part_size : list.count - part * part_size;
+  int low_bits = list.part_info[part] & 0xFF;
+  uint64_t low_start  = list.part_info[part] >> 8;
+  uint64_t high_start = low_start + n * low_bits;
+
+  uint64_t high = select_bit(list.data, high_start, i, 0) - i;
+  uint64_t low  = read_bits(list.data, low_start + i * low_bits, low_bits);
+
+  return list.part_first[part] + ((high << low_bits) | low);
+}
+
+//------------------------------------------------------------------------------
+
+uint64_t EdgeIndex::next_edge(int channel, uint64_t pos) const {
+  uint64_t r = rank(channel, pos + 1);
+  return r < lists[channel].count ? select(channel, r) : none;
+}
+
+uint64_t EdgeIndex::prev_edge(int channel, uint64_t pos) const {
+  uint64_t r = rank(channel, pos);
+  return r ? select(channel, r - 1) : none;
+}
+
+uint64_t EdgeIndex::edges_in_range(int channel, uint64_t a, uint64_t b) const {
+  if (a >= b) return 0;
+  return rank(channel, b) - rank(channel, a);
+}
+
+//------------------------------------------------------------------------------
+
+size_t EdgeIndex::size_bytes(int channel) const {
+  const EdgeList& list = lists[channel];
+  return ((list.data_bits + 63) >> 6) * sizeof(uint64_t) +
+         list.part_count * sizeof(uint64_t) * 2 +
+         list.dir_len * sizeof(uint32_t);
+}
+
+size_t EdgeIndex::size_bytes() const {
+  size_t total = 0;
+  for (int c = 0; c < channels; c++) total += size_bytes(c);
+  return total;
+}
+
+//------------------------------------------------------------------------------
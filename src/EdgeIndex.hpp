@@ -0,0 +1,94 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "Bits.hpp"
+
+//------------------------------------------------------------------------------
+// Compressed list of transition positions for every channel of a trace, for
+// "jump to next edge" and friends without scanning raw bits.
+//
+// A sample is an edge if it differs from the sample before it (same as the
+// edge pyramid, so sample 0 never is). Each channel's edge positions get cut
+// into partitions of 256 and every partition is Elias-Fano coded relative to
+// its first edge - the low L bits of each offset are stored verbatim and the
+// high bits go in a unary bitvector, for about 2 + L bits per edge where L is
+// log2 of the average gap. A partition only needs its own edges to pick L, so
+// the whole thing builds in one streaming pass.
+//
+// finish() adds a directory with one entry per (average partition span)
+// samples, so a query usually goes straight to the right partition and does
+// a constant amount of popcount/bit twiddling inside it. Worst case (very
+// uneven edge density) it's a binary search, O(log edges).
+//
+// Rough cost per edge, including the partition table and directory - about
+// 3.5 bits when edges are a couple of samples apart, 1.6 bytes at a thousand
+// samples apart, 3.3 bytes at ten million apart.
+
+struct EdgeList {
+  uint64_t count = 0;              // Not counting pending edges
+
+  uint64_t* data = nullptr;        // Packed partitions
+  uint64_t  data_bits = 0;
+  size_t    data_cap = 0;          // In words
+
+  uint64_t* part_first = nullptr;  // First edge of each partition
+  uint64_t* part_info = nullptr;   // (bit offset in data << 8) | low bits per edge, plus one past the end
+  size_t    part_count = 0;
+  size_t    part_cap = 0;
+
+  uint32_t* dir = nullptr;         // dir[i] = partitions starting before (i << dir_shift)
+  size_t    dir_len = 0;
+  int       dir_shift = 0;
+
+  uint64_t  pending[256];          // Edges waiting for their partition to fill
+  int       pending_len = 0;
+};
+
+struct EdgeIndex {
+
+  static constexpr int      part_shift = 8;
+  static constexpr uint64_t none = UINT64_MAX;
+
+  // Builds the index for every channel in one pass over the blob.
+  void init(TraceBuffer& trace);
+  void exit();
+
+  // Streaming interface init() is built on - begin(), then edges in
+  // increasing order per channel, then finish() before any queries.
+  void begin(int channels);
+  void finish();
+
+  void push(int channel, uint64_t pos) {
+    EdgeList& list = lists[channel];
+    assert(list.pending_len == 0 || pos > list.pending[list.pending_len - 1]);
+    list.pending[list.pending_len++] = pos;
+    if (list.pending_len == (1 << part_shift)) flush_partition(list);
+  }
+
+  static void flush_partition(EdgeList& list);
+
+  // Number of edges in [0, pos).
+  uint64_t rank(int channel, uint64_t pos) const;
+
+  // Position of edge k, k < edge_count(channel).
+  uint64_t select(int channel, uint64_t k) const;
+
+  // First edge after pos, or none.
+  uint64_t next_edge(int channel, uint64_t pos) const;
+
+  // Last edge before pos, or none.
+  uint64_t prev_edge(int channel, uint64_t pos) const;
+
+  // Number of edges in [a, b).
+  uint64_t edges_in_range(int channel, uint64_t a, uint64_t b) const;
+
+  uint64_t edge_count(int channel) const { return lists[channel].count; }
+
+  size_t size_bytes(int channel) const;
+  size_t size_bytes() const;
+
+  int channels = 0;
+  EdgeList* lists = nullptr;
+};
+
+//------------------------------------------------------------------------------
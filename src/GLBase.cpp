@@ -2,6 +2,7 @@
 #include "third_party/glad/glad.h"
 #include <SDL2/SDL.h>
 #include <assert.h>
+#include <stdio.h>
 #include <map>
 
 static bool is_nvidia = false;
@@ -301,11 +302,27 @@ int create_ssbo(size_t size_bytes) {
   return (int)ssbo;
 }
 
+// No CPU access at all, so the driver is free to put it in device memory.
+// Fill it with glCopyBufferSubData() from a staging buffer - see TraceUploader.
+
+int create_device_ssbo(size_t size_bytes) {
+  GLuint ssbo;
+  glGenBuffers(1, &ssbo);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
+  glBufferStorage(GL_SHADER_STORAGE_BUFFER, size_bytes, nullptr, 0);
+  return (int)ssbo;
+}
+
 void update_ssbo(int ssbo, const void* data, size_t size_bytes) {
   glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
   glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, size_bytes, data);
 }
 
+void update_ssbo(int ssbo, size_t offset, const void* data, size_t size_bytes) {
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
+  glBufferSubData(GL_SHADER_STORAGE_BUFFER, offset, size_bytes, data);
+}
+
 void* map_ssbo(int ssbo, size_t size_bytes) {
   glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
   void* result = glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, size_bytes,
@@ -354,6 +371,21 @@ void update_texture_u32(int tex, int width, int height, const void* pix) {
 
 //-----------------------------------------------------------------------------
 
+int create_texture_f32(int width, int height) {
+  int tex = 0;
+  glGenTextures(1, (GLuint*)&tex);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, tex);
+  glTexStorage2D(GL_TEXTURE_2D, 1, GL_R32F, width, height);
+
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+  return tex;
+}
+
+//-----------------------------------------------------------------------------
+
 int create_texture_u8(int width, int height, const void* data, bool filter) {
   int tex = 0;
   glGenTextures(1, (GLuint*)&tex);
@@ -456,6 +488,27 @@ void bind_table(int prog, const char* name, int index, int tex) {
   glUniform1i(glGetUniformLocation(prog, name), index);
 }
 
+//-----------------------------------------------------------------------------
+// Framebuffer with one color attachment, for rendering into a texture.
+
+int create_fbo(int tex) {
+  int fbo = 0;
+  glGenFramebuffers(1, (GLuint*)&fbo);
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tex, 0);
+  assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  return fbo;
+}
+
+void bind_fbo(int fbo) {
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+}
+
+void unbind_fbo() {
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
 //-----------------------------------------------------------------------------
 
 void dump_shader_info(int program) {
@@ -619,19 +672,20 @@ void bind_shader(int shader) {
 //-----------------------------------------------------------------------------
 
 int create_compute_shader(const char* name, const char* src) {
+  return create_compute_shader(name, src, is_nvidia ? 32 : 64, nullptr);
+}
+
+// local_size picks the work group size, defines (if any) go in right before
+// the source - the mipper autotuner builds its variants this way.
+
+int create_compute_shader(const char* name, const char* src, int local_size, const char* defines) {
   static bool verbose = false;
   assert(!glGetError());
 
   log("Compiling %s", name);
 
-  const char* layout = nullptr;
-
-  if (is_nvidia) {
-    layout = "layout(local_size_x = 32, local_size_y = 1, local_size_z = 1) in;\n";
-  }
-  else {
-    layout = "layout(local_size_x = 64, local_size_y = 1, local_size_z = 1) in;\n";
-  }
+  char layout[128];
+  snprintf(layout, sizeof(layout), "layout(local_size_x = %d, local_size_y = 1, local_size_z = 1) in;\n", local_size);
 
   auto comp_srcs = {
     "#version 460 core\n",
@@ -641,7 +695,8 @@ int create_compute_shader(const char* name, const char* src) {
     "precision highp int;\n",
     "precision highp usampler2D;\n",
     "#define _COMPUTE_\n",
-    layout,
+    (const char*)layout,
+    defines ? defines : "",
     src
   };
 
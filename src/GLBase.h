@@ -13,6 +13,7 @@ int   create_shader(const char* name, const char* src);
 void  bind_shader(int shader);
 
 int   create_compute_shader(const char* name, const char* src);
+int   create_compute_shader(const char* name, const char* src, int local_size, const char* defines);
 void  bind_compute_shader(int shader);
 
 int   create_vao();
@@ -30,7 +31,9 @@ void  update_ubo(int ubo, int size_bytes, const void* data);
 void  bind_ubo  (int prog, const char* name, int index, int ubo);
 
 int   create_ssbo (size_t size_bytes);
+int   create_device_ssbo(size_t size_bytes); // Only writable with copies and shaders
 void  update_ssbo (int ssbo, const void* data, size_t size_bytes);
+void  update_ssbo (int ssbo, size_t offset, const void* data, size_t size_bytes);
 void* map_ssbo    (int ssbo, size_t size_bytes);
 void  unmap_ssbo  (int ssbo);
 void  bind_ssbo   (int ssbo, int binding, size_t offset, size_t size);
@@ -39,6 +42,8 @@ void  unbind_ssbo ();
 int   create_texture_u32(int width, int height, const void* data, bool filter);
 void  update_texture_u32(int tex, int width, int height, const void* pix);
 
+int   create_texture_f32(int width, int height); // R32F, also bindable as an image
+
 int   create_texture_u8(int width, int height, const void* data, bool filter);
 void  update_texture_u8(int tex, int width, int height, const void* pix);
 void  update_texture_u8(int tex, int dx, int dy, int dw, int dh, const void* pix);
@@ -53,3 +58,7 @@ void  update_table_u32(int tex, int width, int height, const void* pix);
 
 void  bind_texture(int prog, const char* name, int index, int tex);
 void  bind_table  (int prog, const char* name, int index, int tex);
+
+int   create_fbo(int tex);
+void  bind_fbo(int fbo);
+void  unbind_fbo();
@@ -0,0 +1,224 @@
+#include "GpuProfiler.hpp"
+#include "third_party/glad/glad.h"
+#include "third_party/imgui/imgui.h"
+#include "log.hpp"
+
+#include <string.h>
+
+//------------------------------------------------------------------------------
+
+void GpuProfiler::init() {
+  for (int i = 0; i < frame_lag; i++) {
+    glGenQueries(max_scopes * 2, queries[i]);
+    frames[i] = {};
+  }
+  frame_index = 0;
+  stack_top = 0;
+  result_count = 0;
+  result_frame = -1;
+  collected = 0;
+  dropped = 0;
+  overflows = 0;
+}
+
+void GpuProfiler::exit() {
+  stop_csv();
+  for (int i = 0; i < frame_lag; i++) {
+    glDeleteQueries(max_scopes * 2, queries[i]);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Frames finish in order, so we collect oldest first and stop at the first one
+// that isn't done yet. The slot we're about to reuse gets dropped if it's
+// still waiting.
+
+void GpuProfiler::begin_frame() {
+  for (int i = 0; i < frame_lag; i++) {
+    Frame& f = frames[(frame_index + i) % frame_lag];
+    if (f.index < 0) continue;
+    if (!collect(f)) break;
+  }
+
+  Frame& f = frames[frame_index % frame_lag];
+  if (f.index >= 0) {
+    dropped++;
+    f.index = -1;
+  }
+
+  f.index = frame_index;
+  f.scope_count = 0;
+  stack_top = 0;
+  too_deep = 0;
+  push("frame");
+}
+
+void GpuProfiler::end_frame() {
+  too_deep = 0;
+  while (stack_top > 0) pop();
+  frame_index++;
+}
+
+//------------------------------------------------------------------------------
+
+void GpuProfiler::push(const char* name) {
+  Frame& f = frames[frame_index % frame_lag];
+
+  if (stack_top == max_depth) {
+    overflows++;
+    too_deep++;
+    return;
+  }
+
+  if (f.scope_count == max_scopes) {
+    overflows++;
+    stack[stack_top++] = -1;
+    return;
+  }
+
+  int index = f.scope_count++;
+  Scope& s = f.scopes[index];
+  s.name        = name;
+  s.parent      = stack_top ? stack[stack_top - 1] : -1;
+  s.depth       = stack_top;
+  s.query_begin = queries[frame_index % frame_lag][index * 2 + 0];
+  s.query_end   = queries[frame_index % frame_lag][index * 2 + 1];
+  glQueryCounter(s.query_begin, GL_TIMESTAMP);
+
+  stack[stack_top++] = index;
+}
+
+void GpuProfiler::pop() {
+  if (too_deep) {
+    too_deep--;
+    return;
+  }
+  if (stack_top == 0) return;
+  int index = stack[--stack_top];
+  if (index < 0) return;
+
+  Frame& f = frames[frame_index % frame_lag];
+  glQueryCounter(f.scopes[index].query_end, GL_TIMESTAMP);
+}
+
+//------------------------------------------------------------------------------
+// The frame scope's end query is the last one issued, so if it's available
+// they all are.
+
+bool GpuProfiler::collect(Frame& frame) {
+  GLint available = 0;
+  glGetQueryObjectiv(frame.scopes[0].query_end, GL_QUERY_RESULT_AVAILABLE, &available);
+  if (!available) return false;
+
+  // Scope index -> result index, so children can find their parent's line.
+  int map[max_scopes];
+  Result old[max_scopes];
+  int old_count = result_count;
+  memcpy(old, results, sizeof(Result) * old_count);
+  result_count = 0;
+
+  for (int i = 0; i < frame.scope_count; i++) {
+    Scope& s = frame.scopes[i];
+    GLuint64 time_a = 0, time_b = 0;
+    glGetQueryObjectui64v(s.query_begin, GL_QUERY_RESULT, &time_a);
+    glGetQueryObjectui64v(s.query_end,   GL_QUERY_RESULT, &time_b);
+    double ms = double(time_b - time_a) * 1.0e-6;
+
+    int parent = s.parent >= 0 ? map[s.parent] : -1;
+
+    int r = 0;
+    for (; r < result_count; r++) {
+      if (results[r].parent == parent && strcmp(results[r].name, s.name) == 0) break;
+    }
+    if (r == result_count) {
+      results[r] = { s.name, parent, s.depth, 0, 0, 0 };
+      result_count++;
+    }
+    results[r].count++;
+    results[r].ms += ms;
+    map[i] = r;
+  }
+
+  // Smooth against the same line of the last frame, if it had one.
+  auto parent_name = [](const Result* list, int r) {
+    return list[r].parent >= 0 ? list[list[r].parent].name : "";
+  };
+
+  for (int r = 0; r < result_count; r++) {
+    Result& res = results[r];
+    res.avg_ms = res.ms;
+    for (int o = 0; o < old_count; o++) {
+      if (old[o].depth == res.depth && strcmp(old[o].name, res.name) == 0 &&
+          strcmp(parent_name(old, o), parent_name(results, r)) == 0) {
+        res.avg_ms = old[o].avg_ms * 0.9 + res.ms * 0.1;
+        break;
+      }
+    }
+  }
+
+  result_frame = frame.index;
+  collected++;
+  if (csv) write_csv(frame.index);
+
+  frame.index = -1;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+
+bool GpuProfiler::start_csv(const char* path) {
+  stop_csv();
+  csv = fopen(path, "w");
+  if (!csv) {
+    log("GpuProfiler: couldn't open %s", path);
+    return false;
+  }
+  fprintf(csv, "frame,depth,scope,count,ms\n");
+  return true;
+}
+
+void GpuProfiler::stop_csv() {
+  if (csv) fclose(csv);
+  csv = nullptr;
+}
+
+// Scopes get written as their full path, "frame/mipper/merger", so the file
+// makes sense without the indentation.
+
+void GpuProfiler::write_csv(int64_t frame) {
+  for (int r = 0; r < result_count; r++) {
+    const char* names[max_depth + 1];
+    int depth = 0;
+    for (int p = r; p >= 0 && depth <= max_depth; p = results[p].parent) names[depth++] = results[p].name;
+
+    fprintf(csv, "%ld,%d,", long(frame), results[r].depth);
+    for (int d = depth - 1; d >= 0; d--) fprintf(csv, d ? "%s/" : "%s", names[d]);
+    fprintf(csv, ",%d,%f\n", results[r].count, results[r].ms);
+  }
+}
+
+//------------------------------------------------------------------------------
+
+void GpuProfiler::draw_gui() {
+  ImGui::Begin("GPU Profiler");
+
+  ImGui::Text("frame %ld, %ld frames behind, %ld collected, %ld dropped, %ld overflows",
+              long(result_frame), long(frame_index - result_frame), collected, dropped, overflows);
+
+  for (int r = 0; r < result_count; r++) {
+    Result& res = results[r];
+    ImGui::Text("%*s%-16s %8.3f ms  avg %8.3f ms  x%d",
+                res.depth * 2, "", res.name, res.ms, res.avg_ms, res.count);
+  }
+
+  if (csv) {
+    if (ImGui::Button("Stop CSV")) stop_csv();
+  }
+  else {
+    if (ImGui::Button("Record CSV")) start_csv("gpu_profile.csv");
+  }
+
+  ImGui::End();
+}
+
+//------------------------------------------------------------------------------
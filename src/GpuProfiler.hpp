@@ -0,0 +1,92 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+//------------------------------------------------------------------------------
+// GPU timing for the frame loop that never waits on the GPU.
+//
+// push()/pop() drop GL_TIMESTAMP queries around a pass - timestamps instead of
+// GL_TIME_ELAPSED, since elapsed-time queries can't nest. Each frame gets its
+// own set of queries out of a ring frame_lag frames deep, and begin_frame()
+// collects whichever old frames the GPU has finished with. If a frame's
+// queries still aren't done by the time we come back around to its slot we
+// drop it instead of stalling.
+//
+// Scopes with the same name under the same parent get added together, so
+// calling something once per channel shows up as one line.
+
+struct GpuProfiler {
+
+  static constexpr int frame_lag  = 4;   // Frames of queries in flight
+  static constexpr int max_scopes = 64;  // Per frame, including the frame itself
+  static constexpr int max_depth  = 8;
+
+  void init();
+  void exit();
+
+  // Everything between these is the "frame" scope.
+  void begin_frame();
+  void end_frame();
+
+  // name has to stick around - string literals only.
+  void push(const char* name);
+  void pop();
+
+  // ImGui window with the last collected frame.
+  void draw_gui();
+
+  // Appends every collected frame to a CSV file - frame, depth, path, count,
+  // ms - until stop_csv().
+  bool start_csv(const char* path);
+  void stop_csv();
+
+  //----------------------------------------
+
+  struct Scope {
+    const char* name;
+    int      parent;          // Index in the frame, -1 for the frame scope
+    int      depth;
+    uint32_t query_begin;
+    uint32_t query_end;
+  };
+
+  struct Frame {
+    int64_t index = -1;       // -1 if the slot is free
+    int     scope_count = 0;
+    Scope   scopes[max_scopes];
+  };
+
+  // Collected time for one line of the panel.
+  struct Result {
+    const char* name;
+    int    parent;            // Index in results, -1 for the frame
+    int    depth;
+    int    count;             // Scopes that got added together
+    double ms;
+    double avg_ms;            // Smoothed over frames
+  };
+
+  bool collect(Frame& frame);
+  void write_csv(int64_t frame_index);
+
+  Frame    frames[frame_lag];
+  uint32_t queries[frame_lag][max_scopes * 2];
+  int64_t  frame_index = 0;
+
+  int      stack[max_depth];  // Open scopes, -1 for ones that didn't fit
+  int      stack_top = 0;
+  int      too_deep = 0;     // Pushes past max_depth that haven't popped yet
+
+  Result   results[max_scopes];
+  int      result_count = 0;
+  int64_t  result_frame = -1; // Frame the results came from
+
+  size_t   collected = 0;
+  size_t   dropped = 0;       // Frames whose queries weren't done in time
+  size_t   overflows = 0;     // Scopes that didn't fit in a frame
+
+  FILE*    csv = nullptr;
+};
+
+//------------------------------------------------------------------------------
@@ -0,0 +1,344 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include "BitOps.hpp"
+#include "log.hpp"
+
+// Only Bits.hpp includes this, after TraceBuffer - include that instead.
+
+//------------------------------------------------------------------------------
+// Density pyramid with the fanout and depth picked at compile time. MipBuffer
+// is the instance the app uses, see mip_fanout and mip_levels in Bits.hpp.
+// bitsbench builds the others to compare them.
+//
+// Level 1 counts the ones in each Fanout-sample bucket. Every level above it
+// is the rounded-up average of Fanout entries below it, so all levels stay in
+// [0, Fanout] and fit in a byte. That caps Fanout at 128.
+//
+// A smaller fanout means finer steps between levels. Fewer entries get walked
+// at the edges of each pixel, but the pyramid needs more levels and more
+// memory to cover the same trace. The top level is walked linearly, so
+// Fanout^Levels samples per top-level entry is how far out you can zoom
+// before render() slows down.
+
+template<int Fanout, int Levels>
+struct MipPyramid {
+  static_assert(Fanout >= 2 && Fanout <= 128 && (Fanout & (Fanout - 1)) == 0,
+                "Fanout has to be a power of two that fits in a byte");
+  static_assert(Levels >= 1, "Need at least one level");
+
+  static constexpr int fanout = Fanout;
+  static constexpr int levels = Levels;
+  static constexpr int fanout_shift = __builtin_ctz(Fanout);
+  static_assert(fanout_shift * Levels <= 48, "Top level too coarse for 32.7 fixed point");
+
+  size_t samples = 0;
+
+  // Level N is mip[N]. Level 0 is the trace itself, so mip[0] stays null.
+  uint8_t* mip[Levels + 1] = {};
+  size_t   mip_len[Levels + 1] = {};
+
+  // Entries read per level by the last render(), [0] is raw samples.
+  size_t   mip_hit[Levels + 1] = {};
+};
+
+//------------------------------------------------------------------------------
+
+template<int F, int L>
+void alloc_levels(MipPyramid<F, L>& mips, size_t samples) {
+  mips.samples = samples;
+  size_t len = samples;
+  for (int level = 1; level <= L; level++) {
+    len = (len + F - 1) >> mips.fanout_shift;
+    mips.mip_len[level] = len;
+    mips.mip[level] = new uint8_t[len]();
+  }
+}
+
+template<int F, int L>
+void free_levels(MipPyramid<F, L>& mips) {
+  for (int level = 1; level <= L; level++) {
+    delete [] mips.mip[level];
+    mips.mip[level] = nullptr;
+    mips.mip_len[level] = 0;
+  }
+}
+
+template<int F, int L>
+void clear_levels(MipPyramid<F, L>& mips) {
+  for (int level = 1; level <= L; level++) memset(mips.mip[level], 0, mips.mip_len[level]);
+}
+
+template<int F, int L>
+size_t levels_size_bytes(const MipPyramid<F, L>& mips) {
+  size_t total = 0;
+  for (int level = 1; level <= L; level++) total += mips.mip_len[level];
+  return total;
+}
+
+//------------------------------------------------------------------------------
+// Level 1 - scalar for anything, and a bit-sliced popcount version for
+// planar and byte-interleaved traces. Same output either way.
+
+template<int F, int L>
+void update_level1_scalar(TraceBuffer& trace, int channel, size_t mip1_min, size_t mip1_max, MipPyramid<F, L>& mips) {
+  for (size_t i = mip1_min; i < mip1_max; i++) {
+    int total = 0;
+    for (size_t j = 0; j < F; j++) {
+      auto index = i * F + j;
+      if (index >= trace.samples) break;
+      total += trace.get_bit(channel, index);
+    }
+    mips.mip[1][i] = uint8_t(total);
+  }
+}
+
+template<int F, int L>
+TARGET_POPCNT
+void update_level1_popcount(TraceBuffer& trace, int channel, size_t mip1_min, size_t mip1_max, MipPyramid<F, L>& mips) {
+  assert(trace.stride == 8 || trace.planar());
+
+  // Buckets of 64+ samples are whole gathers, smaller ones are slices of one.
+  // Either way only whole 64-sample gathers go through the fast path.
+  constexpr size_t per_gather = F >= 64 ? 1 : 64 / F;
+  size_t full_max = (trace.samples / 64) * 64 / F;
+  full_max -= full_max % per_gather;
+  if (full_max > mip1_max) full_max = mip1_max;
+
+  size_t i = mip1_min;
+
+  if constexpr (F >= 64) {
+    for (; i < full_max; i++) {
+      int total = 0;
+      for (size_t g = 0; g < F / 64; g++) {
+        total += popcount64(channel_word(trace, channel, (i * F + g * 64) / 64));
+      }
+      mips.mip[1][i] = uint8_t(total);
+    }
+  }
+  else {
+    constexpr uint64_t mask = (uint64_t(1) << F) - 1;
+    if (i % per_gather) {
+      size_t head_max = i + per_gather - i % per_gather;
+      if (head_max > mip1_max) head_max = mip1_max;
+      update_level1_scalar(trace, channel, i, head_max, mips);
+      i = head_max;
+    }
+    for (; i + per_gather <= full_max; i += per_gather) {
+      uint64_t bits = channel_word(trace, channel, (i * F) / 64);
+      for (size_t j = 0; j < per_gather; j++) {
+        mips.mip[1][i + j] = uint8_t(popcount64((bits >> (j * F)) & mask));
+      }
+    }
+  }
+
+  if (i < mip1_max) {
+    update_level1_scalar(trace, channel, i, mip1_max, mips);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Each entry is the average of F entries in the level below, rounded up.
+
+template<int F, int L>
+void merge_level(MipPyramid<F, L>& mips, int level, size_t dst_min, size_t dst_max) {
+  constexpr int shift = MipPyramid<F, L>::fanout_shift;
+
+  const uint8_t* src = mips.mip[level - 1];
+  size_t src_len = mips.mip_len[level - 1];
+  uint8_t* dst = mips.mip[level];
+  if (dst_max > mips.mip_len[level]) dst_max = mips.mip_len[level];
+
+  for (size_t i = dst_min; i < dst_max; i++) {
+    int total = 0;
+    for (size_t j = 0; j < F; j++) {
+      auto index = i * F + j;
+      if (index >= src_len) break;
+      total += src[index];
+    }
+    dst[i] = uint8_t((total + F - 1) >> shift);
+  }
+}
+
+// Entries [level_min, level_max) of `level` changed, rebuild everything above
+// them.
+
+template<int F, int L>
+void merge_levels(MipPyramid<F, L>& mips, int level, size_t level_min, size_t level_max) {
+  constexpr int shift = MipPyramid<F, L>::fanout_shift;
+
+  for (level++; level <= L; level++) {
+    level_min = (level_min +     0) >> shift;
+    level_max = (level_max + F - 1) >> shift;
+    merge_level(mips, level, level_min, level_max);
+  }
+}
+
+//------------------------------------------------------------------------------
+// The mip walk over one span. Fractional samples at either end, then whole
+// entries of each level until the endpoints line up with the next one, then
+// level `top` the rest of the way. Endpoints and totals are in 1/128ths of a
+// sample. read(level, index) has to return what entry `index` of a level >= 1
+// is worth in those units - for a plain pyramid that's
+// value * F^(level - 1) * 128.
+
+template<int F, int L, typename Read>
+double walk_span(TraceBuffer& trace, MipPyramid<F, L>& mips, int channel,
+                 int64_t sample_imin, int64_t sample_imax, int top, Read read)
+{
+  constexpr int shift = MipPyramid<F, L>::fanout_shift;
+
+  // Both endpoints are inside the same sample.
+  if ((sample_imin >> 7) == (sample_imax >> 7)) {
+    mips.mip_hit[0]++;
+    return trace.get_bit(channel, sample_imin >> 7);
+  }
+
+  uint64_t sample_ilen = sample_imax - sample_imin;
+  uint64_t total = 0;
+
+  if (sample_imin & 0x7F) {
+    total += (128 - (sample_imin & 0x7F)) * trace.get_bit(channel, sample_imin >> 7);
+    sample_imin = (sample_imin + 0x7F) & ~0x7F;
+    mips.mip_hit[0]++;
+  }
+
+  if (sample_imax & 0x7F) {
+    total += (sample_imax & 0x7F) * trace.get_bit(channel, sample_imax >> 7);
+    sample_imax = sample_imax & ~0x7F;
+    mips.mip_hit[0]++;
+  }
+
+  uint64_t imin = sample_imin >> 7;
+  uint64_t imax = sample_imax >> 7;
+
+  // Endpoints are whole samples. Walk up until they're multiples of the
+  // top level's span.
+  for (int level = 0; level < top && imin < imax; level++) {
+    uint64_t size = uint64_t(1) << (level * shift);
+    uint64_t mask = (uint64_t(1) << ((level + 1) * shift)) - 1;
+
+    while ((imin & mask) && (imin < imax)) {
+      total += level ? read(level, imin >> (level * shift)) : uint64_t(trace.get_bit(channel, imin)) * 128;
+      mips.mip_hit[level]++;
+      imin += size;
+    }
+
+    while ((imax & mask) && (imin < imax)) {
+      total += level ? read(level, (imax - 1) >> (level * shift)) : uint64_t(trace.get_bit(channel, imax - 1)) * 128;
+      mips.mip_hit[level]++;
+      imax -= size;
+    }
+  }
+
+  while (imin < imax) {
+    total += read(top, imin >> (top * shift));
+    mips.mip_hit[top]++;
+    imin += uint64_t(1) << (top * shift);
+  }
+
+  return double(total) / double(sample_ilen);
+}
+
+//------------------------------------------------------------------------------
+// walk_span() for every pixel of a view. The span endpoints are 32.7 fixed
+// point in an int64, so the integer part is good for 2^56 samples.
+
+template<int F, int L, typename Read>
+void render_walk(TraceBuffer& trace, MipPyramid<F, L>& mips, int channel,
+                 double world_min, double world_max,
+                 double trace_min, double trace_max,
+                 double* out, int out_len, int top, Read read)
+{
+  assert(top >= 1 && top <= L);
+
+  // We compute a "granularity" based on the width of each pixel in trace space
+  // so that we can reduce the precision of the span endpoints and skip lower
+  // mips when they wouldn't contribute to the final value much. 7 here means
+  // 1/128-subpixel precision.
+  double pix0_l = remap(0.0, world_min, world_max, trace_min, trace_max);
+  double pix0_r = remap(1.0, world_min, world_max, trace_min, trace_max);
+  double granularity = exp2(ceil(log2(pix0_r - pix0_l)) - 7);
+  double igranularity = 1.0 / granularity;
+
+  for (int level = 0; level <= L; level++) mips.mip_hit[level] = 0;
+
+  for (int x = 0; x < out_len; x++) {
+    out[x] = 0;
+
+    double pixel_center = x + 0.5;
+
+    double sample_fmin = remap(pixel_center - 0.5, world_min, world_max, trace_min, trace_max);
+    double sample_fmax = remap(pixel_center + 0.5, world_min, world_max, trace_min, trace_max);
+
+    // If the span is really large, ditch some precision from the end bits so
+    // we don't bother with head/tail samples that don't contribute to the sum
+    sample_fmin = floor(sample_fmin * igranularity) * granularity;
+    sample_fmax = floor(sample_fmax * igranularity) * granularity;
+
+    if (sample_fmin < 0)             sample_fmin = 0;
+    if (sample_fmax > trace.samples) sample_fmax = trace.samples;
+
+    if (sample_fmax < 0)              { out[x] = 0; continue; }
+    if (sample_fmin >= trace.samples) { out[x] = 0; continue; }
+
+    int64_t sample_imin = (int64_t)floor(sample_fmin * 128.0);
+    int64_t sample_imax = (int64_t)floor(sample_fmax * 128.0);
+
+    out[x] = walk_span(trace, mips, channel, sample_imin, sample_imax, top, read);
+  }
+}
+
+//------------------------------------------------------------------------------
+// A bare pyramid, for bitsbench. MipBuffer has its own versions of these that
+// also look after the exact and edge pyramids and the GPU copy.
+
+template<int F, int L>
+void alloc_mips(MipPyramid<F, L>& mips, size_t samples) {
+  alloc_levels(mips, samples);
+}
+
+template<int F, int L>
+void free_mips(MipPyramid<F, L>& mips) {
+  free_levels(mips);
+}
+
+template<int F, int L>
+size_t mips_size_bytes(MipPyramid<F, L>& mips) {
+  return levels_size_bytes(mips);
+}
+
+template<int F, int L>
+void update_mips(TraceBuffer& trace, int channel, size_t sample_min, size_t sample_max, MipPyramid<F, L>& mips) {
+  constexpr int shift = MipPyramid<F, L>::fanout_shift;
+
+  size_t level_min = (sample_min +     0) >> shift;
+  size_t level_max = (sample_max + F - 1) >> shift;
+  if (level_max > mips.mip_len[1]) level_max = mips.mip_len[1];
+
+  if ((trace.stride == 8 || trace.planar()) && cpu_has_popcnt()) {
+    update_level1_popcount(trace, channel, level_min, level_max, mips);
+  }
+  else {
+    update_level1_scalar(trace, channel, level_min, level_max, mips);
+  }
+
+  merge_levels(mips, 1, level_min, level_max);
+}
+
+template<int F, int L>
+void render(TraceBuffer& trace, MipPyramid<F, L>& mips, int channel,
+            double world_min, double world_max,
+            double trace_min, double trace_max,
+            double* out, int out_len)
+{
+  constexpr int shift = MipPyramid<F, L>::fanout_shift;
+  auto read = [&](int level, size_t index) -> uint64_t {
+    return uint64_t(mips.mip[level][index]) << ((level - 1) * shift + 7);
+  };
+  render_walk(trace, mips, channel, world_min, world_max, trace_min, trace_max, out, out_len, L, read);
+}
+
+//------------------------------------------------------------------------------
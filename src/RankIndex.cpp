@@ -0,0 +1,180 @@
+#include "RankIndex.hpp"
+
+#include "BitOps.hpp"
+#include "log.hpp"
+
+static constexpr int super_shift = 16;
+
+//------------------------------------------------------------------------------
+
+void RankIndex::init(TraceBuffer& trace, int channel, int _block_shift) {
+  assert(_block_shift >= 6 && _block_shift <= super_shift);
+
+  samples = trace.samples;
+  block_shift = _block_shift;
+  has_popcnt = cpu_has_popcnt();
+
+  bits_len   = (samples + 63) >> 6;
+  supers_len = (samples >> super_shift) + 1;
+  blocks_len = (samples >> block_shift) + 1;
+
+  bits   = new uint64_t[bits_len]();
+  supers = new uint64_t[supers_len]();
+  blocks = new uint16_t[blocks_len]();
+
+  //----------------------------------------
+  // Pack the channel's bits
+
+  trace.extract(channel, 0, samples, bits);
+
+  //----------------------------------------
+  // Running totals. A block or superblock that starts exactly at the end of
+  // the trace still gets an entry so that rank(samples) works.
+
+  uint64_t total = 0;
+  size_t words_per_block = size_t(1) << (block_shift - 6);
+  size_t blocks_per_super = size_t(1) << (super_shift - block_shift);
+
+  for (size_t block = 0; block < blocks_len; block++) {
+    if ((block & (blocks_per_super - 1)) == 0) {
+      supers[block / blocks_per_super] = total;
+    }
+    blocks[block] = uint16_t(total - supers[block / blocks_per_super]);
+
+    for (size_t w = 0; w < words_per_block; w++) {
+      size_t word = block * words_per_block + w;
+      if (word >= bits_len) break;
+      total += popcount64(bits[word]);
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+
+void RankIndex::exit() {
+  delete [] bits;
+  delete [] supers;
+  delete [] blocks;
+  bits = nullptr;
+  supers = nullptr;
+  blocks = nullptr;
+}
+
+//------------------------------------------------------------------------------
+
+// rank() and count() are the whole inner loop of render(RankIndex&), so like
+// update_mip1_popcount() they get a popcnt build that's only called once
+// init() has checked the CPU.
+
+static inline uint64_t rank_words(const RankIndex& index, size_t i) {
+  assert(i <= index.samples);
+
+  uint64_t result = index.supers[i >> super_shift] + index.blocks[i >> index.block_shift];
+
+  size_t word = i >> 6;
+  for (size_t w = (i >> index.block_shift) << (index.block_shift - 6); w < word; w++) {
+    result += popcount64(index.bits[w]);
+  }
+
+  if (i & 63) {
+    result += popcount64(index.bits[word] & ((1ull << (i & 63)) - 1));
+  }
+
+  return result;
+}
+
+// Spans inside one word don't need the tables.
+static inline uint64_t count_words(const RankIndex& index, size_t a, size_t b) {
+  if ((a >> 6) == (b >> 6)) {
+    if (a == b) return 0;
+    uint64_t mask = ((1ull << (b & 63)) - 1) & ~((1ull << (a & 63)) - 1);
+    return popcount64(index.bits[a >> 6] & mask);
+  }
+  return rank_words(index, b) - rank_words(index, a);
+}
+
+TARGET_POPCNT
+static uint64_t rank_popcnt(const RankIndex& index, size_t i) {
+  return rank_words(index, i);
+}
+
+TARGET_POPCNT
+static uint64_t count_popcnt(const RankIndex& index, size_t a, size_t b) {
+  return count_words(index, a, b);
+}
+
+uint64_t RankIndex::rank(size_t i) const {
+  return has_popcnt ? rank_popcnt(*this, i) : rank_words(*this, i);
+}
+
+uint64_t RankIndex::count(size_t a, size_t b) const {
+  return has_popcnt ? count_popcnt(*this, a, b) : count_words(*this, a, b);
+}
+
+//------------------------------------------------------------------------------
+
+size_t RankIndex::size_bytes() const {
+  return bits_len * sizeof(uint64_t) + supers_len * sizeof(uint64_t) + blocks_len * sizeof(uint16_t);
+}
+
+//------------------------------------------------------------------------------
+// The span endpoints are computed exactly the same way as in render(), only
+// the reduction is different.
+
+void render(RankIndex& index,
+            double world_min, double world_max,
+            double trace_min, double trace_max,
+            double* out, int out_len)
+{
+  double pix0_l = remap(0.0, world_min, world_max, trace_min, trace_max);
+  double pix0_r = remap(1.0, world_min, world_max, trace_min, trace_max);
+  double granularity = exp2(ceil(log2(pix0_r - pix0_l)) - 7);
+  double igranularity = 1.0 / granularity;
+
+  double samples = double(index.samples);
+
+  for (int x = 0; x < out_len; x++) {
+    double pixel_center = x + 0.5;
+
+    double sample_fmin = remap(pixel_center - 0.5, world_min, world_max, trace_min, trace_max);
+    double sample_fmax = remap(pixel_center + 0.5, world_min, world_max, trace_min, trace_max);
+
+    sample_fmin = floor(sample_fmin * igranularity) * granularity;
+    sample_fmax = floor(sample_fmax * igranularity) * granularity;
+
+    if (sample_fmin < 0)       sample_fmin = 0;
+    if (sample_fmax > samples) sample_fmax = samples;
+
+    if (sample_fmax < 0)        { out[x] = 0; continue; }
+    if (sample_fmin >= samples) { out[x] = 0; continue; }
+
+    // 32.7 fixed point, same as render()
+    int64_t sample_imin = (int64_t)floor(sample_fmin * 128.0);
+    int64_t sample_imax = (int64_t)floor(sample_fmax * 128.0);
+
+    size_t sample_min = sample_imin >> 7;
+    size_t sample_max = sample_imax >> 7;
+
+    if (sample_min == sample_max) {
+      out[x] = index.get_bit(sample_min);
+      continue;
+    }
+
+    uint64_t total = 0;
+
+    if (sample_imin & 0x7F) {
+      total += (128 - (sample_imin & 0x7F)) * index.get_bit(sample_min);
+      sample_min++;
+    }
+
+    if (sample_imax & 0x7F) {
+      total += (sample_imax & 0x7F) * index.get_bit(sample_max);
+    }
+
+    total += index.count(sample_min, sample_max) * 128;
+
+    out[x] = double(total) / double(sample_imax - sample_imin);
+  }
+}
+
+//------------------------------------------------------------------------------
@@ -0,0 +1,59 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "Bits.hpp"
+#include "BitOps.hpp"
+
+//------------------------------------------------------------------------------
+// Constant-time "how many ones in [a, b)" queries for one channel of a trace.
+//
+// The channel's bits get packed 64 to a word, and we store a 64-bit running
+// total every 65536 samples plus a 16-bit total (relative to the enclosing
+// 65536-sample superblock) every (1 << block_shift) samples. A query is two
+// table lookups plus at most (1 << block_shift) / 64 popcounts, so
+// block_shift trades memory for speed:
+//
+//   block_shift  6 - 25%   overhead on top of the packed bits, 1 popcount
+//   block_shift  9 - 3.1%  overhead, up to 8 popcounts
+//   block_shift 12 - 0.4%  overhead, up to 64 popcounts
+
+struct RankIndex {
+
+  void init(TraceBuffer& trace, int channel, int block_shift = 9);
+  void exit();
+
+  // Number of ones in samples [0, i).
+  uint64_t rank(size_t i) const;
+
+  // Number of ones in samples [a, b).
+  uint64_t count(size_t a, size_t b) const;
+
+  int get_bit(size_t i) const {
+    return (bits[i >> 6] >> (i & 63)) & 1;
+  }
+
+  size_t size_bytes() const;
+
+  size_t samples = 0;
+  int block_shift = 9;
+  bool has_popcnt = false;  // rank() and count() use the TARGET_POPCNT builds
+
+  uint64_t* bits = nullptr;
+  uint64_t* supers = nullptr;
+  uint16_t* blocks = nullptr;
+
+  size_t bits_len = 0;
+  size_t supers_len = 0;
+  size_t blocks_len = 0;
+};
+
+//------------------------------------------------------------------------------
+// Same output as render() with an exact pyramid, but each pixel is two rank
+// lookups plus the fractional samples at either end instead of a mip walk.
+
+void render(RankIndex& index,
+            double world_min, double world_max,
+            double trace_min, double trace_max,
+            double* out, int out_len);
+
+//------------------------------------------------------------------------------
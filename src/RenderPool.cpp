@@ -0,0 +1,117 @@
+#include "RenderPool.hpp"
+
+#include <mutex>
+#include "log.hpp"
+
+//------------------------------------------------------------------------------
+// Shifting world_min/world_max by x_min makes render() see the span as pixels
+// [0, x_max - x_min) while still mapping them to the same trace positions.
+//
+// render() resets and bumps the hit counters in the MipBuffer it's given, so
+// each task renders on its own shallow copy - the mip arrays themselves are
+// read-only here - and adds its counts back to the real one when it's done.
+
+static std::mutex hit_lock;
+
+static void run_task(const RenderTask& task) {
+  MipBuffer mips = *task.mips;
+  render(*task.trace, mips, task.channel,
+         task.world_min - task.x_min, task.world_max - task.x_min,
+         task.trace_min, task.trace_max,
+         task.out + task.x_min, task.x_max - task.x_min);
+
+  std::lock_guard<std::mutex> lock(hit_lock);
+  for (int level = 0; level <= mip_levels; level++) {
+    task.mips->mip_hit[level] += mips.mip_hit[level];
+  }
+}
+
+//------------------------------------------------------------------------------
+
+void RenderPool::init(int _thread_count) {
+  thread_count = _thread_count;
+  threads = new std::thread*[thread_count];
+
+  for (int i = 0; i < thread_count; i++) {
+    threads[i] = new std::thread([this] () -> void {
+      while (1) {
+        RenderTask task = tasks.get();
+        if (task.channel < 0) break;
+        run_task(task);
+        done.put(1);
+      }
+    });
+  }
+}
+
+//------------------------------------------------------------------------------
+
+void RenderPool::exit() {
+  for (int i = 0; i < thread_count; i++) {
+    RenderTask terminate = {};
+    terminate.channel = -1;
+    tasks.put(terminate);
+  }
+
+  for (int i = 0; i < thread_count; i++) {
+    threads[i]->join();
+    delete threads[i];
+  }
+
+  delete [] threads;
+  threads = nullptr;
+  thread_count = 0;
+}
+
+//------------------------------------------------------------------------------
+
+void RenderPool::render(TraceBuffer& trace, MipBuffer* mips, int channels,
+                        double world_min, double world_max,
+                        double trace_min, double trace_max,
+                        double* out, int out_stride, int out_len)
+{
+  int task_count = 0;
+
+  // Same as calling render() on each channel - the counts start over.
+  for (int channel = 0; channel < channels; channel++) {
+    for (int level = 0; level <= mip_levels; level++) mips[channel].mip_hit[level] = 0;
+  }
+
+  for (int channel = 0; channel < channels; channel++) {
+    for (int x_min = 0; x_min < out_len; x_min += span_pixels) {
+      int x_max = x_min + span_pixels;
+      if (x_max > out_len) x_max = out_len;
+
+      RenderTask task = {
+        &trace, &mips[channel], channel,
+        world_min, world_max, trace_min, trace_max,
+        out + channel * out_stride, x_min, x_max
+      };
+
+      if (thread_count) {
+        tasks.put(task);
+        task_count++;
+      }
+      else {
+        run_task(task);
+      }
+    }
+  }
+
+  // Join
+  for (int i = 0; i < task_count; i++) done.get();
+}
+
+//------------------------------------------------------------------------------
+
+void RenderPool::run(const RenderTask* batch, int count) {
+  if (!thread_count) {
+    for (int i = 0; i < count; i++) run_task(batch[i]);
+    return;
+  }
+
+  for (int i = 0; i < count; i++) tasks.put(batch[i]);
+  for (int i = 0; i < count; i++) done.get();
+}
+
+//------------------------------------------------------------------------------
@@ -0,0 +1,55 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <thread>
+#include "Bits.hpp"
+#include "ThreadQueue.hpp"
+
+//------------------------------------------------------------------------------
+// Persistent worker pool for the software renderer. A frame gets chopped into
+// (channel, pixel span) tasks, every task writes to its own part of the output
+// rows, and render() doesn't return until all of them are done - so the caller
+// can upload the result as soon as it returns.
+
+struct RenderTask {
+  TraceBuffer* trace;
+  MipBuffer*   mips;
+  int          channel; // -1 tells the worker to exit
+  double       world_min;
+  double       world_max;
+  double       trace_min;
+  double       trace_max;
+  double*      out;     // Row for this channel, not offset by x_min
+  int          x_min;
+  int          x_max;
+};
+
+struct RenderPool {
+
+  // thread_count == 0 renders everything on the calling thread.
+  void init(int thread_count);
+  void exit();
+
+  // Renders channels [0, channels) into out + channel * out_stride. Each
+  // channel's mipN_hit counters end up the same as if render() had been
+  // called on it directly.
+  void render(TraceBuffer& trace, MipBuffer* mips, int channels,
+              double world_min, double world_max,
+              double trace_min, double trace_max,
+              double* out, int out_stride, int out_len);
+
+  // Runs an arbitrary batch of tasks and waits for all of them. The tasks'
+  // hit counts get added to their MipBuffers, the caller resets them.
+  void run(const RenderTask* batch, int count);
+
+  // Narrower spans balance better but cost more setup per task.
+  int span_pixels = 240;
+
+  int thread_count = 0;
+  std::thread** threads = nullptr;
+
+  ThreadQueue<RenderTask> tasks;
+  ThreadQueue<int>        done;
+};
+
+//------------------------------------------------------------------------------
@@ -0,0 +1,295 @@
+#include "RowRenderer.hpp"
+
+#include "BitOps.hpp"
+#include "log.hpp"
+
+#include <immintrin.h>
+#include <math.h>
+
+//------------------------------------------------------------------------------
+// Boundary i lands at
+//
+//   base + (((rel0 + i * step) & mask) >> shift)
+//
+// in 32.7 fixed point. base is the first boundary rounded down to a whole
+// granule (or sample), rel0/step are the offset from there and the width of a
+// pixel with 'frac' fraction bits, and the mask floors to the granularity.
+
+struct RowParams {
+  int64_t rel0;
+  int64_t step;
+  int64_t mask;
+  int     shift;
+  int64_t base;
+  int64_t limit;
+};
+
+static RowParams row_params(RankIndex& index,
+                            double world_min, double world_max,
+                            double trace_min, double trace_max,
+                            int out_len)
+{
+  // Same granularity as render().
+  double pix0_l = remap(0.0, world_min, world_max, trace_min, trace_max);
+  double pix0_r = remap(1.0, world_min, world_max, trace_min, trace_max);
+  double gshift_f = ceil(log2(pix0_r - pix0_l)) - 7;
+
+  // Anything finer than 1/128th of a sample gets floored away by the 32.7
+  // conversion anyway. This also catches pixels so narrow that pix0_r and
+  // pix0_l round to the same double.
+  if (!(gshift_f > -7)) gshift_f = -7;
+  int gshift = (int)gshift_f;
+
+  double spp = (trace_max - trace_min) / (world_max - world_min);
+  assert(spp > 0);
+
+  double grain  = exp2(gshift > 0 ? gshift : 0);
+  double origin = floor(pix0_l / grain) * grain;
+  double rel    = pix0_l - origin;
+
+  // Use as many fraction bits as the row allows without overflowing.
+  double rel_max = rel + spp * out_len + 1.0;
+  int frac = 62 - (int)ceil(log2(rel_max));
+  if (frac > 62) frac = 62;
+  assert(frac >= 7);
+
+  RowParams p;
+  p.rel0  = (int64_t)floor(ldexp(rel, frac));
+  p.step  = (int64_t)llround(ldexp(spp, frac));
+  p.mask  = ~((int64_t(1) << (frac + gshift)) - 1);
+  p.shift = frac - 7;
+  p.base  = (int64_t)origin * 128;
+  p.limit = (int64_t)index.samples * 128;
+  return p;
+}
+
+//------------------------------------------------------------------------------
+
+static void bounds_scalar(const RowParams& p, int64_t* raw, int64_t* bound, int begin, int end) {
+  for (int i = begin; i < end; i++) {
+    int64_t b = p.base + (((p.rel0 + i * p.step) & p.mask) >> p.shift);
+    raw[i] = b;
+    if (b < 0)       b = 0;
+    if (b > p.limit) b = p.limit;
+    bound[i] = b;
+  }
+}
+
+TARGET_SSE42
+static int bounds_sse42(const RowParams& p, int64_t* raw, int64_t* bound, int count) {
+  __m128i rel   = _mm_set_epi64x(p.rel0 + p.step, p.rel0);
+  __m128i step  = _mm_set1_epi64x(2 * p.step);
+  __m128i mask  = _mm_set1_epi64x(p.mask);
+  __m128i shift = _mm_cvtsi32_si128(p.shift);
+  __m128i base  = _mm_set1_epi64x(p.base);
+  __m128i zero  = _mm_setzero_si128();
+  __m128i limit = _mm_set1_epi64x(p.limit);
+
+  int i = 0;
+  for (; i + 2 <= count; i += 2) {
+    __m128i b = _mm_add_epi64(base, _mm_srl_epi64(_mm_and_si128(rel, mask), shift));
+    _mm_storeu_si128((__m128i*)(raw + i), b);
+    b = _mm_blendv_epi8(b, zero,  _mm_cmpgt_epi64(zero, b));
+    b = _mm_blendv_epi8(b, limit, _mm_cmpgt_epi64(b, limit));
+    _mm_storeu_si128((__m128i*)(bound + i), b);
+    rel = _mm_add_epi64(rel, step);
+  }
+  return i;
+}
+
+TARGET_AVX2
+static int bounds_avx2(const RowParams& p, int64_t* raw, int64_t* bound, int count) {
+  __m256i rel_a = _mm256_set_epi64x(p.rel0 + 3 * p.step, p.rel0 + 2 * p.step, p.rel0 + p.step, p.rel0);
+  __m256i rel_b = _mm256_add_epi64(rel_a, _mm256_set1_epi64x(4 * p.step));
+  __m256i step  = _mm256_set1_epi64x(8 * p.step);
+  __m256i mask  = _mm256_set1_epi64x(p.mask);
+  __m128i shift = _mm_cvtsi32_si128(p.shift);
+  __m256i base  = _mm256_set1_epi64x(p.base);
+  __m256i zero  = _mm256_setzero_si256();
+  __m256i limit = _mm256_set1_epi64x(p.limit);
+
+  // 8 boundaries per iteration, two independent chains.
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i a = _mm256_add_epi64(base, _mm256_srl_epi64(_mm256_and_si256(rel_a, mask), shift));
+    __m256i b = _mm256_add_epi64(base, _mm256_srl_epi64(_mm256_and_si256(rel_b, mask), shift));
+    _mm256_storeu_si256((__m256i*)(raw + i + 0), a);
+    _mm256_storeu_si256((__m256i*)(raw + i + 4), b);
+    a = _mm256_blendv_epi8(a, zero,  _mm256_cmpgt_epi64(zero, a));
+    b = _mm256_blendv_epi8(b, zero,  _mm256_cmpgt_epi64(zero, b));
+    a = _mm256_blendv_epi8(a, limit, _mm256_cmpgt_epi64(a, limit));
+    b = _mm256_blendv_epi8(b, limit, _mm256_cmpgt_epi64(b, limit));
+    _mm256_storeu_si256((__m256i*)(bound + i + 0), a);
+    _mm256_storeu_si256((__m256i*)(bound + i + 4), b);
+    rel_a = _mm256_add_epi64(rel_a, step);
+    rel_b = _mm256_add_epi64(rel_b, step);
+  }
+  return i;
+}
+
+//------------------------------------------------------------------------------
+// A pixel covers [bound[x], bound[x+1]) and has (cover[x+1] - cover[x]) / 128
+// ones in it. Zero-width pixels show whatever sample they're sitting in, or
+// nothing if they're off the end of the trace - same as render().
+
+static void divide_scalar(const RowParams& p, const int64_t* raw, const int64_t* bound,
+                          const int64_t* cover, const int64_t* bit,
+                          double* out, int begin, int end) {
+  for (int x = begin; x < end; x++) {
+    int64_t len = bound[x + 1] - bound[x];
+    if (len) {
+      out[x] = double(cover[x + 1] - cover[x]) / double(len);
+    }
+    else {
+      bool visible = raw[x + 1] >= 0 && raw[x] < p.limit;
+      out[x] = visible ? double(bit[x]) : 0.0;
+    }
+  }
+}
+
+// Everything here is non-negative and way under 2^52, so we can convert to
+// double by jamming the bits into the mantissa of 2^52.
+
+TARGET_SSE42
+static inline __m128d to_double_sse42(__m128i x) {
+  const __m128i magic = _mm_set1_epi64x(0x4330000000000000ll);
+  return _mm_sub_pd(_mm_castsi128_pd(_mm_or_si128(x, magic)), _mm_castsi128_pd(magic));
+}
+
+TARGET_AVX2
+static inline __m256d to_double_avx2(__m256i x) {
+  const __m256i magic = _mm256_set1_epi64x(0x4330000000000000ll);
+  return _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(x, magic)), _mm256_castsi256_pd(magic));
+}
+
+TARGET_SSE42
+static int divide_sse42(const RowParams& p, const int64_t* raw, const int64_t* bound,
+                        const int64_t* cover, const int64_t* bit,
+                        double* out, int count) {
+  const __m128i zero    = _mm_setzero_si128();
+  const __m128i neg     = _mm_set1_epi64x(-1);
+  const __m128i limit   = _mm_set1_epi64x(p.limit);
+
+  int x = 0;
+  for (; x + 2 <= count; x += 2) {
+    __m128i b0 = _mm_loadu_si128((const __m128i*)(bound + x));
+    __m128i b1 = _mm_loadu_si128((const __m128i*)(bound + x + 1));
+    __m128i c0 = _mm_loadu_si128((const __m128i*)(cover + x));
+    __m128i c1 = _mm_loadu_si128((const __m128i*)(cover + x + 1));
+    __m128i r0 = _mm_loadu_si128((const __m128i*)(raw + x));
+    __m128i r1 = _mm_loadu_si128((const __m128i*)(raw + x + 1));
+    __m128i bt = _mm_loadu_si128((const __m128i*)(bit + x));
+
+    __m128i len = _mm_sub_epi64(b1, b0);
+    __m128d val = _mm_div_pd(to_double_sse42(_mm_sub_epi64(c1, c0)), to_double_sse42(len));
+
+    __m128i visible = _mm_and_si128(_mm_cmpgt_epi64(r1, neg), _mm_cmpgt_epi64(limit, r0));
+    __m128d fill    = to_double_sse42(_mm_and_si128(visible, bt));
+
+    val = _mm_blendv_pd(val, fill, _mm_castsi128_pd(_mm_cmpeq_epi64(len, zero)));
+    _mm_storeu_pd(out + x, val);
+  }
+  return x;
+}
+
+TARGET_AVX2
+static int divide_avx2(const RowParams& p, const int64_t* raw, const int64_t* bound,
+                       const int64_t* cover, const int64_t* bit,
+                       double* out, int count) {
+  const __m256i zero    = _mm256_setzero_si256();
+  const __m256i neg     = _mm256_set1_epi64x(-1);
+  const __m256i limit   = _mm256_set1_epi64x(p.limit);
+
+  int x = 0;
+  for (; x + 4 <= count; x += 4) {
+    __m256i b0 = _mm256_loadu_si256((const __m256i*)(bound + x));
+    __m256i b1 = _mm256_loadu_si256((const __m256i*)(bound + x + 1));
+    __m256i c0 = _mm256_loadu_si256((const __m256i*)(cover + x));
+    __m256i c1 = _mm256_loadu_si256((const __m256i*)(cover + x + 1));
+    __m256i r0 = _mm256_loadu_si256((const __m256i*)(raw + x));
+    __m256i r1 = _mm256_loadu_si256((const __m256i*)(raw + x + 1));
+    __m256i bt = _mm256_loadu_si256((const __m256i*)(bit + x));
+
+    __m256i len = _mm256_sub_epi64(b1, b0);
+    __m256d val = _mm256_div_pd(to_double_avx2(_mm256_sub_epi64(c1, c0)), to_double_avx2(len));
+
+    __m256i visible = _mm256_and_si256(_mm256_cmpgt_epi64(r1, neg), _mm256_cmpgt_epi64(limit, r0));
+    __m256d fill    = to_double_avx2(_mm256_and_si256(visible, bt));
+
+    val = _mm256_blendv_pd(val, fill, _mm256_castsi256_pd(_mm256_cmpeq_epi64(len, zero)));
+    _mm256_storeu_pd(out + x, val);
+  }
+  return x;
+}
+
+//------------------------------------------------------------------------------
+
+void RowRenderer::init(int _max_len) {
+  max_len = _max_len;
+  bound_raw = new int64_t[max_len + 1];
+  bound     = new int64_t[max_len + 1];
+  cover     = new int64_t[max_len + 1];
+  bit       = new int64_t[max_len + 1];
+
+  simd_level = cpu_has_avx2() ? 2 : cpu_has_sse42() ? 1 : 0;
+}
+
+void RowRenderer::exit() {
+  delete [] bound_raw;
+  delete [] bound;
+  delete [] cover;
+  delete [] bit;
+  bound_raw = nullptr;
+  bound = nullptr;
+  cover = nullptr;
+  bit = nullptr;
+}
+
+//------------------------------------------------------------------------------
+
+void RowRenderer::render(RankIndex& index,
+                         double world_min, double world_max,
+                         double trace_min, double trace_max,
+                         double* out, int out_len)
+{
+  assert(out_len <= max_len);
+
+  RowParams p = row_params(index, world_min, world_max, trace_min, trace_max, out_len);
+  int count = out_len + 1;
+
+  //----------------------------------------
+  // Pixel boundaries
+
+  int done = 0;
+  if      (simd_level >= 2) done = bounds_avx2 (p, bound_raw, bound, count);
+  else if (simd_level >= 1) done = bounds_sse42(p, bound_raw, bound, count);
+  bounds_scalar(p, bound_raw, bound, done, count);
+
+  //----------------------------------------
+  // Coverage before each boundary. Boundaries only ever move right, so when
+  // we're zoomed in most of these are the same-word fast path in count().
+
+  size_t   rank_pos = 0;
+  uint64_t rank_val = 0;
+
+  for (int i = 0; i < count; i++) {
+    int64_t b = bound[i];
+    size_t sample = size_t(b >> 7);
+
+    rank_val += index.count(rank_pos, sample);
+    rank_pos = sample;
+
+    bit[i]   = b < p.limit ? index.get_bit(sample) : 0;
+    cover[i] = int64_t(rank_val) * 128 + (b & 0x7F) * bit[i];
+  }
+
+  //----------------------------------------
+  // Per-pixel averages
+
+  done = 0;
+  if      (simd_level >= 2) done = divide_avx2 (p, bound_raw, bound, cover, bit, out, out_len);
+  else if (simd_level >= 1) done = divide_sse42(p, bound_raw, bound, cover, bit, out, out_len);
+  divide_scalar(p, bound_raw, bound, cover, bit, out, done, out_len);
+}
+
+//------------------------------------------------------------------------------
@@ -0,0 +1,44 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "RankIndex.hpp"
+
+//------------------------------------------------------------------------------
+// Renders a whole row of pixels at once instead of one pixel at a time.
+//
+// Adjacent pixels share an endpoint, so we compute the out_len + 1 pixel
+// boundaries up front in 32.7 fixed point (SIMD, integer only) and look up
+// "ones before this boundary" once per boundary in the rank index. Each pixel
+// is then just a subtract and a divide, which also gets vectorized.
+//
+// Tolerance - the scalar render() floors its endpoints in floating point and
+// we floor ours in integer fixed point, so a boundary that lands within
+// rounding error of a granule edge can end up one granule (1/128th of a
+// sample, or more when zoomed out) away from where render() put it. Every
+// pixel is within (2 * granule / pixel width) of render(); most are
+// bit-identical.
+
+struct RowRenderer {
+
+  void init(int max_len);
+  void exit();
+
+  void render(RankIndex& index,
+              double world_min, double world_max,
+              double trace_min, double trace_max,
+              double* out, int out_len);
+
+  // Kernel render() uses - 0 = scalar, 1 = SSE4.2, 2 = AVX2. init() picks the
+  // best one the CPU supports.
+  int simd_level = 0;
+
+  int max_len = 0;
+
+  // One entry per pixel boundary, so max_len + 1 of each.
+  int64_t* bound_raw = nullptr; // 32.7 fixed point, before clamping to the trace
+  int64_t* bound     = nullptr; // clamped to [0, samples * 128]
+  int64_t* cover     = nullptr; // ones before the boundary, times 128
+  int64_t* bit       = nullptr; // the sample the boundary lands in
+};
+
+//------------------------------------------------------------------------------
@@ -0,0 +1,204 @@
+#include "TileCache.hpp"
+
+#include "log.hpp"
+
+#include <math.h>
+#include <string.h>
+
+static int64_t floor_div(int64_t a, int64_t b) {
+  int64_t q = a / b;
+  return (a % b && (a < 0)) ? q - 1 : q;
+}
+
+//------------------------------------------------------------------------------
+
+void TileCache::init(size_t budget_bytes) {
+  tile_count = int(budget_bytes / (tile_width * sizeof(double)));
+  assert(tile_count > 0);
+
+  tiles  = new Tile[tile_count];
+  pixels = new double[size_t(tile_count) * tile_width];
+  tasks  = new RenderTask[tile_count];
+
+  size_t bucket_count = 1;
+  while (bucket_count < size_t(tile_count) * 2) bucket_count *= 2;
+  buckets = new int[bucket_count];
+  bucket_mask = bucket_count - 1;
+
+  clear();
+  total = {};
+}
+
+//------------------------------------------------------------------------------
+
+void TileCache::exit() {
+  delete [] tiles;
+  delete [] pixels;
+  delete [] tasks;
+  delete [] buckets;
+  tiles = nullptr;
+  pixels = nullptr;
+  tasks = nullptr;
+  buckets = nullptr;
+  tile_count = 0;
+}
+
+//------------------------------------------------------------------------------
+// Dead tiles stay in the LRU list too, so alloc() can always take the tail.
+
+void TileCache::clear() {
+  for (size_t i = 0; i <= bucket_mask; i++) buckets[i] = -1;
+
+  for (int i = 0; i < tile_count; i++) {
+    tiles[i] = {};
+    tiles[i].lru_prev  = i - 1;
+    tiles[i].lru_next  = i + 1 < tile_count ? i + 1 : -1;
+    tiles[i].hash_next = -1;
+  }
+  lru_head = 0;
+  lru_tail = tile_count - 1;
+}
+
+//------------------------------------------------------------------------------
+
+size_t TileCache::hash(int channel, int zoom, int64_t index) const {
+  uint64_t h = uint64_t(index) * 0x9E3779B97F4A7C15ull;
+  h ^= (uint64_t(uint32_t(zoom)) << 8 | uint64_t(channel)) * 0xC2B2AE3D27D4EB4Full;
+  return size_t(h ^ (h >> 29)) & bucket_mask;
+}
+
+int TileCache::find(int channel, int zoom, int64_t index) {
+  for (int i = buckets[hash(channel, zoom, index)]; i >= 0; i = tiles[i].hash_next) {
+    Tile& t = tiles[i];
+    if (t.channel == channel && t.zoom == zoom && t.index == index) return i;
+  }
+  return -1;
+}
+
+void TileCache::unhash(int tile) {
+  Tile& t = tiles[tile];
+  int* link = &buckets[hash(t.channel, t.zoom, t.index)];
+  while (*link != tile) link = &tiles[*link].hash_next;
+  *link = t.hash_next;
+  t.hash_next = -1;
+}
+
+// Moves a tile to the front of the LRU list.
+void TileCache::touch(int tile) {
+  if (tile == lru_head) return;
+  Tile& t = tiles[tile];
+
+  tiles[t.lru_prev].lru_next = t.lru_next;
+  if (t.lru_next >= 0) tiles[t.lru_next].lru_prev = t.lru_prev;
+  else lru_tail = t.lru_prev;
+
+  t.lru_prev = -1;
+  t.lru_next = lru_head;
+  tiles[lru_head].lru_prev = tile;
+  lru_head = tile;
+}
+
+int TileCache::alloc(int channel, int zoom, int64_t index) {
+  int tile = lru_tail;
+  Tile& t = tiles[tile];
+
+  if (t.live) {
+    unhash(tile);
+    frame.evictions++;
+  }
+
+  t.channel = channel;
+  t.zoom    = zoom;
+  t.index   = index;
+  t.live    = true;
+
+  size_t b = hash(channel, zoom, index);
+  t.hash_next = buckets[b];
+  buckets[b] = tile;
+
+  touch(tile);
+  return tile;
+}
+
+//------------------------------------------------------------------------------
+
+void TileCache::render(RenderPool& pool, TraceBuffer& trace, MipBuffer* mips, int channels,
+                       double trace_origin, double zoom, double view_min,
+                       double* out, int out_stride, int out_len)
+{
+  double time_a = timestamp();
+  frame = {};
+
+  double spp = exp2(-zoom);
+  double first = (view_min - trace_origin) / spp;
+  int64_t pixel_min = (int64_t)llround(first);
+  int64_t tile_min  = floor_div(pixel_min, tile_width);
+  int64_t tile_max  = floor_div(pixel_min + out_len - 1, tile_width) + 1;
+  int across = int(tile_max - tile_min);
+
+  // Every tile this frame needs has to fit at once, or we'd evict tiles
+  // before we got to use them.
+  bool on_grid = zoom == floor(zoom) && fabs(first - double(pixel_min)) < 1.0e-6;
+  if (!on_grid || across * channels > tile_count) {
+    pool.render(trace, mips, channels, 0, out_len, view_min, view_min + out_len * spp,
+                out, out_stride, out_len);
+    frame.bypassed = true;
+    frame.time = timestamp() - time_a;
+    total.time += frame.time;
+    return;
+  }
+
+  //----------------------------------------
+  // Look up every tile, queue up the ones we don't have.
+
+  int izoom = int(zoom);
+  int task_count = 0;
+
+  for (int c = 0; c < channels; c++) {
+    for (int64_t index = tile_min; index < tile_max; index++) {
+      int tile = find(c, izoom, index);
+      if (tile >= 0) {
+        touch(tile);
+        frame.hits++;
+        continue;
+      }
+
+      tile = alloc(c, izoom, index);
+      frame.misses++;
+
+      double tile_trace_min = trace_origin + double(index * tile_width) * spp;
+      tasks[task_count++] = {
+        &trace, &mips[c], c,
+        0, tile_width, tile_trace_min, tile_trace_min + tile_width * spp,
+        pixels + size_t(tile) * tile_width, 0, tile_width
+      };
+    }
+  }
+
+  pool.run(tasks, task_count);
+
+  //----------------------------------------
+  // Stitch the frame together out of tiles.
+
+  for (int c = 0; c < channels; c++) {
+    for (int64_t index = tile_min; index < tile_max; index++) {
+      int64_t tile_pixel = index * tile_width;
+      int64_t x_min = tile_pixel - pixel_min;
+      int64_t x_max = x_min + tile_width;
+      if (x_min < 0) x_min = 0;
+      if (x_max > out_len) x_max = out_len;
+
+      const double* src = pixels + size_t(find(c, izoom, index)) * tile_width;
+      memcpy(out + c * out_stride + x_min, src + (pixel_min + x_min - tile_pixel),
+             (x_max - x_min) * sizeof(double));
+    }
+  }
+
+  frame.time = timestamp() - time_a;
+  total.hits      += frame.hits;
+  total.misses    += frame.misses;
+  total.evictions += frame.evictions;
+  total.time      += frame.time;
+}
+
+//------------------------------------------------------------------------------
@@ -0,0 +1,82 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "Bits.hpp"
+#include "RenderPool.hpp"
+
+//------------------------------------------------------------------------------
+// Cache of rendered coverage columns for the software viewer, so panning only
+// renders the pixels that scrolled into view.
+//
+// At an integer zoom level Z a pixel is 2^-Z samples wide, and pixel P covers
+// samples [P, P + 1) * 2^-Z from the trace origin. Tiles are tile_width of
+// those pixels, keyed by (channel, Z, P / tile_width), so a tile's contents
+// only depend on its key. That only works if the frame lines up with the
+// pixel grid - Viewport::snap() takes care of that when the zoom is a whole
+// number. Frames at fractional zooms (mid zoom animation, say) or off the
+// grid skip the cache and render directly.
+//
+// Tiles get recycled least-recently-used first once the memory budget is used
+// up.
+
+struct TileStats {
+  int    hits = 0;
+  int    misses = 0;
+  int    evictions = 0;
+  bool   bypassed = false; // Frame wasn't on the pixel grid
+  double time = 0;         // Seconds spent in render()
+};
+
+struct TileCache {
+
+  static constexpr int tile_width = 256;
+
+  void init(size_t budget_bytes);
+  void exit();
+
+  // Drops every tile. Call it when the trace or the mips change.
+  void clear();
+
+  // Renders channels [0, channels) into out + channel * out_stride, same as
+  // RenderPool::render(). trace_origin is the trace position of pixel 0 of
+  // the grid, zoom is log2(pixels per sample), and view_min is the trace
+  // position of the left edge of the frame.
+  void render(RenderPool& pool, TraceBuffer& trace, MipBuffer* mips, int channels,
+              double trace_origin, double zoom, double view_min,
+              double* out, int out_stride, int out_len);
+
+  TileStats frame;           // Stats for the last render()
+  TileStats total;           // Since init()
+
+  //----------------------------------------
+
+  struct Tile {
+    int     channel;
+    int     zoom;
+    int64_t index;
+    int     lru_prev;        // Toward most recently used
+    int     lru_next;        // Toward least recently used
+    int     hash_next;
+    bool    live;
+  };
+
+  int  find(int channel, int zoom, int64_t index);
+  int  alloc(int channel, int zoom, int64_t index);
+  void touch(int tile);
+  void unhash(int tile);
+  size_t hash(int channel, int zoom, int64_t index) const;
+
+  int     tile_count = 0;
+  Tile*   tiles = nullptr;
+  double* pixels = nullptr;  // tile_width per tile
+
+  int*    buckets = nullptr; // Head of each hash chain, -1 if empty
+  size_t  bucket_mask = 0;
+
+  int     lru_head = -1;     // Most recently used
+  int     lru_tail = -1;     // Least recently used, next to go
+
+  RenderTask* tasks = nullptr;
+};
+
+//------------------------------------------------------------------------------
@@ -1,55 +1,76 @@
 #include "TraceMipper.hpp"
 #include "third_party/glad/glad.h"
 #include "GLBase.h"
+#include <SDL2/SDL.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "log.hpp"
+#include "Bits.hpp"
+#include "GpuProfiler.hpp"
 
 // making mip0 DYNAMIC_STORAGE does not affect performance
 // making mip0 mappable does not affect performance
 // making mip0 persistent DOES affect performance massively (44 gs/sec -> 2 gs/sec)
 // Persistent + coherent is the same as persistent
+// ...which is why live traces go through TraceUploader's staging ring instead.
 
 //------------------------------------------------------------------------------
-// 64-bit version is 50% faster than 32-bit
+// 64-bit version is 50% faster than 32-bit on the card this was written on.
+// TraceMipper::tune() checks again on whatever we run on.
 
 // Each invocation of this shader converts 128 bytes of bit-interleaved
 // 8-channel sample data into 8 8-bit accumulators, where accumulator N stores
 // how many times bit N was set in each byte of the source data. The output
 // is 8-channel striped accumulators.
+//
+// With SAMPLE_BYTES set to 2 or 4 it takes 16 or 32-channel samples instead -
+// 128 samples is then 128 * SAMPLE_BYTES bytes, each byte lane gets its own
+// accumulator, and every entry of the output is SAMPLE_BYTES words with
+// channel N in byte N.
 
 const char* mipper_glsl_64 = R"(
 
+#ifndef SAMPLE_BYTES
+#define SAMPLE_BYTES 1
+#endif
+
 layout(std430, binding = 0) buffer Mip0 { uint64_t mip0[]; };
 layout(std430, binding = 1) buffer Mip1 { uint64_t mip1[]; };
 
 void main() {
 
   // Our accumulator is actually 8 8-bit accumulators in one variable.
-  uint64_t accum = 0;
+  uint64_t accum[SAMPLE_BYTES];
+  for (int l = 0; l < SAMPLE_BYTES; l++) accum[l] = 0;
 
-  // We process mip0 in 128-sample chunks, or 16 8-sample chunks.
-  for (int j = 0; j < 16; j++) {
-    uint64_t chunk = mip0[gl_GlobalInvocationID.x * 16 + j];
+  // We process mip0 in 128-sample chunks, or 16 8-byte chunks per byte lane.
+  for (int j = 0; j < 16 * SAMPLE_BYTES; j++) {
+    uint64_t chunk = mip0[gl_GlobalInvocationID.x * 16 * SAMPLE_BYTES + j];
 
     // Reverse the bits so that channels will be in order after expansion.
     // Somehow this also makes the shader a few percent faster...?
 
     uint chunk_lo = uint(chunk >> 0);
     uint chunk_hi = uint(chunk >> 32);
-    chunk = uint64_t(bitfieldReverse(chunk_lo) << 32) | uint64_t(bitfieldReverse(chunk_hi) << 0);
+    chunk = (uint64_t(bitfieldReverse(chunk_lo)) << 32) | uint64_t(bitfieldReverse(chunk_hi));
 
     for (int i = 0; i < 8; i++) {
       // Grab a byte of the chunk and 'expand' it out via multiplication. This
       // will place each bit of the byte at index 8n+7 in 'expanded'
       uint64_t expanded = ((chunk >> (8*i)) & 0xFF) * 0x8040201008040201L;
 
-      // Shift the expanded bits down to index 0 and add them all to the accumulator in parallel.
-      accum += (expanded >> 7) & 0x0101010101010101L;
+      // Shift the expanded bits down to index 0 and add them all to the
+      // accumulator in parallel. Byte i came from byte 7-i before the
+      // reverse, which picks its lane.
+      accum[(7 - i) % SAMPLE_BYTES] += (expanded >> 7) & 0x0101010101010101L;
     }
   }
 
-  // Done, store all 8 channels of the accumulator in the output buffer
-  mip1[gl_GlobalInvocationID.x] = accum;
+  // Done, store all 8 channels of each accumulator in the output buffer
+  for (int l = 0; l < SAMPLE_BYTES; l++) {
+    mip1[gl_GlobalInvocationID.x * SAMPLE_BYTES + l] = accum[l];
+  }
 }
 )";
 
@@ -69,13 +90,13 @@ void main() {
   for (int j = 0; j < 32; j++) {
     uint chunk = mip0[cursor++];
 
+    // Spreads a nibble out so bit N lands at bit 8N, which keeps the
+    // channels in the same order as the 64-bit version.
     for (int i = 0; i < 4; i++) {
-      uint expanded_lo = (chunk & 0x0F) * 0x80402010;
-      accum_lo += (expanded_lo >> 7) & 0x01010101;
+      accum_lo += ((chunk & 0x0F) * 0x00204081) & 0x01010101;
       chunk >>= 4;
 
-      uint expanded_hi = (chunk & 0x0F) * 0x80402010;
-      accum_hi += (expanded_hi >> 7) & 0x01010101;
+      accum_hi += ((chunk & 0x0F) * 0x00204081) & 0x01010101;
       chunk >>= 4;
     }
   }
@@ -91,36 +112,264 @@ void main() {
 // accumulator data into 8 bytes of merged accumulator data, where the Nth
 // merged accumulator stores the average value (rounded up) of the Nth stripe
 // of the source data. The output is also 8-channel striped.
+//
+// SAMPLE_BYTES works the same as in mipper_glsl_64 - entries are that many
+// words wide, and each word of an entry gets merged on its own.
 
 const char* merger_glsl_64 = R"(
 
+#ifndef SAMPLE_BYTES
+#define SAMPLE_BYTES 1
+#endif
+
 layout(std430, binding = 0) buffer Mip1 { uint64_t mip1[]; };
 layout(std430, binding = 1) buffer Mip2 { uint64_t mip2[]; };
 
 void main() {
 
-  uint64_t accum_lo = 0;
-  uint64_t accum_hi = 0;
+  for (int l = 0; l < SAMPLE_BYTES; l++) {
+    uint64_t accum_lo = 0;
+    uint64_t accum_hi = 0;
+
+    for (int j = 0; j < 128; j++) {
+      uint64_t chunk = mip1[(gl_GlobalInvocationID.x * 128 + j) * SAMPLE_BYTES + l];
+      accum_lo += ((chunk & 0x00FF00FF00FF00FFL) >> 0);
+      accum_hi += ((chunk & 0xFF00FF00FF00FF00L) >> 8);
+    }
+
+    // Force accumulators to round up
+    accum_lo += 0x007F007F007F007FL;
+    accum_hi += 0x007F007F007F007FL;
+
+    // Scale down by 128
+    accum_lo = (accum_lo >> 7) & 0x00FF00FF00FF00FFL;
+    accum_hi = (accum_hi >> 7) & 0x00FF00FF00FF00FFL;
+
+    // Splice back together and store the merged accumulator.
+    mip2[gl_GlobalInvocationID.x * SAMPLE_BYTES + l] = accum_lo | (accum_hi << 8);
+  }
+}
+
+)";
+
+//------------------------------------------------------------------------------
+// Same as mipper_glsl_64, except that each 8-sample chunk gets XORed with
+// itself shifted over by one sample first. That leaves a 1 in every channel
+// that changed since the previous sample, so the accumulators count edges
+// instead of ones. A bucket has at most 128 edges, so 8 bits is still enough.
+
+const char* edger_glsl_64 = R"(
+
+layout(std140) uniform MipperUniforms {
+  uint samples;
+  uint channels;
+  uint stride;
+  uint channel;
+  uint skew; // Words of mip0 bound before our first chunk, see dispatch()
+};
+
+layout(std430, binding = 0) buffer Mip0  { uint64_t mip0[]; };
+layout(std430, binding = 1) buffer Edge1 { uint64_t edge1[]; };
+
+void main() {
+  uint64_t accum = 0;
+  uint base = gl_GlobalInvocationID.x * 16 + skew;
+
+  // The last sample of the previous bucket goes in the top byte. The first
+  // bucket uses sample 0 itself, so sample 0 never counts as an edge.
+  uint64_t prev = (base > 0) ? mip0[base - 1] : (mip0[0] << 56);
+
+  for (int j = 0; j < 16; j++) {
+    uint64_t chunk = mip0[base + j];
+    uint64_t edges = chunk ^ ((chunk << 8) | (prev >> 56));
+    prev = chunk;
+
+    uint edges_lo = uint(edges >> 0);
+    uint edges_hi = uint(edges >> 32);
+    edges = (uint64_t(bitfieldReverse(edges_lo)) << 32) | uint64_t(bitfieldReverse(edges_hi));
+
+    for (int i = 0; i < 8; i++) {
+      uint64_t expanded = ((edges >> (8*i)) & 0xFF) * 0x8040201008040201UL;
+      accum += (expanded >> 7) & 0x0101010101010101UL;
+    }
+  }
+
+  edge1[gl_GlobalInvocationID.x] = accum;
+}
+)";
+
+//------------------------------------------------------------------------------
+// Edge counts have to be summed, not averaged, or isolated glitches would
+// round away. 128 buckets of up to 128 edges needs 16 bits per channel, so
+// each invocation turns 1024 bytes of striped edge1 into 16 bytes of edge2 -
+// channels 0-3 in the first word, 4-7 in the second.
+
+const char* edge_merger_glsl_64 = R"(
+
+layout(std430, binding = 0) buffer Edge1 { uint64_t edge1[]; };
+layout(std430, binding = 1) buffer Edge2 { uint64_t edge2[]; };
+
+void main() {
+  uint64_t accum_lo = 0; // channels 0, 2, 4, 6
+  uint64_t accum_hi = 0; // channels 1, 3, 5, 7
 
   for (int j = 0; j < 128; j++) {
-    uint64_t chunk = mip1[gl_GlobalInvocationID.x * 128 + j];
-    accum_lo += ((chunk & 0x00FF00FF00FF00FFL) >> 0);
-    accum_hi += ((chunk & 0xFF00FF00FF00FF00L) >> 8);
+    uint64_t chunk = edge1[gl_GlobalInvocationID.x * 128 + j];
+    accum_lo += (chunk >> 0) & 0x00FF00FF00FF00FFUL;
+    accum_hi += (chunk >> 8) & 0x00FF00FF00FF00FFUL;
   }
 
-  // Force accumulators to round up
-  accum_lo += 0x007F007F007F007FL;
-  accum_hi += 0x007F007F007F007FL;
+  // Interleave back into channel order.
+  uint64_t out_a = ((accum_lo >>  0) & 0xFFFFUL) << 0  | ((accum_hi >>  0) & 0xFFFFUL) << 16 |
+                   ((accum_lo >> 16) & 0xFFFFUL) << 32 | ((accum_hi >> 16) & 0xFFFFUL) << 48;
+  uint64_t out_b = ((accum_lo >> 32) & 0xFFFFUL) << 0  | ((accum_hi >> 32) & 0xFFFFUL) << 16 |
+                   ((accum_lo >> 48) & 0xFFFFUL) << 32 | ((accum_hi >> 48) & 0xFFFFUL) << 48;
 
-  // Scale down by 128
-  accum_lo = (accum_lo >> 7) & 0x00FF00FF00FF00FFL;
-  accum_hi = (accum_hi >> 7) & 0x00FF00FF00FF00FFL;
+  edge2[gl_GlobalInvocationID.x * 2 + 0] = out_a;
+  edge2[gl_GlobalInvocationID.x * 2 + 1] = out_b;
+}
+
+)";
+
+//------------------------------------------------------------------------------
+// Pyramid builders. These write straight into one channel's part of the mips
+// ssbo every channel shares, laid out the way layout_mips() says.
+//
+// Level 1 reads the trace as uints - a planar trace gets its channel's plane
+// bound (stride 1), an interleaved one gets the raw samples (stride 8/16/32)
+// and mask picks the channel's bit out of each sample in a word. Each
+// invocation does BUCKETS buckets, so it always writes whole uints of
+// mip1/edge1.
+
+const char* pyramid1_glsl = R"(
+
+layout(std140) uniform PyramidUniforms {
+  uint count;    // Invocations in this batch
+  uint valid;    // Samples (level 1) or source entries (merges) from the batch start
+  uint stride;   // Bits per sample of the bound trace, 1 for planar
+  uint mask;     // The channel's bit in every sample of a word
+  uint prev;     // Level 1 - the trace word before the batch, see build()
+  uint first;    // Level 1 - the batch starts at sample 0
+  uint edges;    // Level 1 also writes edge1
+  uint in_bits;  // Merges - source and destination entry sizes
+  uint out_bits;
+  uint average;  // Merges - rounded-up average (density) or sum (edges)
+};
+
+// Buckets per invocation, a multiple of 4. The autotuner picks it.
+#ifndef BUCKETS
+#define BUCKETS 4
+#endif
+
+layout(std430, binding = 0) buffer Trace { uint trace[]; };
+layout(std430, binding = 1) buffer Mip1  { uint mip1[]; };
+layout(std430, binding = 2) buffer Edge1 { uint edge1[]; };
+
+void main() {
+  uint id = gl_GlobalInvocationID.x;
+  if (id >= count) return;
+
+  uint per_word = 32 / stride;
+  uint words    = 128 / per_word;
+  uint base     = id * BUCKETS * words;
+
+  // Same edge rule as the CPU - sample 0 gets compared with itself.
+  uint last = (base > 0) ? trace[base - 1] : prev;
+
+  uint mip_out  = 0;
+  uint edge_out = 0;
+
+  for (uint b = 0; b < BUCKETS; b++) {
+    uint ones = 0;
+    uint flips = 0;
+
+    for (uint k = 0; k < words; k++) {
+      uint index = base + b * words + k;
+      uint sample0 = index * per_word;
+
+      uint w = 0;
+      uint m = 0;
+      if (sample0 < valid) {
+        w = trace[index];
+        m = mask;
+        uint left = valid - sample0;
+        if (left < per_word) m &= (1u << (left * stride)) - 1u;
+      }
 
-  // Splice back together
-  uint64_t accum = accum_lo | (accum_hi << 8);
+      if (first != 0 && index == 0) last = (stride == 32) ? w : (w << (32 - stride));
+      uint e = (stride == 32) ? (w ^ last) : (w ^ ((w << stride) | (last >> (32 - stride))));
+
+      ones  += bitCount(w & m);
+      flips += bitCount(e & m);
+      last = w;
+    }
+
+    mip_out  |= ones  << (8 * (b & 3));
+    edge_out |= flips << (8 * (b & 3));
+
+    if ((b & 3) == 3) {
+      mip1[id * (BUCKETS / 4) + b / 4] = mip_out;
+      if (edges != 0) edge1[id * (BUCKETS / 4) + b / 4] = edge_out;
+      mip_out  = 0;
+      edge_out = 0;
+    }
+  }
+}
+
+)";
+
+//------------------------------------------------------------------------------
+// Levels 2-4 - each entry is the rounded-up average (density) or the sum
+// (edges) of 128 entries of the level below. Each invocation does 4 entries.
+
+const char* pyramid_merge_glsl = R"(
+
+layout(std140) uniform PyramidUniforms {
+  uint count;    // Invocations in this batch
+  uint valid;    // Samples (level 1) or source entries (merges) from the batch start
+  uint stride;   // Bits per sample of the bound trace, 1 for planar
+  uint mask;     // The channel's bit in every sample of a word
+  uint prev;     // Level 1 - the trace word before the batch, see build()
+  uint first;    // Level 1 - the batch starts at sample 0
+  uint edges;    // Level 1 also writes edge1
+  uint in_bits;  // Merges - source and destination entry sizes
+  uint out_bits;
+  uint average;  // Merges - rounded-up average (density) or sum (edges)
+};
+
+layout(std430, binding = 0) buffer Src { uint src[]; };
+layout(std430, binding = 1) buffer Dst { uint dst[]; };
+
+uint read_entry(uint i) {
+  if (in_bits == 8)  return bitfieldExtract(src[i >> 2], int(i & 3) * 8, 8);
+  if (in_bits == 16) return bitfieldExtract(src[i >> 1], int(i & 1) * 16, 16);
+  return src[i];
+}
+
+void main() {
+  uint id = gl_GlobalInvocationID.x;
+  if (id >= count) return;
+
+  uint outs[4];
+  for (uint b = 0; b < 4; b++) {
+    uint total = 0;
+    uint first_in = (id * 4 + b) * 128;
+    for (uint j = 0; j < 128; j++) {
+      if (first_in + j < valid) total += read_entry(first_in + j);
+    }
+    outs[b] = (average != 0) ? (total + 127) >> 7 : total;
+  }
 
-  // Done, store the merged accumulator.
-  mip2[gl_GlobalInvocationID.x] = accum;
+  if (out_bits == 8) {
+    dst[id] = outs[0] | (outs[1] << 8) | (outs[2] << 16) | (outs[3] << 24);
+  }
+  else if (out_bits == 16) {
+    dst[id * 2 + 0] = outs[0] | (outs[1] << 16);
+    dst[id * 2 + 1] = outs[2] | (outs[3] << 16);
+  }
+  else {
+    for (uint b = 0; b < 4; b++) dst[id * 4 + b] = outs[b];
+  }
 }
 
 )";
@@ -140,14 +389,33 @@ size_t num_chunks(size_t a, size_t b) {
 void TraceMipper::init() {
   log("TraceMipper::init()");
 
-  // Max size, any larger than this cuts off the end for some reason
-  //num_samples = 4 * 1024ull * 1024ull * 1024ull - 4096;
+  // Anything past 4G samples used to get cut off - that was one dispatch
+  // running into the work group count limit. dispatch() batches now, so the
+  // only limit is how big a buffer the driver will give us.
   num_samples = 256*1024ull*1024ull;
   num_channels = 8;
 
-  mipper_prog = create_compute_shader("TraceMipper", mipper_glsl_64);
+  // mipper_prog and pyramid1_prog come out of tune(), once there's test data
+  // to time them on.
   merger_prog = create_compute_shader("TraceMerger", merger_glsl_64);
+  edger_prog  = create_compute_shader("TraceEdger", edger_glsl_64);
+  edge_merger_prog = create_compute_shader("TraceEdgeMerger", edge_merger_glsl_64);
   mipper_ubo = create_ubo();
+  uniforms = {};
+
+  pyramid_merge_prog = create_compute_shader("TracePyramidMerge", pyramid_merge_glsl);
+  pyramid_ubo = create_ubo();
+  pyramid_uniforms = {};
+
+  int group_count = 0;
+  glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_COUNT, 0, &group_count);
+  max_groups = group_count;
+
+  int ssbo_align = 0;
+  glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &ssbo_align);
+  skew_bytes = ssbo_align < 8 ? 8 : ssbo_align;
+
+  log("Max work groups %ld, ssbo alignment %d", max_groups, ssbo_align);
 
   log("Initializing buffers");
 
@@ -202,9 +470,26 @@ void TraceMipper::init() {
   glBufferStorage(GL_SHADER_STORAGE_BUFFER, mip2_size_bytes, nullptr, GL_DYNAMIC_STORAGE_BIT);
   log("glGenBuffers(mip2) done");
 
+  //----------
+
+  edge1_size_bytes = mip1_size_bytes;
+  edge2_size_bytes = num_chunks(mip1_size_bytes / 8, 128) * 16;
+
+  log("glGenBuffers(edge1) %ld", edge1_size_bytes);
+  glGenBuffers(1, &edge1_ssbo);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, edge1_ssbo);
+  glBufferStorage(GL_SHADER_STORAGE_BUFFER, edge1_size_bytes, nullptr, GL_DYNAMIC_STORAGE_BIT);
+
+  log("glGenBuffers(edge2) %ld", edge2_size_bytes);
+  glGenBuffers(1, &edge2_ssbo);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, edge2_ssbo);
+  glBufferStorage(GL_SHADER_STORAGE_BUFFER, edge2_size_bytes, nullptr, GL_DYNAMIC_STORAGE_BIT);
+
   log("Initializing buffers done");
 
- glGenQueries(32, queries);
+  glGenQueries(32, queries);
+
+  tune();
 }
 
 //------------------------------------------------------------------------------
@@ -213,29 +498,229 @@ void TraceMipper::exit() {
 }
 
 //------------------------------------------------------------------------------
-// Dump out the first and last 4 rows of mip1 for debugging
+// Runs prog once per in_stride bytes of input, writing out_stride bytes of
+// output each. One glDispatchCompute can only launch max_groups work groups
+// and a shader can only index 2^32 elements, so big buffers go in batches
+// that each bind their own slice of the input and output. Sample offsets stay
+// 64-bit on the CPU side and the shaders only ever see local indices.
+//
+// The edger needs the word before its first chunk, so with overlap set every
+// batch but the first binds skew_bytes early (slices have to stay aligned)
+// and tells the shader to skip that many words.
+
+void TraceMipper::dispatch(uint32_t prog,
+                           uint32_t in_ssbo,  size_t in_size,  size_t in_stride,
+                           uint32_t out_ssbo, size_t out_size, size_t out_stride,
+                           bool overlap) {
+  int work_group_size[3];
+  glGetProgramiv(prog, GL_COMPUTE_WORK_GROUP_SIZE, work_group_size);
+
+  size_t group_in  = in_stride  * work_group_size[0];
+  size_t group_out = out_stride * work_group_size[0];
+
+  size_t total_groups = in_size / group_in;
+  if (total_groups == 0) total_groups = 1;
+
+  for (size_t group = 0; group < total_groups; group += max_groups) {
+    size_t groups = total_groups - group;
+    if (groups > max_groups) groups = max_groups;
+
+    size_t in_offset  = group * group_in;
+    size_t out_offset = group * group_out;
+    size_t skew = (overlap && in_offset) ? skew_bytes : 0;
+
+    size_t in_len  = groups * group_in + skew;
+    size_t out_len = groups * group_out;
+    if (in_offset - skew + in_len > in_size) in_len  = in_size - (in_offset - skew);
+    if (out_offset + out_len > out_size)     out_len = out_size - out_offset;
+
+    if (overlap) {
+      uniforms.skew = uint32_t(skew / 8);
+      update_ubo(mipper_ubo, sizeof(uniforms), &uniforms);
+      bind_ubo(prog, "MipperUniforms", 0, mipper_ubo);
+    }
 
-void dump_ssbo(int ssbo, size_t size_bytes) {
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 0, in_ssbo,  in_offset - skew, in_len);
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 1, out_ssbo, out_offset, out_len);
+    glDispatchCompute(groups, 1, 1);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Both pyramid shaders do a fixed amount of work per invocation and bounds
+// check against count, so a batch is just count rounded up to whole groups.
+
+void TraceMipper::dispatch_pyramid(uint32_t prog, size_t count) {
+  int work_group_size[3];
+  glGetProgramiv(prog, GL_COMPUTE_WORK_GROUP_SIZE, work_group_size);
 
-  size_t cols = 8;
-  size_t rows = size_bytes / cols;
+  pyramid_uniforms.count = uint32_t(count);
+  update_ubo(pyramid_ubo, sizeof(pyramid_uniforms), &pyramid_uniforms);
+  bind_ubo(prog, "PyramidUniforms", 0, pyramid_ubo);
 
-  glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
+  glDispatchCompute(num_chunks(count, work_group_size[0]), 1, 1);
+}
 
-  uint8_t* buf = new uint8_t[size_bytes];
-  glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, size_bytes, buf);
+//------------------------------------------------------------------------------
+// Batches are capped at 2^29 samples at level 1 - 2^20 invocations at 4
+// buckets each, fewer if the tuner picked more - and 2^22 entries out of a
+// merge. That keeps every index in the shaders 32-bit and
+// stays under the 65535 work groups GL guarantees us for any local size of 16
+// or more.
+//
+// Batch starts get rounded down to 32768 samples (256 mip1 buckets), so every
+// range we bind - trace, mip1, and all the levels above it - starts on a
+// 256-byte boundary. Rebuilding a few extra buckets is cheaper than patching
+// up partial uints.
+//
+// Batches also stop at the end of each trace shard. Shards are a multiple of
+// 2^24 samples, so that doesn't break the alignment.
+
+static const size_t pyramid_batch = size_t(1) << 20;
+
+void TraceMipper::build(TraceBuffer& trace, MipBuffer& mips, int channel, size_t sample_min, size_t sample_max) {
+  assert(trace.samples <= mips.samples);
+  if (sample_max > trace.samples) sample_max = trace.samples;
+  if (sample_min >= sample_max) return;
+
+  bool edges = mips.edge1 != nullptr;
 
-  for (size_t y = 0; y < rows; y++) {
-    if (y >= 4 && y < (rows - 4)) continue;
+  //----------------------------------------
+  // Level 1 - mip1 and edge1 straight from the trace
 
-    printf("0x%08lx: ", y * cols);
-    for (size_t x = 0; x < cols; x++) {
-      printf("%02x ", buf[y * cols + x]);
+  if (trace.planar()) {
+    pyramid_uniforms.stride = 1;
+    pyramid_uniforms.mask   = 0xFFFFFFFF;
+  }
+  else {
+    assert(trace.stride == 8 || trace.stride == 16 || trace.stride == 32);
+    assert(trace.channel_stride == 1);
+    pyramid_uniforms.stride = uint32_t(trace.stride);
+    pyramid_uniforms.mask   = trace.stride ==  8 ? 0x01010101u << channel :
+                              trace.stride == 16 ? 0x00010001u << channel :
+                                                   0x00000001u << channel;
+  }
+  pyramid_uniforms.edges = edges;
+
+  if (profiler) profiler->push("mip1");
+  bind_compute_shader(pyramid1_prog);
+
+  size_t start = sample_min & ~size_t(32767);
+  size_t batch_max = pyramid_batch * 512;
+  size_t buckets = tuning.pyramid_buckets;
+  size_t group_samples = buckets * 128;
+
+  for (size_t batch = start; batch < sample_max;) {
+    // Batches never straddle two shards of the trace.
+    TraceShard shard = trace_shard(trace, channel, batch / trace_shard(trace, 0, 0).samples);
+    size_t batch_end = shard.sample_base + shard.samples;
+    if (batch_end > batch + batch_max) batch_end = batch + batch_max;
+    if (batch_end > sample_max) batch_end = sample_max;
+
+    size_t count = num_chunks(batch_end - batch, group_samples);
+    size_t valid = trace.samples - batch;
+    if (valid > count * group_samples) valid = count * group_samples;
+
+    size_t in_offset = ((batch - shard.sample_base) * pyramid_uniforms.stride) / 8;
+    size_t in_len = (count * group_samples * pyramid_uniforms.stride) / 8;
+    if (in_offset + in_len > shard.len) in_len = shard.len - in_offset;
+
+    // The first sample's edge needs the word before it, which might not even
+    // be in this shard - the CPU copy of the trace has it handy.
+    pyramid_uniforms.first = batch == 0;
+    pyramid_uniforms.prev  = 0;
+    if (batch) {
+      const uint8_t* blob = (const uint8_t*)trace.blob;
+      size_t byte = trace.planar() ? channel * (trace.channel_stride / 8) + batch / 8
+                                   : (batch * trace.stride) / 8;
+      memcpy(&pyramid_uniforms.prev, blob + byte - 4, 4);
+    }
+    pyramid_uniforms.valid = uint32_t(valid);
+
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 0, shard.ssbo, shard.offset + in_offset, in_len);
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 1, mips.ssbo, mips.mip1_offset + batch / 128, count * buckets);
+    if (edges) {
+      glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 2, mips.ssbo, mips.edge1_offset + batch / 128, count * buckets);
+    }
+    else {
+      // Never written, but the binding still has to be something.
+      glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 2, mips.ssbo, mips.mip1_offset + batch / 128, count * buckets);
     }
-    printf("\n");
+    dispatch_pyramid(pyramid1_prog, count);
+
+    batch = batch_end;
+  }
+  if (profiler) profiler->pop();
+
+  //----------------------------------------
+  // Levels 2-4, each one merging the level below
+
+  if (profiler) profiler->push("merger");
+  bind_compute_shader(pyramid_merge_prog);
+
+  size_t mip_min = start / 128;
+  size_t mip_max = num_chunks(sample_max, 128);
+  size_t edge_min = mip_min;
+  size_t edge_max = mip_max;
+
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+  merge_level(mips.ssbo, mips.mip1_offset, mips.mip_len[1], 8, mips.mip2_offset, 8, true, mip_min, mip_max);
+  if (edges) merge_level(mips.ssbo, mips.edge1_offset, mips.mip_len[1], 8, mips.edge2_offset, 16, false, edge_min, edge_max);
+
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+  merge_level(mips.ssbo, mips.mip2_offset, mips.mip_len[2], 8, mips.mip3_offset, 8, true, mip_min, mip_max);
+  if (edges) merge_level(mips.ssbo, mips.edge2_offset, mips.mip_len[2], 16, mips.edge3_offset, 32, false, edge_min, edge_max);
+
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+  merge_level(mips.ssbo, mips.mip3_offset, mips.mip_len[3], 8, mips.mip4_offset, 8, true, mip_min, mip_max);
+  if (edges) merge_level(mips.ssbo, mips.edge3_offset, mips.mip_len[3], 32, mips.edge4_offset, 32, false, edge_min, edge_max);
+
+  // The painter reads the pyramid as an ssbo too.
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+  if (profiler) profiler->pop();
+
+  glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 0, 0, 0, 0);
+  glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 1, 0, 0, 0);
+  glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 2, 0, 0, 0);
+}
+
+//------------------------------------------------------------------------------
+// Builds [level_min, level_max) of the next level up from [level_min,
+// level_max) of this one, and leaves the range it built in level_min/max.
+
+void TraceMipper::merge_level(uint32_t ssbo, size_t src_offset, size_t src_len, int src_bits,
+                              size_t dst_offset, int dst_bits, bool average,
+                              size_t& level_min, size_t& level_max) {
+  size_t dst_len = num_chunks(src_len, 128);
+  size_t dst_min = (level_min >> 7) & ~size_t(255);
+  size_t dst_max = num_chunks(level_max, 128);
+  if (dst_max > dst_len) dst_max = dst_len;
+
+  pyramid_uniforms.in_bits  = uint32_t(src_bits);
+  pyramid_uniforms.out_bits = uint32_t(dst_bits);
+  pyramid_uniforms.average  = average;
+
+  for (size_t batch = dst_min; batch < dst_max; batch += pyramid_batch * 4) {
+    size_t entries = dst_max - batch;
+    if (entries > pyramid_batch * 4) entries = pyramid_batch * 4;
+    size_t count = num_chunks(entries, 4);
+
+    size_t in_first = batch * 128;
+    size_t valid = src_len - in_first;
+    if (valid > count * 4 * 128) valid = count * 4 * 128;
+
+    size_t in_offset = src_offset + (in_first * src_bits) / 8;
+    size_t in_len = round_up((valid * src_bits) / 8, 4);
+
+    pyramid_uniforms.valid = uint32_t(valid);
+
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 0, ssbo, in_offset, in_len);
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 1, ssbo, dst_offset + (batch * dst_bits) / 8, count * dst_bits / 2);
+    dispatch_pyramid(pyramid_merge_prog, count);
   }
 
-  delete [] buf;
+  level_min = dst_min;
+  level_max = dst_max;
 }
 
 //------------------------------------------------------------------------------
@@ -248,8 +733,6 @@ void TraceMipper::run(int , int ) {
 
   {
     bind_compute_shader(mipper_prog);
-    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 0, mip0_ssbo, 0, mip0_size_bytes);
-    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 1, mip1_ssbo, 0, mip1_size_bytes);
 
     int work_group_size[3];
     glGetProgramiv(mipper_prog, GL_COMPUTE_WORK_GROUP_SIZE, work_group_size);
@@ -266,7 +749,7 @@ void TraceMipper::run(int , int ) {
 
     log("Warmup");
     for (size_t rep = 0; rep < 100; rep++) {
-      glDispatchCompute(num_groups, 1, 1);
+      dispatch(mipper_prog, mip0_ssbo, mip0_size_bytes, 128, mip1_ssbo, mip1_size_bytes, 8, false);
     }
 
     //----------------------------------------
@@ -280,7 +763,7 @@ void TraceMipper::run(int , int ) {
       glFinish();
       glBeginQuery(GL_TIME_ELAPSED, queries[1]);
       for (size_t rep = 0; rep < reps; rep++) {
-        glDispatchCompute(num_groups, 1, 1);
+        dispatch(mipper_prog, mip0_ssbo, mip0_size_bytes, 128, mip1_ssbo, mip1_size_bytes, 8, false);
       }
       glFinish();
       glEndQuery(GL_TIME_ELAPSED);
@@ -300,13 +783,11 @@ void TraceMipper::run(int , int ) {
 
   {
     bind_compute_shader(merger_prog);
-    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 0, mip1_ssbo, 0, mip1_size_bytes);
-    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 1, mip2_ssbo, 0, mip2_size_bytes);
 
     int work_group_size[3];
-    glGetProgramiv(mipper_prog, GL_COMPUTE_WORK_GROUP_SIZE, work_group_size);
+    glGetProgramiv(merger_prog, GL_COMPUTE_WORK_GROUP_SIZE, work_group_size);
 
-    size_t num_groups = (mip1_size_bytes / 128) / work_group_size[0];
+    size_t num_groups = (mip1_size_bytes / 1024) / work_group_size[0];
     if (num_groups == 0) num_groups = 1;
 
     log("Merge %ld threads", num_groups * work_group_size[0]);
@@ -317,7 +798,7 @@ void TraceMipper::run(int , int ) {
     size_t reps = 1000;
     for (size_t rep = 0; rep < 1000; rep++) {
       glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
-      glDispatchCompute(num_groups, 1, 1);
+      dispatch(merger_prog, mip1_ssbo, mip1_size_bytes, 1024, mip2_ssbo, mip2_size_bytes, 8, false);
     }
     glFinish();
     glEndQuery(GL_TIME_ELAPSED);
@@ -328,20 +809,693 @@ void TraceMipper::run(int , int ) {
     log("Merge time %f usec", double(time3) * 1.0e-3 / reps);
   }
 
+  //----------------------------------------
+  // Run the edger and the edge merger
+
+  {
+    bind_compute_shader(edger_prog);
+
+    size_t reps = 100;
+    glFinish();
+    glBeginQuery(GL_TIME_ELAPSED, queries[3]);
+    for (size_t rep = 0; rep < reps; rep++) {
+      dispatch(edger_prog, mip0_ssbo, mip0_size_bytes, 128, edge1_ssbo, edge1_size_bytes, 8, true);
+    }
+    glFinish();
+    glEndQuery(GL_TIME_ELAPSED);
+
+    GLuint64 time4;
+    glGetQueryObjectui64v(queries[3], GL_QUERY_RESULT, &time4);
+    double seconds_per_rep = double(time4) / (1.0e9 * reps);
+    log("Edger usec/rep %f, gs/sec %f", seconds_per_rep * 1.0e6, num_samples / seconds_per_rep / 1.0e9);
+
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    bind_compute_shader(edge_merger_prog);
+
+    glFinish();
+    glBeginQuery(GL_TIME_ELAPSED, queries[4]);
+    dispatch(edge_merger_prog, edge1_ssbo, edge1_size_bytes, 1024, edge2_ssbo, edge2_size_bytes, 16, false);
+    glFinish();
+    glEndQuery(GL_TIME_ELAPSED);
+
+    GLuint64 time5;
+    glGetQueryObjectui64v(queries[4], GL_QUERY_RESULT, &time5);
+    log("Edge merge time %f usec", double(time5) * 1.0e-3);
+
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    check_edges();
+  }
+
+  //----------------------------------------
+  // Same striped mipper and merger on 16 and 32-channel samples
+
+  check_wide(2);
+  check_wide(4);
+
+  //----------------------------------------
+  // Build a whole pyramid the way the painter wants it
+
+  check_pyramid();
+
+  //----------------------------------------
+  // Striped mipper and merger against the CPU ports, on fresh data
+
+  check_striped(8);
+
   //----------------------------------------
 
   glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 0, 0, 0, 0);
   glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 1, 0, 0, 0);
 
-  log("mip0");
-  dump_ssbo(mip0_ssbo, mip0_size_bytes);
+  log("TraceMipper::run() done");
+}
+
+//------------------------------------------------------------------------------
+// Compares the start of edge1/edge2 against the CPU edge pyramid for the same
+// data.
 
-  log("mip1");
-  dump_ssbo(mip1_ssbo, mip1_size_bytes);
+void TraceMipper::check_edges() {
+  const size_t check_samples = 1024 * 1024;
+  const size_t check_buckets = check_samples / 128;
 
-  log("mip2");
-  dump_ssbo(mip2_ssbo, mip2_size_bytes);
+  TraceBuffer trace;
+  trace.samples  = check_samples;
+  trace.channels = 8;
+  trace.stride   = 8;
+  trace.ssbo_len = check_samples;
+  trace.ssbo     = -1;
+  trace.blob     = new uint8_t[check_samples];
 
+  uint64_t* gpu_edge1 = new uint64_t[check_buckets];
+  uint16_t* gpu_edge2 = new uint16_t[check_buckets / 128 * 8];
 
-  log("TraceMipper::run() done");
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, mip0_ssbo);
+  glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, check_samples, trace.blob);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, edge1_ssbo);
+  glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, check_buckets * 8, gpu_edge1);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, edge2_ssbo);
+  glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, check_buckets / 128 * 16, gpu_edge2);
+
+  MipBuffer mips[8];
+  for (int c = 0; c < 8; c++) alloc_mips(mips[c], check_samples, false, true);
+  update_mips_all(trace, mips, 8);
+
+  size_t bad1 = 0;
+  size_t bad2 = 0;
+  for (int c = 0; c < 8; c++) {
+    for (size_t i = 0; i < check_buckets; i++) {
+      if (uint8_t(gpu_edge1[i] >> (8 * c)) != mips[c].edge1[i]) bad1++;
+    }
+    for (size_t i = 0; i < check_buckets / 128; i++) {
+      if (gpu_edge2[i * 8 + c] != mips[c].edge2[i]) bad2++;
+    }
+  }
+  log("Edge check: %ld bad edge1, %ld bad edge2", bad1, bad2);
+
+  for (int c = 0; c < 8; c++) free_mips(mips[c]);
+  delete [] gpu_edge1;
+  delete [] gpu_edge2;
+  delete [] (uint8_t*)trace.blob;
+}
+
+//------------------------------------------------------------------------------
+// Randomized differential test of mipper_prog and merger_prog against
+// stripe_mips(). Every round puts new data in the start of mip0, made of runs
+// where the channels in a random mask are all zeros, all ones, random or
+// sparse and the rest are random. That gets the counts out to 0 and 128 and
+// everything in between. Then both shaders run and have to match the CPU exactly.
+// Overwrites the test data in mip0, so it goes after everything else.
+
+void TraceMipper::check_striped(int rounds) {
+  const size_t check_samples = 1024 * 1024;
+  const size_t check_buckets = check_samples / 128;
+  const size_t check_merged  = check_buckets / 128;
+
+  uint8_t*  blob = new uint8_t[check_samples];
+  uint64_t* cpu1 = new uint64_t[check_buckets];
+  uint64_t* cpu2 = new uint64_t[check_merged];
+  uint64_t* gpu1 = new uint64_t[check_buckets];
+  uint64_t* gpu2 = new uint64_t[check_merged];
+
+  size_t bad1 = 0;
+  size_t bad2 = 0;
+
+  for (int round = 0; round < rounds; round++) {
+    for (size_t i = 0; i < check_samples;) {
+      size_t run = 1 + rng() % 4096;
+      if (run > check_samples - i) run = check_samples - i;
+      uint8_t mask = uint8_t(rng());
+      int mode = rng() % 4;
+      for (size_t j = 0; j < run; j++) {
+        uint8_t x = mode == 0 ? 0x00 : mode == 1 ? 0xFF : mode == 2 ? uint8_t(rng()) : uint8_t(rng() & rng() & rng());
+        blob[i + j] = (x & mask) | (uint8_t(rng()) & ~mask);
+      }
+      i += run;
+    }
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, mip0_ssbo);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, check_samples, blob);
+
+    bind_compute_shader(mipper_prog);
+    dispatch(mipper_prog, mip0_ssbo, check_samples, 128, mip1_ssbo, check_buckets * 8, 8, false);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    bind_compute_shader(merger_prog);
+    dispatch(merger_prog, mip1_ssbo, check_buckets * 8, 1024, mip2_ssbo, check_merged * 8, 8, false);
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, mip1_ssbo);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, check_buckets * 8, gpu1);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, mip2_ssbo);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, check_merged * 8, gpu2);
+
+    stripe_mips(blob, check_samples, cpu1, cpu2);
+    for (size_t i = 0; i < check_buckets; i++) bad1 += gpu1[i] != cpu1[i];
+    for (size_t i = 0; i < check_merged; i++)  bad2 += gpu2[i] != cpu2[i];
+  }
+  log("Striped check: %d rounds, %ld bad mip1, %ld bad mip2", rounds, bad1, bad2);
+
+  delete [] blob;
+  delete [] cpu1;
+  delete [] cpu2;
+  delete [] gpu1;
+  delete [] gpu2;
+}
+
+//------------------------------------------------------------------------------
+// Runs the striped mipper and merger built for sample_bytes-wide samples over
+// the test data in mip0, which doesn't care what width we read it as. The
+// output takes up exactly as many bytes as the 8-channel version, so it goes
+// in mip1/mip2. Then compares the start of both against update_mips() on
+// every channel.
+
+void TraceMipper::check_wide(int sample_bytes) {
+  const size_t check_samples = 1024 * 1024;
+  const size_t check_buckets = check_samples / 128;
+  int channels = sample_bytes * 8;
+  size_t entry_bytes = 8 * sample_bytes;
+
+  char defines[64];
+  snprintf(defines, sizeof(defines), "#define SAMPLE_BYTES %d\n", sample_bytes);
+  int mipper = create_compute_shader("TraceMipperWide", mipper_glsl_64, tuning.mipper_local, defines);
+  int merger = create_compute_shader("TraceMergerWide", merger_glsl_64, tuning.mipper_local, defines);
+
+  bind_compute_shader(mipper);
+  glFinish();
+  glBeginQuery(GL_TIME_ELAPSED, queries[7]);
+  dispatch(mipper, mip0_ssbo, mip0_size_bytes, 128 * sample_bytes, mip1_ssbo, mip1_size_bytes, entry_bytes, false);
+  glFinish();
+  glEndQuery(GL_TIME_ELAPSED);
+
+  GLuint64 time;
+  glGetQueryObjectui64v(queries[7], GL_QUERY_RESULT, &time);
+  double seconds = double(time) * 1.0e-9;
+  log("%d-channel mipper: %f usec, gs/sec %f", channels, seconds * 1.0e6,
+      (mip0_size_bytes / sample_bytes) / seconds / 1.0e9);
+
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+  bind_compute_shader(merger);
+  dispatch(merger, mip1_ssbo, mip1_size_bytes, 1024 * sample_bytes, mip2_ssbo, mip2_size_bytes, entry_bytes, false);
+  glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+
+  TraceBuffer trace;
+  trace.samples  = check_samples;
+  trace.channels = channels;
+  trace.stride   = channels;
+  trace.ssbo_len = check_samples * sample_bytes;
+  trace.ssbo     = -1;
+  trace.blob     = new uint8_t[trace.ssbo_len];
+
+  uint8_t* gpu_mip1 = new uint8_t[check_buckets * entry_bytes];
+  uint8_t* gpu_mip2 = new uint8_t[check_buckets / 128 * entry_bytes];
+
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, mip0_ssbo);
+  glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, trace.ssbo_len, trace.blob);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, mip1_ssbo);
+  glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, check_buckets * entry_bytes, gpu_mip1);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, mip2_ssbo);
+  glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, check_buckets / 128 * entry_bytes, gpu_mip2);
+
+  size_t bad1 = 0;
+  size_t bad2 = 0;
+  MipBuffer mips;
+  alloc_mips(mips, check_samples);
+  for (int c = 0; c < channels; c++) {
+    update_mips(trace, c, 0, check_samples, mips);
+    for (size_t i = 0; i < check_buckets; i++) {
+      if (gpu_mip1[i * entry_bytes + c] != mips.mip[1][i]) bad1++;
+    }
+    for (size_t i = 0; i < check_buckets / 128; i++) {
+      if (gpu_mip2[i * entry_bytes + c] != mips.mip[2][i]) bad2++;
+    }
+  }
+  log("%d-channel check: %ld bad mip1, %ld bad mip2", channels, bad1, bad2);
+
+  free_mips(mips);
+  delete [] gpu_mip1;
+  delete [] gpu_mip2;
+  delete [] (uint8_t*)trace.blob;
+  glDeleteProgram(mipper);
+  glDeleteProgram(merger);
+}
+
+//------------------------------------------------------------------------------
+// Builds full pyramids from the test data in mip0 in two appends, reads them
+// back and compares them against update_mips(), then times a full 8-channel
+// build.
+
+void TraceMipper::check_pyramid() {
+  const size_t check_samples = 3 * 1024 * 1024 + 12345;
+  const size_t first_samples = check_samples / 3;
+
+  TraceBuffer trace;
+  trace.samples  = first_samples;
+  trace.channels = 8;
+  trace.stride   = 8;
+  trace.ssbo_len = mip0_size_bytes;
+  trace.ssbo     = mip0_ssbo;
+  trace.blob     = new uint8_t[check_samples];
+
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, mip0_ssbo);
+  glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, check_samples, trace.blob);
+
+  MipBuffer gpu[8];
+  for (int c = 0; c < 8; c++) {
+    alloc_mips(gpu[c], check_samples, false, true);
+    layout_mips(gpu[c]);
+    gpu[c].ssbo = create_ssbo(gpu[c].ssbo_len);
+    build(trace, gpu[c], c, 0, first_samples);
+  }
+
+  // Second append doesn't start on a bucket boundary.
+  trace.samples = check_samples;
+  for (int c = 0; c < 8; c++) build(trace, gpu[c], c, first_samples, check_samples);
+  glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+
+  size_t bad_mips  = 0;
+  size_t bad_edges = 0;
+  for (int c = 0; c < 8; c++) {
+    MipBuffer cpu;
+    alloc_mips(cpu, check_samples, false, true);
+    update_mips(trace, c, 0, check_samples, cpu);
+
+    MipBuffer& m = gpu[c];
+    uint8_t* buf = new uint8_t[m.ssbo_len];
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m.ssbo);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, m.ssbo_len, buf);
+
+    auto compare = [&](const void* want, size_t elem_size, size_t len, size_t offset) {
+      size_t bad = 0;
+      for (size_t i = 0; i < len; i++) {
+        if (memcmp((const uint8_t*)want + i * elem_size, buf + offset + i * elem_size, elem_size)) bad++;
+      }
+      return bad;
+    };
+
+    bad_mips  += compare(cpu.mip[1],  1, cpu.mip_len[1], m.mip1_offset);
+    bad_mips  += compare(cpu.mip[2],  1, cpu.mip_len[2], m.mip2_offset);
+    bad_mips  += compare(cpu.mip[3],  1, cpu.mip_len[3], m.mip3_offset);
+    bad_mips  += compare(cpu.mip[4],  1, cpu.mip_len[4], m.mip4_offset);
+    bad_edges += compare(cpu.edge1, 1, cpu.mip_len[1], m.edge1_offset);
+    bad_edges += compare(cpu.edge2, 2, cpu.mip_len[2], m.edge2_offset);
+    bad_edges += compare(cpu.edge3, 4, cpu.mip_len[3], m.edge3_offset);
+    bad_edges += compare(cpu.edge4, 4, cpu.mip_len[4], m.edge4_offset);
+
+    delete [] buf;
+    free_mips(cpu);
+  }
+  log("Pyramid check: %ld bad mip entries, %ld bad edge entries", bad_mips, bad_edges);
+
+  for (int c = 0; c < 8; c++) {
+    GLuint ssbo = gpu[c].ssbo;
+    glDeleteBuffers(1, &ssbo);
+    free_mips(gpu[c]);
+  }
+
+  //----------------------------------------
+  // Time every channel of the whole test buffer
+
+  trace.samples = num_samples;
+
+  MipBuffer mips;
+  alloc_mips(mips, num_samples, false, true);
+  layout_mips(mips);
+  mips.ssbo = create_ssbo(mips.ssbo_len);
+
+  glFinish();
+  glBeginQuery(GL_TIME_ELAPSED, queries[5]);
+  for (int c = 0; c < 8; c++) build(trace, mips, c, 0, num_samples);
+  glFinish();
+  glEndQuery(GL_TIME_ELAPSED);
+
+  GLuint64 time;
+  glGetQueryObjectui64v(queries[5], GL_QUERY_RESULT, &time);
+  double seconds = double(time) * 1.0e-9;
+  log("Pyramid build, 8 channels: %f usec, gs/sec %f", seconds * 1.0e6, num_samples / seconds / 1.0e9);
+
+  GLuint ssbo = mips.ssbo;
+  glDeleteBuffers(1, &ssbo);
+  free_mips(mips);
+  delete [] (uint8_t*)trace.blob;
+}
+
+//------------------------------------------------------------------------------
+// Striped mipper variants the tuner gets to pick from. They all take 128 bytes
+// of mip0 and write 8 bytes of mip1 per invocation.
+
+struct MipperVariant {
+  const char* name;
+  const char* src;
+};
+
+static const MipperVariant mipper_variants[] = {
+  { "TraceMipper64", mipper_glsl_64 },
+  { "TraceMipper32", mipper_glsl_32 },
+};
+static const int mipper_variant_count = sizeof(mipper_variants) / sizeof(mipper_variants[0]);
+
+static const int tune_locals[]  = { 32, 64, 128, 256 };
+static const int tune_buckets[] = { 4, 8, 16 };
+
+// Bump this whenever the shaders change, so old results get retuned.
+static const int tune_version = 1;
+
+// mipper_tune.txt in the per-user directory SDL picks for us, so every launch
+// on this machine shares one no matter where it was started from. Falls back
+// to the working directory if there isn't one.
+static const char* tune_path() {
+  static char path[1024] = {};
+  if (!path[0]) {
+    char* pref = SDL_GetPrefPath("ZoomyTrace", "ZoomyTrace");
+    snprintf(path, sizeof(path), "%smipper_tune.txt", pref ? pref : "");
+    SDL_free(pref);
+  }
+  return path;
+}
+
+static int create_pyramid1(int local_size, int buckets) {
+  char name[64];
+  char defines[64];
+  snprintf(name, sizeof(name), "TracePyramid1 %d x %d", local_size, buckets);
+  snprintf(defines, sizeof(defines), "#define BUCKETS %d\n", buckets);
+  return create_compute_shader(name, pyramid1_glsl, local_size, defines);
+}
+
+static bool linked(int prog) {
+  int result = 0;
+  glGetProgramiv(prog, GL_LINK_STATUS, &result);
+  return result != GL_FALSE;
+}
+
+// Best of three, after a warmup run.
+template<typename F>
+static double time_best(uint32_t query, int reps, F f) {
+  f();
+  double best = 1.0e100;
+  for (int top_rep = 0; top_rep < 3; top_rep++) {
+    glFinish();
+    glBeginQuery(GL_TIME_ELAPSED, query);
+    for (int rep = 0; rep < reps; rep++) f();
+    glEndQuery(GL_TIME_ELAPSED);
+
+    GLuint64 time = 0;
+    glGetQueryObjectui64v(query, GL_QUERY_RESULT, &time);
+    double seconds = double(time) * 1.0e-9 / reps;
+    if (seconds < best) best = seconds;
+  }
+  return best;
+}
+
+//------------------------------------------------------------------------------
+// Every candidate has to match the CPU on the first check_samples of the test
+// data before its time counts - a variant that's fast because the driver
+// miscompiled it is no use to us.
+
+void TraceMipper::tune() {
+  const char* renderer = (const char*)glGetString(GL_RENDERER);
+  if (!renderer) renderer = "unknown";
+
+  if (load_tuning(renderer)) {
+    log("Mipper tuning for \"%s\" loaded from %s", renderer, tune_path());
+  }
+  else {
+    log("Tuning mippers for \"%s\"", renderer);
+
+    const size_t check_samples = 1024 * 1024;
+    const size_t check_buckets = check_samples / 128;
+    const int reps = 5;
+
+    TraceBuffer trace;
+    trace.samples  = num_samples;
+    trace.channels = 8;
+    trace.stride   = 8;
+    trace.ssbo_len = mip0_size_bytes;
+    trace.ssbo     = mip0_ssbo;
+    trace.blob     = new uint8_t[check_samples];
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, mip0_ssbo);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, check_samples, trace.blob);
+
+    // Striped reference - byte c of entry i counts channel c over bucket i.
+    uint8_t* want = new uint8_t[check_buckets * 8];
+    uint8_t* got  = new uint8_t[check_buckets * 8];
+    const uint8_t* blob = (const uint8_t*)trace.blob;
+    for (size_t i = 0; i < check_buckets; i++) {
+      for (int c = 0; c < 8; c++) {
+        int total = 0;
+        for (int j = 0; j < 128; j++) total += (blob[i * 128 + j] >> c) & 1;
+        want[i * 8 + c] = uint8_t(total);
+      }
+    }
+
+    //----------------------------------------
+    // Striped mipper - variant x work group size
+
+    double best_mipper = 1.0e100;
+
+    for (int v = 0; v < mipper_variant_count; v++) {
+      for (int local_size : tune_locals) {
+        int prog = create_compute_shader(mipper_variants[v].name, mipper_variants[v].src, local_size, nullptr);
+        if (!linked(prog)) {
+          log("  %s x %d didn't link, skipping", mipper_variants[v].name, local_size);
+          glDeleteProgram(prog);
+          continue;
+        }
+
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, mip1_ssbo);
+        glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R8UI, GL_RED_INTEGER, GL_UNSIGNED_BYTE, nullptr);
+
+        bind_compute_shader(prog);
+        double seconds = time_best(queries[6], reps, [&]() {
+          dispatch(prog, mip0_ssbo, mip0_size_bytes, 128, mip1_ssbo, mip1_size_bytes, 8, false);
+        });
+
+        glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, mip1_ssbo);
+        glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, check_buckets * 8, got);
+        bool good = memcmp(want, got, check_buckets * 8) == 0;
+
+        log("  %s x %3d: %8.2f gs/sec%s", mipper_variants[v].name, local_size,
+            num_samples / seconds / 1.0e9, good ? "" : "  BAD OUTPUT");
+
+        if (good && seconds < best_mipper) {
+          best_mipper = seconds;
+          tuning.mipper_variant = v;
+          tuning.mipper_local   = local_size;
+        }
+        glDeleteProgram(prog);
+      }
+    }
+
+    //----------------------------------------
+    // Pyramid level 1 - work group size x buckets per invocation. Times a
+    // whole one-channel build(), the merges are the same for all of them.
+
+    MipBuffer cpu;
+    alloc_mips(cpu, check_samples, false, true);
+    trace.samples = check_samples;
+    update_mips(trace, 0, 0, check_samples, cpu);
+    trace.samples = num_samples;
+
+    MipBuffer mips;
+    alloc_mips(mips, num_samples, false, true);
+    layout_mips(mips);
+    mips.ssbo = create_ssbo(mips.ssbo_len);
+
+    // Only the first batch ever reads the blob, and we only have a bit of it.
+    assert(num_samples <= pyramid_batch * 512);
+
+    MipperTuning best_tuning = tuning;
+    double best_pyramid = 1.0e100;
+
+    for (int local_size : tune_locals) {
+      for (int buckets : tune_buckets) {
+        int prog = create_pyramid1(local_size, buckets);
+        if (!linked(prog)) {
+          log("  TracePyramid1 %d x %d didn't link, skipping", local_size, buckets);
+          glDeleteProgram(prog);
+          continue;
+        }
+
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, mips.ssbo);
+        glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R8UI, GL_RED_INTEGER, GL_UNSIGNED_BYTE, nullptr);
+
+        pyramid1_prog = prog;
+        tuning.pyramid_buckets = buckets;
+        double seconds = time_best(queries[6], reps, [&]() {
+          build(trace, mips, 0, 0, num_samples);
+        });
+
+        glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, mips.ssbo);
+        glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, mips.mip1_offset, check_buckets, got);
+        bool good = memcmp(cpu.mip[1], got, check_buckets) == 0;
+        glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, mips.edge1_offset, check_buckets, got);
+        good = good && memcmp(cpu.edge1, got, check_buckets) == 0;
+
+        log("  TracePyramid1 %3d x %2d: %8.2f gs/sec%s", local_size, buckets,
+            num_samples / seconds / 1.0e9, good ? "" : "  BAD OUTPUT");
+
+        if (good && seconds < best_pyramid) {
+          best_pyramid = seconds;
+          best_tuning.pyramid_local   = local_size;
+          best_tuning.pyramid_buckets = buckets;
+        }
+        glDeleteProgram(prog);
+      }
+    }
+
+    tuning.pyramid_local   = best_tuning.pyramid_local;
+    tuning.pyramid_buckets = best_tuning.pyramid_buckets;
+
+    GLuint ssbo = mips.ssbo;
+    glDeleteBuffers(1, &ssbo);
+    free_mips(mips);
+    free_mips(cpu);
+    delete [] want;
+    delete [] got;
+    delete [] (uint8_t*)trace.blob;
+
+    // Nothing passed - keep the defaults, but don't cache them.
+    if (best_mipper == 1.0e100 || best_pyramid == 1.0e100) {
+      log("Mipper tuning failed, using defaults");
+      tuning = {};
+    }
+    else {
+      save_tuning(renderer);
+    }
+  }
+
+  log("Mipper tuning: %s x %d, pyramid1 %d x %d buckets",
+      mipper_variants[tuning.mipper_variant].name, tuning.mipper_local,
+      tuning.pyramid_local, tuning.pyramid_buckets);
+
+  const MipperVariant& variant = mipper_variants[tuning.mipper_variant];
+  mipper_prog   = create_compute_shader(variant.name, variant.src, tuning.mipper_local, nullptr);
+  pyramid1_prog = create_pyramid1(tuning.pyramid_local, tuning.pyramid_buckets);
 }
+
+//------------------------------------------------------------------------------
+// One line per renderer - "version<tab>renderer<tab>variant local local buckets".
+// Renderer strings have spaces in them but never tabs. Lines with sizes the
+// tuner wouldn't have picked get ignored, so a hand-edited or old file can't
+// build a mipper nobody checked.
+
+template<int N>
+static bool one_of(int x, const int (&list)[N]) {
+  for (int v : list) if (v == x) return true;
+  return false;
+}
+
+// True if [line, end) is a line for this renderer, whatever its version.
+static bool renderer_line(const char* line, const char* end, const char* renderer) {
+  const char* tab1 = (const char*)memchr(line, '\t', end - line);
+  const char* tab2 = tab1 ? (const char*)memchr(tab1 + 1, '\t', end - tab1 - 1) : nullptr;
+  if (!tab2) return false;
+  size_t len = strlen(renderer);
+  return size_t(tab2 - tab1 - 1) == len && memcmp(tab1 + 1, renderer, len) == 0;
+}
+
+bool TraceMipper::load_tuning(const char* renderer) {
+  FILE* f = fopen(tune_path(), "r");
+  if (!f) return false;
+
+  bool found = false;
+  char line[512];
+  while (!found && fgets(line, sizeof(line), f)) {
+    char* tab1 = strchr(line, '\t');
+    char* tab2 = tab1 ? strchr(tab1 + 1, '\t') : nullptr;
+    if (!tab2) continue;
+    *tab1 = 0;
+    *tab2 = 0;
+    if (atoi(line) != tune_version || strcmp(tab1 + 1, renderer) != 0) continue;
+
+    MipperTuning t;
+    if (sscanf(tab2 + 1, "%d %d %d %d", &t.mipper_variant, &t.mipper_local,
+               &t.pyramid_local, &t.pyramid_buckets) != 4) continue;
+    if (t.mipper_variant < 0 || t.mipper_variant >= mipper_variant_count) continue;
+    if (!one_of(t.mipper_local, tune_locals) || !one_of(t.pyramid_local, tune_locals) ||
+        !one_of(t.pyramid_buckets, tune_buckets)) {
+      log("Ignoring mipper tuning %d %d %d %d from %s, not sizes the tuner tries",
+          t.mipper_variant, t.mipper_local, t.pyramid_local, t.pyramid_buckets, tune_path());
+      continue;
+    }
+
+    tuning = t;
+    found = true;
+  }
+
+  fclose(f);
+  return found;
+}
+
+// Rewrites the file with this renderer's line replaced in place - other GPUs'
+// lines stay put, and stale lines for this one from older versions go, so
+// retuning doesn't grow the file.
+
+void TraceMipper::save_tuning(const char* renderer) {
+  char* old = nullptr;
+  if (FILE* f = fopen(tune_path(), "rb")) {
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    old = new char[len > 0 ? len + 1 : 1];
+    len = len > 0 ? long(fread(old, 1, len, f)) : 0;
+    old[len] = 0;
+    fclose(f);
+  }
+
+  FILE* f = fopen(tune_path(), "w");
+  if (!f) {
+    log("Couldn't write %s", tune_path());
+    delete [] old;
+    return;
+  }
+
+  auto write_ours = [&]() {
+    fprintf(f, "%d\t%s\t%d %d %d %d\n", tune_version, renderer,
+            tuning.mipper_variant, tuning.mipper_local,
+            tuning.pyramid_local, tuning.pyramid_buckets);
+  };
+
+  bool written = false;
+  for (const char* line = old; line && *line;) {
+    const char* end = strchr(line, '\n');
+    const char* next = end ? end + 1 : line + strlen(line);
+    if (!renderer_line(line, next, renderer)) {
+      fwrite(line, 1, next - line, f);
+      if (!end) fputc('\n', f);
+    }
+    else if (!written) {
+      write_ours();
+      written = true;
+    }
+    line = next;
+  }
+  if (!written) write_ours();
+
+  fclose(f);
+  delete [] old;
+}
+
+//------------------------------------------------------------------------------
@@ -7,18 +7,89 @@ struct MipperUniforms {
   uint32_t channels;
   uint32_t stride;
   uint32_t channel;
+  uint32_t skew;
+  uint32_t pad[3];
+};
+
+struct PyramidUniforms {
+  uint32_t count;
+  uint32_t valid;
+  uint32_t stride;
+  uint32_t mask;
+  uint32_t prev;
+  uint32_t first;
+  uint32_t edges;
+  uint32_t in_bits;
+  uint32_t out_bits;
+  uint32_t average;
+  uint32_t pad[2];
+};
+
+struct TraceBuffer;
+struct MipBuffer;
+struct GpuProfiler;
+
+// What the startup autotuner picked for this device. Index into
+// mipper_variants[] for the striped mipper, work group sizes for both, and
+// how many 128-sample buckets each pyramid1 invocation does.
+struct MipperTuning {
+  int mipper_variant  = 0;
+  int mipper_local    = 64;
+  int pyramid_local   = 64;
+  int pyramid_buckets = 4;
 };
 
 struct TraceMipper {
 
   void init();
   void exit();
+  // Times the mipper on the test data and runs every check below against the
+  // CPU. Only logs, and takes a while - main calls it for --gpu-checks.
   void run(int trace_ssbo, int mip_ssbo);
+  void check_edges();
+  void check_wide(int sample_bytes);
+  void check_pyramid();
+
+  // Randomized test of the striped mipper and merger against stripe_mips().
+  void check_striped(int rounds);
+
+  // Benchmarks the striped mipper and pyramid1 variants on this device and
+  // builds whichever were fastest. Results get cached in tune_path(), keyed by
+  // the GL renderer string, so we only pay for it once per GPU.
+  void tune();
+  bool load_tuning(const char* renderer);
+  void save_tuning(const char* renderer);
+
+  // Rebuilds levels 1 through gpu_mip_levels of one channel's pyramid covering
+  // samples [sample_min, sample_max) straight into mips.ssbo, which has to be
+  // laid out by layout_mips(). The CPU-only levels above those aren't touched.
+  // The trace has to be on the GPU already, sharded or not, and still in
+  // trace.blob on the CPU - each batch past the first reads the word before
+  // it from there for its first edge. Edges get built too if the MipBuffer
+  // has an edge pyramid.
+  void build(TraceBuffer& trace, MipBuffer& mips, int channel, size_t sample_min, size_t sample_max);
+  void merge_level(uint32_t ssbo, size_t src_offset, size_t src_len, int src_bits,
+                   size_t dst_offset, int dst_bits, bool average,
+                   size_t& level_min, size_t& level_max);
+  void dispatch_pyramid(uint32_t prog, size_t count);
+  void dispatch(uint32_t prog,
+                uint32_t in_ssbo,  size_t in_size,  size_t in_stride,
+                uint32_t out_ssbo, size_t out_size, size_t out_stride,
+                bool overlap);
 
   uint32_t mipper_prog;
   uint32_t mipper_ubo;
 
   uint32_t merger_prog;
+  uint32_t edger_prog;
+  uint32_t edge_merger_prog;
+
+  uint32_t pyramid1_prog;
+  uint32_t pyramid_merge_prog;
+  uint32_t pyramid_ubo;
+  PyramidUniforms pyramid_uniforms;
+
+  MipperTuning tuning;
 
   size_t num_samples;
   size_t num_channels;
@@ -31,7 +102,19 @@ struct TraceMipper {
   uint32_t mip1_ssbo;
   uint32_t mip2_ssbo;
 
+  size_t edge1_size_bytes;
+  size_t edge2_size_bytes;
+
+  uint32_t edge1_ssbo;
+  uint32_t edge2_ssbo;
+
+  size_t max_groups;
+  size_t skew_bytes;
+
   uint32_t queries[32];
 
+  // build() marks its passes in here if it's set.
+  GpuProfiler* profiler = nullptr;
+
   MipperUniforms uniforms;
 };
@@ -3,35 +3,125 @@
 #include "GLBase.h"
 #include "third_party/glad/glad.h"
 #include "ViewController.hpp"
+#include "TraceUploader.hpp"
+#include "log.hpp"
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
 
 using namespace glm;
 
 uint32_t rng();
 
 //-----------------------------------------------------------------------------
+// 64-bit integer math with no fp64 and no int64 - values are two's complement
+// in a uvec2, low word first. For GPUs that emulate int64 or run it slowly.
+// The TRACE_UVEC2 trace shader and the coverage shader get this pasted in.
 
-const char* trace_glsl = R"(
+const char* uvec2_glsl = R"(
 
-layout(std140) uniform TraceUniforms
-{
+uvec2 add64(uvec2 a, uvec2 b) {
+  uint carry;
+  uint lo = uaddCarry(a.x, b.x, carry);
+  return uvec2(lo, a.y + b.y + carry);
+}
+
+uvec2 sub64(uvec2 a, uvec2 b) {
+  uint borrow;
+  uint lo = usubBorrow(a.x, b.x, borrow);
+  return uvec2(lo, a.y - b.y - borrow);
+}
+
+uvec2 mul64(uvec2 a, uint b) {
+  uint hi, lo;
+  umulExtended(a.x, b, hi, lo);
+  return uvec2(lo, hi + a.y * b);
+}
+
+// Logical shifts, 0 < s < 32.
+uvec2 shr64(uvec2 a, int s) {
+  return uvec2((a.x >> s) | (a.y << (32 - s)), a.y >> s);
+}
+
+uvec2 shl64(uvec2 a, int s) {
+  return uvec2(a.x << s, (a.y << s) | (a.x >> (32 - s)));
+}
+
+// Clears the low s bits, 0 <= s < 64.
+uvec2 floor64(uvec2 a, int s) {
+  if (s < 32) return uvec2(a.x & ~((1u << s) - 1u), a.y);
+  return uvec2(0u, a.y & ~((1u << (s - 32)) - 1u));
+}
+
+bool lt64(uvec2 a, uvec2 b) {
+  return a.y < b.y || (a.y == b.y && a.x < b.x);
+}
+
+bool neg64(uvec2 a) {
+  return (a.y & 0x80000000u) != 0u;
+}
+
+float to_float(uvec2 a) {
+  return float(a.y) * 4294967296.0 + float(a.x);
+}
+
+)";
+
+//-----------------------------------------------------------------------------
+// Per-lane state for the trace and copy shaders, see TracePainter::Lane. Both
+// get this pasted in front of them.
+
+const char* lane_struct_glsl = R"(
+
+struct Lane {
   float  blit_x;
   float  blit_y;
   float  blit_w;
   float  blit_h;
-  vec4   screen_size;
-  double scale;
-  double offset;
-  uint   stride;
+  uint   ring_offset;
+  int    ring_row;
+  int    cover;
+  uint   shade_mode;
+  int    offset_hi;     // First sample of the view, split - see SamplePos
+  uint   offset_lo;
+  float  offset_frac;
+  float  scale;         // Samples per pixel
+  uint   origin_fx_lo;  // TRACE_UVEC2 only - the sample under the center of
+  uint   origin_fx_hi;  // column 0 and the step between columns, fixed point,
+  uint   step_fx_lo;    // see SampleFx
+  uint   step_fx_hi;
+  uint   fx_bits;       // Fraction bits in the two above, 1 to 24
   uint   channel;
+  uint   plane;         // Word offset of the channel's plane in Mip0/Mip0Next
   int    miplevel;
+  uint   mip_base[4];   // Word offsets of levels 1-4 in Mips
+  uint   edge_base[4];
 };
 
-layout(std430, binding = 0) buffer Mip0 { uint mip0[]; };
-layout(std430, binding = 1) buffer Mip1 { uint mip1[]; };
-layout(std430, binding = 2) buffer Mip2 { uint mip2[]; };
-layout(std430, binding = 3) buffer Mip3 { uint mip3[]; };
-layout(std430, binding = 4) buffer Mip4 { uint mip4[]; };
+)";
+
+//-----------------------------------------------------------------------------
+// Shades trace columns, one instance per lane. Everything that differs
+// between channels comes out of the Lanes buffer, and every channel's mips
+// are in the one Mips buffer, so any number of lanes is one draw.
+
+const char* trace_glsl = R"(
+
+layout(std140) uniform TraceUniforms
+{
+  vec4   screen_size;
+  uint   samples_lo;
+  uint   samples_hi;
+  uint   stride;
+  uint   shard_base_lo; // First sample of the trace shard bound to Mip0
+  uint   shard_base_hi;
+  uint   shard_samples; // Samples per shard, the next one is bound to Mip0Next
+};
+
+layout(std430, binding = 0) readonly buffer Mip0 { uint mip0[]; };
+layout(std430, binding = 9) readonly buffer Mip0Next { uint mip0_next[]; };
+layout(std430, binding = 1) readonly buffer Mips { uint mips[]; };
+layout(std430, binding = 2) readonly buffer Lanes { Lane lanes[]; };
 
 float remap(float x, float a1, float a2, float b1, float b2) {
   x = (x - a1) / (a2 - a1);
@@ -43,20 +133,22 @@ float remap(float x, float a1, float a2, float b1, float b2) {
 
 #ifdef _VERTEX_
 
-out vec2 ftex;
+flat out int lane_index;
 
 void main() {
+  Lane lane = lanes[gl_InstanceID];
 
   float vpos_x = float((gl_VertexID >> 0) & 1);
   float vpos_y = float((gl_VertexID >> 1) & 1);
 
-  float screen_x = vpos_x * blit_w + blit_x;
-  float screen_y = vpos_y * blit_h + blit_y;
+  float screen_x = vpos_x * lane.blit_w + lane.blit_x;
+  float screen_y = vpos_y * lane.blit_h + lane.blit_y;
 
   float norm_x = (screen_x * screen_size.z) * 2.0 - 1.0;
   float norm_y = (screen_y * screen_size.w) * 2.0 - 1.0;
 
   gl_Position = vec4(norm_x, -norm_y, 0.0, 1.0);
+  lane_index = gl_InstanceID;
 }
 
 #endif
@@ -65,78 +157,474 @@ void main() {
 
 #ifdef _FRAGMENT_
 
+flat in int lane_index;
+
 out vec4 frag;
 
+// This fragment's lane, loaded at the top of main().
+Lane lane;
+
+// The sample under this fragment, and the two ways of finding it. Everything
+// below only asks for bucket(level) and mip0_bit(), so the shading is the same
+// for both.
+
+#ifdef TRACE_UVEC2
+
+//----------------------------------------
+// Integer-only - no fp64, no int64, see uvec2_glsl.
+
+uvec2 x;
+
+bool find_sample() {
+  uvec2 pos = add64(uvec2(lane.origin_fx_lo, lane.origin_fx_hi),
+                    mul64(uvec2(lane.step_fx_lo, lane.step_fx_hi), uint(gl_FragCoord.x)));
+  if (neg64(pos)) return false;
+  x = shr64(pos, int(lane.fx_bits));
+  return lt64(x, uvec2(samples_lo, samples_hi));
+}
+
+uint bucket(int level) {
+  return shr64(x, 7 * level).x;
+}
+
+// -1 if the sample isn't in either of the bound shards.
+int mip0_bit() {
+  uvec2 local = sub64(x, uvec2(shard_base_lo, shard_base_hi));
+  if (lt64(local, uvec2(shard_samples, 0))) {
+    uvec2 bit_index = add64(mul64(local, stride), uvec2(lane.channel, 0));
+    return int(bitfieldExtract(mip0[lane.plane + shr64(bit_index, 5).x], int(bit_index.x & 31), 1));
+  }
+  local = sub64(local, uvec2(shard_samples, 0));
+  if (lt64(local, uvec2(shard_samples, 0))) {
+    uvec2 bit_index = add64(mul64(local, stride), uvec2(lane.channel, 0));
+    return int(bitfieldExtract(mip0_next[lane.plane + shr64(bit_index, 5).x], int(bit_index.x & 31), 1));
+  }
+  return -1;
+}
+
+#else
+
+//----------------------------------------
+// Signed 64-bit integer origin plus a float offset across the view. The float
+// part only ever holds the offset from the left edge of the view.
+
+uint64_t x;
+
+bool find_sample() {
+  int64_t origin = int64_t(packUint2x32(uvec2(lane.offset_lo, uint(lane.offset_hi))));
+  int64_t pos = origin + int64_t(floor(lane.offset_frac + gl_FragCoord.x * lane.scale));
+  if (pos < 0 || uint64_t(pos) >= packUint2x32(uvec2(samples_lo, samples_hi))) return false;
+  x = uint64_t(pos);
+  return true;
+}
+
+uint bucket(int level) {
+  return uint(x >> (7 * level));
+}
+
+// Bit indices stay 64-bit until they're relative to a shard. Shards stop at
+// 2^31 samples and one storage block, see create_trace_ssbo(), so the word
+// index always fits in a uint by then, plane and all.
+int mip0_bit() {
+  uint64_t local = x - packUint2x32(uvec2(shard_base_lo, shard_base_hi));
+  if (local < uint64_t(shard_samples)) {
+    uint64_t bit_index = local * stride + lane.channel;
+    return int(bitfieldExtract(mip0[lane.plane + uint(bit_index >> 5)], int(bit_index & 31), 1));
+  }
+  else if (local < 2 * uint64_t(shard_samples)) {
+    uint64_t bit_index = (local - shard_samples) * stride + lane.channel;
+    return int(bitfieldExtract(mip0_next[lane.plane + uint(bit_index >> 5)], int(bit_index & 31), 1));
+  }
+  return -1;
+}
+
+#endif
+
+//----------------------------------------
+
+// Bucket brightness for density levels, one byte per bucket.
+vec4 density(uint word, uint index) {
+  uint byte = bitfieldExtract(word, int(index & 3) * 8, 8);
+  float t = float(byte) / 255.0;
+  return vec4(t, t, t, 1);
+}
+
 void main() {
-  double x = double(gl_FragCoord.x) * scale + offset;
+  lane = lanes[lane_index];
 
-  if (x < 0.0) {
+  if (!find_sample()) {
     frag = vec4(0,0,0.2,1);
     return;
   }
-  if (x >= 4294967296.0) {
-    frag = vec4(0,0,0.2,1);
+
+  // Activity shading - brightness follows how many transitions the bucket
+  // has, on a log scale with a floor so that a single edge is still visible.
+  // Reads the edge pyramid only, never mip0.
+  if (lane.shade_mode == 1) {
+    int level = max(lane.miplevel, 1);
+    uint  edges = 0;
+    float max_edges = 1.0;
+
+    if (level == 1) {
+      uint index = bucket(1);
+      edges = bitfieldExtract(mips[lane.edge_base[0] + (index >> 2)], int(index & 3) * 8, 8);
+      max_edges = 128.0;
+    }
+    else if (level == 2) {
+      uint index = bucket(2);
+      edges = bitfieldExtract(mips[lane.edge_base[1] + (index >> 1)], int(index & 1) * 16, 16);
+      max_edges = 128.0 * 128.0;
+    }
+    else if (level == 3) {
+      edges = mips[lane.edge_base[2] + bucket(3)];
+      max_edges = 128.0 * 128.0 * 128.0;
+    }
+    else if (level == 4) {
+      edges = mips[lane.edge_base[3] + bucket(4)];
+      max_edges = 128.0 * 128.0 * 128.0 * 128.0;
+    }
+    else {
+      frag = vec4(0.2, 0.1, 0, 1);
+      return;
+    }
+
+    if (edges == 0) {
+      frag = vec4(0, 0, 0, 1);
+    }
+    else {
+      float t = 0.3 + 0.7 * log2(float(edges) + 1.0) / log2(max_edges + 1.0);
+      frag = vec4(t, t * 0.6, 0, 1);
+    }
     return;
   }
 
-  x = floor(x);
+  if (lane.miplevel == 0) {
+    // A view at level 0 is narrow enough to touch two shards at most.
+    int bit = mip0_bit();
+    if (bit < 0) {
+      frag = vec4(0.2, 0, 0.2, 1);
+      return;
+    }
+    frag = bit == 1 ? vec4(1,1,1,1) : vec4(0,0,0,1);
+  }
+  else if (lane.miplevel >= 1 && lane.miplevel <= 4) {
+    uint index = bucket(lane.miplevel);
+    frag = density(mips[lane.mip_base[lane.miplevel - 1] + (index >> 2)], index);
+  }
+  else {
+    frag = vec4(0, 0.2, 0.2, 1);
+  }
+}
 
-  if (miplevel == 0) {
-    double stride_index = x * stride + channel;
-    double word_index   = (stride_index) / 32.0;
-    double bit_index    = mod(stride_index, 32.0);
+#endif
 
-    uint bit = bitfieldExtract(mip0[int(word_index)], int(bit_index), 1);
+//------------------------------------------------------------------------------
 
-    frag = bit == 1 ? vec4(1,1,1,1) : vec4(0,0,0,1);
+)";
+
+//-----------------------------------------------------------------------------
+// Copies ring texture rows to the screen, one instance per lane. Each lane's
+// rect and row come out of the Lanes buffer, so any number of lanes is one
+// draw. Screen column X of a lane shows column (ring_offset + X) & ring_mask of
+// its row - of cover_tex for a coverage lane, ring_tex otherwise.
+
+const char* lane_glsl = R"(
+
+layout(std140) uniform LaneUniforms
+{
+  vec4   screen_size;
+  uint   ring_mask;
+};
+
+layout(std430, binding = 0) readonly buffer Lanes { Lane lanes[]; };
+
+uniform sampler2D ring_tex;
+uniform sampler2D cover_tex;
+
+#ifdef _VERTEX_
+
+flat out uint lane_offset;
+flat out int  lane_row;
+flat out int  lane_cover;
+
+void main() {
+  Lane lane = lanes[gl_InstanceID];
+
+  float vpos_x = float((gl_VertexID >> 0) & 1);
+  float vpos_y = float((gl_VertexID >> 1) & 1);
+
+  float screen_x = vpos_x * lane.blit_w + lane.blit_x;
+  float screen_y = vpos_y * lane.blit_h + lane.blit_y;
+
+  float norm_x = (screen_x * screen_size.z) * 2.0 - 1.0;
+  float norm_y = (screen_y * screen_size.w) * 2.0 - 1.0;
+
+  gl_Position = vec4(norm_x, -norm_y, 0.0, 1.0);
+
+  lane_offset = lane.ring_offset;
+  lane_row    = lane.ring_row;
+  lane_cover  = lane.cover;
+}
+
+#endif
+
+#ifdef _FRAGMENT_
+
+flat in uint lane_offset;
+flat in int  lane_row;
+flat in int  lane_cover;
+
+out vec4 frag;
+
+void main() {
+  uint col = (lane_offset + uint(gl_FragCoord.x)) & ring_mask;
+  if (lane_cover != 0) {
+    float t = texelFetch(cover_tex, ivec2(int(col), lane_row), 0).r;
+    frag = t < 0.0 ? vec4(0, 0, 0.2, 1) : vec4(t, t, t, 1);
+  }
+  else {
+    frag = texelFetch(ring_tex, ivec2(int(col), lane_row), 0);
   }
-  else if (miplevel == 1) {
-    x /= 128;
-    double word_index = x / 4;
-    double byte_index = mod(x, 4);
-    uint byte = bitfieldExtract(mip1[int(word_index)], int(byte_index) * 8, 8);
+}
+
+#endif
 
-    float t = float(byte) / 255.0;
-    frag = vec4(t, t, t, 1);
+)";
+
+struct LaneUniforms {
+  vec4     screen_size;
+  uint32_t ring_mask;
+  uint32_t pad[3];
+};
+
+//-----------------------------------------------------------------------------
+// Coverage - the fraction of each column's span where the channel is high.
+// This is render_cover() from Bits.cpp, head and tail fractions and the mip
+// walk and all, with one invocation per column of a CoverLane - work group row
+// Y does lane Y, so one dispatch fills in runs for every channel. Columns
+// outside the trace get -1. Positions and totals are 64-bit, all of it in
+// uvec2s from uvec2_glsl.
+//
+// Level 0 reads come out of two shards, like trace_glsl. Only columns at most
+// 8192 samples wide walk mip0, so the shard a column starts in and the one
+// after it hold everything it reads. cover() runs a dispatch per shard, and a
+// column only gets written by the dispatch for the shard it starts in. Wider
+// columns only read mip0 if they end on a partial bucket at the end of the
+// trace, and there we add the last mip1 count instead - it's the number of
+// ones the walk would have found.
+
+const char* cover_glsl = R"(
+
+layout(std140) uniform CoverUniforms
+{
+  uint   step_lo;       // Samples per column, fixed point with fx_bits of
+  uint   step_hi;       // fraction - see CoverFx
+  int    fx_bits;
+  int    granule_bits;  // Span endpoints get rounded down to 2^granule_bits
+  uint   samples_lo;
+  uint   samples_hi;
+  uint   samples_fx_lo; // Same, in the fixed point
+  uint   samples_fx_hi;
+  uint   shard_a_lo;    // First sample of the shard bound to Mip0
+  uint   shard_a_hi;
+  uint   shard_b_lo;    // First sample of the shard bound to Mip0Next
+  uint   shard_b_hi;
+  uint   shard_samples;
+  uint   stride;
+  uint   own_all;       // Write every column, not just the ones starting in Mip0
+  uint   ring_mask;
+};
+
+struct CoverLane {
+  uint   origin_lo;     // Left edge of the first column, same fixed point
+  uint   origin_hi;
+  int    row;
+  int    col;
+  int    count;
+  uint   channel;
+  uint   plane;
+  uint   pad;
+  uint   mip_base[4];
+};
+
+layout(std430, binding = 0) readonly buffer Mip0 { uint mip0[]; };
+layout(std430, binding = 9) readonly buffer Mip0Next { uint mip0_next[]; };
+layout(std430, binding = 1) readonly buffer Mips { uint mips[]; };
+layout(std430, binding = 2) readonly buffer CoverLanes { CoverLane cover_lanes[]; };
+
+layout(r32f, binding = 0) uniform writeonly image2D cover_img;
+
+CoverLane lane;
+
+// Shard-local word indices fit in a uint, same as trace_glsl.
+uint get_bit(uvec2 index) {
+  uvec2 local = sub64(index, uvec2(shard_a_lo, shard_a_hi));
+  if (lt64(local, uvec2(shard_samples, 0u))) {
+    uvec2 bit_index = add64(mul64(local, stride), uvec2(lane.channel, 0u));
+    return bitfieldExtract(mip0[lane.plane + shr64(bit_index, 5).x], int(bit_index.x & 31u), 1);
   }
-  else if (miplevel == 2) {
-    x /= 128 * 128;
-    double word_index = x / 4;
-    double byte_index = mod(x, 4);
-    uint byte = bitfieldExtract(mip2[int(word_index)], int(byte_index) * 8, 8);
+  else {
+    local = sub64(index, uvec2(shard_b_lo, shard_b_hi));
+    uvec2 bit_index = add64(mul64(local, stride), uvec2(lane.channel, 0u));
+    return bitfieldExtract(mip0_next[lane.plane + shr64(bit_index, 5).x], int(bit_index.x & 31u), 1);
+  }
+}
+
+// The level entry whose bucket holds sample `index`.
+uint get_mip(int level, uvec2 index) {
+  uint i = shr64(index, 7 * level).x;
+  uint word = mips[lane.mip_base[level - 1] + (i >> 2)];
+  return bitfieldExtract(word, int(i & 3u) * 8, 8);
+}
+
+// Fixed point to 1/128ths of a sample, rounding down. Only for pos >= 0.
+uvec2 to_subsample(uvec2 pos) {
+  if (fx_bits > 7) return shr64(pos, fx_bits - 7);
+  if (fx_bits < 7) return shl64(pos, 7 - fx_bits);
+  return pos;
+}
+
+#ifdef _COMPUTE_
+
+void main() {
+  lane = cover_lanes[gl_WorkGroupID.y];
+  int x = int(gl_GlobalInvocationID.x);
+  if (x >= lane.count) return;
+  ivec2 texel = ivec2(int(uint(lane.col + x) & ring_mask), lane.row);
 
-    float t = float(byte) / 255.0;
-    frag = vec4(t, t, t, 1);
+  uvec2 samples    = uvec2(samples_lo, samples_hi);
+  uvec2 samples_fx = uvec2(samples_fx_lo, samples_fx_hi);
+
+  //----------------------------------------
+  // Span endpoints, same as cover_span() in Bits.hpp. The origin can be
+  // negative, everything after the clamp isn't.
+
+  uvec2 origin = uvec2(lane.origin_lo, lane.origin_hi);
+  uvec2 step   = uvec2(step_lo, step_hi);
+
+  uvec2 pos_min = floor64(add64(origin, mul64(step, uint(x))), granule_bits);
+  uvec2 pos_max = floor64(add64(origin, mul64(step, uint(x + 1))), granule_bits);
+
+  if (neg64(pos_min)) pos_min = uvec2(0u);
+  if (!neg64(pos_max) && lt64(samples_fx, pos_max)) pos_max = samples_fx;
+
+  // Every dispatch writes these, all with the same value.
+  if (neg64(pos_max) || !lt64(pos_min, samples_fx)) {
+    imageStore(cover_img, texel, vec4(-1.0));
+    return;
   }
-  else if (miplevel == 3) {
-    x /= 128 * 128 * 128;
-    double word_index = x / 4;
-    double byte_index = mod(x, 4);
-    uint byte = bitfieldExtract(mip3[int(word_index)], int(byte_index) * 8, 8);
 
-    float t = float(byte) / 255.0;
-    frag = vec4(t, t, t, 1);
+  uvec2 sample_imin = to_subsample(pos_min);
+  uvec2 sample_imax = to_subsample(pos_max);
+  uvec2 first = shr64(sample_imin, 7);
+  if (own_all == 0u && !lt64(sub64(first, uvec2(shard_a_lo, shard_a_hi)), uvec2(shard_samples, 0u))) return;
+
+  if (first == shr64(sample_imax, 7)) {
+    imageStore(cover_img, texel, vec4(float(get_bit(first))));
+    return;
   }
-  else if (miplevel == 4) {
-    x /= 128 * 128 * 128 * 128;
-    double word_index = x / 4;
-    double byte_index = mod(x, 4);
-    uint byte = bitfieldExtract(mip4[int(word_index)], int(byte_index) * 8, 8);
 
-    float t = float(byte) / 255.0;
-    frag = vec4(t, t, t, 1);
+  //----------------------------------------
+  // Same walk as walk_span() in MipPyramid.hpp. Totals are in 1/128ths of a
+  // sample, the top level's entries alone can overflow a uint.
+
+  uvec2 sample_ilen = sub64(sample_imax, sample_imin);
+  uvec2 total = uvec2(0u);
+
+  if ((sample_imin.x & 0x7Fu) != 0u) {
+    total = add64(total, uvec2((128u - (sample_imin.x & 0x7Fu)) * get_bit(first), 0u));
+    sample_imin = floor64(add64(sample_imin, uvec2(0x7Fu, 0u)), 7);
   }
-  else {
-    frag = vec4(0, 0.2, 0.2, 1);
+
+  if ((sample_imax.x & 0x7Fu) != 0u) {
+    total = add64(total, uvec2((sample_imax.x & 0x7Fu) * get_bit(shr64(sample_imax, 7)), 0u));
+    sample_imax = floor64(sample_imax, 7);
   }
+
+  uvec2 imin = shr64(sample_imin, 7);
+  uvec2 imax = shr64(sample_imax, 7);
+
+  //----------------------------------------
+  // A span that ends on the partial bucket at the end of the trace takes its
+  // count from mip1, see above. Same total as walking it.
+
+  uvec2 last = floor64(samples, 7);
+  if (imax == samples && imax != last && !lt64(last, imin)) {
+    total = add64(total, uvec2(get_mip(1, last) * 128u, 0u));
+    imax = last;
+  }
+
+  //----------------------------------------
+  // Walk in from both ends, one level at a time. Each level stops at the next
+  // level's bucket boundary or when the ends meet.
+
+  while ((imin.x & 0x7Fu) != 0u && lt64(imin, imax)) {
+    total = add64(total, uvec2(get_bit(imin) * 128u, 0u));
+    imin = add64(imin, uvec2(1u, 0u));
+  }
+  while ((imax.x & 0x7Fu) != 0u && lt64(imin, imax)) {
+    imax = sub64(imax, uvec2(1u, 0u));
+    total = add64(total, uvec2(get_bit(imax) * 128u, 0u));
+  }
+
+  while ((imin.x & 0x3FFFu) != 0u && lt64(imin, imax)) {
+    total = add64(total, uvec2(get_mip(1, imin) * 0x80u, 0u));
+    imin = add64(imin, uvec2(0x80u, 0u));
+  }
+  while ((imax.x & 0x3FFFu) != 0u && lt64(imin, imax)) {
+    imax = sub64(imax, uvec2(0x80u, 0u));
+    total = add64(total, uvec2(get_mip(1, imax) * 0x80u, 0u));
+  }
+
+  while ((imin.x & 0x1FFFFFu) != 0u && lt64(imin, imax)) {
+    total = add64(total, uvec2(get_mip(2, imin) * 0x4000u, 0u));
+    imin = add64(imin, uvec2(0x4000u, 0u));
+  }
+  while ((imax.x & 0x1FFFFFu) != 0u && lt64(imin, imax)) {
+    imax = sub64(imax, uvec2(0x4000u, 0u));
+    total = add64(total, uvec2(get_mip(2, imax) * 0x4000u, 0u));
+  }
+
+  while ((imin.x & 0xFFFFFFFu) != 0u && lt64(imin, imax)) {
+    total = add64(total, uvec2(get_mip(3, imin) * 0x200000u, 0u));
+    imin = add64(imin, uvec2(0x200000u, 0u));
+  }
+  while ((imax.x & 0xFFFFFFFu) != 0u && lt64(imin, imax)) {
+    imax = sub64(imax, uvec2(0x200000u, 0u));
+    total = add64(total, uvec2(get_mip(3, imax) * 0x200000u, 0u));
+  }
+
+  while (lt64(imin, imax)) {
+    total = add64(total, mul64(uvec2(0x10000000u, 0u), get_mip(4, imin)));
+    imin = add64(imin, uvec2(0x10000000u, 0u));
+  }
+
+  imageStore(cover_img, texel, vec4(to_float(total) / to_float(sample_ilen)));
 }
 
 #endif
 
-//------------------------------------------------------------------------------
-
 )";
 
+struct CoverUniforms {
+  uint32_t step_lo;
+  uint32_t step_hi;
+  int32_t  fx_bits;
+  int32_t  granule_bits;
+  uint32_t samples_lo;
+  uint32_t samples_hi;
+  uint32_t samples_fx_lo;
+  uint32_t samples_fx_hi;
+  uint32_t shard_a_lo;
+  uint32_t shard_a_hi;
+  uint32_t shard_b_lo;
+  uint32_t shard_b_hi;
+  uint32_t shard_samples;
+  uint32_t stride;
+  uint32_t own_all;
+  uint32_t ring_mask;
+};
+
 //-----------------------------------------------------------------------------
 
 template<typename T>
@@ -149,6 +637,18 @@ void rotate_bufs(T* bufs, int count) {
 
 //-----------------------------------------------------------------------------
 
+// Shaders that read Lanes get uvec2_glsl and lane_struct_glsl pasted in after
+// any defines.
+
+static int create_lane_shader(const char* name, const char* defines, const char* src) {
+  size_t len = strlen(defines) + strlen(uvec2_glsl) + strlen(lane_struct_glsl) + strlen(src) + 1;
+  char* text = new char[len];
+  snprintf(text, len, "%s%s%s%s", defines, uvec2_glsl, lane_struct_glsl, src);
+  int prog = create_shader(name, text);
+  delete [] text;
+  return prog;
+}
+
 void TracePainter::init() {
 
   trace_ubo = create_ubo();
@@ -156,91 +656,935 @@ void TracePainter::init() {
   glEnableVertexAttribArray(0);
   glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
 
-  trace_prog = create_shader("trace_glsl", trace_glsl);
+  trace_prog     = create_lane_shader("trace_glsl", "", trace_glsl);
+  trace_int_prog = create_lane_shader("trace_glsl uvec2", "#define TRACE_UVEC2\n", trace_glsl);
+
+  ring_tex  = create_texture_u32(ring_width, ring_rows, nullptr, false);
+  ring_fbo  = create_fbo(ring_tex);
+
+  cover_ubo  = create_ubo();
+  cover_prog = create_compute_shader("cover_glsl", cover_glsl, cover_local, uvec2_glsl);
+  cover_tex  = create_texture_f32(ring_width, ring_rows);
+  cover_lane_ssbo = create_ssbo(sizeof(cover_lanes));
+
+  lane_ubo  = create_ubo();
+  lane_ssbo = create_ssbo(lane_slots * sizeof(Lane));
+  lane_prog = create_lane_shader("lane_glsl", "", lane_glsl);
 }
 
 void TracePainter::exit() {
 }
 
 //-----------------------------------------------------------------------------
+// Each kind of lane gets its own part of lane_ssbo, so filling one in doesn't
+// have to wait on a draw still reading another. The parts have to start on a
+// GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT boundary, which is at most 256.
+
+static_assert((sizeof(TracePainter::Lane) * TracePainter::ring_rows) % 256 == 0,
+              "lane_ssbo parts have to stay 256-byte aligned");
 
 struct TraceUniforms {
-  float blit_x;
-  float blit_y;
-  float blit_w;
-  float blit_h;
   vec4     screen_size;
-  double   scale;
-  double   offset;
+  uint32_t samples_lo;
+  uint32_t samples_hi;
   uint32_t stride;
-  uint32_t channel;
-  int32_t  miplevel;
+  uint32_t shard_base_lo;
+  uint32_t shard_base_hi;
+  uint32_t shard_samples;
 };
 
-void TracePainter::blit(
+// The whole of shard k, every plane of it - lanes add their own plane offset.
+
+static void bind_shard(const TraceBuffer& trace, size_t k, int binding) {
+  TraceShard shard = trace_shard(trace, 0, k);
+  size_t planes = trace.planar() ? trace.channels : 1;
+  bind_ssbo(shard.ssbo, binding, 0, shard.len * planes);
+}
+
+TracePainter::Lane TracePainter::trace_lane(
+  TraceBuffer& trace, MipBuffer& mips, int channel, int miplevel, int shade_mode,
+  double origin, double scale, int x, int y, int w, int h) {
+
+  Lane lane = {};
+  lane.blit_x = x;
+  lane.blit_y = y;
+  lane.blit_w = w;
+  lane.blit_h = h;
+  lane.shade_mode = shade_mode;
+
+  SamplePos pos = split_sample_pos(origin);
+  lane.offset_hi   = pos.hi;
+  lane.offset_lo   = pos.lo;
+  lane.offset_frac = pos.frac;
+  lane.scale       = float(scale);
+
+  SampleFx fx = sample_fx(origin, scale);
+  lane.origin_fx_lo = uint32_t(uint64_t(fx.origin));
+  lane.origin_fx_hi = uint32_t(uint64_t(fx.origin) >> 32);
+  lane.step_fx_lo   = uint32_t(uint64_t(fx.step));
+  lane.step_fx_hi   = uint32_t(uint64_t(fx.step) >> 32);
+  lane.fx_bits      = uint32_t(fx.bits);
+
+  // A planar trace reads the channel's plane like a one-channel trace.
+  lane.channel  = trace.planar() ? 0 : channel;
+  lane.plane    = uint32_t(trace_shard(trace, channel, 0).offset / 4);
+  lane.miplevel = miplevel;
+
+  lane.mip_base[0] = uint32_t(mips.mip1_offset / 4);
+  lane.mip_base[1] = uint32_t(mips.mip2_offset / 4);
+  lane.mip_base[2] = uint32_t(mips.mip3_offset / 4);
+  lane.mip_base[3] = uint32_t(mips.mip4_offset / 4);
+
+  if (mips.edge1) {
+    lane.edge_base[0] = uint32_t(mips.edge1_offset / 4);
+    lane.edge_base[1] = uint32_t(mips.edge2_offset / 4);
+    lane.edge_base[2] = uint32_t(mips.edge3_offset / 4);
+    lane.edge_base[3] = uint32_t(mips.edge4_offset / 4);
+  }
+  return lane;
+}
+
+void TracePainter::shade_lanes(TraceBuffer& trace, int mips_ssbo, const Lane* lanes, int count,
+                               int slot, dvec2 target_size) {
+  if (count == 0) return;
+
+  // Level 0 reads the shard under the leftmost column and the one after it.
+  // Lanes in one batch all come from the same view, so that's everything.
+  // Views too far out for the fixed point fall back to the int64 shader.
+  double first = 0;
+  bool integer = use_integer;
+  for (int i = 0; i < count; i++) {
+    const Lane& lane = lanes[i];
+    double origin = double(int64_t((uint64_t(uint32_t(lane.offset_hi)) << 32) | lane.offset_lo));
+    double sample = origin + lane.offset_frac + lane.blit_x * lane.scale;
+    if (i == 0 || sample < first) first = sample;
+    if (lane.fx_bits == 0) integer = false;
+    columns_shaded += size_t(lane.blit_w) * size_t(lane.blit_h);
+  }
+
+  size_t shard_count = trace_shard_count(trace);
+  size_t per_shard = trace_shard(trace, 0, 0).samples;
+  size_t shard = first > 0 ? size_t(first) / per_shard : 0;
+  if (shard >= shard_count) shard = shard_count - 1;
+  size_t next = shard + 1 < shard_count ? shard + 1 : shard;
+
+  TraceUniforms uniforms = {};
+  uniforms.screen_size = { target_size.x, target_size.y, 1.0 / target_size.x, 1.0 / target_size.y };
+  uniforms.samples_lo  = uint32_t(trace.samples);
+  uniforms.samples_hi  = uint32_t(uint64_t(trace.samples) >> 32);
+  uniforms.stride      = trace.stride;
+  uniforms.shard_base_lo = uint32_t(shard * per_shard);
+  uniforms.shard_base_hi = uint32_t(uint64_t(shard * per_shard) >> 32);
+  uniforms.shard_samples = uint32_t(per_shard < 0xFFFFFFFF ? per_shard : 0xFFFFFFFF);
+
+  uint32_t prog = integer ? trace_int_prog : trace_prog;
+  bind_shader(prog);
+
+  update_ubo(trace_ubo, sizeof(uniforms), &uniforms);
+  bind_ubo(prog, "TraceUniforms", 0, trace_ubo);
+
+  size_t offset = slot * sizeof(Lane);
+  update_ssbo(lane_ssbo, offset, lanes, count * sizeof(Lane));
+  bind_ssbo(lane_ssbo, 2, offset, count * sizeof(Lane));
+
+  bind_shard(trace, shard, 0);
+  bind_shard(trace, next, 9);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, mips_ssbo);
+
+  glDisable(GL_BLEND);
+  glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, count);
+  glEnable(GL_BLEND);
+
+  draw_calls++;
+}
+
+//-----------------------------------------------------------------------------
+// Ring pixel P lives in column (P mod ring_width) of the channel's row, which
+// is drawn upside down - the vertex shader flips y. Cover rows use the same
+// columns, right side up.
+
+static int64_t ring_col(int64_t pixel) {
+  return pixel & (TracePainter::ring_width - 1);
+}
+
+// Calls piece(col, pixel, len) for each part of [pixel_min, pixel_max) - at
+// most two, if the span wraps around the end of the ring.
+
+template<typename F>
+static void split_ring(int64_t pixel_min, int64_t pixel_max, F piece) {
+  while (pixel_min < pixel_max) {
+    int64_t col = ring_col(pixel_min);
+    int64_t len = pixel_max - pixel_min;
+    if (len > TracePainter::ring_width - col) len = TracePainter::ring_width - col;
+    piece(int(col), pixel_min, int(len));
+    pixel_min += len;
+  }
+}
+
+// Grows a row's [pixel_min, pixel_max) to hold [need_min, need_max), keeping
+// at most ring_width of it, and calls fill(a, b) for each new span.
+
+template<typename F>
+static void scroll_row(int64_t& pixel_min, int64_t& pixel_max,
+                       int64_t need_min, int64_t need_max, F fill) {
+  if (need_max <= pixel_min || need_min >= pixel_max) {
+    pixel_min = need_min;
+    pixel_max = need_min;
+  }
+
+  if (need_min < pixel_min) {
+    fill(need_min, pixel_min);
+    pixel_min = need_min;
+    if (pixel_max - pixel_min > TracePainter::ring_width) pixel_max = pixel_min + TracePainter::ring_width;
+  }
+
+  if (need_max > pixel_max) {
+    fill(pixel_max, need_max);
+    pixel_max = need_max;
+    if (pixel_max - pixel_min > TracePainter::ring_width) pixel_min = pixel_max - TracePainter::ring_width;
+  }
+}
+
+void TracePainter::queue_ring(TraceBuffer& trace, MipBuffer& mips, int channel,
+                              int64_t pixel_min, int64_t pixel_max) {
+  RingRow& row = ring[channel];
+  split_ring(pixel_min, pixel_max, [&](int col, int64_t pixel, int len) {
+    assert(ring_lane_count < 4 * ring_rows);
+    double origin = (double(pixel - col) + row.phase) * row.scale;
+    ring_lanes[ring_lane_count++] = trace_lane(trace, mips, channel, row.miplevel, row.shade_mode,
+                                               origin, row.scale, col, channel, len, 1);
+  });
+}
+
+// Copies a ring or cover row to the screen, wrapping around the ring.
+
+static TracePainter::Lane copy_lane(int x, int y, int w, int h, int64_t pixel0, int row, int cover) {
+  TracePainter::Lane lane = {};
+  lane.blit_x = x;
+  lane.blit_y = y;
+  lane.blit_w = w;
+  lane.blit_h = h;
+  lane.ring_offset = uint32_t(ring_col(pixel0));
+  lane.ring_row = row;
+  lane.cover = cover;
+  return lane;
+}
+
+//-----------------------------------------------------------------------------
+// The blit covers pixels [P, P + w) of a grid where pixel P starts at sample
+// (P + phase) * scale. Same scale, phase, miplevel and shading as last time
+// means the ring or cover row can be reused, and only the columns that
+// scrolled in need shading.
+
+bool TracePainter::prepare_lane(
   Viewport view, dvec2 screen_size,
   int x, int y, int w, int h,
-  TraceBuffer& trace, MipBuffer& mips, int channel) {
-
-  TraceUniforms uniforms;
+  TraceBuffer& trace, MipBuffer& mips, int channel, Lane& lane) {
 
   dvec2 world_min = view.world_min(screen_size);
   dvec2 world_max = view.world_max(screen_size);
 
-  uniforms.blit_x = x;
-  uniforms.blit_y = y;
-  uniforms.blit_w = w;
-  uniforms.blit_h = h;
-  uniforms.screen_size = { screen_size.x, screen_size.y, 1.0 / screen_size.x, 1.0 / screen_size.y };
+  double scale = (world_max.x - world_min.x) / screen_size.x;
+  int miplevel = int((-view._zoom.x) / 7);
+  int shade_mode_now = (shade_mode == shade_activity && !mips.edge1) ? shade_density : shade_mode;
+
+  if (shade_mode_now == shade_coverage && (w > ring_width || channel >= ring_rows)) {
+    shade_mode_now = shade_density;
+  }
 
-  uniforms.scale  = (world_max.x - world_min.x) / screen_size.x;
-  uniforms.offset = world_min.x;
+  if (shade_mode_now != shade_coverage && (!use_ring || w > ring_width || channel >= ring_rows)) {
+    assert(direct_lane_count < ring_rows);
+    direct_lanes[direct_lane_count++] = trace_lane(trace, mips, channel, miplevel, shade_mode_now,
+                                                   world_min.x, scale, x, y, w, h);
+    return false;
+  }
 
-  //uniforms.scale = { screen_size.x, 1.0 };
-  //uniforms.offset_coarse = 3000000000;
-  //uniforms.offset_fine   = 0;
+  double first = world_min.x / scale;
+  int64_t pixel0 = (int64_t)floor(first);
+  double phase = first - double(pixel0);
 
-  uniforms.channel = channel;
-  uniforms.stride = trace.stride;
-  uniforms.miplevel = (-view._zoom.x) / 7;
+  int64_t need_min = pixel0 + x;
+  int64_t need_max = need_min + w;
 
+  if (shade_mode_now == shade_coverage) {
+    CoverRow& row = cover_rows[channel];
+    if (!row.valid || row.scale != scale || fabs(row.phase - phase) > 1.0e-6) {
+      row.valid     = true;
+      row.scale     = scale;
+      row.phase     = phase;
+      row.pixel_min = 0;
+      row.pixel_max = 0;
+    }
 
-  bind_shader(trace_prog);
+    scroll_row(row.pixel_min, row.pixel_max, need_min, need_max, [&](int64_t a, int64_t b) {
+      split_ring(a, b, [&](int col, int64_t pixel, int len) {
+        queue_cover(trace, mips, channel, channel, col, len, (double(pixel) + row.phase) * row.scale, row.scale);
+      });
+    });
 
-  update_ubo(trace_ubo, sizeof(uniforms), &uniforms);
-  bind_ubo(trace_prog, "TraceUniforms", 0, trace_ubo);
+    lane = copy_lane(x, y, w, h, pixel0, channel, 1);
+    return true;
+  }
 
-  bind_ssbo(trace.ssbo, 0, 0, trace.ssbo_len);
-  bind_ssbo(mips.ssbo,  1, mips.mip1_offset, mips.mip1_len);
-  bind_ssbo(mips.ssbo,  2, mips.mip2_offset, mips.mip2_len);
-  bind_ssbo(mips.ssbo,  3, mips.mip3_offset, mips.mip3_len);
-  bind_ssbo(mips.ssbo,  4, mips.mip4_offset, mips.mip4_len);
+  RingRow& row = ring[channel];
+  if (!row.valid || row.scale != scale || fabs(row.phase - phase) > 1.0e-6 ||
+      row.miplevel != miplevel || row.shade_mode != shade_mode_now || row.integer != use_integer) {
+    row.valid      = true;
+    row.scale      = scale;
+    row.phase      = phase;
+    row.miplevel   = miplevel;
+    row.shade_mode = shade_mode_now;
+    row.integer    = use_integer;
+    row.pixel_min  = 0;
+    row.pixel_max  = 0;
+  }
 
-  /*
-  {
-    int64_t ssbo_binding;
-    int64_t ssbo_align;
-    int64_t ssbo_start;
-    int64_t ssbo_size;
+  scroll_row(row.pixel_min, row.pixel_max, need_min, need_max, [&](int64_t a, int64_t b) {
+    queue_ring(trace, mips, channel, a, b);
+  });
 
-    glGetInteger64v(GL_SHADER_STORAGE_BUFFER_BINDING,          &ssbo_binding);
-    glGetInteger64v(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &ssbo_align);
-    glGetInteger64i_v(GL_SHADER_STORAGE_BUFFER_START,            0, &ssbo_start);
-    glGetInteger64i_v(GL_SHADER_STORAGE_BUFFER_SIZE,             0, &ssbo_size);
+  lane = copy_lane(x, y, w, h, pixel0, ring_rows - 1 - channel, 0);
+  return true;
+}
 
-    printf("ssbo_binding %ld\n", ssbo_binding);
-    printf("ssbo_align   %ld\n", ssbo_align);
-    printf("ssbo_start   %ld\n", ssbo_start);
-    printf("ssbo_size    %ld\n", ssbo_size);
+void TracePainter::blit(
+  Viewport view, dvec2 screen_size,
+  int x, int y, int w, int h,
+  TraceBuffer& trace, MipBuffer& mips, int channel) {
+  int count = prepare_lane(view, screen_size, x, y, w, h, trace, mips, channel, lanes[0]) ? 1 : 0;
+  flush_lanes(trace, mips.ssbo, screen_size, count);
+}
+
+// Every step is one draw or dispatch for all the channels - filling in ring
+// rows, filling in cover rows, shading lanes that don't fit the ring straight
+// onto the screen, and copying the rows out. Once the rows are filled, a
+// frame is just the copy however many channels there are.
+
+void TracePainter::blit_lanes(
+  Viewport view, dvec2 screen_size,
+  int x, int y, int w, int h, int pitch,
+  TraceBuffer& trace, MipBuffer* mips, int channels) {
+  assert(channels <= ring_rows);
+  int count = 0;
+  for (int channel = 0; channel < channels; channel++) {
+    assert(mips[channel].ssbo == mips[0].ssbo);
+    if (prepare_lane(view, screen_size, x, y + channel * pitch, w, h,
+                     trace, mips[channel], channel, lanes[count])) {
+      count++;
+    }
   }
-  */
+  flush_lanes(trace, mips[0].ssbo, screen_size, count);
+}
+
+void TracePainter::flush_lanes(TraceBuffer& trace, int mips_ssbo, dvec2 screen_size, int count) {
+  if (ring_lane_count) {
+    bind_fbo(ring_fbo);
+    glViewport(0, 0, ring_width, ring_rows);
+    shade_lanes(trace, mips_ssbo, ring_lanes, ring_lane_count, ring_lane_slot, dvec2(ring_width, ring_rows));
+    unbind_fbo();
+    glViewport(0, 0, int(screen_size.x), int(screen_size.y));
+    ring_lane_count = 0;
+  }
+
+  cover(trace, mips_ssbo);
+
+  shade_lanes(trace, mips_ssbo, direct_lanes, direct_lane_count, direct_lane_slot, screen_size);
+  direct_lane_count = 0;
+
+  draw_lanes(screen_size, lanes, count);
+}
+
+void TracePainter::draw_lanes(dvec2 screen_size, const Lane* lanes, int count) {
+  if (count == 0) return;
+
+  LaneUniforms uniforms = {};
+  uniforms.screen_size = { screen_size.x, screen_size.y, 1.0 / screen_size.x, 1.0 / screen_size.y };
+  uniforms.ring_mask   = ring_width - 1;
+
+  size_t offset = copy_lane_slot * sizeof(Lane);
+  update_ssbo(lane_ssbo, offset, lanes, count * sizeof(Lane));
+
+  bind_shader(lane_prog);
+  update_ubo(lane_ubo, sizeof(uniforms), &uniforms);
+  bind_ubo(lane_prog, "LaneUniforms", 0, lane_ubo);
+  bind_ssbo(lane_ssbo, 0, offset, count * sizeof(Lane));
+  bind_texture(lane_prog, "ring_tex", 0, ring_tex);
+  bind_texture(lane_prog, "cover_tex", 1, cover_tex);
 
   glDisable(GL_BLEND);
-  glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+  glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, count);
   glEnable(GL_BLEND);
 
-  //rotate_bufs(trace_ssbos, buf_count);
-  //rotate_bufs(mapped_buffers, buf_count);
+  draw_calls++;
+}
+
+//-----------------------------------------------------------------------------
+// New data at [sample_min, sample_max) changes every ring column whose sample
+// falls in a mip bucket that overlaps it. Ring rows only hold one contiguous
+// span, so a hole in the middle drops everything to the right of it too.
+
+static void punch_hole(int64_t& pixel_min, int64_t& pixel_max, int64_t hole_min, int64_t hole_max) {
+  if (hole_max <= pixel_min || hole_min >= pixel_max) return;
+
+  if (hole_min <= pixel_min) {
+    pixel_min = hole_max < pixel_max ? hole_max : pixel_max;
+  }
+  else {
+    pixel_max = hole_min;
+  }
+}
+
+void TracePainter::invalidate_ring(size_t sample_min, size_t sample_max) {
+  // A coverage column only reads buckets inside its own span, so only the
+  // columns over the new data change - give or take one for the rounding.
+  for (int i = 0; i < ring_rows; i++) {
+    CoverRow& row = cover_rows[i];
+    if (!row.valid || row.pixel_min >= row.pixel_max) continue;
+
+    int64_t hole_min = (int64_t)floor(double(sample_min) / row.scale - row.phase) - 1;
+    int64_t hole_max = (int64_t)ceil (double(sample_max) / row.scale - row.phase) + 1;
+    punch_hole(row.pixel_min, row.pixel_max, hole_min, hole_max);
+  }
+
+  for (int i = 0; i < ring_rows; i++) {
+    RingRow& row = ring[i];
+    if (!row.valid || row.pixel_min >= row.pixel_max) continue;
+
+    int level = row.miplevel < 4 ? row.miplevel : 4;
+    if (row.shade_mode == shade_activity && level < 1) level = 1;
+    double bucket = double(uint64_t(1) << (7 * level));
+
+    double a = floor(double(sample_min) / bucket) * bucket;
+    double b = ceil (double(sample_max) / bucket) * bucket;
+
+    int64_t hole_min = (int64_t)floor(a / row.scale - row.phase - 1.5);
+    int64_t hole_max = (int64_t)ceil (b / row.scale - row.phase + 0.5);
+    punch_hole(row.pixel_min, row.pixel_max, hole_min, hole_max);
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+void TracePainter::queue_cover(TraceBuffer& trace, MipBuffer& mips, int channel, int row,
+                               int col, int count, double origin, double scale) {
+  assert(cover_lane_count < 4 * ring_rows);
+  assert(cover_lane_count == 0 || cover_scale == scale);
+  assert(col >= 0 && col + count <= ring_width);
+
+  CoverLane& lane = cover_lanes[cover_lane_count];
+  lane = {};
+  lane.row     = row;
+  lane.col     = col;
+  lane.count   = count;
+  lane.channel = trace.planar() ? 0 : channel;
+  lane.plane   = uint32_t(trace_shard(trace, channel, 0).offset / 4);
+  lane.mip_base[0] = uint32_t(mips.mip1_offset / 4);
+  lane.mip_base[1] = uint32_t(mips.mip2_offset / 4);
+  lane.mip_base[2] = uint32_t(mips.mip3_offset / 4);
+  lane.mip_base[3] = uint32_t(mips.mip4_offset / 4);
+
+  cover_origins[cover_lane_count] = origin;
+  cover_scale = scale;
+  cover_lane_count++;
+}
+
+//-----------------------------------------------------------------------------
+// Narrow columns get a dispatch per shard under the queued runs, with the
+// shard after it bound as Mip0Next. Every run goes in every dispatch, the
+// shader sorts out which columns really start in the shard. Wide columns get
+// one dispatch, with shard 0 and the last shard bound - a column that's empty
+// except for sample 0 still reads that one.
+
+void TracePainter::cover(TraceBuffer& trace, int mips_ssbo) {
+  int count = cover_lane_count;
+  cover_lane_count = 0;
+  if (count == 0) return;
+
+  double scale = cover_scale;
+  float outside = -1.0f;
+  if (trace.samples == 0 || scale <= 0) {
+    for (int i = 0; i < count; i++) {
+      const CoverLane& lane = cover_lanes[i];
+      glClearTexSubImage(cover_tex, 0, lane.col, lane.row, 0, lane.count, 1, 1, GL_RED, GL_FLOAT, &outside);
+    }
+    return;
+  }
+
+  // The samples the runs cover, and the fixed point that fits all of them.
+  // The shader steps from the left edge of each run's first column, which is
+  // the center of a column half a column to the left. The trace end has to fit
+  // in the same fixed point so the shader can clamp to it.
+  double view_min = cover_origins[0];
+  double view_max = cover_origins[0];
+  double reach = 0;
+  int width = 0;
+  for (int i = 0; i < count; i++) {
+    double a = cover_origins[i];
+    double b = a + cover_lanes[i].count * scale;
+    if (a < view_min) view_min = a;
+    if (b > view_max) view_max = b;
+    if (fabs(a) > fabs(reach)) reach = a;
+    if (cover_lanes[i].count > width) width = cover_lanes[i].count;
+    columns_shaded += cover_lanes[i].count;
+  }
+
+  // A view past 2^61 samples is left blank - by then the whole trace is less
+  // than a column anyway.
+  CoverFx fx = cover_fx(reach, scale, double(trace.samples));
+  if (fx.bits == 0) {
+    for (int i = 0; i < count; i++) {
+      const CoverLane& lane = cover_lanes[i];
+      glClearTexSubImage(cover_tex, 0, lane.col, lane.row, 0, lane.count, 1, 1, GL_RED, GL_FLOAT, &outside);
+    }
+    return;
+  }
+
+  for (int i = 0; i < count; i++) {
+    int64_t origin = cover_origin(fx, cover_origins[i]);
+    cover_lanes[i].origin_lo = uint32_t(uint64_t(origin));
+    cover_lanes[i].origin_hi = uint32_t(uint64_t(origin) >> 32);
+  }
+
+  uint64_t samples_fx = uint64_t(trace.samples) << fx.bits;
+
+  CoverUniforms uniforms = {};
+  uniforms.step_lo       = uint32_t(uint64_t(fx.step));
+  uniforms.step_hi       = uint32_t(uint64_t(fx.step) >> 32);
+  uniforms.fx_bits       = fx.bits;
+  uniforms.granule_bits  = fx.granule_bits;
+  uniforms.samples_lo    = uint32_t(trace.samples);
+  uniforms.samples_hi    = uint32_t(uint64_t(trace.samples) >> 32);
+  uniforms.samples_fx_lo = uint32_t(samples_fx);
+  uniforms.samples_fx_hi = uint32_t(samples_fx >> 32);
+  uniforms.stride        = trace.stride;
+  uniforms.ring_mask     = ring_width - 1;
+
+  size_t shard_count = trace_shard_count(trace);
+  size_t per_shard = trace_shard(trace, 0, 0).samples;
+  size_t last = (trace.samples - 1) / per_shard;
+  if (last >= shard_count) last = shard_count - 1;
+  uniforms.shard_samples = uint32_t(per_shard < 0xFFFFFFFF ? per_shard : 0xFFFFFFFF);
+
+  update_ssbo(cover_lane_ssbo, cover_lanes, count * sizeof(CoverLane));
+
+  bind_compute_shader(cover_prog);
+  glBindImageTexture(0, cover_tex, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, mips_ssbo);
+  bind_ssbo(cover_lane_ssbo, 2, 0, count * sizeof(CoverLane));
+
+  auto dispatch = [&](size_t a, size_t b, bool own_all) {
+    uniforms.shard_a_lo = uint32_t(a * per_shard);
+    uniforms.shard_a_hi = uint32_t(uint64_t(a * per_shard) >> 32);
+    uniforms.shard_b_lo = uint32_t(b * per_shard);
+    uniforms.shard_b_hi = uint32_t(uint64_t(b * per_shard) >> 32);
+    uniforms.own_all    = own_all;
+
+    update_ubo(cover_ubo, sizeof(uniforms), &uniforms);
+    bind_ubo(cover_prog, "CoverUniforms", 0, cover_ubo);
+    bind_shard(trace, a, 0);
+    bind_shard(trace, b, 9);
+    glDispatchCompute((width + cover_local - 1) / cover_local, count, 1);
+    draw_calls++;
+  };
+
+  // Spans rounded to whole buckets never read mip0.
+  if (fx.granule_bits >= fx.bits + 7) {
+    dispatch(0, last, true);
+  }
+  else {
+    // Span starts round down by up to a granule, so a column can start a bit
+    // left of its run.
+    double lo = view_min - 2 * scale;
+    double hi = view_max + 3 * scale;
+    if (lo < 0) lo = 0;
+    if (hi > double(trace.samples)) hi = double(trace.samples);
+
+    if (lo < hi) {
+      size_t k_max = size_t(hi) / per_shard;
+      if (k_max > last) k_max = last;
+      for (size_t k = size_t(lo) / per_shard; k <= k_max; k++) {
+        dispatch(k, k < last ? k + 1 : k, false);
+      }
+    }
+    else {
+      // Nothing in the trace, but the columns still need their -1.
+      dispatch(0, 0, false);
+    }
+  }
+
+  glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT);
+}
+
+//-----------------------------------------------------------------------------
+// Two channels, so the second one's planes are offset in every shard. The data
+// comes in runs of different densities so the pyramid isn't all 50%, and the
+// trace ends partway into a bucket.
+
+void TracePainter::create_test_trace(TraceBuffer& trace, MipBuffer* mips) {
+  const size_t shard_samples = size_t(1) << 24;
+  const size_t samples = 3 * shard_samples + 12345;
+
+  trace = {};
+  init_planar(trace, test_channels, samples);
+  init_shards(trace, shard_samples);
+  size_t shard_len = trace_shard(trace, 0, 0).len * test_channels;
+  for (int i = 0; i < trace.shard_count; i++) trace.shards[i] = create_ssbo(shard_len);
+  trace.ssbo = trace.shards[0];
+  trace.blob = new uint8_t[trace.ssbo_len];
+  trace.samples = samples;
+
+  uint64_t* words = (uint64_t*)trace.blob;
+  for (size_t i = 0; i < trace.ssbo_len / 8; i++) {
+    uint64_t w = (uint64_t(rng()) << 32) | rng();
+    for (size_t j = 0; j < ((i >> 9) * 7) % 5; j++) w &= (uint64_t(rng()) << 32) | rng();
+    words[i] = w;
+  }
+  // Nothing past the end, same as a capture.
+  for (int c = 0; c < test_channels; c++) {
+    uint64_t* plane = trace.plane(c);
+    plane[samples / 64] &= (uint64_t(1) << (samples % 64)) - 1;
+    for (size_t i = samples / 64 + 1; i < trace.channel_stride / 64; i++) plane[i] = 0;
+  }
+  upload_trace(trace, 0, samples);
+
+  for (int c = 0; c < test_channels; c++) {
+    alloc_mips(mips[c], samples);
+    update_mips(trace, c, 0, samples, mips[c]);
+  }
+  create_mips_ssbo(mips, test_channels);
+}
+
+// Uploading the test trace knocked bits out of the caches, and the checks
+// drew over them, so they start over.
+
+void TracePainter::destroy_test_trace(TraceBuffer& trace, MipBuffer* mips) {
+  destroy_mips_ssbo(mips, test_channels);
+  for (int c = 0; c < test_channels; c++) free_mips(mips[c]);
+  destroy_trace_ssbo(trace);
+  delete [] (uint8_t*)trace.blob;
+  trace = {};
+
+  for (int i = 0; i < ring_rows; i++) {
+    ring[i].valid = false;
+    cover_rows[i].valid = false;
+  }
+  columns_shaded = 0;
+}
+
+//-----------------------------------------------------------------------------
+// The views cover every mip level, shard boundaries and both ends of the
+// trace, with both channels in one batch. render_cover() finds the same spans
+// the shader does and walks the same levels, so the only difference left is
+// the shader's float division.
+
+void TracePainter::check_coverage() {
+  const int width = 1920;
+
+  TraceBuffer trace;
+  MipBuffer mips[test_channels];
+  create_test_trace(trace, mips);
+
+  const double shard_samples = double(trace.shard_samples);
+  const double samples = double(trace.samples);
+
+  struct View { double origin; double scale; };
+  const View views[] = {
+    { -300.25,                   0.37 },
+    { shard_samples - 900.5,     1.3 },
+    { 2 * shard_samples - 3.0e6, 3000.7 },
+    { 2 * shard_samples - 4.0e6, 8191.9 },
+    { -100000.5,                 samples / 1500 },
+    { samples - 1.0e6,           9000.3 },
+    { samples - 500,             0.61 },
+    { -1.0e9,                    1.0e7 },
+  };
+
+  float*  got  = new float[width];
+  double* want = new double[width];
+  size_t bad = 0;
+  double worst = 0;
+
+  for (const View& v : views) {
+    // Both lanes start at v.origin, so that's the reach cover() uses too.
+    CoverFx fx = cover_fx(v.origin, v.scale, samples);
+
+    for (int c = 0; c < test_channels; c++) {
+      queue_cover(trace, mips[c], c, c, 0, width, v.origin, v.scale);
+    }
+    cover(trace, mips[0].ssbo);
+
+    for (int c = 0; c < test_channels; c++) {
+      glGetTextureSubImage(cover_tex, 0, 0, c, 0, width, 1, 1, GL_RED, GL_FLOAT, width * sizeof(float), got);
+
+      render_cover(trace, mips[c], c, fx, cover_origin(fx, v.origin), want, width);
+      for (int x = 0; x < width; x++) {
+        double g = got[x] < 0 ? 0 : got[x];
+        double d = fabs(g - want[x]);
+        if (d > 1.0e-6) bad++;
+        if (d > worst) worst = d;
+      }
+    }
+  }
+  log("Coverage check: %ld bad columns, worst %g", bad, worst);
+
+  destroy_test_trace(trace, mips);
+  delete [] got;
+  delete [] want;
+}
+
+//-----------------------------------------------------------------------------
+// Fills the whole ring texture with one channel at each mip level, which is
+// about as many fragments as a screen full of lanes. The views start on a
+// whole sample with a power of two scale, where neither shader has anything
+// to round, so every pixel has to match.
+
+void TracePainter::bench_trace_shaders() {
+  const int reps = 10;
+  const size_t pixels = size_t(ring_width) * ring_rows;
+
+  TraceBuffer trace;
+  MipBuffer mips[test_channels];
+  create_test_trace(trace, mips);
+
+  GLuint query = 0;
+  glGenQueries(1, &query);
+  uint32_t* pix[2] = { new uint32_t[pixels], new uint32_t[pixels] };
+  bool old_integer = use_integer;
+  dvec2 ring_size = { ring_width, ring_rows };
+
+  bind_fbo(ring_fbo);
+  glViewport(0, 0, ring_width, ring_rows);
+
+  for (int level = 0; level <= 4; level++) {
+    double scale  = exp2(7 * level - 3);
+    double origin = floor(double(trace.samples / 2) - ring_width * scale / 2);
+    double ns[2];
+
+    for (int v = 0; v < 2; v++) {
+      use_integer = v == 1;
+      Lane lane = trace_lane(trace, mips[0], 0, level, shade_density, origin, scale,
+                             0, 0, ring_width, ring_rows);
+      auto draw = [&]() {
+        shade_lanes(trace, mips[0].ssbo, &lane, 1, ring_lane_slot, ring_size);
+      };
+
+      draw();
+      glFinish();
+      glBeginQuery(GL_TIME_ELAPSED, query);
+      for (int rep = 0; rep < reps; rep++) draw();
+      glEndQuery(GL_TIME_ELAPSED);
+
+      GLuint64 time = 0;
+      glGetQueryObjectui64v(query, GL_QUERY_RESULT, &time);
+      ns[v] = double(time) / double(reps * pixels);
+
+      glReadPixels(0, 0, ring_width, ring_rows, GL_RGBA, GL_UNSIGNED_BYTE, pix[v]);
+    }
+
+    size_t differ = 0;
+    for (size_t i = 0; i < pixels; i++) differ += pix[0][i] != pix[1][i];
+    log("Trace shader level %d: int64 %.3f ns/frag, uvec2 %.3f ns/frag, %ld pixels differ",
+        level, ns[0], ns[1], differ);
+  }
+
+  unbind_fbo();
+  use_integer = old_integer;
+
+  glDeleteQueries(1, &query);
+  delete [] pix[0];
+  delete [] pix[1];
+  destroy_test_trace(trace, mips);
+}
+
+//-----------------------------------------------------------------------------
+
+static size_t max_block_size() {
+  GLint64 max_block = 0;
+  glGetInteger64v(GL_MAX_SHADER_STORAGE_BLOCK_SIZE, &max_block);
+  return size_t(max_block);
+}
+
+// Every channel's mips get bound as one block, and indexed with a uint.
+
+static size_t max_mips_len() {
+  size_t max_block = max_block_size();
+  if (max_block > (size_t(1) << 32)) max_block = size_t(1) << 32;
+  return max_block & ~size_t(255);
+}
+
+// The most samples per channel whose mips all fit, in whole level 1 buckets.
+
+size_t TracePainter::max_mip_samples(int channels, bool edges) {
+  size_t max_len = max_mips_len();
+  size_t lo = 0;
+  size_t hi = max_len / channels + 1;
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (mips_ssbo_len(mid * 128, edges) * channels <= max_len) lo = mid;
+    else hi = mid;
+  }
+  return lo * 128;
+}
+
+//-----------------------------------------------------------------------------
+// The level layout comes from layout_mips(), one channel after another, so
+// TraceMipper::build() can fill the same buffer on the GPU. Unlike the trace,
+// the mips aren't sharded - the buffer gets bound whole, so channels whose
+// mips don't all fit in one storage block get no GPU copy at all.
+
+bool TracePainter::create_mips_ssbo(MipBuffer* mips, int count) {
+  size_t total = 0;
+  for (int i = 0; i < count; i++) {
+    layout_mips(mips[i], total);
+    total += mips[i].ssbo_len;
+  }
+
+  if (total > max_mips_len()) {
+    log("Mips for %d channels need %ld bytes, more than a %ld byte storage block, not creating them",
+        count, total, max_block_size());
+    for (int i = 0; i < count; i++) mips[i].ssbo = 0;
+    return false;
+  }
+
+  int ssbo = create_ssbo(total);
+  for (int i = 0; i < count; i++) {
+    mips[i].ssbo = ssbo;
+    mark_dirty(mips[i], 0, mips[i].mip_len[1] * 128);
+    upload_mips(mips[i]);
+  }
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// Shards are the biggest power of two that fits both limits. Lanes for every
+// channel share one binding of the whole shard, planes and all, so that's what
+// has to fit in a storage block. The shader only does 32-bit math inside a
+// shard, so we stop at 2^31 samples too.
+
+void TracePainter::create_trace_ssbo(TraceBuffer& trace) {
+  size_t max_block = max_block_size();
+
+  size_t capacity = trace.capacity();
+  size_t shard_bits = trace.planar() ? trace.channels : trace.stride;
+
+  size_t shard_samples = size_t(1) << 24;
+  while (shard_samples < capacity &&
+         shard_samples < (size_t(1) << 31) &&
+         (shard_samples * 2 * shard_bits) / 8 <= max_block &&
+         (shard_samples * 2 * shard_bits) / 8 <= max_shard_bytes) {
+    shard_samples *= 2;
+  }
+
+  init_shards(trace, shard_samples);
+
+  // The shaders index shard words with a uint.
+  assert((shard_samples * shard_bits) / 32 <= (size_t(1) << 32));
+
+  size_t shard_len = trace_shard(trace, 0, 0).len * (trace.planar() ? trace.channels : 1);
+  for (int i = 0; i < trace.shard_count; i++) {
+    trace.shards[i] = uploader ? create_device_ssbo(shard_len) : create_ssbo(shard_len);
+  }
+  trace.ssbo = trace.shards[0];
+
+  log("Trace storage: %d shards of %ld samples, %ld bytes each, max block %ld",
+      trace.shard_count, shard_samples, shard_len, max_block);
+}
+
+//-----------------------------------------------------------------------------
+
+void TracePainter::destroy_trace_ssbo(TraceBuffer& trace) {
+  for (int i = 0; i < trace.shard_count; i++) {
+    GLuint ssbo = trace.shards[i];
+    glDeleteBuffers(1, &ssbo);
+    trace.shards[i] = 0;
+  }
+  if (trace.shard_count == 0 && trace.ssbo > 0) {
+    GLuint ssbo = trace.ssbo;
+    glDeleteBuffers(1, &ssbo);
+  }
+  trace.ssbo = 0;
+  trace.shard_count = 0;
+  trace.shard_samples = 0;
+}
+
+void TracePainter::destroy_mips_ssbo(MipBuffer* mips, int count) {
+  GLuint ssbo = count ? mips[0].ssbo : 0;
+  if (ssbo) glDeleteBuffers(1, &ssbo);
+  for (int i = 0; i < count; i++) mips[i].ssbo = 0;
+}
+
+//-----------------------------------------------------------------------------
+
+void TracePainter::upload_trace(TraceBuffer& trace, size_t sample_min, size_t sample_max) {
+  invalidate_ring(sample_min, sample_max);
+
+  if (sample_max > trace.capacity()) sample_max = trace.capacity();
+  if (sample_min >= sample_max) return;
+
+  // Planar traces change in every plane, so that's one upload per channel in
+  // every shard the new samples landed in.
+  size_t planes    = trace.planar() ? trace.channels : 1;
+  size_t per_shard = trace_shard(trace, 0, 0).samples;
+
+  for (size_t k = sample_min / per_shard; k <= (sample_max - 1) / per_shard; k++) {
+    for (size_t c = 0; c < planes; c++) {
+      TraceShard shard = trace_shard(trace, c, k);
+      size_t a = (sample_min > shard.sample_base ? sample_min : shard.sample_base) - shard.sample_base;
+      size_t b = (sample_max < shard.sample_base + shard.samples ? sample_max : shard.sample_base + shard.samples) - shard.sample_base;
+
+      size_t byte_min, byte_max, blob_offset;
+      if (trace.planar()) {
+        byte_min = (a / 64) * 8;
+        byte_max = ((b + 63) / 64) * 8;
+        blob_offset = c * (trace.channel_stride / 8) + shard.sample_base / 8;
+      }
+      else {
+        byte_min = (a * trace.stride) / 8;
+        byte_max = (b * trace.stride + 7) / 8;
+        blob_offset = (shard.sample_base * trace.stride) / 8;
+      }
+      if (byte_max > shard.len) byte_max = shard.len;
+      if (byte_min >= byte_max) continue;
+
+      const uint8_t* src = (const uint8_t*)trace.blob + blob_offset + byte_min;
+      size_t dst = shard.offset + byte_min;
+      if (uploader) uploader->upload(shard.ssbo, dst, src, byte_max - byte_min);
+      else          update_ssbo(shard.ssbo, dst, src, byte_max - byte_min);
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+// During capture only the tail end of each level changes, so we only send
+// the buckets covering the dirty range instead of the whole pyramid.
+
+void TracePainter::upload_mips(MipBuffer& mips) {
+  if (mips.dirty_min >= mips.dirty_max) return;
+  invalidate_ring(mips.dirty_min, mips.dirty_max);
+
+  auto upload_level = [&](const void* mip, size_t elem_size, size_t mip_len, size_t mip_offset, int shift) {
+    size_t mask = (size_t(1) << shift) - 1;
+    size_t level_min = (mips.dirty_min +    0) >> shift;
+    size_t level_max = (mips.dirty_max + mask) >> shift;
+    if (level_max > mip_len) level_max = mip_len;
+    if (level_min >= level_max) return;
+    update_ssbo(mips.ssbo, mip_offset + level_min * elem_size,
+                (const uint8_t*)mip + level_min * elem_size, (level_max - level_min) * elem_size);
+  };
+
+  upload_level(mips.mip[1], 1, mips.mip_len[1], mips.mip1_offset, 7);
+  upload_level(mips.mip[2], 1, mips.mip_len[2], mips.mip2_offset, 14);
+  upload_level(mips.mip[3], 1, mips.mip_len[3], mips.mip3_offset, 21);
+  upload_level(mips.mip[4], 1, mips.mip_len[4], mips.mip4_offset, 28);
+
+  if (mips.edge1) {
+    upload_level(mips.edge1, 1, mips.mip_len[1], mips.edge1_offset, 7);
+    upload_level(mips.edge2, 2, mips.mip_len[2], mips.edge2_offset, 14);
+    upload_level(mips.edge3, 4, mips.mip_len[3], mips.edge3_offset, 21);
+    upload_level(mips.edge4, 4, mips.mip_len[4], mips.edge4_offset, 28);
+  }
+
+  clear_dirty(mips);
 }
 
 //-----------------------------------------------------------------------------
@@ -5,6 +5,7 @@
 
 using namespace glm;
 struct Viewport;
+struct TraceUploader;
 
 //-----------------------------------------------------------------------------
 
@@ -13,15 +14,244 @@ public:
   void init();
   void exit();
 
+  // Draws one channel into the screen rect (x, y, w, h). Columns are cached in
+  // the ring texture, see RingRow.
   void blit(
     Viewport view, dvec2 screen_size,
     int x, int y, int w, int h,
     TraceBuffer& trace, MipBuffer& mips, int channel);
 
+  // Draws channels [0, channels) as lanes - the same as calling blit() for
+  // each one with the rect moved down by `pitch` per channel, but each step
+  // goes out for every channel at once, see Lane.
+  void blit_lanes(
+    Viewport view, dvec2 screen_size,
+    int x, int y, int w, int h, int pitch,
+    TraceBuffer& trace, MipBuffer* mips, int channels);
+
+  // Creates the GPU copy of the mips for `count` channels, levels 1-4 of all of
+  // them in one ssbo. The whole buffer gets bound as one block, so this logs
+  // and returns false without creating anything if it wouldn't fit - see
+  // max_mip_samples().
+  bool create_mips_ssbo(MipBuffer* mips, int count);
+  size_t max_mip_samples(int channels, bool edges);
+
+  // Creates the GPU copy of the trace, split into as many shards as it takes
+  // to keep every binding under GL_MAX_SHADER_STORAGE_BLOCK_SIZE and every
+  // buffer under max_shard_bytes.
+  void create_trace_ssbo(TraceBuffer& trace);
+  static constexpr size_t max_shard_bytes = size_t(1) << 30;
+
+  // Frees what the two above made, so a trace can be set up again with a
+  // different width.
+  void destroy_trace_ssbo(TraceBuffer& trace);
+  void destroy_mips_ssbo(MipBuffer* mips, int count);
+
+  // Uploads the parts of the trace and mips that changed since the last call.
+  void upload_trace(TraceBuffer& trace, size_t sample_min, size_t sample_max);
+  void upload_mips(MipBuffer& mips);
+
+  // If set, upload_trace() goes through the staging ring instead of
+  // glBufferSubData(). Needed for traces in a create_device_ssbo() buffer.
+  TraceUploader* uploader = nullptr;
+
   static constexpr int buf_count = 1;
 
+  // shade_activity colors buckets by transition count instead of density.
+  // Only takes effect for mips allocated with edges. shade_coverage draws what
+  // render() would, see CoverRow.
+  static constexpr int shade_density  = 0;
+  static constexpr int shade_activity = 1;
+  static constexpr int shade_coverage = 2;
+  int shade_mode = shade_density;
+
   uint32_t trace_ubo = 0;
   uint32_t trace_prog = 0;
+
+  // Same shader built with TRACE_UVEC2 - finds the sample under each fragment
+  // with 32-bit integer math only, see SampleFx. For GPUs that emulate int64
+  // or run it slowly. use_integer picks it, except for views too far out for
+  // SampleFx, which still go through trace_prog.
+  uint32_t trace_int_prog = 0;
+  bool     use_integer = false;
+
+  // Times both trace shaders at every mip level on a test trace and checks
+  // they agree where neither has to round.
+  void bench_trace_shaders();
+
+  //----------------------------------------
+  // Scrolling column cache. Each channel gets a row of the ring texture that
+  // holds shaded columns for the current zoom, so panning only runs the trace
+  // shader on the strip that scrolled into view and the rest is a texture
+  // copy. Changing the zoom or shading starts the row over, and uploads drop
+  // the columns that the new data touches.
+
+  static constexpr int ring_width = 4096; // Power of two, at least the widest blit
+  static constexpr int ring_rows  = 64;   // Max channels
+
+  struct RingRow {
+    bool    valid = false;
+    double  scale = 0;        // Samples per pixel
+    double  phase = 0;        // Pixel P starts at sample (P + phase) * scale
+    int     miplevel = 0;
+    int     shade_mode = 0;
+    bool    integer = false;
+    int64_t pixel_min = 0;    // Pixels [pixel_min, pixel_max) are in the ring
+    int64_t pixel_max = 0;
+  };
+
+  bool     use_ring = true;
+  size_t   columns_shaded = 0; // Trace shader columns * rows, the caller resets it
+  size_t   draw_calls = 0;     // Draws and dispatches, the caller resets it
+
+  RingRow  ring[ring_rows];
+  uint32_t ring_tex = 0;
+  uint32_t ring_fbo = 0;
+
+  void invalidate_ring(size_t sample_min, size_t sample_max);
+
+  // Queues the trace shader on ring pixels [pixel_min, pixel_max) of the
+  // channel's row.
+  void queue_ring(TraceBuffer& trace, MipBuffer& mips, int channel,
+                  int64_t pixel_min, int64_t pixel_max);
+
+  //----------------------------------------
+  // One lane, matches Lane in lane_struct_glsl. The trace shader and the copy
+  // to the screen both take all of their per-channel state from an array of
+  // these in lane_ssbo, so each of them is one instanced draw for one lane or
+  // 64. Every channel's mips are in the same buffer, at mip_base/edge_base.
+
+  struct Lane {
+    float    blit_x;
+    float    blit_y;
+    float    blit_w;
+    float    blit_h;
+    uint32_t ring_offset;     // Ring column under screen column 0
+    int32_t  ring_row;
+    int32_t  cover;           // Row is in cover_tex, not ring_tex
+    uint32_t shade_mode;
+
+    // Trace shader only - the view and where the channel's data is.
+    int32_t  offset_hi;       // Sample under the left edge of column 0, see SamplePos
+    uint32_t offset_lo;
+    float    offset_frac;
+    float    scale;
+    uint32_t origin_fx_lo;    // Same for trace_int_prog, see SampleFx
+    uint32_t origin_fx_hi;
+    uint32_t step_fx_lo;
+    uint32_t step_fx_hi;
+    uint32_t fx_bits;
+    uint32_t channel;         // Bit within a sample, 0 for planar traces
+    uint32_t plane;           // Word offset of the channel's plane in a shard
+    int32_t  miplevel;
+    uint32_t mip_base[4];     // Word offsets of levels 1-4 in the mips buffer
+    uint32_t edge_base[4];
+  };
+
+  // Where each kind of lane goes in lane_ssbo. Up to two spans a frame per
+  // ring row, each in at most two pieces, plus one lane per channel drawn
+  // straight to the screen and one copied out of the ring.
+  static constexpr int ring_lane_slot   = 0;
+  static constexpr int direct_lane_slot = 4 * ring_rows;
+  static constexpr int copy_lane_slot   = 5 * ring_rows;
+  static constexpr int lane_slots       = 6 * ring_rows;
+
+  Lane     ring_lanes[4 * ring_rows];
+  Lane     direct_lanes[ring_rows];
+  Lane     lanes[ring_rows];
+  int      ring_lane_count = 0;
+  int      direct_lane_count = 0;
+
+  uint32_t lane_ssbo = 0;
+  uint32_t lane_ubo = 0;
+  uint32_t lane_prog = 0;
+
+  // The trace shader's lane for a channel - fragment column X of the rect
+  // (x, y, w, h) shows the sample at origin + (X + 0.5) * scale.
+  Lane trace_lane(TraceBuffer& trace, MipBuffer& mips, int channel, int miplevel, int shade_mode,
+                  double origin, double scale, int x, int y, int w, int h);
+
+  // Runs the trace shader on `count` lanes into the current render target,
+  // which is target_size pixels. All of them read mips_ssbo.
+  void shade_lanes(TraceBuffer& trace, int mips_ssbo, const Lane* lanes, int count,
+                   int slot, dvec2 target_size);
+
+  // Works out what the channel needs shaded and queues it - into its ring or
+  // cover row, or straight onto the screen if it doesn't fit in the ring.
+  // Returns true and fills in `lane` if there's a row to copy to the screen.
+  bool prepare_lane(
+    Viewport view, dvec2 screen_size,
+    int x, int y, int w, int h,
+    TraceBuffer& trace, MipBuffer& mips, int channel, Lane& lane);
+
+  // Runs everything prepare_lane() queued, then copies `count` lanes out of
+  // the ring and cover rows.
+  void flush_lanes(TraceBuffer& trace, int mips_ssbo, dvec2 screen_size, int count);
+
+  void draw_lanes(dvec2 screen_size, const Lane* lanes, int count);
+
+  //----------------------------------------
+  // Coverage shading. The trace shader picks one mip level for the whole view
+  // and shows one bucket per column, which aliases. cover() runs the span
+  // reduction from render() on the GPU instead - every column gets the exact
+  // fraction of its samples that are high - and writes it to the channel's
+  // row of cover_tex. Cover rows scroll the same way ring rows do, so that
+  // only happens for columns that are new or whose data changed.
+
+  struct CoverRow {
+    bool    valid = false;
+    double  scale = 0;        // Samples per pixel
+    double  phase = 0;        // Pixel P covers samples from (P + phase) * scale
+    int64_t pixel_min = 0;    // Pixels [pixel_min, pixel_max) are in the row
+    int64_t pixel_max = 0;
+  };
+
+  // A run of columns for cover() to fill in, matches CoverLane in cover_glsl.
+  struct CoverLane {
+    uint32_t origin_lo;       // Left edge of the first column, CoverFx -
+    uint32_t origin_hi;       // cover() fills these in from cover_origins
+    int32_t  row;
+    int32_t  col;             // cover_tex column of the first one, wraps around
+    int32_t  count;
+    uint32_t channel;         // Same as Lane
+    uint32_t plane;
+    uint32_t pad;
+    uint32_t mip_base[4];
+  };
+
+  static constexpr int cover_local = 64;
+
+  CoverRow  cover_rows[ring_rows];
+  CoverLane cover_lanes[4 * ring_rows];
+  double    cover_origins[4 * ring_rows];
+  double    cover_scale = 0;
+  int       cover_lane_count = 0;
+
+  uint32_t cover_tex = 0;
+  uint32_t cover_ubo = 0;
+  uint32_t cover_prog = 0;
+  uint32_t cover_lane_ssbo = 0;
+
+  // Queues columns [col, col + count) of cover_tex row `row`, which mustn't
+  // wrap - column col + X covers samples [origin + X * scale,
+  // origin + (X + 1) * scale). Everything queued until the next cover() has
+  // to have the same scale.
+  void queue_cover(TraceBuffer& trace, MipBuffer& mips, int channel, int row,
+                   int col, int count, double origin, double scale);
+
+  // Fills in every queued run, all reading mips_ssbo. Columns outside the
+  // trace get -1.
+  void cover(TraceBuffer& trace, int mips_ssbo);
+
+  // Runs cover() on a test trace big enough to need several shards and
+  // compares it against render_cover().
+  void check_coverage();
+
+  // The test trace for the two above - test_channels planar channels in
+  // several shards, with mips, on the GPU.
+  static constexpr int test_channels = 2;
+  void create_test_trace(TraceBuffer& trace, MipBuffer* mips);
+  void destroy_test_trace(TraceBuffer& trace, MipBuffer* mips);
 };
 
 //-----------------------------------------------------------------------------
@@ -0,0 +1,126 @@
+#include "TraceUploader.hpp"
+#include "third_party/glad/glad.h"
+#include "log.hpp"
+
+#include <string.h>
+
+//------------------------------------------------------------------------------
+// Coherent, so the memcpys are visible to the copies without us having to
+// flush mapped ranges.
+
+void TraceUploader::init(size_t slot_bytes) {
+  this->slot_bytes = slot_bytes;
+
+  GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+  for (int i = 0; i < slot_count; i++) {
+    Slot& s = slots[i];
+    glGenBuffers(1, &s.buffer);
+    glBindBuffer(GL_COPY_READ_BUFFER, s.buffer);
+    glBufferStorage(GL_COPY_READ_BUFFER, slot_bytes, nullptr, flags);
+    s.mapped = (uint8_t*)glMapBufferRange(GL_COPY_READ_BUFFER, 0, slot_bytes, flags);
+    s.fence = nullptr;
+  }
+  glBindBuffer(GL_COPY_READ_BUFFER, 0);
+
+  current = 0;
+  fill = 0;
+  frame = {};
+  total = {};
+  pending = {};
+}
+
+//------------------------------------------------------------------------------
+
+void TraceUploader::exit() {
+  for (int i = 0; i < slot_count; i++) {
+    Slot& s = slots[i];
+    wait(s);
+    glBindBuffer(GL_COPY_READ_BUFFER, s.buffer);
+    glUnmapBuffer(GL_COPY_READ_BUFFER);
+    glDeleteBuffers(1, &s.buffer);
+    s = {};
+  }
+  glBindBuffer(GL_COPY_READ_BUFFER, 0);
+}
+
+//------------------------------------------------------------------------------
+
+void TraceUploader::upload(int dst_ssbo, size_t dst_offset, const void* data, size_t size) {
+  const uint8_t* src = (const uint8_t*)data;
+
+  glBindBuffer(GL_COPY_WRITE_BUFFER, dst_ssbo);
+
+  while (size) {
+    if (fill == slot_bytes) next_slot();
+
+    // Starting a slot - make sure the GPU is done with what was in it.
+    Slot& s = slots[current];
+    if (fill == 0) wait(s);
+
+    size_t chunk = slot_bytes - fill;
+    if (chunk > size) chunk = size;
+
+    double time_a = timestamp();
+    memcpy(s.mapped + fill, src, chunk);
+    pending.memcpy_time += timestamp() - time_a;
+
+    glBindBuffer(GL_COPY_READ_BUFFER, s.buffer);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, fill, dst_offset, chunk);
+
+    pending.bytes += chunk;
+    pending.copies++;
+
+    fill += chunk;
+    src += chunk;
+    dst_offset += chunk;
+    size -= chunk;
+  }
+
+  glBindBuffer(GL_COPY_READ_BUFFER, 0);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+//------------------------------------------------------------------------------
+
+void TraceUploader::flush() {
+  if (fill) next_slot();
+
+  frame = pending;
+  total.bytes       += pending.bytes;
+  total.copies      += pending.copies;
+  total.stalls      += pending.stalls;
+  total.memcpy_time += pending.memcpy_time;
+  total.stall_time  += pending.stall_time;
+  pending = {};
+}
+
+//------------------------------------------------------------------------------
+
+void TraceUploader::next_slot() {
+  slots[current].fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  current = (current + 1) % slot_count;
+  fill = 0;
+}
+
+// Checks the fence without blocking first, so we only count real stalls.
+
+void TraceUploader::wait(Slot& slot) {
+  if (!slot.fence) return;
+  GLsync fence = (GLsync)slot.fence;
+
+  GLenum result = glClientWaitSync(fence, 0, 0);
+  if (result == GL_TIMEOUT_EXPIRED) {
+    double time_a = timestamp();
+    do {
+      result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+    } while (result == GL_TIMEOUT_EXPIRED);
+    pending.stalls++;
+    pending.stall_time += timestamp() - time_a;
+  }
+  if (result == GL_WAIT_FAILED) log("TraceUploader: glClientWaitSync failed");
+
+  glDeleteSync(fence);
+  slot.fence = nullptr;
+}
+
+//------------------------------------------------------------------------------
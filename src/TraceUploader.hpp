@@ -0,0 +1,64 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+//------------------------------------------------------------------------------
+// Streams trace data to the GPU without blocking the render thread.
+//
+// Shaders reading a persistent-mapped buffer run way slower (see the notes in
+// TraceMipper.cpp), and glBufferSubData() stalls whenever the driver still has
+// the destination in use. So we go through a ring of persistent-mapped staging
+// buffers instead - upload() memcpys into the current slot and queues a
+// glCopyBufferSubData() into the real (device-local) buffer. Anything queued
+// after that, like TraceMipper::build(), sees the new data without waiting on
+// the CPU.
+//
+// flush() fences the slot and moves on to the next one. We only wait on a
+// fence when we come back around to a slot whose copies haven't finished, so
+// the CPU can fill one slot while the GPU copies out of another.
+
+struct UploadStats {
+  size_t bytes = 0;
+  size_t copies = 0;         // glCopyBufferSubData calls
+  size_t stalls = 0;         // Times we had to wait on a slot's fence
+  double memcpy_time = 0;    // Seconds spent copying into staging
+  double stall_time = 0;     // Seconds spent waiting on fences
+};
+
+struct TraceUploader {
+
+  static constexpr int slot_count = 3;
+
+  void init(size_t slot_bytes);
+  void exit();
+
+  // Queues a copy of data into dst_ssbo at dst_offset. Bigger than a slot is
+  // fine, it just gets split up.
+  void upload(int dst_ssbo, size_t dst_offset, const void* data, size_t size);
+
+  // Fences whatever has been queued so far. Call it once a frame, it also
+  // rolls the stats over.
+  void flush();
+
+  UploadStats frame;         // Stats for the last flush()
+  UploadStats total;         // Since init()
+
+  //----------------------------------------
+
+  struct Slot {
+    uint32_t buffer = 0;
+    uint8_t* mapped = nullptr;
+    void*    fence = nullptr; // GLsync for the copies out of this slot
+  };
+
+  void next_slot();
+  void wait(Slot& slot);
+
+  Slot        slots[slot_count];
+  size_t      slot_bytes = 0;
+  int         current = 0;
+  size_t      fill = 0;      // Bytes used in the current slot
+  UploadStats pending;       // Since the last flush()
+};
+
+//------------------------------------------------------------------------------
@@ -10,6 +10,8 @@
 
 #include "log.hpp"
 #include "Bits.hpp"
+#include "RenderPool.hpp"
+#include "TileCache.hpp"
 
 #ifdef _MSC_VER
 #  include <intrin.h>
@@ -25,11 +27,15 @@
 
 //------------------------------------------------------------------------------
 
+// 16 and 32-bit samples get the same pattern in the low byte and scrambled
+// copies of it above that.
+
 void gen_pattern(TraceBuffer& trace) {
-  assert(trace.channels == 8);
-  assert(trace.stride == 8);
+  assert(trace.stride == 8 || trace.stride == 16 || trace.stride == 32);
+  assert(trace.channels == trace.stride);
 
   uint8_t* bits = (uint8_t*)trace.blob;
+  size_t bytes_per_sample = trace.stride / 8;
 
   for (size_t i = 0; i < trace.samples; i++) {
 
@@ -38,7 +44,9 @@ void gen_pattern(TraceBuffer& trace) {
     size_t t = i + 0x993781;
     t = t*((t>>9|t>>13)&25&t>>6);
 
-    bits[i] = t;
+    for (size_t b = 0; b < bytes_per_sample; b++) {
+      bits[i * bytes_per_sample + b] = uint8_t(t * (2 * b + 1) + b * 0x35);
+    }
 
     //size_t t = i;
     //t *= 0x23456789;
@@ -56,10 +64,17 @@ int main(int argc, char* argv[]) {
 
   double time_a, time_b;
 
+  // ZoomyTrace [channels] - 8, 16 or 32.
+  int channels = argc > 1 ? atoi(argv[1]) : 8;
+  if (channels != 8 && channels != 16 && channels != 32) {
+    printf("channels has to be 8, 16 or 32\n");
+    return 1;
+  }
+
   TraceBuffer trace;
   trace.samples  = 65536ull;
-  trace.channels = 8;
-  trace.stride   = 8;
+  trace.channels = channels;
+  trace.stride   = channels;
   trace.ssbo_len = (trace.samples * trace.stride + 7) / 8;
   trace.ssbo     = -1;
   trace.blob     = new uint8_t[trace.ssbo_len];
@@ -72,27 +87,22 @@ int main(int argc, char* argv[]) {
 
 
   time_a = timestamp();
-  MipBuffer mips[8];
-  for (int i = 0; i < 8; i++) {
-    mips[i].samples = trace.samples;
-
-    size_t len = (trace.samples + 127) / 128;
-    mips[i].mip1 = new uint8_t[len];
-
-    len = (len + 127) / 128;
-    mips[i].mip2 = new uint8_t[len];
-
-    len = (len + 127) / 128;
-    mips[i].mip3 = new uint8_t[len];
-
-    len = (len + 127) / 128;
-    mips[i].mip4 = new uint8_t[len];
-
-    update_mips(trace, i, 0, trace.samples, mips[i]);
+  MipBuffer mips[32];
+  for (int i = 0; i < channels; i++) {
+    alloc_mips(mips[i], trace.samples);
   }
+  update_mips_all(trace, mips, channels);
   time_b = timestamp();
   printf("generating mips took %f\n", time_b - time_a);
 
+  RenderPool render_pool;
+  render_pool.init((int)std::thread::hardware_concurrency());
+  printf("render pool has %d threads\n", render_pool.thread_count);
+
+  TileCache tile_cache;
+  tile_cache.init(64 * 1024 * 1024);
+  printf("tile cache has %d tiles\n", tile_cache.tile_count);
+
   //----------
 
   SDL_Window* window = NULL;
@@ -187,25 +197,28 @@ int main(int argc, char* argv[]) {
     zoom   = view_control.view_smooth_snap._zoom;
     origin = view_control.view_smooth_snap._center.x + trace.samples / 2.0;
 
-    origin += sin(new_now * 1.0) * 1.0 * exp2(-zoom.x);
+    // Wobble by whole pixels so the frame stays on the tile cache's grid.
+    origin += round(sin(new_now * 1.0) * 1.0) * exp2(-zoom.x);
 
     double pixels_per_sample = pow(2, zoom.x);
     double samples_per_pixel = 1.0 / pixels_per_sample;
 
-    double bar_min = 0.0;
-    double bar_max = WINDOW_WIDTH;
-
     double view_min = origin - ((WINDOW_WIDTH / 2.0) * samples_per_pixel);
-    double view_max = origin + ((WINDOW_WIDTH / 2.0) * samples_per_pixel);
 
-    double traces[8][WINDOW_WIDTH];
+    static double traces[32][WINDOW_WIDTH];
 
     time_a = timestamp();
-    for (int i = 0; i < 8; i++) {
-      render(trace, mips[i], i, bar_min, bar_max, view_min, view_max, traces[i], WINDOW_WIDTH);
-    }
+    // World 0 is the middle of the trace.
+    tile_cache.render(render_pool, trace, mips, channels, trace.samples / 2.0, zoom.x, view_min, traces[0], WINDOW_WIDTH, WINDOW_WIDTH);
     time_b = timestamp();
-    printf("render trace took %12.6f\n", time_b - time_a);
+
+    TileStats& frame = tile_cache.frame;
+    TileStats& total = tile_cache.total;
+    int lookups = total.hits + total.misses;
+    printf("render trace took %12.6f - %s, %3d hits %3d misses %3d evictions, %6.2f%% hit rate overall\n",
+           time_b - time_a, frame.bypassed ? "bypassed" : "cached",
+           frame.hits, frame.misses, frame.evictions,
+           lookups ? 100.0 * total.hits / lookups : 0.0);
 
     //----------
     // Render
@@ -216,7 +229,7 @@ int main(int argc, char* argv[]) {
     SDL_LockTexture(texture, NULL, (void**) & pixels, &pitch);
 
     // sRGB conversion
-    for (int i = 0; i < 8; i++) {
+    for (int i = 0; i < channels; i++) {
       for (int x = 0; x < WINDOW_WIDTH; x++) {
         double s = traces[i][x];
         s = (s < 0.0031308) ? 12.92 * s : (1.0 + 0.055) * pow(s, 1.0 / 2.4) - 0.055;
@@ -225,10 +238,14 @@ int main(int argc, char* argv[]) {
       }
     }
 
-    for (int channel = 0; channel < 8; channel++) {
-      for (int row = 0; row < 64; row++) {
+    // 96 pixels a lane for 8 channels, squeezed down for more.
+    int lane_pitch = (WINDOW_HEIGHT - 128) / channels;
+    if (lane_pitch > 96) lane_pitch = 96;
+
+    for (int channel = 0; channel < channels; channel++) {
+      for (int row = 0; row < lane_pitch * 2 / 3; row++) {
         for (int x = 0; x < WINDOW_WIDTH; x++) {
-          int y = 128 + channel * 96 + row;
+          int y = 128 + channel * lane_pitch + row;
           int v = (int)traces[channel][x];
           uint32_t color = (v << 24) | (v << 16) | (v << 8) | 0xFF;
           pixels[x + y * (pitch / sizeof(uint32_t))] = color;
@@ -248,6 +265,9 @@ int main(int argc, char* argv[]) {
     SDL_RenderPresent(renderer);
   }
 
+  tile_cache.exit();
+  render_pool.exit();
+
   SDL_DestroyTexture(texture);
   SDL_DestroyRenderer(renderer);
   SDL_DestroyWindow(window);
@@ -55,8 +55,10 @@ Capture::Capture() {
   hdev = nullptr;
 
   // Allocate buffers & packets
-  //ring_buffer = (uint8_t*)aligned_alloc(chunk_size, ring_size);
-  //ring_buffer_len = ring_size;
+  // DMA ring buffer size seems to be limited to 8 megs (128 chunks). Blocks
+  // are handed to the host by pointer and stay put until it sends them back,
+  // see pump_chunks().
+  ring = new RingBuffer(8ull * 1024ull * 1024ull);
 
   for (int i = 0; i < 16; i++) {
     auto t = libusb_alloc_transfer(0);
@@ -134,8 +136,7 @@ Capture::~Capture() {
   ctx = nullptr;
 
   // Free buffers & packets
-  //delete [] ring_buffer;
-  //free(ring_buffer);
+  delete ring;
   ring = nullptr;
 
   while (!control_pool.empty()) {
@@ -404,13 +405,16 @@ int Capture::thread_loop() {
       } break;
 
       case XCMD_START_CAP: {
-        start_cap(msg.result);
+        // length is the bytes per sample, 0 for the default of 1.
+        start_cap(msg.result, msg.length ? int(msg.length) : 1);
         cap_to_host.put(msg);
       } break;
 
       case XCMD_BLOCK: {
-        // FIXME this message is cap-to-host only
-        assert(false);
+        // The host is done with the oldest block, its slot can take another chunk.
+        ring->cursor_read = (ring->cursor_read + chunk_size) & (ring->buffer_len - 1);
+        ring_used--;
+        pump_chunks();
       } break;
 
       case XCMD_STOP_CAP: {
@@ -498,15 +502,22 @@ int Capture::get_revid() {
 }
 
 //------------------------------------------------------------------------------
+// fx2lafw can send either 8 or 16 channels per sample. 16-bit samples at the
+// 8-bit rate would be 48 MB/sec, more than the FX2 can push over USB 2, so
+// wide captures run at 16 MHz instead of 24.
 
-int Capture::start_cap(int block_count) {
+int Capture::start_cap(int block_count, int sample_bytes) {
   if (block_count == 0) return 0;
+  assert(sample_bytes == 1 || sample_bytes == 2);
 
   assert(!capture_running);
   bulk_requested = block_count;
   bulk_submitted = 0;
   bulk_pending   = 0;
   bulk_done      = 0;
+  bulk_failed    = 0;
+  bulk_stalls    = 0;
+  ring_stalled   = false;
 
   auto transfer = control_pool.front();
   control_pool.pop();
@@ -520,7 +531,13 @@ int Capture::start_cap(int block_count) {
     sizeof(cmd_start_acquisition)
   );
 
-  cmd_start_acquisition cmd = {CMD_START_FLAGS_SAMPLE_8BIT | CMD_START_FLAGS_CLK_48MHZ, 0, 1};
+  cmd_start_acquisition cmd;
+  if (sample_bytes == 2) {
+    cmd = {CMD_START_FLAGS_SAMPLE_16BIT | CMD_START_FLAGS_CLK_48MHZ, 0, 2};
+  }
+  else {
+    cmd = {CMD_START_FLAGS_SAMPLE_8BIT | CMD_START_FLAGS_CLK_48MHZ, 0, 1};
+  }
   memcpy(transfer->buffer + 8, &cmd, sizeof(cmd));
 
   libusb_fill_control_transfer(
@@ -539,9 +556,7 @@ int Capture::start_cap(int block_count) {
   // We _must_ immediately enqueue _two_ bulk transfers after the cap starts or
   // the FX2's internal buffer will overflow.
 
-  if (block_count > 0) CHECK(queue_chunk());
-  if (block_count > 1) CHECK(queue_chunk());
-
+  CHECK(pump_chunks());
   capture_running = true;
 
   return 0;
@@ -555,6 +570,30 @@ int Capture::stop_cap() {
   return 0;
 }
 
+//------------------------------------------------------------------------------
+// Keeps two bulk transfers in flight, as long as the ring has a free slot for
+// them. Slots only come back when the host returns their block, so a host that
+// falls behind stalls the capture (and overflows the FX2) instead of having
+// blocks overwritten under it.
+
+int Capture::pump_chunks() {
+  int ring_chunks = int(ring->buffer_len / chunk_size);
+
+  while (bulk_pending < 2 && bulk_submitted < bulk_requested) {
+    if (ring_used >= ring_chunks) {
+      if (!ring_stalled) {
+        log("Capture ring full, host is %d blocks behind", (int)ring_used);
+        bulk_stalls++;
+        ring_stalled = true;
+      }
+      return 0;
+    }
+    ring_stalled = false;
+    CHECK(queue_chunk());
+  }
+  return 0;
+}
+
 //------------------------------------------------------------------------------
 
 int Capture::queue_chunk() {
@@ -579,12 +618,17 @@ int Capture::queue_chunk() {
       cap->bulk_done++;
       cap->bulk_pool.push(transfer);
 
-      cap->cap_to_host.put({XCMD_BLOCK, 0, transfer->buffer, cap->chunk_size});
-
-      if (cap->bulk_submitted < cap->bulk_requested) {
-        //log("queueing next chunk");
-        cap->queue_chunk();
+      // A failed transfer still holds its slot, so it goes to the host with no
+      // samples and comes back like any other block.
+      int length = transfer->actual_length;
+      if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        log("Bulk transfer failed, status %d, dropping %d bytes", transfer->status, length);
+        cap->bulk_failed++;
+        length = 0;
       }
+      cap->cap_to_host.put({XCMD_BLOCK, transfer->status, transfer->buffer, length});
+
+      cap->pump_chunks();
 
       if (cap->bulk_done >= cap->bulk_requested) {
         //log("capture done");
@@ -599,6 +643,7 @@ int Capture::queue_chunk() {
 
   CHECK(libusb_submit_transfer(transfer));
   ring->cursor_write = (ring->cursor_write + chunk_size) & ring_mask;
+  ring_used++;
   bulk_submitted++;
   bulk_pending++;
 
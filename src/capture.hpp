@@ -36,8 +36,8 @@ constexpr uint16_t EZUSB_HALT_REG_ADDR = 0xe600;
 
 enum CapCommand {
   XCMD_CONNECT,     // Connect to the logic analyzer, uploading firmware if needed.
-  XCMD_START_CAP,   // Start capturing blocks.
-  XCMD_BLOCK,       // Fill a block.
+  XCMD_START_CAP,   // Start capturing blocks. result = block count, length = bytes per sample.
+  XCMD_BLOCK,       // A filled block. The host sends it back once it's appended.
   XCMD_STOP_CAP,    // Stop capturing blocks.
   XCMD_GET_FWID,    //
   XCMD_GET_REVID,   //
@@ -95,8 +95,9 @@ public:
 
   int connect();
   int disconnect();
-  int start_cap(int block_count);
+  int start_cap(int block_count, int sample_bytes);
   int stop_cap();
+  int pump_chunks();
   int queue_chunk();
   int get_fwid();
   int get_revid();
@@ -112,6 +113,14 @@ public:
   std::atomic_int  bulk_submitted = 0;
   std::atomic_int  bulk_pending = 0;
   std::atomic_int  bulk_done = 0;
+  std::atomic_int  bulk_failed = 0;
+  std::atomic_int  bulk_stalls = 0;
+
+  // Ring slots holding a chunk in flight or a block the host hasn't sent back.
+  // Never reset, blocks from an old capture still come back after a new one
+  // starts.
+  std::atomic_int  ring_used = 0;
+  bool ring_stalled = false;
 
   libusb_context* ctx = nullptr;
   libusb_device_handle *hdev = nullptr;
@@ -9,6 +9,7 @@
 #include "third_party/imgui/imgui.h"
 #include <SDL2/SDL.h>
 #include <algorithm>
+#include <string.h>
 
 void log(const char* format, ...);
 void err(const char* format, ...);
@@ -116,8 +117,24 @@ void Main::init() {
   blit.init();
   trace_painter.init();
 
+  // Planar, so each channel's samples sit together for the mippers and the
+  // painter. append_samples() transposes the capture blocks on the way in.
+  // Capture blocks reach the trace through the staging ring, so appending
+  // never waits on the GPU.
+  trace_uploader.init(16 * 1024 * 1024);
+  trace_painter.uploader = &trace_uploader;
+  if (gpu_checks) {
+    trace_painter.check_coverage();
+    trace_painter.bench_trace_shaders();
+  }
+
+  init_trace(trace_channels);
+
   trace_mipper.init();
-  trace_mipper.run(0, 0);
+  if (gpu_checks) trace_mipper.run(0, 0);
+
+  gpu_profiler.init();
+  trace_mipper.profiler = &gpu_profiler;
 
   vcon.init({initial_screen_w, initial_screen_h});
 
@@ -136,12 +153,46 @@ void Main::init() {
 void Main::exit() {
   cap->stop_thread();
   delete cap;
+  gpu_profiler.exit();
+  trace_uploader.exit();
+  exit_trace();
   trace_painter.exit();
   log("ZoomyTrace exit");
 }
 
 //------------------------------------------------------------------------------
 
+void Main::init_trace(int channels) {
+  assert(channels > 0 && channels <= max_channels);
+  trace_channels = channels;
+
+  // The trace gets sharded, but every channel's mips are bound as one block,
+  // so that's what caps the sample count on the GPU side.
+  size_t capacity = trace_bytes * 8 / channels;
+  size_t max_samples = trace_painter.max_mip_samples(channels, true);
+  if (capacity > max_samples) {
+    log("Trace: %ld samples is more than the mips can hold, using %ld", capacity, max_samples);
+    capacity = max_samples;
+  }
+  init_planar(trace, channels, capacity);
+  trace_painter.create_trace_ssbo(trace);
+  trace.blob = new uint8_t[trace.ssbo_len];
+
+  for (int i = 0; i < channels; i++) alloc_mips(mips[i], capacity, false, true);
+  trace_painter.create_mips_ssbo(mips, channels);
+  log("Trace: %d channels, %ld samples", channels, capacity);
+}
+
+void Main::exit_trace() {
+  trace_painter.destroy_mips_ssbo(mips, trace_channels);
+  for (int i = 0; i < trace_channels; i++) free_mips(mips[i]);
+  trace_painter.destroy_trace_ssbo(trace);
+  delete [] (uint8_t*)trace.blob;
+  trace = {};
+}
+
+//------------------------------------------------------------------------------
+
 void Main::update() {
 
   SDL_GL_GetDrawableSize((SDL_Window*)window, &screen_w, &screen_h);
@@ -153,6 +204,8 @@ void Main::update() {
   keyboard_state = SDL_GetKeyboardState(&key_count);
   SDL_GetCurrentDisplayMode(0, &display_mode);
 
+  gpu_profiler.begin_frame();
+
   // Hax, force frame delta to be exactly the refresh interval
   frame++;
   old_now = new_now;
@@ -247,11 +300,63 @@ void Main::update() {
 
   //----------------------------------------
 
+  // Blocks show up too fast to log each one. Append them all to the trace,
+  // then send the GPU the parts that changed in one go.
+  size_t new_min = trace.samples;
+
   while (!cap->cap_to_host.empty()) {
     auto res = cap->cap_to_host.get();
+
+    if (res.command == XCMD_BLOCK) {
+      append_samples(trace, mips, capture_gpu_mips ? 0 : trace_channels, res.block, res.length);
+      // Done with it, the capture can reuse the slot.
+      cap->post_async(res);
+      continue;
+    }
+
+    // New capture, start the trace over. It comes back with the bytes per
+    // sample we asked for, so a new width means a new trace.
+    if (res.command == XCMD_START_CAP) {
+      int channels = int(res.length ? res.length : 1) * 8;
+      if (channels != trace_channels) {
+        glFinish();
+        exit_trace();
+        init_trace(channels);
+      }
+
+      trace.samples = 0;
+      new_min = 0;
+      capture_gpu_mips = gpu_mips;
+
+      // Send the cleared pyramids now, before any GPU builds land in them.
+      for (int i = 0; i < trace_channels; i++) {
+        clear_mips(mips[i]);
+        trace_painter.upload_mips(mips[i]);
+      }
+    }
+
     log("<- %-16s 0x%08x 0x%016x %ld", capcmd_to_cstr(res.command), res.result, res.block, res.length);
   }
 
+  if (trace.samples > new_min) {
+    gpu_profiler.push("upload");
+    trace_painter.upload_trace(trace, new_min, trace.samples);
+    gpu_profiler.pop();
+
+    if (capture_gpu_mips) {
+      gpu_profiler.push("mipper");
+      for (int i = 0; i < trace_channels; i++) trace_mipper.build(trace, mips[i], i, new_min, trace.samples);
+      gpu_profiler.pop();
+    }
+  }
+
+  gpu_profiler.push("upload mips");
+  for (int i = 0; i < trace_channels; i++) {
+    trace_painter.upload_mips(mips[i]);
+  }
+  gpu_profiler.pop();
+  trace_uploader.flush();
+
   double delta = new_now - old_now;
   vcon.update(delta);
 
@@ -282,6 +387,21 @@ void Main::update_imgui() {
     dvec2 world_max = vcon.view_target.world_max(screen_size);
 
     ImGui::Text("view width       %f\n",world_max.x - world_min.x);
+
+    ImGui::RadioButton("Density", &trace_painter.shade_mode, TracePainter::shade_density);
+    ImGui::SameLine();
+    ImGui::RadioButton("Activity", &trace_painter.shade_mode, TracePainter::shade_activity);
+    ImGui::SameLine();
+    ImGui::RadioButton("Coverage", &trace_painter.shade_mode, TracePainter::shade_coverage);
+
+    ImGui::Checkbox("Cache columns in ring texture", &trace_painter.use_ring);
+    ImGui::Checkbox("Integer-only trace shader", &trace_painter.use_integer);
+    ImGui::Checkbox("Build mips on the GPU", &gpu_mips);
+    ImGui::RadioButton("8 channels", &capture_channels, 8);
+    ImGui::SameLine();
+    ImGui::RadioButton("16 channels", &capture_channels, 16);
+    ImGui::Text("columns shaded   %ld\n", shaded_columns);
+    ImGui::Text("trace draw calls %ld\n", trace_draw_calls);
   }
   ImGui::End();
 
@@ -305,6 +425,9 @@ void Main::update_imgui() {
   ImGui::Text("bulk_submitted  %d", (int)cap->bulk_submitted);
   ImGui::Text("bulk_pending    %d", (int)cap->bulk_pending);
   ImGui::Text("bulk_done       %d", (int)cap->bulk_done);
+  ImGui::Text("bulk_failed     %d", (int)cap->bulk_failed);
+  ImGui::Text("bulk_stalls     %d", (int)cap->bulk_stalls);
+  ImGui::Text("ring_used       %d", (int)cap->ring_used);
 
   if (ImGui::TreeNode("Ring Buffer Settings")) {
     //ImGui::Text("ring_buffer     %p", ring->buffer);
@@ -337,7 +460,7 @@ void Main::update_imgui() {
     }
 
     if (ImGui::Button("start_cap", {100,25})) {
-      cap->post_async({XCMD_START_CAP, 1024, 0, 0});
+      cap->post_async({XCMD_START_CAP, 1024, 0, size_t(capture_channels / 8)});
     }
 
     if (ImGui::Button("stop_cap", {100,25})) {
@@ -350,6 +473,16 @@ void Main::update_imgui() {
   ImGui::Text("frame time %f", new_now - old_now);
   ImGui::Text("render time %f", render_time);
 
+  {
+    UploadStats& f = trace_uploader.frame;
+    UploadStats& t = trace_uploader.total;
+    double memcpy_rate = t.memcpy_time > 0 ? double(t.bytes) / t.memcpy_time : 0;
+    ImGui::Text("upload     %.3f MB in %ld copies, %ld stalls (%f sec)",
+                double(f.bytes) / (1024.0 * 1024.0), f.copies, f.stalls, f.stall_time);
+    ImGui::Text("uploaded   %.3f GB, staging %.3f GB/sec, %ld stalls (%f sec)",
+                double(t.bytes) / (1024.0 * 1024.0 * 1024.0), memcpy_rate / 1.0e9, t.stalls, t.stall_time);
+  }
+
   {
       ImGui::Begin("log");
       ImGui::BeginChild("scrolling", ImVec2(0, 0), ImGuiChildFlags_None, ImGuiWindowFlags_HorizontalScrollbar);
@@ -364,6 +497,7 @@ void Main::update_imgui() {
   }
 
   ImGui::End();
+  gpu_profiler.draw_gui();
   ImGui::ShowDemoWindow();
   ImGui::Render();
 }
@@ -389,27 +523,40 @@ void Main::render() {
 
   auto time_a = timestamp();
 
-//  int cursor_y = 64;
-//  for (int channel = 0; channel < 8; channel++) {
-//    trace_painter.blit(
-//      vcon.view_smooth_snap, screen_size,
-//      0, cursor_y, 1920, 64,
-//      trace, mips[channel], channel);
-//    cursor_y += 96;
-//  }
+  gpu_profiler.push("trace blit");
+  if (trace.samples) {
+    // 96 pixels a lane if they fit, squeezed down if they don't.
+    int pitch = (screen_h - 64) / trace_channels;
+    if (pitch > 96) pitch = 96;
+    trace_painter.blit_lanes(
+      vcon.view_smooth_snap, screen_size,
+      0, 64, 1920, pitch * 2 / 3, pitch,
+      trace, mips, trace_channels);
+  }
+  gpu_profiler.pop();
 
   auto time_b = timestamp();
   render_time = time_b - time_a;
+  shaded_columns = trace_painter.columns_shaded;
+  trace_painter.columns_shaded = 0;
+  trace_draw_calls = trace_painter.draw_calls;
+  trace_painter.draw_calls = 0;
 
+  gpu_profiler.push("imgui");
   gui.render_gl(window);
+  gpu_profiler.pop();
 
   SDL_GL_SwapWindow((SDL_Window*)window);
+  gpu_profiler.end_frame();
 }
 
 //------------------------------------------------------------------------------
 
 int main(int argc, char** argv) {
   Main m;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--gpu-checks") == 0) m.gpu_checks = true;
+  }
   m.init();
 
   while (!m.quit) {
@@ -7,6 +7,8 @@
 #include <atomic>
 #include <stdint.h>
 #include "TraceMipper.hpp"
+#include "TraceUploader.hpp"
+#include "GpuProfiler.hpp"
 
 struct Capture;
 struct SDL_Window;
@@ -23,6 +25,11 @@ public:
 
   void update_imgui();
 
+  // Sets up the trace, its GPU copy and the mips for a capture with this many
+  // channels, and tears them down again.
+  void init_trace(int channels);
+  void exit_trace();
+
   Capture* cap;
   SDL_Window* window;
   Gui gui;
@@ -38,6 +45,20 @@ public:
   Blitter blit;
   TracePainter trace_painter;
   TraceMipper  trace_mipper;
+  TraceUploader trace_uploader;
+  GpuProfiler  gpu_profiler;
+
+  // Live capture goes straight into these. The trace always takes
+  // trace_bytes, so wider captures get fewer samples.
+  static constexpr size_t trace_bytes = 256ull * 1024ull * 1024ull;
+  static constexpr int max_channels = 32;
+  TraceBuffer trace;
+  MipBuffer   mips[max_channels];
+
+  // 8 or 16 - what fx2lafw can send. Like gpu_mips, a new width only takes
+  // effect when the next capture starts.
+  int trace_channels = 8;
+  int capture_channels = 8;
 
 
   int screen_w = 0;
@@ -61,4 +82,17 @@ public:
   dvec2 screen_size;
 
   double render_time;
+  size_t shaded_columns = 0;
+  size_t trace_draw_calls = 0;
+
+  // Build the mip pyramids with TraceMipper instead of on the CPU. Only
+  // switches over when a new capture starts, so a trace never ends up with
+  // half of its pyramid on each side.
+  bool gpu_mips = true;
+  bool capture_gpu_mips = true;
+
+  // --gpu-checks - run TracePainter's and TraceMipper's shader checks and
+  // benchmarks on test data at startup. They take a while, so they're off by
+  // default.
+  bool gpu_checks = false;
 };